@@ -47,8 +47,10 @@ extern "C" {
 #define FREENECT_DEPTH_MM_NO_VALUE 0
 /// Maximum value that a uint16_t pixel will take on in the buffer of any of the FREENECT_DEPTH_11BIT, FREENECT_DEPTH_10BIT, FREENECT_DEPTH_11BIT_PACKED, or FREENECT_DEPTH_10BIT_PACKED frame callbacks
 #define FREENECT_DEPTH_RAW_MAX_VALUE 2048
-/// Value indicating that this pixel has no data, when using FREENECT_DEPTH_11BIT, FREENECT_DEPTH_10BIT, FREENECT_DEPTH_11BIT_PACKED, or FREENECT_DEPTH_10BIT_PACKED
+/// Value indicating that this pixel has no data, when using FREENECT_DEPTH_11BIT or FREENECT_DEPTH_11BIT_PACKED
 #define FREENECT_DEPTH_RAW_NO_VALUE 2047
+/// Value indicating that this pixel has no data, when using FREENECT_DEPTH_10BIT or FREENECT_DEPTH_10BIT_PACKED
+#define FREENECT_DEPTH_10BIT_NO_VALUE 1023
 
 /// Flags representing devices to open when freenect_open_device() is called.
 /// In particular, this allows libfreenect to grab only a subset of the devices
@@ -61,6 +63,13 @@ typedef enum {
 	FREENECT_DEVICE_AUDIO  = 0x04,
 } freenect_device_flags;
 
+/// Enumeration of memory types for stream buffers, see freenect_set_buffer_flags()
+typedef enum {
+	FREENECT_BUFFER_HUGEPAGES = 0x01, /**< Back large buffers with huge pages where the OS allows */
+	FREENECT_BUFFER_DEV_MEM   = 0x02, /**< Use libusb_dev_mem_alloc() for transfer buffers, so the kernel can DMA straight into them */
+	FREENECT_BUFFER_LOCKED    = 0x04, /**< Lock buffers into RAM with mlock() where permitted, so they are never paged out */
+} freenect_buffer_flags;
+
 /// A struct used in enumeration to give access to serial numbers, so you can
 /// open a particular device by serial rather than depending on index.  This
 /// is most useful if you have more than one Kinect.
@@ -91,6 +100,12 @@ typedef enum {
 	FREENECT_VIDEO_IR_10BIT_PACKED = 4, /**< 10-bit packed IR mode */
 	FREENECT_VIDEO_YUV_RGB         = 5, /**< YUV RGB mode */
 	FREENECT_VIDEO_YUV_RAW         = 6, /**< YUV Raw mode */
+	FREENECT_VIDEO_RGB_HALF        = 7, /**< RGB at half the camera resolution, one pixel per Bayer quad */
+	FREENECT_VIDEO_RGB_QUARTER     = 8, /**< RGB at a quarter of the camera resolution, one pixel per 2x2 Bayer quads */
+	FREENECT_VIDEO_Y8              = 9, /**< BT.601 limited range luma from the Bayer pattern */
+	FREENECT_VIDEO_NV12            = 10, /**< BT.601 limited range NV12 from the Bayer pattern: luma plane, then interleaved CbCr at half resolution */
+	FREENECT_VIDEO_YUV_Y8          = 11, /**< Luma from YUV mode */
+	FREENECT_VIDEO_YUV_NV12        = 12, /**< NV12 from YUV mode */
 	FREENECT_VIDEO_DUMMY           = 2147483647, /**< Dummy value to force enum to be 32 bits wide */
 } freenect_video_format;
 
@@ -143,6 +158,28 @@ typedef struct {
 	int8_t is_valid;                /**< If 0, this freenect_frame_mode is invalid and does not describe a supported mode.  Otherwise, the frame_mode is valid. */
 } freenect_frame_mode;
 
+/// Isochronous transfer queue settings for one stream.  Any field left at 0
+/// selects the platform default compiled into the library.
+typedef struct {
+	int num_xfers;     /**< Number of transfers kept in flight */
+	int pkts_per_xfer; /**< Number of packets in each transfer */
+	int pkt_buf_size;  /**< Bytes reserved for each packet, at least the endpoint packet size */
+	int adaptive;      /**< If nonzero, the number of transfers in flight follows packet loss between min_xfers and max_xfers */
+	int min_xfers;     /**< Lower bound for the adaptive controller */
+	int max_xfers;     /**< Upper bound for the adaptive controller; this many transfers are allocated */
+} freenect_iso_config;
+
+/// Current state of the isochronous transfer queue of one stream
+typedef struct {
+	int num_xfers;       /**< Number of transfers currently in flight */
+	int allocated_xfers; /**< Number of transfers allocated */
+	int pkts_per_xfer;   /**< Number of packets in each transfer */
+	int pkt_buf_size;    /**< Bytes reserved for each packet */
+	int buffer_bytes;    /**< Memory held by the transfer buffers, in bytes */
+	uint32_t lost_pkts;  /**< Packets lost since the stream was started */
+	int valid_frames;    /**< Frames received since the stream was started */
+} freenect_iso_stats;
+
 /// Enumeration of LED states
 /// See http://openkinect.org/wiki/Protocol_Documentation#Setting_LED for more information.
 typedef enum {
@@ -172,6 +209,12 @@ typedef struct {
 	freenect_tilt_status_code tilt_status;     /**< State of the tilt motor (stopped, moving, etc...) */
 } freenect_raw_tilt_state;
 
+/// Tilt state read by the background sampler, see freenect_start_tilt_sampler()
+typedef struct {
+	freenect_raw_tilt_state state; /**< Motor and accelerometer state */
+	uint64_t timestamp;            /**< When the state was read, on the freenect_get_time_us() clock */
+} freenect_tilt_sample;
+
 struct _freenect_context;
 typedef struct _freenect_context freenect_context; /**< Holds information about the usb context. */
 
@@ -328,6 +371,18 @@ FREENECTAPI void freenect_select_subdevices(freenect_context *ctx, freenect_devi
  */
 FREENECTAPI freenect_device_flags freenect_enabled_subdevices(freenect_context *ctx);
 
+/**
+ * Select how transfer and frame buffers are allocated for streams started
+ * afterwards.  Buffers are always page aligned; the flags request huge pages,
+ * device memory or locked pages on top of that, falling back to ordinary
+ * pages where those are not available.  Buffers are kept when a stream is stopped and
+ * reused when it is started again, and only freed when the device is closed.
+ *
+ * @param ctx Context to set buffer flags for
+ * @param flags Combination of freenect_buffer_flags
+ */
+FREENECTAPI void freenect_set_buffer_flags(freenect_context *ctx, int flags);
+
 /**
  * Opens a kinect device via a context. Index specifies the index of
  * the device on the current state of the bus. Bus resets may cause
@@ -445,6 +500,142 @@ FREENECTAPI int freenect_set_depth_buffer(freenect_device *dev, void *buf);
  */
 FREENECTAPI int freenect_set_video_buffer(freenect_device *dev, void *buf);
 
+/// A frame held from freenect_get_latest_depth() or freenect_get_latest_video()
+typedef struct {
+	void *data;                /**< Frame contents, valid until the frame is released */
+	uint32_t timestamp;        /**< Camera timestamp of the frame */
+	uint32_t sequence;         /**< Counts published frames from 1 */
+	freenect_frame_mode mode;  /**< Mode the frame was captured in */
+	void *reserved;            /**< Internal, NULL when no frame is held */
+} freenect_frame;
+
+/**
+ * Keep the most recent depth frame available to freenect_get_latest_depth().
+ * Frames rotate through a small pool of buffers owned by libfreenect: the
+ * stream fills one while the newest finished frame waits in another, so
+ * nothing is copied.  Readers holding frames pin their buffers, and the pool
+ * grows up to max_frames (at least 3) before frames are dropped instead.
+ *
+ * While enabled the depth callback still runs, but freenect_set_depth_buffer()
+ * is refused.  freenect_process_events() must be called as usual.
+ *
+ * @param dev Device whose depth stream to keep
+ * @param max_frames Most buffers to use
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_enable_latest_depth(freenect_device *dev, int max_frames);
+
+/**
+ * Keep the most recent video frame available, see freenect_enable_latest_depth()
+ *
+ * @param dev Device whose video stream to keep
+ * @param max_frames Most buffers to use
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_enable_latest_video(freenect_device *dev, int max_frames);
+
+/**
+ * Stop keeping depth frames.  Waiting readers return with an error, and the
+ * buffers are freed once every held frame is released.
+ *
+ * @param dev Device to stop keeping depth frames for
+ *
+ * @return 0 on success, < 0 if not enabled
+ */
+FREENECTAPI int freenect_disable_latest_depth(freenect_device *dev);
+
+/**
+ * Stop keeping video frames, see freenect_disable_latest_depth()
+ *
+ * @param dev Device to stop keeping video frames for
+ *
+ * @return 0 on success, < 0 if not enabled
+ */
+FREENECTAPI int freenect_disable_latest_video(freenect_device *dev);
+
+/**
+ * Hold the newest depth frame after the one in frame->sequence, waiting for
+ * it if need be.  Zero the frame before its first use; a frame still held
+ * from an earlier call is released first.  Any number of threads may read
+ * at once.
+ *
+ * @param dev Device to read from
+ * @param frame Frame to fill in
+ * @param timeout_ms Longest wait in milliseconds, 0 to only look, < 0 to wait forever
+ *
+ * @return 0 on success, 1 if no newer frame arrived in time, < 0 on error
+ */
+FREENECTAPI int freenect_get_latest_depth(freenect_device *dev, freenect_frame *frame, int timeout_ms);
+
+/**
+ * Hold the newest video frame, see freenect_get_latest_depth()
+ *
+ * @param dev Device to read from
+ * @param frame Frame to fill in
+ * @param timeout_ms Longest wait in milliseconds, 0 to only look, < 0 to wait forever
+ *
+ * @return 0 on success, 1 if no newer frame arrived in time, < 0 on error
+ */
+FREENECTAPI int freenect_get_latest_video(freenect_device *dev, freenect_frame *frame, int timeout_ms);
+
+/**
+ * Give a held frame's buffer back.  frame->sequence is kept, so the frame can
+ * be passed to the next freenect_get_latest_*() call as it is.
+ *
+ * @param frame Frame to release, nothing happens if none is held
+ */
+FREENECTAPI void freenect_release_frame(freenect_frame *frame);
+
+/// Number of histogram bins in freenect_depth_stats
+#define FREENECT_DEPTH_STATS_BINS 2048
+
+/// Statistics of a depth frame, gathered while it is unpacked. Pixels without
+/// a reading are left out of every field.
+typedef struct {
+	uint32_t timestamp;  /**< Camera timestamp of the frame */
+	uint32_t valid;      /**< Number of pixels with a reading */
+	uint16_t min;        /**< Smallest reading, 0 if there are none */
+	uint16_t max;        /**< Largest reading, 0 if there are none */
+	float mean;          /**< Mean reading, 0 if there are none */
+	int bin_shift;       /**< A reading v is counted in histogram[v >> bin_shift]: 0 in the raw modes, 3 (8mm bins) in the mm modes */
+	uint32_t histogram[FREENECT_DEPTH_STATS_BINS]; /**< Number of readings per bin */
+} freenect_depth_stats;
+
+/**
+ * Gather freenect_depth_stats for every depth frame as it is unpacked, so
+ * they cost no extra pass over the frame.  Only frames unpacked from the
+ * camera in FREENECT_DEPTH_11BIT, FREENECT_DEPTH_10BIT, FREENECT_DEPTH_MM or
+ * FREENECT_DEPTH_REGISTERED get statistics.
+ *
+ * @param dev Device whose depth frames to measure
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_enable_depth_stats(freenect_device *dev);
+
+/**
+ * Stop gathering depth statistics.
+ *
+ * @param dev Device to stop measuring
+ *
+ * @return 0 on success, < 0 if not enabled
+ */
+FREENECTAPI int freenect_disable_depth_stats(freenect_device *dev);
+
+/**
+ * Copy the statistics of the last unpacked depth frame.  Inside the depth
+ * callback these belong to the frame being delivered; any thread may call
+ * this.
+ *
+ * @param dev Device to read from
+ * @param stats Statistics to fill in
+ *
+ * @return 0 on success, < 0 if not enabled or no frame has been measured yet
+ */
+FREENECTAPI int freenect_get_depth_stats(freenect_device *dev, freenect_depth_stats *stats);
+
 /**
  * Start the depth information stream for a device.
  *
@@ -473,7 +664,8 @@ FREENECTAPI int freenect_start_video(freenect_device *dev);
 FREENECTAPI int freenect_stop_depth(freenect_device *dev);
 
 /**
- * Stop the video information stream for a device
+ * Stop the video information stream for a device.  This also ends
+ * multiplexing started with freenect_start_video_multiplex().
  *
  * @param dev Device to stop video information stream on.
  *
@@ -481,6 +673,41 @@ FREENECTAPI int freenect_stop_depth(freenect_device *dev);
  */
 FREENECTAPI int freenect_stop_video(freenect_device *dev);
 
+/**
+ * Configure the isochronous transfer queue of the depth stream.  Changes to
+ * num_xfers take effect immediately if the stream is running and the new
+ * value fits within the transfers already allocated; everything else takes
+ * effect the next time the stream is started.
+ *
+ * @param dev Device to configure
+ * @param config Queue settings, see freenect_iso_config
+ *
+ * @return 0 on success, < 0 if the settings are invalid
+ */
+FREENECTAPI int freenect_set_depth_iso_config(freenect_device *dev, const freenect_iso_config *config);
+
+/**
+ * Configure the isochronous transfer queue of the video stream.  See
+ * freenect_set_depth_iso_config().
+ */
+FREENECTAPI int freenect_set_video_iso_config(freenect_device *dev, const freenect_iso_config *config);
+
+/**
+ * Report the state of the depth stream's isochronous transfer queue.
+ *
+ * @param dev Device to query
+ * @param stats Structure to fill in
+ *
+ * @return 0 on success, < 0 if the stream is not running
+ */
+FREENECTAPI int freenect_get_depth_iso_stats(freenect_device *dev, freenect_iso_stats *stats);
+
+/**
+ * Report the state of the video stream's isochronous transfer queue.  See
+ * freenect_get_depth_iso_stats().
+ */
+FREENECTAPI int freenect_get_video_iso_stats(freenect_device *dev, freenect_iso_stats *stats);
+
 /**
  * Updates the accelerometer state using a blocking control message
  * call.
@@ -558,6 +785,96 @@ FREENECTAPI int freenect_set_led(freenect_device *dev, freenect_led_options opti
  */
 FREENECTAPI void freenect_get_mks_accel(freenect_raw_tilt_state *state, double* x, double* y, double* z);
 
+/**
+ * Read the motor and accelerometer state in the background at the given
+ * rate.  Reads are issued from freenect_process_events() without blocking
+ * it, so the rate is only reached while events are being processed often
+ * enough.  While the sampler runs, freenect_update_tilt_state() returns the
+ * latest sample instead of querying the device.
+ *
+ * @param dev Device to sample
+ * @param rate_hz Samples per second
+ * @param history_len Number of samples kept for freenect_get_tilt_history(), 0 for none
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_start_tilt_sampler(freenect_device *dev, int rate_hz, int history_len);
+
+/**
+ * Stop the background sampler, waiting for a read in progress.  Must be
+ * called from the thread that calls freenect_process_events(), and not
+ * while other threads are reading samples.
+ *
+ * @return 0 on success, < 0 if the sampler was not running
+ */
+FREENECTAPI int freenect_stop_tilt_sampler(freenect_device *dev);
+
+/**
+ * Copy the latest sample.  Never blocks, and may be called from any thread.
+ *
+ * @param dev Device to get the sample from
+ * @param sample Where to store the sample
+ *
+ * @return 0 on success, < 0 if the sampler is not running or has no sample yet
+ */
+FREENECTAPI int freenect_get_tilt_sample(freenect_device *dev, freenect_tilt_sample *sample);
+
+/**
+ * Copy the most recent samples, newest first.  Never blocks, and may be
+ * called from any thread.
+ *
+ * @param dev Device to get the samples from
+ * @param samples Where to store the samples
+ * @param max_samples Size of the samples array
+ *
+ * @return Number of samples copied, < 0 if the sampler is not running
+ */
+FREENECTAPI int freenect_get_tilt_history(freenect_device *dev, freenect_tilt_sample *samples, int max_samples);
+
+/**
+ * @return Microseconds on the monotonic clock libfreenect timestamps samples with
+ */
+FREENECTAPI uint64_t freenect_get_time_us(void);
+
+/// Nominal rate of the camera timestamp clock, in ticks per second
+#define FREENECT_TICKS_PER_SECOND 60000000
+
+/// Timing of a delivered frame, see freenect_get_depth_frame_info()
+typedef struct {
+	uint32_t timestamp;    /**< Camera timestamp, as passed to the callback */
+	uint64_t device_time;  /**< Camera timestamp unwrapped to 64 bits */
+	uint64_t arrival_us;   /**< When the last packet of the frame arrived, on the freenect_get_time_us() clock */
+	uint64_t host_us;      /**< device_time mapped onto the freenect_get_time_us() clock; free of USB jitter, but including the mean transfer delay */
+	double ticks_per_us;   /**< Measured rate of the camera clock */
+	uint32_t sequence;     /**< Frame number since the first frame, counting dropped frames */
+	uint32_t dropped;      /**< Frames missing between the previous frame and this one; gaps across a stream restart or mode switch are not counted */
+	uint32_t total_dropped;/**< Frames missing since the first frame */
+} freenect_frame_info;
+
+/**
+ * Timing of the current depth frame.  Camera timestamps wrap every minute or
+ * so; libfreenect unwraps them, fits the camera clock to the host clock as
+ * frames arrive, and counts frames missing from the gaps between them.
+ * Inside the depth callback this is the frame being delivered; any thread
+ * may call it.
+ *
+ * @param dev Device to read from
+ * @param info Timing to fill in
+ *
+ * @return 0 on success, < 0 if no depth frame has arrived yet
+ */
+FREENECTAPI int freenect_get_depth_frame_info(freenect_device *dev, freenect_frame_info *info);
+
+/**
+ * Timing of the current video frame, see freenect_get_depth_frame_info()
+ *
+ * @param dev Device to read from
+ * @param info Timing to fill in
+ *
+ * @return 0 on success, < 0 if no video frame has arrived yet
+ */
+FREENECTAPI int freenect_get_video_frame_info(freenect_device *dev, freenect_frame_info *info);
+
 /**
  * Get the number of video camera modes supported by the driver.  This includes both RGB and IR modes.
  *
@@ -659,6 +976,118 @@ FREENECTAPI freenect_frame_mode freenect_find_depth_mode(freenect_resolution res
  */
 FREENECTAPI int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode);
 
+/**
+ * Changes the video mode of a running stream without stopping it.  The
+ * isochronous transfers stay queued and the frame buffers are reused when
+ * they are large enough; only the mode registers written by
+ * freenect_start_video() are reprogrammed.  If the stream is not running
+ * this is the same as freenect_set_video_mode().
+ *
+ * Must be called from the thread that calls freenect_process_events().  A
+ * buffer set with freenect_set_video_buffer() must already be large enough
+ * for the new mode.
+ *
+ * @param dev Device for which to switch the video mode
+ * @param mode Frame mode to switch to
+ *
+ * @return 0 on success, < 0 if error
+ */
+FREENECTAPI int freenect_switch_video_mode(freenect_device* dev, const freenect_frame_mode mode);
+
+/**
+ * Changes the depth mode of a running stream without stopping it.  See
+ * freenect_switch_video_mode().
+ */
+FREENECTAPI int freenect_switch_depth_mode(freenect_device* dev, const freenect_frame_mode mode);
+
+/**
+ * Time from the last freenect_switch_video_mode() call to the first frame
+ * delivered in the new mode.
+ *
+ * @param dev Device to query
+ *
+ * @return Time in microseconds, or -1 if there was no switch or its first frame has not arrived yet
+ */
+FREENECTAPI int freenect_get_video_switch_time(freenect_device *dev);
+
+/**
+ * Time from the last freenect_switch_depth_mode() call to the first frame
+ * delivered in the new mode.  See freenect_get_video_switch_time().
+ */
+FREENECTAPI int freenect_get_depth_switch_time(freenect_device *dev);
+
+/**
+ * Time from the last freenect_start_video() call to the first video frame.
+ *
+ * @param dev Device to query
+ * @param call_us If not NULL, set to the time the freenect_start_video() call itself took
+ *
+ * @return Time in microseconds, or -1 if video was not started or its first frame has not arrived yet
+ */
+FREENECTAPI int freenect_get_video_start_time(freenect_device *dev, int *call_us);
+
+/**
+ * Time from the last freenect_start_depth() call to the first depth frame.
+ * See freenect_get_video_start_time().
+ */
+FREENECTAPI int freenect_get_depth_start_time(freenect_device *dev, int *call_us);
+
+/// Most video modes freenect_start_video_multiplex() takes turns between
+#define FREENECT_MULTIPLEX_MAX_MODES 4
+
+/// Counters of a multiplexed video stream, see freenect_get_video_multiplex_stats()
+typedef struct {
+	uint32_t switches;                              /**< Mode switches made */
+	uint32_t frames[FREENECT_MULTIPLEX_MAX_MODES];  /**< Frames delivered in each mode */
+	int last_switch_us;                             /**< Time from the last switch to the first frame in the new mode, -1 before the first */
+	int mean_switch_us;                             /**< Mean of those times */
+	int max_switch_us;                              /**< Longest of those times */
+	float dead_frames;                              /**< Frame periods lost to each switch on average */
+} freenect_multiplex_stats;
+
+/**
+ * Start the video stream taking turns between several modes, such as RGB
+ * and IR which share the camera's video endpoint: frames[0] frames in
+ * modes[0], then frames[1] in modes[1], and so on round.  Each switch is
+ * made as soon as the last frame of a turn has been delivered, without
+ * stopping the isochronous transfers, and every mode keeps its own frame
+ * buffers so none are reallocated.
+ *
+ * Inside the video callback, freenect_get_current_video_mode() is the mode
+ * of the frame being delivered, and freenect_set_video_buffer() sets the
+ * buffer for that mode's next frame.  Video must be stopped when this is
+ * called, and it must be called from the thread that calls
+ * freenect_process_events().  Registration keeps the tables of modes[0].
+ *
+ * @param dev Device to start video on
+ * @param modes Video modes to take turns between
+ * @param frames Frames to take in each mode per turn, at least 1
+ * @param count Number of modes, 2 to FREENECT_MULTIPLEX_MAX_MODES
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_start_video_multiplex(freenect_device *dev, const freenect_frame_mode *modes, const int *frames, int count);
+
+/**
+ * Stop a video stream started with freenect_start_video_multiplex().  The
+ * device stays in the mode of the last frame.
+ *
+ * @param dev Device to stop video on
+ *
+ * @return 0 on success, < 0 if not multiplexing
+ */
+FREENECTAPI int freenect_stop_video_multiplex(freenect_device *dev);
+
+/**
+ * Switch counters of a multiplexed video stream.
+ *
+ * @param dev Device to query
+ * @param stats Counters to fill in
+ *
+ * @return 0 on success, < 0 if not multiplexing
+ */
+FREENECTAPI int freenect_get_video_multiplex_stats(freenect_device *dev, freenect_multiplex_stats *stats);
+
 /**
  * Enables or disables the specified flag.
  * 
@@ -669,6 +1098,87 @@ FREENECTAPI int freenect_set_depth_mode(freenect_device* dev, const freenect_fra
  */
 FREENECTAPI int freenect_set_flag(freenect_device *dev, freenect_flag flag, freenect_flag_value value);
 
+struct _freenect_cmd_batch;
+typedef struct _freenect_cmd_batch freenect_cmd_batch; /**< Camera register writes sent without blocking the caller. */
+
+/// Typedef for batch completion callbacks; status is 0 on success, < 0 if a command failed
+typedef void (*freenect_cmd_batch_cb)(freenect_device *dev, freenect_cmd_batch *batch, int status, void *user_data);
+
+/**
+ * Create an empty batch of camera commands.  Commands are added with
+ * freenect_cmd_batch_write_register() and freenect_cmd_batch_set_flag(),
+ * then sent with freenect_cmd_batch_submit().  Batches run one after the
+ * other, in the order they were submitted, and complete from inside
+ * freenect_process_events().
+ *
+ * @param dev Device the commands are for
+ *
+ * @return New batch, or NULL on error
+ */
+FREENECTAPI freenect_cmd_batch *freenect_cmd_batch_create(freenect_device *dev);
+
+/**
+ * Append a camera register write to a batch which has not been submitted.
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_cmd_batch_write_register(freenect_cmd_batch *batch, uint16_t reg, uint16_t value);
+
+/**
+ * Append the commands freenect_set_flag() would send to a batch which has
+ * not been submitted.
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_cmd_batch_set_flag(freenect_cmd_batch *batch, freenect_flag flag, freenect_flag_value value);
+
+/**
+ * Queue a batch for sending.  The callback is called from inside
+ * freenect_process_events() once the last command was answered or one
+ * failed.
+ *
+ * @param batch Batch to send
+ * @param cb Completion callback, may be NULL
+ * @param user_data Passed on to the callback
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_cmd_batch_submit(freenect_cmd_batch *batch, freenect_cmd_batch_cb cb, void *user_data);
+
+/**
+ * @return 1 while the batch is queued or being sent, 0 once it succeeded, < 0 if it failed
+ */
+FREENECTAPI int freenect_cmd_batch_status(freenect_cmd_batch *batch);
+
+/**
+ * Process events until the batch has completed.  Must be called from the
+ * thread that calls freenect_process_events().
+ *
+ * @return Final status, see freenect_cmd_batch_status()
+ */
+FREENECTAPI int freenect_cmd_batch_wait(freenect_cmd_batch *batch);
+
+/**
+ * @return Microseconds from submitting the batch to its completion, or -1 if it has not completed
+ */
+FREENECTAPI int freenect_cmd_batch_time(freenect_cmd_batch *batch);
+
+/**
+ * Free a batch.  A batch which is still queued is freed once it completes,
+ * after its callback has run.
+ */
+FREENECTAPI void freenect_cmd_batch_destroy(freenect_cmd_batch *batch);
+
+/**
+ * Like freenect_set_flag(), but returns without waiting for the camera.
+ *
+ * @param cb Completion callback, may be NULL; the batch is freed after it returns
+ * @param user_data Passed on to the callback
+ *
+ * @return 0 if the commands were queued, < 0 on error
+ */
+FREENECTAPI int freenect_set_flag_async(freenect_device *dev, freenect_flag flag, freenect_flag_value value, freenect_cmd_batch_cb cb, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
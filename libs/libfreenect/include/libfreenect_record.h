@@ -0,0 +1,188 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Stream a recorded or virtual frame belongs to
+typedef enum {
+	FREENECT_STREAM_DEPTH = 0, /**< Frame came from the depth stream */
+	FREENECT_STREAM_VIDEO = 1, /**< Frame came from the video stream */
+} freenect_stream;
+
+/// A single frame inside a recording.  `data` points straight into the
+/// memory-mapped file and must be treated as read-only.
+typedef struct {
+	freenect_stream stream;   /**< Stream this frame was recorded from */
+	freenect_frame_mode mode; /**< Frame mode the frame was recorded in */
+	uint32_t timestamp;       /**< Device timestamp passed to the original callback */
+	const void *data;         /**< Frame data, mode.bytes long */
+} freenect_playback_frame;
+
+struct _freenect_recorder;
+typedef struct _freenect_recorder freenect_recorder; /**< Writes frames to an indexed capture file. */
+
+struct _freenect_playback;
+typedef struct _freenect_playback freenect_playback; /**< Memory-mapped view of an indexed capture file. */
+
+/**
+ * Opens a device which is not backed by any USB hardware.  Frames are fed
+ * to it with freenect_virtual_push_depth() and freenect_virtual_push_video()
+ * and are delivered through the regular depth/video callbacks and buffers,
+ * so code written against a live device can be driven by recordings or
+ * other processes.
+ *
+ * @param ctx Context the virtual device belongs to
+ * @param dev Address of pointer to store the new device in
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_open_virtual_device(freenect_context *ctx, freenect_device **dev);
+
+/**
+ * Deliver a depth frame through a virtual device.  If a depth buffer has
+ * been set with freenect_set_depth_buffer() the frame is copied into it,
+ * otherwise the callback receives `frame` itself.
+ *
+ * @param dev Virtual device to deliver the frame through
+ * @param mode Frame mode describing `frame`
+ * @param frame Frame data, mode.bytes long
+ * @param timestamp Timestamp passed on to the depth callback
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_virtual_push_depth(freenect_device *dev, freenect_frame_mode mode, const void *frame, uint32_t timestamp);
+
+/**
+ * Deliver a video frame through a virtual device.  See
+ * freenect_virtual_push_depth().
+ */
+FREENECTAPI int freenect_virtual_push_video(freenect_device *dev, freenect_frame_mode mode, const void *frame, uint32_t timestamp);
+
+/**
+ * Create a capture file.  Frames are appended as they are recorded and a
+ * timestamp/offset index is written at the end by freenect_record_close().
+ *
+ * @param rec Address of pointer to store the new recorder in
+ * @param filename Path of the file to create
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_record_open(freenect_recorder **rec, const char *filename);
+
+/**
+ * Append a depth frame, typically from inside a depth callback.
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_record_depth(freenect_recorder *rec, freenect_frame_mode mode, const void *frame, uint32_t timestamp);
+
+/**
+ * Append a video frame, typically from inside a video callback.
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_record_video(freenect_recorder *rec, freenect_frame_mode mode, const void *frame, uint32_t timestamp);
+
+/**
+ * Write the frame index, close the file and free the recorder.
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_record_close(freenect_recorder *rec);
+
+/**
+ * Memory-map a capture file for playback.  Files which were never closed
+ * properly (and therefore have no index) are indexed by scanning them.
+ *
+ * @param ctx Context to create the playback device in
+ * @param pb Address of pointer to store the new playback in
+ * @param filename Path of the capture file
+ *
+ * @return 0 on success, < 0 on error
+ */
+FREENECTAPI int freenect_playback_open(freenect_context *ctx, freenect_playback **pb, const char *filename);
+
+/**
+ * Unmap the file, close the playback device and free the playback.
+ *
+ * @return 0 on success
+ */
+FREENECTAPI int freenect_playback_close(freenect_playback *pb);
+
+/**
+ * Virtual device frames are delivered through by freenect_playback_step().
+ * Set its callbacks, buffers and user data as you would for a live device.
+ */
+FREENECTAPI freenect_device *freenect_playback_get_device(freenect_playback *pb);
+
+/// Number of frames (depth and video together) in the recording
+FREENECTAPI int freenect_playback_num_frames(freenect_playback *pb);
+
+/**
+ * Random access to a frame without going through the callbacks.  This only
+ * reads the mapping, so it may be called from several threads at once.
+ *
+ * @param pb Playback to read from
+ * @param index Frame index, 0 <= index < freenect_playback_num_frames()
+ * @param frame Frame description to fill in
+ *
+ * @return 0 on success, < 0 if index is out of range
+ */
+FREENECTAPI int freenect_playback_get_frame(freenect_playback *pb, int index, freenect_playback_frame *frame);
+
+/**
+ * Find the first frame of the given stream with a timestamp at or after
+ * `timestamp`.  Device timestamps wrap; `timestamp` is taken as the first
+ * time the clock reaches it after the stream's first frame.
+ *
+ * @return Frame index, or < 0 if there is none
+ */
+FREENECTAPI int freenect_playback_find_frame(freenect_playback *pb, freenect_stream stream, uint32_t timestamp);
+
+/**
+ * Move the playback cursor used by freenect_playback_step().
+ *
+ * @return 0 on success, < 0 if index is out of range
+ */
+FREENECTAPI int freenect_playback_seek(freenect_playback *pb, int index);
+
+/**
+ * Deliver the frame at the playback cursor through the playback device's
+ * callbacks and advance the cursor.
+ *
+ * @return 0 if a frame was delivered, 1 at the end of the recording, < 0 on error
+ */
+FREENECTAPI int freenect_playback_step(freenect_playback *pb);
+
+#ifdef __cplusplus
+}
+#endif
@@ -33,12 +33,15 @@
 #include "registration.h"
 #include "cameras.h"
 #include "flags.h"
+#include "latest.h"
+#include "stats.h"
+#include "timing.h"
 
 #define MAKE_RESERVED(res, fmt) (uint32_t)(((res & 0xff) << 8) | (((fmt & 0xff))))
 #define RESERVED_TO_RESOLUTION(reserved) (freenect_resolution)((reserved >> 8) & 0xff)
 #define RESERVED_TO_FORMAT(reserved) ((reserved) & 0xff)
 
-#define video_mode_count 12
+#define video_mode_count 22
 static freenect_frame_mode supported_video_modes[video_mode_count] = {
 	// reserved, resolution, format, bytes, width, height, data_bits_per_pixel, padding_bits_per_pixel, framerate, is_valid
 	{MAKE_RESERVED(FREENECT_RESOLUTION_HIGH,   FREENECT_VIDEO_RGB), FREENECT_RESOLUTION_HIGH, {FREENECT_VIDEO_RGB}, 1280*1024*3, 1280, 1024, 24, 0, 10, 1 },
@@ -59,6 +62,23 @@ static freenect_frame_mode supported_video_modes[video_mode_count] = {
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RGB), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RGB}, 640*480*3, 640, 480, 24, 0, 15, 1 },
 
 	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RAW), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_RAW}, 640*480*2, 640, 480, 16, 0, 15, 1 },
+
+	// Modes added later go last, so freenect_get_video_mode() indices stay put.
+	// Binned from the Bayer frame of the resolution, so smaller than it
+	{MAKE_RESERVED(FREENECT_RESOLUTION_HIGH,   FREENECT_VIDEO_RGB_HALF), FREENECT_RESOLUTION_HIGH, {FREENECT_VIDEO_RGB_HALF}, 640*512*3, 640, 512, 24, 0, 10, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB_HALF), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_RGB_HALF}, 320*240*3, 320, 240, 24, 0, 30, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_HIGH,   FREENECT_VIDEO_RGB_QUARTER), FREENECT_RESOLUTION_HIGH, {FREENECT_VIDEO_RGB_QUARTER}, 320*256*3, 320, 256, 24, 0, 10, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB_QUARTER), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_RGB_QUARTER}, 160*120*3, 160, 120, 24, 0, 30, 1 },
+
+	{MAKE_RESERVED(FREENECT_RESOLUTION_HIGH,   FREENECT_VIDEO_Y8), FREENECT_RESOLUTION_HIGH, {FREENECT_VIDEO_Y8}, 1280*1024, 1280, 1024, 8, 0, 10, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_Y8), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_Y8}, 640*480, 640, 480, 8, 0, 30, 1 },
+
+	{MAKE_RESERVED(FREENECT_RESOLUTION_HIGH,   FREENECT_VIDEO_NV12), FREENECT_RESOLUTION_HIGH, {FREENECT_VIDEO_NV12}, 1280*1024*3/2, 1280, 1024, 12, 0, 10, 1 },
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_NV12), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_NV12}, 640*480*3/2, 640, 480, 12, 0, 30, 1 },
+
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_Y8), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_Y8}, 640*480, 640, 480, 8, 0, 15, 1 },
+
+	{MAKE_RESERVED(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_NV12), FREENECT_RESOLUTION_MEDIUM, {FREENECT_VIDEO_YUV_NV12}, 640*480*3/2, 640, 480, 12, 0, 15, 1 },
 };
 
 #define depth_mode_count 6
@@ -88,6 +108,9 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 {
 	if (len < 12)
 		return 0;
+	// Buffers could not be allocated, see stream_alloc_bufs()
+	if (!strm->raw_buf)
+		return 0;
 
 	struct pkt_hdr *hdr = (struct pkt_hdr*)pkt;
 	uint8_t *data = pkt + sizeof(*hdr);
@@ -228,26 +251,69 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 	return got_frame_size;
 }
 
-static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
+static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
 {
-	strm->valid_frames = 0;
-	strm->synced = 0;
+	if (strm->split_bufs)
+		fn_buffer_free(strm->raw_buf, strm->raw_buf_size, strm->raw_buf_kind);
+	fn_buffer_free(strm->lib_buf, strm->lib_buf_size, strm->lib_buf_kind);
+
+	strm->split_bufs = 0;
+	strm->raw_buf = NULL;
+	strm->proc_buf = NULL;
+	strm->lib_buf = NULL;
+	strm->lib_buf_size = 0;
+	strm->raw_buf_size = 0;
+}
+
+// (Re)size the stream's buffers for a raw frame of rlen bytes (0 if frames
+// are delivered raw) and a processed frame of plen bytes.  Buffers which are
+// already large enough are kept, so restarting a stream or changing its mode
+// usually doesn't allocate.  If one can't be allocated, all are released and
+// -1 is returned; the stream must not take packets until it has buffers again.
+static int stream_alloc_bufs(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
+{
+	// Frames kept for freenect_get_latest_*() go straight into the pool
+	if (strm->latest)
+		strm->usr_buf = fn_latest_writing_buffer(strm->latest, plen);
 
 	if (strm->usr_buf) {
-		strm->lib_buf = NULL;
 		strm->proc_buf = strm->usr_buf;
+		// A kept buffer too small for this mode must not become the fallback
+		// when the user buffer is cleared, see stream_setbuf()
+		if (strm->lib_buf && strm->lib_buf_size < plen) {
+			fn_buffer_free(strm->lib_buf, strm->lib_buf_size, strm->lib_buf_kind);
+			strm->lib_buf = NULL;
+			strm->lib_buf_size = 0;
+		}
 	} else {
-		strm->lib_buf = malloc(plen);
+		if (!strm->lib_buf || strm->lib_buf_size < plen) {
+			fn_buffer_free(strm->lib_buf, strm->lib_buf_size, strm->lib_buf_kind);
+			strm->lib_buf = fn_buffer_alloc(ctx, plen, &strm->lib_buf_kind);
+			strm->lib_buf_size = strm->lib_buf ? plen : 0;
+			if (!strm->lib_buf)
+				goto fail;
+		}
 		strm->proc_buf = strm->lib_buf;
 	}
 
 	if (rlen == 0) {
+		if (strm->split_bufs)
+			fn_buffer_free(strm->raw_buf, strm->raw_buf_size, strm->raw_buf_kind);
 		strm->split_bufs = 0;
 		strm->raw_buf = (uint8_t*)strm->proc_buf;
+		strm->raw_buf_size = 0;
 		strm->frame_size = plen;
 	} else {
+		if (!strm->split_bufs || !strm->raw_buf || strm->raw_buf_size < rlen) {
+			if (strm->split_bufs)
+				fn_buffer_free(strm->raw_buf, strm->raw_buf_size, strm->raw_buf_kind);
+			strm->split_bufs = 0;
+			strm->raw_buf = (uint8_t*)fn_buffer_alloc(ctx, rlen, &strm->raw_buf_kind);
+			strm->raw_buf_size = strm->raw_buf ? rlen : 0;
+			if (!strm->raw_buf)
+				goto fail;
+		}
 		strm->split_bufs = 1;
-		strm->raw_buf = (uint8_t*)malloc(rlen);
 		strm->frame_size = rlen;
 	}
 
@@ -255,22 +321,55 @@ static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, in
 	if (strm->last_pkt_size == 0)
 		strm->last_pkt_size = strm->pkt_size;
 	strm->pkts_per_frame = (strm->frame_size + strm->pkt_size - 1) / strm->pkt_size;
+	return 0;
+
+fail:
+	FN_ERROR("Could not allocate %d byte stream buffers\n", rlen + plen);
+	stream_freebufs(ctx, strm);
+	return -1;
 }
 
-static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
+static int stream_init(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
 {
-	if (strm->split_bufs)
-		free(strm->raw_buf);
-	if (strm->lib_buf)
-		free(strm->lib_buf);
+	strm->valid_frames = 0;
+	strm->synced = 0;
+	strm->lost_pkts = 0;
+	strm->lost_pkts_checkpoint = 0;
+	strm->adapt_frames = 0;
+	strm->adapt_stable_windows = 0;
+	strm->switch_start_us = 0;
+	strm->held = 0;
+	strm->start_us = 0;
+	strm->start_time_us = 0;
+	strm->start_call_us = 0;
+	fn_clock_restart(&strm->clock);
+
+	return stream_alloc_bufs(ctx, strm, rlen, plen);
+}
 
-	strm->raw_buf = NULL;
-	strm->proc_buf = NULL;
-	strm->lib_buf = NULL;
+// Note the time from a start or mode switch to the first frame in the new mode
+static void stream_switch_done(freenect_context *ctx, packet_stream *strm)
+{
+	if (strm->start_us) {
+		strm->start_time_us = (int)(fn_get_time_us() - strm->start_us);
+		strm->start_us = 0;
+		FN_INFO("[Stream %02x] First frame %d us after start, which returned after %d us\n",
+		        strm->flag, strm->start_time_us, strm->start_call_us);
+	}
+	if (!strm->switch_start_us)
+		return;
+	strm->switch_time_us = (int)(fn_get_time_us() - strm->switch_start_us);
+	strm->switch_start_us = 0;
+	fn_clock_restart(&strm->clock);
+	FN_INFO("[Stream %02x] First frame %d us after mode switch\n", strm->flag, strm->switch_time_us);
 }
 
 static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
 {
+	if (strm->latest) {
+		FN_ERROR("Attempted to set a buffer while the stream keeps its latest frames\n");
+		return -1;
+	}
 	if (!strm->running) {
 		strm->usr_buf = pbuf;
 		return 0;
@@ -292,6 +391,62 @@ static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
 	}
 }
 
+// Hand a finished frame to freenect_get_latest_*() readers and carry on in
+// a free buffer of the pool
+static void stream_publish(packet_stream *strm, freenect_frame_mode mode)
+{
+	if (!strm->latest)
+		return;
+	void *next = fn_latest_publish(strm->latest, strm->proc_buf, mode, strm->timestamp);
+	if (!next)
+		return;
+	strm->usr_buf = next;
+	strm->proc_buf = next;
+	if (!strm->split_bufs)
+		strm->raw_buf = (uint8_t*)next;
+}
+
+static int stream_enable_latest(freenect_device *dev, packet_stream *strm, int max_frames, int plen)
+{
+	freenect_context *ctx = dev->parent;
+	if (strm->latest)
+		return 0;
+
+	fn_latest *latest = fn_latest_create(max_frames);
+	if (!latest)
+		return -1;
+	if (strm->running) {
+		void *buf = fn_latest_writing_buffer(latest, plen);
+		if (!buf || stream_setbuf(ctx, strm, buf) < 0) {
+			fn_latest_destroy(latest);
+			return -1;
+		}
+	}
+	fn_lock_acquire(&dev->lock);
+	strm->latest = latest;
+	fn_lock_release(&dev->lock);
+	return 0;
+}
+
+static int stream_disable_latest(freenect_device *dev, packet_stream *strm, int rlen, int plen)
+{
+	freenect_context *ctx = dev->parent;
+	fn_latest *latest = strm->latest;
+	if (!latest)
+		return -1;
+
+	// Move a running stream back to a library buffer before the pool goes
+	fn_lock_acquire(&dev->lock);
+	strm->latest = NULL;
+	fn_lock_release(&dev->lock);
+	strm->usr_buf = NULL;
+	int res = 0;
+	if (strm->running)
+		res = stream_alloc_bufs(ctx, strm, rlen, plen);
+	fn_latest_destroy(latest);
+	return res;
+}
+
 /**
  * Convert a packed array of n elements with vw useful bits into array of
  * zero-padded 16bit elements.
@@ -342,7 +497,8 @@ static inline void convert_packed_to_8bit(uint8_t *src, uint8_t *dest, int vw, i
 }
 
 // Loop-unrolled version of the 11-to-16 bit unpacker.  n must be a multiple of 8.
-static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
+// Each group of 8 pixels is counted into stats, if given, while it is still in cache.
+static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n, fn_depth_stats *stats)
 {
 	uint16_t baseMask = (1 << 11) - 1;
 	while(n >= 8)
@@ -368,12 +524,72 @@ static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
 		frame[6] = ((r8<<5)  | (r9>>3) )           & baseMask;
 		frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
 
+		if (stats)
+			fn_depth_stats_add8(stats, frame);
+
 		n -= 8;
 		raw += 11;
 		frame += 8;
 	}
 }
 
+// 10 bit depth unpacker.  Groups of 8 pixels end on a byte boundary, so they are
+// unpacked one at a time and counted into stats, if given.  n must be a multiple of 8.
+static void convert_packed10_depth(uint8_t *raw, uint16_t *frame, int n, fn_depth_stats *stats)
+{
+	if (!stats) {
+		convert_packed_to_16bit(raw, frame, 10, n);
+		return;
+	}
+	while (n >= 8) {
+		convert_packed_to_16bit(raw, frame, 10, 8);
+		fn_depth_stats_add8(stats, frame);
+		n -= 8;
+		raw += 10;
+		frame += 8;
+	}
+}
+
+// Frames per evaluation window of the adaptive transfer queue controller
+#define ISO_ADAPT_WINDOW 30
+// Loss-free windows before the controller gives a transfer back
+#define ISO_ADAPT_STABLE_WINDOWS 10
+
+// Grow the number of transfers in flight when packets are being lost, and
+// slowly shrink it again once the stream has been stable for a while.
+static void stream_adapt_iso(freenect_context *ctx, packet_stream *strm, fnusb_isoc_stream *isoc, freenect_iso_config *config)
+{
+	if (!config->adaptive)
+		return;
+	if (++strm->adapt_frames < ISO_ADAPT_WINDOW)
+		return;
+
+	uint lost = strm->lost_pkts - strm->lost_pkts_checkpoint;
+	int active = isoc->target_xfers;
+	int target = active;
+
+	strm->adapt_frames = 0;
+	strm->lost_pkts_checkpoint = strm->lost_pkts;
+
+	if (lost > 0) {
+		strm->adapt_stable_windows = 0;
+		target = active + 1;
+	} else if (++strm->adapt_stable_windows >= ISO_ADAPT_STABLE_WINDOWS) {
+		strm->adapt_stable_windows = 0;
+		target = active - 1;
+	}
+
+	if (target < config->min_xfers)
+		target = config->min_xfers;
+	if (target == active)
+		return;
+
+	target = fnusb_set_iso_xfers(isoc, target);
+	if (target != active)
+		FN_INFO("[Stream %02x] %u packets lost, %d transfers in flight (%d bytes)\n",
+		        strm->flag, lost, target, target * isoc->pkts * isoc->len);
+}
+
 static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 {
 	freenect_context *ctx = dev->parent;
@@ -381,7 +597,7 @@ static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 	if (len == 0)
 		return;
 
-	if (!dev->depth.running)
+	if (!dev->depth.running || dev->depth.held)
 		return;
 
 	int got_frame_size = stream_process(ctx, &dev->depth, pkt, len,dev->depth_chunk_cb,dev->user_data);
@@ -392,18 +608,28 @@ static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 	FN_SPEW("Got depth frame of size %d/%d, %d/%d packets arrived, TS %08x\n", got_frame_size,
 	        dev->depth.frame_size, dev->depth.valid_pkts, dev->depth.pkts_per_frame, dev->depth.timestamp);
 
+	stream_adapt_iso(ctx, &dev->depth, &dev->depth_isoc, &dev->depth_iso_config);
+	stream_switch_done(ctx, &dev->depth);
+	fn_clock_frame(&dev->depth.clock, dev->depth.timestamp, freenect_get_current_depth_mode(dev).framerate);
+
+	fn_depth_stats *stats = fn_depth_stats_hold(dev);
+	if (stats && !fn_depth_stats_begin(stats, dev->depth_format)) {
+		fn_depth_stats_drop(dev, stats);
+		stats = NULL;
+	}
+
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_11BIT:
-			convert_packed11_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480);
+			convert_packed11_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480, stats);
 			break;
 		case FREENECT_DEPTH_REGISTERED:
-			freenect_apply_registration(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf );
+			freenect_apply_registration(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, stats);
 			break;
 		case FREENECT_DEPTH_MM:
-			freenect_apply_depth_to_mm(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf );
+			freenect_apply_depth_to_mm(dev, dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, stats);
 			break;
 		case FREENECT_DEPTH_10BIT:
-			convert_packed_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 10, 640*480);
+			convert_packed10_depth(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480, stats);
 			break;
 		case FREENECT_DEPTH_10BIT_PACKED:
 		case FREENECT_DEPTH_11BIT_PACKED:
@@ -412,8 +638,13 @@ static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 			FN_ERROR("depth_process() was called, but an invalid depth_format is set\n");
 			break;
 	}
+	if (stats) {
+		fn_depth_stats_end(stats, dev->depth.timestamp);
+		fn_depth_stats_drop(dev, stats);
+	}
 	if (dev->depth_cb)
 		dev->depth_cb(dev, dev->depth.proc_buf, dev->depth.timestamp);
+	stream_publish(&dev->depth, freenect_get_current_depth_mode(dev));
 }
 
 #define CLAMP(x) if (x < 0) {x = 0;} if (x > 255) {x = 255;}
@@ -614,6 +845,166 @@ static void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_f
 	} // end of for y loop
 }
 
+static inline void convert_bayer_to_rgb_binned(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode, int quads)
+{
+	/*
+	 * Each output pixel averages a square of quads x quads Bayer quads,
+	 *
+	 *   G1 R
+	 *   B  G2
+	 *
+	 * taking r = R, g = (G1 + G2) / 2 and b = B over the square. Nothing
+	 * is interpolated, so this costs a fraction of convert_bayer_to_rgb(),
+	 * and the colours of a pixel all come from the same part of the image.
+	 * frame_mode is the output mode; the Bayer frame is 2*quads times as
+	 * wide and high.
+	 */
+	int stride = frame_mode.width * quads * 2;
+	int area = quads * quads;
+	int x, y, qx, qy;
+	uint8_t *dst = proc_buf;
+
+	for (y = 0; y < frame_mode.height; ++y) {
+		uint8_t *row = raw_buf + y * quads * 2 * stride;
+		for (x = 0; x < frame_mode.width; ++x) {
+			unsigned int r = 0, g = 0, b = 0;
+			for (qy = 0; qy < quads; ++qy) {
+				uint8_t *p = row + qy * 2 * stride;
+				for (qx = 0; qx < quads; ++qx, p += 2) {
+					g += p[0] + p[stride + 1];
+					r += p[1];
+					b += p[stride];
+				}
+			}
+			*(dst++) = (r + area / 2) / area;
+			*(dst++) = (g + area) / (2 * area);
+			*(dst++) = (b + area / 2) / area;
+			row += quads * 2;
+		}
+	}
+}
+
+/*
+ * Luma and chroma are BT.601 limited range (Y 16-235, Cb/Cr 16-240), in
+ * fixed point with 8 fractional bits:
+ *
+ *   Y  =  16 + ( 66 R + 129 G +  25 B) / 256
+ *   Cb = 128 + (-38 R -  74 G + 112 B) / 256
+ *   Cr = 128 + (112 R -  94 G -  18 B) / 256
+ */
+
+// Luma of the Bayer pixel at x, from the same neighbours convert_bayer_to_rgb()
+// interpolates with; xl and xr are its left and right columns, mirrored at the
+// edges. pattern is 2 on B G rows plus 1 on odd columns.
+static inline uint8_t bayer_luma(const uint8_t *prev, const uint8_t *cur, const uint8_t *next, int x, int xl, int xr, int pattern)
+{
+	// Four times the interpolated r, g and b, so no precision is lost
+	int r4, g4, b4;
+	int hSum = cur[xl] + cur[xr];
+	int vSum = prev[x] + next[x];
+	switch (pattern) {
+		case 0: // G on a G R row
+			r4 = 2 * hSum;
+			g4 = 4 * cur[x];
+			b4 = 2 * vSum;
+			break;
+		case 1: // R
+			r4 = 4 * cur[x];
+			g4 = hSum + vSum;
+			b4 = prev[xl] + prev[xr] + next[xl] + next[xr];
+			break;
+		case 2: // B
+			r4 = prev[xl] + prev[xr] + next[xl] + next[xr];
+			g4 = hSum + vSum;
+			b4 = 4 * cur[x];
+			break;
+		default: // G on a B G row
+			r4 = 2 * vSum;
+			g4 = 4 * cur[x];
+			b4 = 2 * hSum;
+			break;
+	}
+	return 16 + ((66 * r4 + 129 * g4 + 25 * b4 + 512) >> 10);
+}
+
+static void convert_bayer_to_luma(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int w = frame_mode.width;
+	int x, y;
+	uint8_t *dst = proc_buf;
+
+	for (y = 0; y < frame_mode.height; ++y) {
+		// First and last lines mirror the second and second last, as in convert_bayer_to_rgb()
+		const uint8_t *cur = raw_buf + y * w;
+		const uint8_t *prev = y > 0 ? cur - w : cur + w;
+		const uint8_t *next = y < frame_mode.height - 1 ? cur + w : cur - w;
+		int row = (y & 1) << 1;
+
+		*(dst++) = bayer_luma(prev, cur, next, 0, 1, 1, row);
+		// Odd then even column, with the row's patterns constant in each loop
+		if (row == 0) {
+			for (x = 1; x < w - 1; x += 2) {
+				*(dst++) = bayer_luma(prev, cur, next, x, x - 1, x + 1, 1);
+				*(dst++) = bayer_luma(prev, cur, next, x + 1, x, x + 2, 0);
+			}
+		} else {
+			for (x = 1; x < w - 1; x += 2) {
+				*(dst++) = bayer_luma(prev, cur, next, x, x - 1, x + 1, 3);
+				*(dst++) = bayer_luma(prev, cur, next, x + 1, x, x + 2, 2);
+			}
+		}
+		*(dst++) = bayer_luma(prev, cur, next, w - 1, w - 2, w - 2, row | 1);
+	}
+}
+
+// Interleaved CbCr of each Bayer quad, the chroma plane of NV12
+static void convert_bayer_to_chroma(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int w = frame_mode.width;
+	int x, y;
+	uint8_t *dst = proc_buf;
+
+	for (y = 0; y < frame_mode.height; y += 2) {
+		const uint8_t *p = raw_buf + y * w;
+		for (x = 0; x < w; x += 2, p += 2) {
+			// Twice r, g and b of the quad
+			int r2 = 2 * p[1];
+			int g2 = p[0] + p[w + 1];
+			int b2 = 2 * p[w];
+			*(dst++) = 128 + ((-38 * r2 - 74 * g2 + 112 * b2 + 256) >> 9);
+			*(dst++) = 128 + ((112 * r2 - 94 * g2 - 18 * b2 + 256) >> 9);
+		}
+	}
+}
+
+// The camera's UYVY is already limited range, so these only rearrange it
+static void convert_uyvy_to_luma(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int i, n = frame_mode.width * frame_mode.height;
+	for (i = 0; i < n; ++i)
+		proc_buf[i] = raw_buf[2*i+1];
+}
+
+// NV12 chroma from UYVY, averaging each pair of lines
+static void convert_uyvy_to_chroma(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+{
+	int stride = frame_mode.width * 2;
+	int x, y;
+	uint8_t *dst = proc_buf;
+
+	for (y = 0; y < frame_mode.height; y += 2) {
+		const uint8_t *top = raw_buf + y * stride;
+		const uint8_t *bottom = top + stride;
+		for (x = 0; x < stride; x += 4) {
+			*(dst++) = (top[x] + bottom[x] + 1) >> 1;         // u
+			*(dst++) = (top[x + 2] + bottom[x + 2] + 1) >> 1; // v
+		}
+	}
+}
+
+static void video_multiplex_frame(freenect_device *dev);
+static void video_multiplex_free(freenect_device *dev);
+
 static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 {
 	freenect_context *ctx = dev->parent;
@@ -621,7 +1012,7 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 	if (len == 0)
 		return;
 
-	if (!dev->video.running)
+	if (!dev->video.running || dev->video.held)
 		return;
 
 	int got_frame_size = stream_process(ctx, &dev->video, pkt, len,dev->video_chunk_cb,dev->user_data);
@@ -632,13 +1023,30 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 	FN_SPEW("Got video frame of size %d/%d, %d/%d packets arrived, TS %08x\n", got_frame_size,
 	        dev->video.frame_size, dev->video.valid_pkts, dev->video.pkts_per_frame, dev->video.timestamp);
 
+	stream_adapt_iso(ctx, &dev->video, &dev->video_isoc, &dev->video_iso_config);
+	stream_switch_done(ctx, &dev->video);
+
 	freenect_frame_mode frame_mode = freenect_get_current_video_mode(dev);
+	fn_clock_frame(&dev->video.clock, dev->video.timestamp, frame_mode.framerate);
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
 			convert_bayer_to_rgb(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode);
 			break;
 		case FREENECT_VIDEO_BAYER:
 			break;
+		case FREENECT_VIDEO_RGB_HALF:
+			convert_bayer_to_rgb_binned(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode, 1);
+			break;
+		case FREENECT_VIDEO_RGB_QUARTER:
+			convert_bayer_to_rgb_binned(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode, 2);
+			break;
+		case FREENECT_VIDEO_Y8:
+			convert_bayer_to_luma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode);
+			break;
+		case FREENECT_VIDEO_NV12:
+			convert_bayer_to_luma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode);
+			convert_bayer_to_chroma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf + frame_mode.width * frame_mode.height, frame_mode);
+			break;
 		case FREENECT_VIDEO_IR_10BIT:
 			convert_packed_to_16bit(dev->video.raw_buf, (uint16_t*)dev->video.proc_buf, 10, frame_mode.width * frame_mode.height);
 			break;
@@ -652,6 +1060,13 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 			break;
 		case FREENECT_VIDEO_YUV_RAW:
 			break;
+		case FREENECT_VIDEO_YUV_Y8:
+			convert_uyvy_to_luma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode);
+			break;
+		case FREENECT_VIDEO_YUV_NV12:
+			convert_uyvy_to_luma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf, frame_mode);
+			convert_uyvy_to_chroma(dev->video.raw_buf, (uint8_t*)dev->video.proc_buf + frame_mode.width * frame_mode.height, frame_mode);
+			break;
 		default:
 			FN_ERROR("video_process() was called, but an invalid video_format is set\n");
 			break;
@@ -659,14 +1074,35 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 
 	if (dev->video_cb)
 		dev->video_cb(dev, dev->video.proc_buf, dev->video.timestamp);
+	stream_publish(&dev->video, freenect_get_current_video_mode(dev));
+	if (dev->video_multiplex)
+		video_multiplex_frame(dev);
+}
+
+static fn_reg_info_entry *reg_info_cached(freenect_device *dev, const freenect_frame_mode mode)
+{
+	int i;
+	for (i = 0; i < dev->reg_info_cached; i++) {
+		fn_reg_info_entry *entry = &dev->reg_info_cache[i];
+		if (entry->resolution == mode.resolution && entry->framerate == mode.framerate)
+			return entry;
+	}
+	return NULL;
 }
 
-static int freenect_fetch_reg_info(freenect_device *dev)
+// Load the registration parameters of the video mode, asking the camera only
+// for a resolution and rate it hasn't reported yet
+static int freenect_fetch_reg_info(freenect_device *dev, const freenect_frame_mode mode)
 {
 	freenect_context *ctx = dev->parent;
 	char reply[0x200];
 	uint16_t cmd[5];
-	freenect_frame_mode mode = freenect_get_current_video_mode(dev);
+
+	fn_reg_info_entry *entry = reg_info_cached(dev, mode);
+	if (entry) {
+		dev->registration.reg_info = entry->reg_info;
+		return 0;
+	}
 	cmd[0] = fn_le16(0x40); // ParamID - in this scenario, XN_HOST_PROTOCOL_ALGORITHM_REGISTRATION
 	cmd[1] = fn_le16(0); // Format
 	cmd[2] = fn_le16((uint16_t)mode.resolution); // Resolution
@@ -736,6 +1172,12 @@ static int freenect_fetch_reg_info(freenect_device *dev)
 	FN_SPEW("back_comp1:            %d\n", dev_reg_info->back_comp1);
 	FN_SPEW("back_comp2:            %d\n", dev_reg_info->back_comp2);
 	*/
+	if (dev->reg_info_cached < FN_REG_INFO_CACHE) {
+		entry = &dev->reg_info_cache[dev->reg_info_cached++];
+		entry->resolution = mode.resolution;
+		entry->framerate = mode.framerate;
+		entry->reg_info = dev->registration.reg_info;
+	}
 	return 0;
 }
 
@@ -838,102 +1280,259 @@ static int freenect_fetch_zero_plane_info(freenect_device *dev)
 	return 0;
 }
 
-int freenect_start_depth(freenect_device *dev)
+// Fill in the defaults for any iso queue setting left at 0
+static void iso_config_resolve(const freenect_iso_config *config, int pktbuf, int *xfers, int *active, int *pkts, int *len)
+{
+	*active = config->num_xfers > 0 ? config->num_xfers : NUM_XFERS;
+	*pkts = config->pkts_per_xfer > 0 ? config->pkts_per_xfer : PKTS_PER_XFER;
+	*len = config->pkt_buf_size > 0 ? config->pkt_buf_size : pktbuf;
+	*xfers = *active;
+	if (config->adaptive && config->max_xfers > *xfers)
+		*xfers = config->max_xfers;
+}
+
+static int iso_config_set(freenect_device *dev, freenect_iso_config *dst, fnusb_isoc_stream *isoc, int running, int pktsize, const freenect_iso_config *config)
 {
 	freenect_context *ctx = dev->parent;
-	int res;
 
-	if (dev->depth.running)
+	if (config->num_xfers < 0 || config->pkts_per_xfer < 0 || config->pkt_buf_size < 0 ||
+	    config->min_xfers < 0 || config->max_xfers < 0) {
+		FN_ERROR("freenect_set_*_iso_config(): negative values are invalid\n");
+		return -1;
+	}
+	if (config->pkt_buf_size && config->pkt_buf_size < pktsize) {
+		FN_ERROR("freenect_set_*_iso_config(): pkt_buf_size must be at least %d\n", pktsize);
+		return -1;
+	}
+	if (config->adaptive && config->max_xfers && config->max_xfers < config->min_xfers) {
+		FN_ERROR("freenect_set_*_iso_config(): max_xfers is smaller than min_xfers\n");
+		return -1;
+	}
+#if defined(__APPLE__)
+	if (config->pkts_per_xfer % 8) {
+		FN_ERROR("freenect_set_*_iso_config(): pkts_per_xfer must be a multiple of 8 on OSX\n");
 		return -1;
+	}
+#endif
 
-	dev->depth.pkt_size = DEPTH_PKTDSIZE;
-	dev->depth.flag = 0x70;
-	dev->depth.variable_length = 0;
+	*dst = *config;
+	if (running && config->num_xfers > 0)
+		fnusb_set_iso_xfers(isoc, config->num_xfers);
+	return 0;
+}
+
+static int iso_stats_get(packet_stream *strm, fnusb_isoc_stream *isoc, freenect_iso_stats *stats)
+{
+	if (!strm->running)
+		return -1;
+	stats->num_xfers = isoc->num_xfers - isoc->num_idle;
+	stats->allocated_xfers = isoc->num_xfers;
+	stats->pkts_per_xfer = isoc->pkts;
+	stats->pkt_buf_size = isoc->len;
+	stats->buffer_bytes = isoc->num_xfers * isoc->pkts * isoc->len;
+	stats->lost_pkts = strm->lost_pkts;
+	stats->valid_frames = strm->valid_frames;
+	return 0;
+}
+
+int freenect_set_depth_iso_config(freenect_device *dev, const freenect_iso_config *config)
+{
+	return iso_config_set(dev, &dev->depth_iso_config, &dev->depth_isoc, dev->depth.running, DEPTH_PKTSIZE, config);
+}
+
+int freenect_set_video_iso_config(freenect_device *dev, const freenect_iso_config *config)
+{
+	return iso_config_set(dev, &dev->video_iso_config, &dev->video_isoc, dev->video.running, VIDEO_PKTSIZE, config);
+}
+
+int freenect_get_depth_iso_stats(freenect_device *dev, freenect_iso_stats *stats)
+{
+	return iso_stats_get(&dev->depth, &dev->depth_isoc, stats);
+}
+
+int freenect_get_video_iso_stats(freenect_device *dev, freenect_iso_stats *stats)
+{
+	return iso_stats_get(&dev->video, &dev->video_isoc, stats);
+}
+
+// Raw and processed frame sizes for the current depth mode, see stream_alloc_bufs()
+static int depth_buf_sizes(freenect_device *dev, int *rlen, int *plen)
+{
+	freenect_context *ctx = dev->parent;
 
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_REGISTERED:
 		case FREENECT_DEPTH_MM:
-			freenect_init_registration(dev);
 		case FREENECT_DEPTH_11BIT:
-			stream_init(ctx, &dev->depth, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT).bytes);
-			break;
+			*rlen = freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT_PACKED).bytes;
+			*plen = freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_11BIT).bytes;
+			return 0;
 		case FREENECT_DEPTH_10BIT:
-			stream_init(ctx, &dev->depth, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT_PACKED).bytes, freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT).bytes);
-			break;
+			*rlen = freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT_PACKED).bytes;
+			*plen = freenect_find_depth_mode(dev->depth_resolution, FREENECT_DEPTH_10BIT).bytes;
+			return 0;
 		case FREENECT_DEPTH_11BIT_PACKED:
 		case FREENECT_DEPTH_10BIT_PACKED:
-			stream_init(ctx, &dev->depth, 0, freenect_find_depth_mode(dev->depth_resolution, dev->depth_format).bytes);
-			break;
+			*rlen = 0;
+			*plen = freenect_find_depth_mode(dev->depth_resolution, dev->depth_format).bytes;
+			return 0;
 		default:
 			FN_ERROR("freenect_start_depth() called with invalid depth format %d\n", dev->depth_format);
 			return -1;
 	}
+}
 
-	res = fnusb_start_iso(&dev->usb_cam, &dev->depth_isoc, depth_process, 0x82, NUM_XFERS, PKTS_PER_XFER, DEPTH_PKTBUF);
-	if (res < 0)
-		return res;
-
-	write_register(dev, 0x105, 0x00); // Disable auto-cycle of projector
-	write_register(dev, 0x06, 0x00); // reset depth stream
+// Queue the depth mode register writes that start the stream on the device
+static void depth_program(freenect_device *dev, freenect_cmd_batch *batch)
+{
+	freenect_cmd_batch_write_register(batch, 0x105, 0x00); // Disable auto-cycle of projector
+	freenect_cmd_batch_write_register(batch, 0x06, 0x00); // reset depth stream
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_11BIT:
 		case FREENECT_DEPTH_11BIT_PACKED:
 		case FREENECT_DEPTH_REGISTERED:
 		case FREENECT_DEPTH_MM:
-			write_register(dev, 0x12, 0x03);
+			freenect_cmd_batch_write_register(batch, 0x12, 0x03);
 			break;
 		case FREENECT_DEPTH_10BIT:
 		case FREENECT_DEPTH_10BIT_PACKED:
-			write_register(dev, 0x12, 0x02);
+			freenect_cmd_batch_write_register(batch, 0x12, 0x02);
 			break;
 		case FREENECT_DEPTH_DUMMY: // Returned already, hush gcc
 			break;
 	}
-	write_register(dev, 0x13, 0x01);
-	write_register(dev, 0x14, 0x1e);
-	write_register(dev, 0x06, 0x02); // start depth stream
-	write_register(dev, 0x17, 0x00); // disable depth hflip
+	freenect_cmd_batch_write_register(batch, 0x13, 0x01);
+	freenect_cmd_batch_write_register(batch, 0x14, 0x1e);
+	freenect_cmd_batch_write_register(batch, 0x06, 0x02); // start depth stream
+	freenect_cmd_batch_write_register(batch, 0x17, 0x00); // disable depth hflip
+}
 
-	dev->depth.running = 1;
-	return 0;
+// Completion of the register writes queued by a stream start or mode switch
+static void stream_programmed(freenect_device *dev, freenect_cmd_batch *batch, int status, void *user_data)
+{
+	freenect_context *ctx = dev->parent;
+	packet_stream *strm = (packet_stream*)user_data;
+
+	if (status < 0) {
+		FN_ERROR("[Stream %02x] Failed to program stream registers: %d\n", strm->flag, status);
+		strm->held = 0;
+		strm->switch_start_us = 0;
+		return;
+	}
+	FN_DEBUG("[Stream %02x] Stream registers programmed in %d us\n", strm->flag, freenect_cmd_batch_time(batch));
+	if (strm->held) {
+		// Mode switches hold back packets until the new mode is set, see
+		// freenect_switch_video_mode()
+		strm->synced = 0;
+		strm->held = 0;
+	}
 }
 
-int freenect_start_video(freenect_device *dev)
+// Send the register writes queued by depth_program()/video_program() without
+// waiting for the camera
+static int stream_program_submit(freenect_cmd_batch *batch, packet_stream *strm)
+{
+	int res = freenect_cmd_batch_submit(batch, stream_programmed, strm);
+	// The first write may fail before freenect_cmd_batch_submit() returns
+	if (res == 0 && freenect_cmd_batch_status(batch) < 0)
+		res = freenect_cmd_batch_status(batch);
+	freenect_cmd_batch_destroy(batch);
+	return res;
+}
+
+static int depth_needs_registration(freenect_depth_format fmt)
+{
+	return fmt == FREENECT_DEPTH_REGISTERED || fmt == FREENECT_DEPTH_MM;
+}
+
+int freenect_start_depth(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 	int res;
+	uint64_t start = fn_get_time_us();
 
-	if (dev->video.running)
+	if (dev->depth.running)
 		return -1;
 
-	dev->video.pkt_size = VIDEO_PKTDSIZE;
-	dev->video.flag = 0x80;
-	dev->video.variable_length = 0;
+	if (dev->is_virtual) {
+		dev->depth.running = 1;
+		return 0;
+	}
 
+	dev->depth.pkt_size = DEPTH_PKTDSIZE;
+	dev->depth.flag = 0x70;
+	dev->depth.variable_length = 0;
+
+	int rlen, plen;
+	if (depth_buf_sizes(dev, &rlen, &plen) < 0)
+		return -1;
+	if (depth_needs_registration(dev->depth_format))
+		freenect_init_registration(dev);
+	if (stream_init(ctx, &dev->depth, rlen, plen) < 0)
+		return -1;
+
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch)
+		return -1;
+	depth_program(dev, batch);
+
+	int xfers, active, pkts, pktbuf;
+	iso_config_resolve(&dev->depth_iso_config, DEPTH_PKTBUF, &xfers, &active, &pkts, &pktbuf);
+	res = fnusb_start_iso(&dev->usb_cam, &dev->depth_isoc, depth_process, 0x82, xfers, active, pkts, pktbuf);
+	if (res < 0) {
+		freenect_cmd_batch_destroy(batch);
+		return res;
+	}
+
+	dev->depth.running = 1;
+	res = stream_program_submit(batch, &dev->depth);
+	if (res < 0) {
+		// Don't leave the transfers running for a stream the camera won't send
+		dev->depth.running = 0;
+		fnusb_stop_iso(&dev->usb_cam, &dev->depth_isoc);
+		return res;
+	}
+	dev->depth.start_us = start;
+	dev->depth.start_call_us = (int)(fn_get_time_us() - start);
+	FN_DEBUG("freenect_start_depth() returned after %d us\n", dev->depth.start_call_us);
+	return 0;
+}
+
+typedef struct {
 	uint16_t mode_reg, mode_value;
 	uint16_t res_reg, res_value;
 	uint16_t fps_reg, fps_value;
 	uint16_t hflip_reg;
+} video_regs;
+
+// Work out the registers for the current video mode
+static int video_mode_regs(freenect_device *dev, video_regs *regs)
+{
+	freenect_context *ctx = dev->parent;
 
 	switch(dev->video_format) {
 		case FREENECT_VIDEO_RGB:
 		case FREENECT_VIDEO_BAYER:
+		case FREENECT_VIDEO_RGB_HALF:
+		case FREENECT_VIDEO_RGB_QUARTER:
+		case FREENECT_VIDEO_Y8:
+		case FREENECT_VIDEO_NV12:
 			if(dev->video_resolution == FREENECT_RESOLUTION_HIGH) {
-				mode_value = 0x00; // Bayer
-				res_value = 0x02; // 1280x1024
-				fps_value = 0x0f; // "15" Hz
+				regs->mode_value = 0x00; // Bayer
+				regs->res_value = 0x02; // 1280x1024
+				regs->fps_value = 0x0f; // "15" Hz
 			} else if (dev->video_resolution == FREENECT_RESOLUTION_MEDIUM) {
-				mode_value = 0x00; // Bayer
-				res_value = 0x01; // 640x480
-				fps_value = 0x1e; // 30 Hz
+				regs->mode_value = 0x00; // Bayer
+				regs->res_value = 0x01; // 640x480
+				regs->fps_value = 0x1e; // 30 Hz
 			} else {
 				FN_ERROR("freenect_start_video(): called with invalid format/resolution combination\n");
 				return -1;
 			}
-			mode_reg = 0x0c;
-			res_reg = 0x0d;
-			fps_reg = 0x0e;
-			hflip_reg = 0x47;
+			regs->mode_reg = 0x0c;
+			regs->res_reg = 0x0d;
+			regs->fps_reg = 0x0e;
+			regs->hflip_reg = 0x47;
 			break;
 		case FREENECT_VIDEO_IR_8BIT:
 		case FREENECT_VIDEO_IR_10BIT:
@@ -943,105 +1542,171 @@ int freenect_start_video(freenect_device *dev)
 					FN_ERROR("freenect_start_video(): cannot stream high-resolution IR at same time as depth stream\n");
 					return -1;
 				}
-
-				// Due to some ridiculous condition in the firmware, we have to start and stop the
-				// depth stream before the camera will hand us 1280x1024 IR.  This is a stupid
-				// workaround, but we've yet to find a better solution.
-				write_register(dev, 0x13, 0x01); // set depth camera resolution (640x480)
-				write_register(dev, 0x14, 0x1e); // set depth camera FPS (30)
-				write_register(dev, 0x06, 0x02); // start depth camera
-				write_register(dev, 0x06, 0x00); // stop depth camera
-
-				mode_value = 0x00; // Luminance, 10-bit packed
-				res_value = 0x02; // 1280x1024
-				fps_value = 0x0f; // "15" Hz
+				regs->mode_value = 0x00; // Luminance, 10-bit packed
+				regs->res_value = 0x02; // 1280x1024
+				regs->fps_value = 0x0f; // "15" Hz
 			} else if (dev->video_resolution == FREENECT_RESOLUTION_MEDIUM) {
-				mode_value = 0x00; // Luminance, 10-bit packed
-				res_value = 0x01; // 640x480
-				fps_value = 0x1e; // 30 Hz
+				regs->mode_value = 0x00; // Luminance, 10-bit packed
+				regs->res_value = 0x01; // 640x480
+				regs->fps_value = 0x1e; // 30 Hz
 			} else {
 				FN_ERROR("freenect_start_video(): called with invalid format/resolution combination\n");
 				return -1;
 			}
-			mode_reg = 0x19;
-			res_reg = 0x1a;
-			fps_reg = 0x1b;
-			hflip_reg = 0x48;
+			regs->mode_reg = 0x19;
+			regs->res_reg = 0x1a;
+			regs->fps_reg = 0x1b;
+			regs->hflip_reg = 0x48;
 			break;
 		case FREENECT_VIDEO_YUV_RGB:
 		case FREENECT_VIDEO_YUV_RAW:
+		case FREENECT_VIDEO_YUV_Y8:
+		case FREENECT_VIDEO_YUV_NV12:
 			if(dev->video_resolution == FREENECT_RESOLUTION_MEDIUM) {
-				mode_value = 0x05; // UYUV mode
-				res_value = 0x01; // 640x480
-				fps_value = 0x0f; // 15Hz
+				regs->mode_value = 0x05; // UYUV mode
+				regs->res_value = 0x01; // 640x480
+				regs->fps_value = 0x0f; // 15Hz
 			} else {
 				FN_ERROR("freenect_start_video(): called with invalid format/resolution combination\n");
 				return -1;
 			}
-			mode_reg = 0x0c;
-			res_reg = 0x0d;
-			fps_reg = 0x0e;
-			hflip_reg = 0x47;
+			regs->mode_reg = 0x0c;
+			regs->res_reg = 0x0d;
+			regs->fps_reg = 0x0e;
+			regs->hflip_reg = 0x47;
 			break;
 		default:
 			FN_ERROR("freenect_start_video(): called with invalid video format %d\n", dev->video_format);
 			return -1;
 	}
+	return 0;
+}
 
+// Raw and processed frame sizes for the current video mode, see stream_alloc_bufs()
+static void video_buf_sizes(freenect_device *dev, int *rlen, int *plen)
+{
 	freenect_frame_mode frame_mode = freenect_get_current_video_mode(dev);
+	*rlen = 0;
+	*plen = frame_mode.bytes;
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_BAYER).bytes, frame_mode.bytes);
-			break;
-		case FREENECT_VIDEO_BAYER:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
+		case FREENECT_VIDEO_RGB_HALF:
+		case FREENECT_VIDEO_RGB_QUARTER:
+		case FREENECT_VIDEO_Y8:
+		case FREENECT_VIDEO_NV12:
+			*rlen = freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_BAYER).bytes;
 			break;
 		case FREENECT_VIDEO_IR_8BIT:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
-			break;
 		case FREENECT_VIDEO_IR_10BIT:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes, frame_mode.bytes);
-			break;
-		case FREENECT_VIDEO_IR_10BIT_PACKED:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
+			*rlen = freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_IR_10BIT_PACKED).bytes;
 			break;
 		case FREENECT_VIDEO_YUV_RGB:
-			stream_init(ctx, &dev->video, freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_YUV_RAW).bytes, frame_mode.bytes);
+		case FREENECT_VIDEO_YUV_Y8:
+		case FREENECT_VIDEO_YUV_NV12:
+			*rlen = freenect_find_video_mode(dev->video_resolution, FREENECT_VIDEO_YUV_RAW).bytes;
 			break;
+		case FREENECT_VIDEO_BAYER:
+		case FREENECT_VIDEO_IR_10BIT_PACKED:
 		case FREENECT_VIDEO_YUV_RAW:
-			stream_init(ctx, &dev->video, 0, frame_mode.bytes);
-			break;
 		case FREENECT_VIDEO_DUMMY: // Silence compiler
 			break;
 	}
+}
 
-	res = fnusb_start_iso(&dev->usb_cam, &dev->video_isoc, video_process, 0x81, NUM_XFERS, PKTS_PER_XFER, VIDEO_PKTBUF);
-	if (res < 0)
-		return res;
+// Queue the video mode register writes that start the stream on the device
+static void video_program(freenect_device *dev, const video_regs *regs, freenect_cmd_batch *batch)
+{
+	if ((dev->video_format == FREENECT_VIDEO_IR_8BIT || dev->video_format == FREENECT_VIDEO_IR_10BIT ||
+	     dev->video_format == FREENECT_VIDEO_IR_10BIT_PACKED) && dev->video_resolution == FREENECT_RESOLUTION_HIGH) {
+		// Due to some ridiculous condition in the firmware, we have to start and stop the
+		// depth stream before the camera will hand us 1280x1024 IR.  This is a stupid
+		// workaround, but we've yet to find a better solution.
+		freenect_cmd_batch_write_register(batch, 0x13, 0x01); // set depth camera resolution (640x480)
+		freenect_cmd_batch_write_register(batch, 0x14, 0x1e); // set depth camera FPS (30)
+		freenect_cmd_batch_write_register(batch, 0x06, 0x02); // start depth camera
+		freenect_cmd_batch_write_register(batch, 0x06, 0x00); // stop depth camera
+	}
 
-	write_register(dev, mode_reg, mode_value);
-	write_register(dev, res_reg, res_value);
-	write_register(dev, fps_reg, fps_value);
+	freenect_cmd_batch_write_register(batch, regs->mode_reg, regs->mode_value);
+	freenect_cmd_batch_write_register(batch, regs->res_reg, regs->res_value);
+	freenect_cmd_batch_write_register(batch, regs->fps_reg, regs->fps_value);
 
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
 		case FREENECT_VIDEO_BAYER:
+		case FREENECT_VIDEO_RGB_HALF:
+		case FREENECT_VIDEO_RGB_QUARTER:
+		case FREENECT_VIDEO_Y8:
+		case FREENECT_VIDEO_NV12:
 		case FREENECT_VIDEO_YUV_RGB:
 		case FREENECT_VIDEO_YUV_RAW:
-			write_register(dev, 0x05, 0x01); // start video stream
+		case FREENECT_VIDEO_YUV_Y8:
+		case FREENECT_VIDEO_YUV_NV12:
+			freenect_cmd_batch_write_register(batch, 0x05, 0x01); // start video stream
 			break;
 		case FREENECT_VIDEO_IR_8BIT:
 		case FREENECT_VIDEO_IR_10BIT:
 		case FREENECT_VIDEO_IR_10BIT_PACKED:
-			write_register(dev, 0x105, 0x00); // Disable auto-cycle of projector
-			write_register(dev, 0x05, 0x03); // start video stream
+			freenect_cmd_batch_write_register(batch, 0x105, 0x00); // Disable auto-cycle of projector
+			freenect_cmd_batch_write_register(batch, 0x05, 0x03); // start video stream
 			break;
 		case FREENECT_VIDEO_DUMMY: // Silence compiler
 			break;
 	}
-	write_register(dev, hflip_reg, 0x00); // disable Hflip
+	freenect_cmd_batch_write_register(batch, regs->hflip_reg, 0x00); // disable Hflip
+}
+
+int freenect_start_video(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	int res;
+	uint64_t start = fn_get_time_us();
+
+	if (dev->video.running)
+		return -1;
+
+	if (dev->is_virtual) {
+		dev->video.running = 1;
+		return 0;
+	}
+
+	dev->video.pkt_size = VIDEO_PKTDSIZE;
+	dev->video.flag = 0x80;
+	dev->video.variable_length = 0;
+
+	video_regs regs;
+	if (video_mode_regs(dev, &regs) < 0)
+		return -1;
+
+	int rlen, plen;
+	video_buf_sizes(dev, &rlen, &plen);
+	if (stream_init(ctx, &dev->video, rlen, plen) < 0)
+		return -1;
+
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch)
+		return -1;
+	video_program(dev, &regs, batch);
+
+	int xfers, active, pkts, pktbuf;
+	iso_config_resolve(&dev->video_iso_config, VIDEO_PKTBUF, &xfers, &active, &pkts, &pktbuf);
+	res = fnusb_start_iso(&dev->usb_cam, &dev->video_isoc, video_process, 0x81, xfers, active, pkts, pktbuf);
+	if (res < 0) {
+		freenect_cmd_batch_destroy(batch);
+		return res;
+	}
 
 	dev->video.running = 1;
+	res = stream_program_submit(batch, &dev->video);
+	if (res < 0) {
+		// As in freenect_start_depth()
+		dev->video.running = 0;
+		fnusb_stop_iso(&dev->usb_cam, &dev->video_isoc);
+		return res;
+	}
+	dev->video.start_us = start;
+	dev->video.start_call_us = (int)(fn_get_time_us() - start);
+	FN_DEBUG("freenect_start_video() returned after %d us\n", dev->video.start_call_us);
 	return 0;
 }
 
@@ -1054,6 +1719,8 @@ int freenect_stop_depth(freenect_device *dev)
 		return -1;
 
 	dev->depth.running = 0;
+	if (dev->is_virtual)
+		return 0;
 	write_register(dev, 0x06, 0x00); // stop depth stream
 
 	res = fnusb_stop_iso(&dev->usb_cam, &dev->depth_isoc);
@@ -1062,8 +1729,8 @@ int freenect_stop_depth(freenect_device *dev)
 		return res;
 	}
 
+	// Buffers are kept for the next start, see freenect_camera_teardown()
 	freenect_destroy_registration(&(dev->registration));
-	stream_freebufs(ctx, &dev->depth);
 	return 0;
 }
 
@@ -1076,6 +1743,11 @@ int freenect_stop_video(freenect_device *dev)
 		return -1;
 
 	dev->video.running = 0;
+	// A plain start after this must not keep switching modes
+	if (dev->video_multiplex)
+		video_multiplex_free(dev);
+	if (dev->is_virtual)
+		return 0;
 	write_register(dev, 0x05, 0x00); // stop video stream
 
 	res = fnusb_stop_iso(&dev->usb_cam, &dev->video_isoc);
@@ -1084,7 +1756,6 @@ int freenect_stop_video(freenect_device *dev)
 		return res;
 	}
 
-	stream_freebufs(ctx, &dev->video);
 	return 0;
 }
 
@@ -1168,7 +1839,8 @@ int freenect_set_video_mode(freenect_device* dev, const freenect_frame_mode mode
 	dev->video_resolution = res;
 	// Now that we've changed video format and resolution, we need to update
 	// registration tables.
-	freenect_fetch_reg_info(dev);
+	if (!dev->is_virtual)
+		freenect_fetch_reg_info(dev, freenect_get_current_video_mode(dev));
 	return 0;
 }
 
@@ -1230,6 +1902,423 @@ int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode
 	dev->depth_resolution = res;
 	return 0;
 }
+
+static int mode_supported(const freenect_frame_mode *modes, int count, const freenect_frame_mode mode)
+{
+	int i;
+	for(i = 0 ; i < count; i++) {
+		if (modes[i].reserved == mode.reserved)
+			return 1;
+	}
+	return 0;
+}
+
+int freenect_switch_video_mode(freenect_device* dev, const freenect_frame_mode mode)
+{
+	freenect_context *ctx = dev->parent;
+	if (dev->video_multiplex) {
+		FN_ERROR("freenect_switch_video_mode: video is being multiplexed\n");
+		return -1;
+	}
+	if (!dev->video.running)
+		return freenect_set_video_mode(dev, mode);
+	if (!mode_supported(supported_video_modes, video_mode_count, mode)) {
+		FN_ERROR("freenect_switch_video_mode: freenect_frame_mode provided is invalid\n");
+		return -1;
+	}
+
+	freenect_video_format old_fmt = dev->video_format;
+	freenect_resolution old_res = dev->video_resolution;
+	dev->video_format = (freenect_video_format)RESERVED_TO_FORMAT(mode.reserved);
+	dev->video_resolution = RESERVED_TO_RESOLUTION(mode.reserved);
+	if (dev->is_virtual)
+		return 0;
+
+	video_regs regs;
+	if (video_mode_regs(dev, &regs) < 0) {
+		dev->video_format = old_fmt;
+		dev->video_resolution = old_res;
+		return -1;
+	}
+
+	// Drop packets until the new mode is programmed, so that no frame is
+	// converted with one mode into buffers sized for the other; the stream
+	// is let through again by stream_programmed()
+	dev->video.switch_start_us = fn_get_time_us();
+	dev->video.held = 1;
+
+	// The iso transfers keep running; only the frame buffers may need to grow
+	int rlen, plen;
+	video_buf_sizes(dev, &rlen, &plen);
+	if (stream_alloc_bufs(ctx, &dev->video, rlen, plen) < 0) {
+		// Go back to the old mode, whose buffers are smaller than the ones
+		// which couldn't be had, and keep dropping packets if even that fails
+		dev->video_format = old_fmt;
+		dev->video_resolution = old_res;
+		video_buf_sizes(dev, &rlen, &plen);
+		if (stream_alloc_bufs(ctx, &dev->video, rlen, plen) == 0)
+			dev->video.held = 0;
+		dev->video.switch_start_us = 0;
+		return -1;
+	}
+
+	// freenect_camera_init() fetched the parameters of every mode, so this
+	// doesn't wait on the camera in the middle of the switch
+	fn_reg_info_entry *reg = reg_info_cached(dev, mode);
+	if (reg)
+		dev->registration.reg_info = reg->reg_info;
+	else
+		FN_WARNING("freenect_switch_video_mode: no registration parameters for the mode, keeping the old ones\n");
+	if (dev->depth.running && depth_needs_registration(dev->depth_format))
+		freenect_init_registration(dev);
+
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch) {
+		dev->video.held = 0;
+		dev->video.switch_start_us = 0;
+		return -1;
+	}
+	freenect_cmd_batch_write_register(batch, 0x05, 0x00); // stop video stream
+	video_program(dev, &regs, batch);
+	return stream_program_submit(batch, &dev->video);
+}
+
+int freenect_switch_depth_mode(freenect_device* dev, const freenect_frame_mode mode)
+{
+	freenect_context *ctx = dev->parent;
+	if (!dev->depth.running)
+		return freenect_set_depth_mode(dev, mode);
+	if (!mode_supported(supported_depth_modes, depth_mode_count, mode)) {
+		FN_ERROR("freenect_switch_depth_mode: freenect_frame_mode provided is invalid\n");
+		return -1;
+	}
+
+	freenect_depth_format old_fmt = dev->depth_format;
+	freenect_resolution old_res = dev->depth_resolution;
+	dev->depth_format = (freenect_depth_format)RESERVED_TO_FORMAT(mode.reserved);
+	dev->depth_resolution = RESERVED_TO_RESOLUTION(mode.reserved);
+	if (dev->is_virtual)
+		return 0;
+
+	// Drop packets until the new mode is programmed, see freenect_switch_video_mode()
+	dev->depth.switch_start_us = fn_get_time_us();
+	dev->depth.held = 1;
+
+	if (depth_needs_registration(dev->depth_format) && !depth_needs_registration(old_fmt))
+		freenect_init_registration(dev);
+	else if (!depth_needs_registration(dev->depth_format) && depth_needs_registration(old_fmt))
+		freenect_destroy_registration(&(dev->registration));
+
+	// The iso transfers keep running; only the frame buffers may need to grow
+	int rlen, plen;
+	depth_buf_sizes(dev, &rlen, &plen);
+	if (stream_alloc_bufs(ctx, &dev->depth, rlen, plen) < 0) {
+		// As in freenect_switch_video_mode()
+		if (depth_needs_registration(old_fmt) && !depth_needs_registration(dev->depth_format))
+			freenect_init_registration(dev);
+		else if (!depth_needs_registration(old_fmt) && depth_needs_registration(dev->depth_format))
+			freenect_destroy_registration(&(dev->registration));
+		dev->depth_format = old_fmt;
+		dev->depth_resolution = old_res;
+		depth_buf_sizes(dev, &rlen, &plen);
+		if (stream_alloc_bufs(ctx, &dev->depth, rlen, plen) == 0)
+			dev->depth.held = 0;
+		dev->depth.switch_start_us = 0;
+		return -1;
+	}
+
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch) {
+		dev->depth.held = 0;
+		dev->depth.switch_start_us = 0;
+		return -1;
+	}
+	freenect_cmd_batch_write_register(batch, 0x06, 0x00); // stop depth stream
+	depth_program(dev, batch);
+	return stream_program_submit(batch, &dev->depth);
+}
+
+static int stream_switch_time(packet_stream *strm)
+{
+	if (strm->switch_start_us || !strm->switch_time_us)
+		return -1;
+	return strm->switch_time_us;
+}
+
+int freenect_get_video_switch_time(freenect_device *dev)
+{
+	return stream_switch_time(&dev->video);
+}
+
+int freenect_get_depth_switch_time(freenect_device *dev)
+{
+	return stream_switch_time(&dev->depth);
+}
+
+static int stream_start_time(packet_stream *strm, int *call_us)
+{
+	if (call_us)
+		*call_us = strm->start_call_us ? strm->start_call_us : -1;
+	if (strm->start_us || !strm->start_time_us)
+		return -1;
+	return strm->start_time_us;
+}
+
+int freenect_get_video_start_time(freenect_device *dev, int *call_us)
+{
+	return stream_start_time(&dev->video, call_us);
+}
+
+int freenect_get_depth_start_time(freenect_device *dev, int *call_us)
+{
+	return stream_start_time(&dev->depth, call_us);
+}
+
+// Video modes taken in turns, see freenect_start_video_multiplex()
+typedef struct {
+	freenect_frame_mode mode;
+	int frames;
+	// Frame buffers of the mode while another one is streaming
+	int split_bufs;
+	void *lib_buf;
+	void *usr_buf;
+	uint8_t *raw_buf;
+	int lib_buf_size;
+	int raw_buf_size;
+	fn_buffer_kind lib_buf_kind;
+	fn_buffer_kind raw_buf_kind;
+} multiplex_slot;
+
+struct _fn_video_multiplex {
+	multiplex_slot slots[FREENECT_MULTIPLEX_MAX_MODES];
+	int count;
+	int current;
+	int taken;    // frames delivered in the current turn
+	int pending;  // a switch is waiting for its first frame
+	uint64_t total_switch_us;
+	uint32_t timed_switches;
+	double total_dead_frames;
+	freenect_multiplex_stats stats;
+};
+
+static void stream_save_bufs(packet_stream *strm, multiplex_slot *slot)
+{
+	slot->split_bufs = strm->split_bufs;
+	slot->lib_buf = strm->lib_buf;
+	slot->raw_buf = strm->raw_buf;
+	slot->lib_buf_size = strm->lib_buf_size;
+	slot->raw_buf_size = strm->raw_buf_size;
+	slot->lib_buf_kind = strm->lib_buf_kind;
+	slot->raw_buf_kind = strm->raw_buf_kind;
+	// The pool of freenect_enable_latest_video() serves every mode
+	if (!strm->latest)
+		slot->usr_buf = strm->usr_buf;
+}
+
+static void stream_load_bufs(packet_stream *strm, const multiplex_slot *slot)
+{
+	strm->split_bufs = slot->split_bufs;
+	strm->lib_buf = slot->lib_buf;
+	strm->raw_buf = slot->raw_buf;
+	strm->lib_buf_size = slot->lib_buf_size;
+	strm->raw_buf_size = slot->raw_buf_size;
+	strm->lib_buf_kind = slot->lib_buf_kind;
+	strm->raw_buf_kind = slot->raw_buf_kind;
+	if (!strm->latest)
+		strm->usr_buf = slot->usr_buf;
+}
+
+static void video_set_mode_fields(freenect_device *dev, const freenect_frame_mode mode)
+{
+	dev->video_format = (freenect_video_format)RESERVED_TO_FORMAT(mode.reserved);
+	dev->video_resolution = RESERVED_TO_RESOLUTION(mode.reserved);
+}
+
+// Move the stream into the buffers of another slot, sized for its mode.
+// Returns -1 if they couldn't be allocated, with the slot left empty.
+static int video_multiplex_load(freenect_device *dev, int from, int to)
+{
+	struct _fn_video_multiplex *mux = dev->video_multiplex;
+	int rlen, plen;
+
+	stream_save_bufs(&dev->video, &mux->slots[from]);
+	stream_load_bufs(&dev->video, &mux->slots[to]);
+	video_set_mode_fields(dev, mux->slots[to].mode);
+	video_buf_sizes(dev, &rlen, &plen);
+	return stream_alloc_bufs(dev->parent, &dev->video, rlen, plen);
+}
+
+// Free the buffers of every slot but the one streaming, which the stream
+// keeps for restarting
+static void video_multiplex_free(freenect_device *dev)
+{
+	struct _fn_video_multiplex *mux = dev->video_multiplex;
+	int i;
+
+	for (i = 0; i < mux->count; i++) {
+		multiplex_slot *slot = &mux->slots[i];
+		if (i == mux->current)
+			continue;
+		if (slot->split_bufs)
+			fn_buffer_free(slot->raw_buf, slot->raw_buf_size, slot->raw_buf_kind);
+		fn_buffer_free(slot->lib_buf, slot->lib_buf_size, slot->lib_buf_kind);
+	}
+	free(mux);
+	dev->video_multiplex = NULL;
+}
+
+// Account for a delivered frame and move on to the next mode at the end of a turn
+static void video_multiplex_frame(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	struct _fn_video_multiplex *mux = dev->video_multiplex;
+	packet_stream *strm = &dev->video;
+
+	if (mux->pending) {
+		// stream_switch_done() timed this first frame in the new mode
+		int us = strm->switch_time_us;
+		int fps = mux->slots[mux->current].mode.framerate;
+		double dead = fps > 0 ? us * fps / 1000000.0 - 1 : 0;
+		mux->pending = 0;
+		mux->timed_switches++;
+		mux->total_switch_us += us;
+		mux->total_dead_frames += dead > 0 ? dead : 0;
+		mux->stats.last_switch_us = us;
+		mux->stats.mean_switch_us = (int)(mux->total_switch_us / mux->timed_switches);
+		if (us > mux->stats.max_switch_us)
+			mux->stats.max_switch_us = us;
+		mux->stats.dead_frames = (float)(mux->total_dead_frames / mux->timed_switches);
+	}
+	mux->stats.frames[mux->current]++;
+
+	if (++mux->taken < mux->slots[mux->current].frames)
+		return;
+	mux->taken = 0;
+
+	int from = mux->current;
+	int to = (from + 1) % mux->count;
+	video_regs regs;
+	video_set_mode_fields(dev, mux->slots[to].mode);
+	if (video_mode_regs(dev, &regs) < 0) {
+		// Can happen when depth was started after high resolution IR was
+		// chosen; stay where we are
+		video_set_mode_fields(dev, mux->slots[from].mode);
+		return;
+	}
+
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch) {
+		video_set_mode_fields(dev, mux->slots[from].mode);
+		return;
+	}
+
+	// As in freenect_switch_video_mode(), but into buffers kept for the mode
+	strm->switch_start_us = fn_get_time_us();
+	strm->held = 1;
+	if (video_multiplex_load(dev, from, to) < 0) {
+		// Stay where we are, in buffers which were already allocated
+		freenect_cmd_batch_destroy(batch);
+		if (video_multiplex_load(dev, to, from) == 0)
+			strm->held = 0;
+		strm->switch_start_us = 0;
+		return;
+	}
+	mux->current = to;
+	mux->pending = 1;
+	mux->stats.switches++;
+
+	freenect_cmd_batch_write_register(batch, 0x05, 0x00); // stop video stream
+	video_program(dev, &regs, batch);
+	if (stream_program_submit(batch, strm) < 0)
+		FN_ERROR("Failed to switch multiplexed video to mode %d\n", to);
+}
+
+int freenect_start_video_multiplex(freenect_device *dev, const freenect_frame_mode *modes, const int *frames, int count)
+{
+	freenect_context *ctx = dev->parent;
+	struct _fn_video_multiplex *mux;
+	int i, res;
+
+	if (dev->video.running || dev->video_multiplex) {
+		FN_ERROR("freenect_start_video_multiplex: video is already running\n");
+		return -1;
+	}
+	if (dev->is_virtual) {
+		FN_ERROR("freenect_start_video_multiplex: not supported on virtual devices\n");
+		return -1;
+	}
+	if (count < 2 || count > FREENECT_MULTIPLEX_MAX_MODES) {
+		FN_ERROR("freenect_start_video_multiplex: needs 2 to %d modes\n", FREENECT_MULTIPLEX_MAX_MODES);
+		return -1;
+	}
+
+	// Check every mode up front, so that turns never fail on a bad one
+	freenect_video_format old_fmt = dev->video_format;
+	freenect_resolution old_res = dev->video_resolution;
+	for (i = 0; i < count; i++) {
+		video_regs regs;
+		if (!mode_supported(supported_video_modes, video_mode_count, modes[i]) || frames[i] < 1) {
+			FN_ERROR("freenect_start_video_multiplex: mode %d is invalid\n", i);
+			return -1;
+		}
+		video_set_mode_fields(dev, modes[i]);
+		res = video_mode_regs(dev, &regs);
+		dev->video_format = old_fmt;
+		dev->video_resolution = old_res;
+		if (res < 0)
+			return -1;
+	}
+
+	mux = (struct _fn_video_multiplex*)calloc(1, sizeof(*mux));
+	if (!mux)
+		return -1;
+	mux->count = count;
+	for (i = 0; i < count; i++) {
+		mux->slots[i].mode = modes[i];
+		mux->slots[i].frames = frames[i];
+	}
+	mux->stats.last_switch_us = -1;
+
+	res = freenect_set_video_mode(dev, modes[0]);
+	if (res == 0)
+		res = freenect_start_video(dev);
+	if (res < 0) {
+		free(mux);
+		return res;
+	}
+	dev->video_multiplex = mux;
+
+	// Allocate the buffers of the other modes now rather than on their first turn
+	res = 0;
+	for (i = 1; i <= count && res == 0; i++)
+		res = video_multiplex_load(dev, i - 1, i % count);
+	if (res == 0)
+		return 0;
+	// The stream is in the slot which failed
+	mux->current = (i - 1) % count;
+	freenect_stop_video_multiplex(dev);
+	return res;
+}
+
+int freenect_stop_video_multiplex(freenect_device *dev)
+{
+	if (!dev->video_multiplex)
+		return -1;
+	// Stopping the stream ends the multiplexing too
+	if (dev->video.running)
+		return freenect_stop_video(dev);
+	video_multiplex_free(dev);
+	return 0;
+}
+
+int freenect_get_video_multiplex_stats(freenect_device *dev, freenect_multiplex_stats *stats)
+{
+	if (!dev->video_multiplex)
+		return -1;
+	*stats = dev->video_multiplex->stats;
+	return 0;
+}
+
 int freenect_set_depth_buffer(freenect_device *dev, void *buf)
 {
 	return stream_setbuf(dev->parent, &dev->depth, buf);
@@ -1240,6 +2329,34 @@ int freenect_set_video_buffer(freenect_device *dev, void *buf)
 	return stream_setbuf(dev->parent, &dev->video, buf);
 }
 
+int freenect_enable_latest_depth(freenect_device *dev, int max_frames)
+{
+	int rlen, plen;
+	depth_buf_sizes(dev, &rlen, &plen);
+	return stream_enable_latest(dev, &dev->depth, max_frames, plen);
+}
+
+int freenect_enable_latest_video(freenect_device *dev, int max_frames)
+{
+	int rlen, plen;
+	video_buf_sizes(dev, &rlen, &plen);
+	return stream_enable_latest(dev, &dev->video, max_frames, plen);
+}
+
+int freenect_disable_latest_depth(freenect_device *dev)
+{
+	int rlen, plen;
+	depth_buf_sizes(dev, &rlen, &plen);
+	return stream_disable_latest(dev, &dev->depth, rlen, plen);
+}
+
+int freenect_disable_latest_video(freenect_device *dev)
+{
+	int rlen, plen;
+	video_buf_sizes(dev, &rlen, &plen);
+	return stream_disable_latest(dev, &dev->video, rlen, plen);
+}
+
 FN_INTERNAL int freenect_camera_init(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
@@ -1254,6 +2371,12 @@ FN_INTERNAL int freenect_camera_init(freenect_device *dev)
 		FN_ERROR("freenect_camera_init(): Failed to fetch zero plane info for device\n");
 		return res;
 	}
+	// Registration parameters of every video mode, for freenect_switch_video_mode()
+	int i;
+	for (i = 0; i < video_mode_count; i++) {
+		if (freenect_fetch_reg_info(dev, supported_video_modes[i]) < 0)
+			FN_WARNING("freenect_camera_init(): Failed to fetch registration info for video mode %d\n", i);
+	}
 	res = freenect_set_video_mode(dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
 	res = freenect_set_depth_mode(dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
 	res = freenect_fetch_reg_const_shift(dev);
@@ -1267,21 +2390,32 @@ FN_INTERNAL int freenect_camera_init(freenect_device *dev)
 FN_INTERNAL int freenect_camera_teardown(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
-	int res = 0;
+	int depth_res = 0, video_res = 0;
 	if (dev->depth.running) {
-		res = freenect_stop_depth(dev);
-		if (res < 0) {
+		depth_res = freenect_stop_depth(dev);
+		if (depth_res < 0)
 			FN_ERROR("freenect_camera_teardown(): Failed to stop depth camera\n");
-		}
-		return res;
 	}
 	if (dev->video.running) {
-		res = freenect_stop_video(dev);
-		if (res < 0) {
+		video_res = freenect_stop_video(dev);
+		if (video_res < 0)
 			FN_ERROR("freenect_camera_teardown(): Failed to stop video camera\n");
-		}
-		return res;
 	}
+	if (dev->video_multiplex)
+		video_multiplex_free(dev);
+	// Release the buffers the streams kept for restarting
+	if (dev->depth.latest)
+		freenect_disable_latest_depth(dev);
+	if (dev->video.latest)
+		freenect_disable_latest_video(dev);
+	// The transfers of a stream which failed to stop may still be in flight,
+	// so their memory is left to the process; the frame buffers go either way
+	if (depth_res == 0)
+		fnusb_free_iso(&dev->usb_cam, &dev->depth_isoc);
+	if (video_res == 0)
+		fnusb_free_iso(&dev->usb_cam, &dev->video_isoc);
+	stream_freebufs(ctx, &dev->depth);
+	stream_freebufs(ctx, &dev->video);
 	freenect_destroy_registration(&(dev->registration));
-	return 0;
+	return depth_res < 0 ? depth_res : video_res;
 }
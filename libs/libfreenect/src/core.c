@@ -30,10 +30,17 @@
 #include <stdarg.h>
 
 #include <unistd.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "freenect_internal.h"
 #include "registration.h"
 #include "cameras.h"
+#include "flags.h"
+#include "tilt.h"
 #ifdef BUILD_AUDIO
 #include "loader.h"
 #endif
@@ -88,6 +95,7 @@ FREENECTAPI int freenect_process_events_timeout(freenect_context *ctx, struct ti
 	// Iterate over the devices in ctx.  If any of them are flagged as
 	freenect_device* dev = ctx->first;
 	while(dev) {
+		freenect_tilt_sampler_poll(dev);
 		if (dev->usb_cam.device_dead) {
 			FN_ERROR("USB camera marked dead, stopping streams\n");
 			res = -1;
@@ -152,6 +160,93 @@ FREENECTAPI freenect_device_flags freenect_enabled_subdevices(freenect_context *
 	return ctx->enabled_subdevices;
 }
 
+FREENECTAPI void freenect_set_buffer_flags(freenect_context *ctx, int flags) {
+	ctx->buffer_flags = flags & (FREENECT_BUFFER_HUGEPAGES | FREENECT_BUFFER_DEV_MEM | FREENECT_BUFFER_LOCKED);
+}
+
+#define FN_PAGE_SIZE 4096
+#define FN_HUGE_PAGE_SIZE (2*1024*1024)
+
+// Keep a buffer's pages resident if the context asks for it, so unpacking a
+// frame never waits on the pager.  This needs CAP_IPC_LOCK or a large enough
+// RLIMIT_MEMLOCK; without either the buffer is left as it is.
+static void *fn_buffer_lock(freenect_context *ctx, void *buf, size_t len, fn_buffer_kind *kind)
+{
+#ifndef _WIN32
+	if (ctx->buffer_flags & FREENECT_BUFFER_LOCKED) {
+		if (mlock(buf, len) == 0)
+			*kind = (fn_buffer_kind)(*kind | FN_BUFFER_LOCKED);
+		else
+			FN_INFO("Could not lock a %d byte buffer in memory\n", (int)len);
+	}
+#endif
+	return buf;
+}
+
+// Allocate a page aligned stream buffer, with huge pages if the context asks
+// for them.  Buffers smaller than a huge page are not worth the waste.
+FN_INTERNAL void *fn_buffer_alloc(freenect_context *ctx, size_t len, fn_buffer_kind *kind)
+{
+	void *buf = NULL;
+	int hugepages = (ctx->buffer_flags & FREENECT_BUFFER_HUGEPAGES) && len >= FN_HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		size_t maplen = (len + FN_HUGE_PAGE_SIZE - 1) & ~(size_t)(FN_HUGE_PAGE_SIZE - 1);
+		buf = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED) {
+			*kind = FN_BUFFER_HUGETLB;
+			return fn_buffer_lock(ctx, buf, maplen, kind);
+		}
+		FN_INFO("No huge pages reserved for a %d byte buffer, using normal pages\n", (int)len);
+		buf = NULL;
+	}
+#endif
+
+#ifdef _WIN32
+	buf = _aligned_malloc(len, FN_PAGE_SIZE);
+#else
+	if (posix_memalign(&buf, FN_PAGE_SIZE, len) != 0)
+		buf = NULL;
+#endif
+	if (!buf)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	// Transparent huge pages are the next best thing
+	if (hugepages)
+		madvise(buf, len, MADV_HUGEPAGE);
+#endif
+	*kind = FN_BUFFER_ALIGNED;
+	return fn_buffer_lock(ctx, buf, len, kind);
+}
+
+FN_INTERNAL void fn_buffer_free(void *buf, size_t len, fn_buffer_kind kind)
+{
+	if (!buf)
+		return;
+#ifndef _WIN32
+	// Unmapping unlocks too, but heap pages go back to the allocator
+	if (kind & FN_BUFFER_LOCKED)
+		munlock(buf, len);
+#endif
+	switch (kind & ~FN_BUFFER_LOCKED) {
+		case FN_BUFFER_ALIGNED:
+#ifdef _WIN32
+			_aligned_free(buf);
+#else
+			free(buf);
+#endif
+			break;
+#ifdef MAP_HUGETLB
+		case FN_BUFFER_HUGETLB:
+			munmap(buf, (len + FN_HUGE_PAGE_SIZE - 1) & ~(size_t)(FN_HUGE_PAGE_SIZE - 1));
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
 FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index)
 {
 	int res;
@@ -162,9 +257,11 @@ FREENECTAPI int freenect_open_device(freenect_context *ctx, freenect_device **de
 	memset(pdev, 0, sizeof(*pdev));
 
 	pdev->parent = ctx;
+	fn_lock_init(&pdev->lock);
 
 	res = fnusb_open_subdevices(pdev, index);
 	if (res < 0) {
+		fn_lock_destroy(&pdev->lock);
 		free(pdev);
 		return res;
 	}
@@ -219,9 +316,21 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 	freenect_context *ctx = dev->parent;
 	int res;
 
+	if (dev->tilt_sampler) {
+		freenect_stop_tilt_sampler(dev);
+	}
+
 	if (dev->usb_cam.dev) {
+		fn_cmd_queue_drain(dev);
 		freenect_camera_teardown(dev);
 	}
+	// Virtual devices have no camera to tear down
+	if (dev->depth.latest)
+		freenect_disable_latest_depth(dev);
+	if (dev->video.latest)
+		freenect_disable_latest_video(dev);
+	if (dev->depth_stats)
+		freenect_disable_depth_stats(dev);
 
 	res = fnusb_close_subdevices(dev);
 	if (res < 0) {
@@ -247,6 +356,7 @@ FREENECTAPI int freenect_close_device(freenect_device *dev)
 	else
 		ctx->first = cur->next;
 
+	fn_lock_destroy(&dev->lock);
 	free(dev);
 	return 0;
 }
@@ -24,6 +24,7 @@
  * either License.
  */
 
+#include <stdlib.h>
 #include <string.h> // for memcpy
 #include "freenect_internal.h"
 #include "flags.h"
@@ -72,14 +73,11 @@ typedef struct {
 	uint16_t tag;
 } cam_hdr;
 
-FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, void *replybuf, int reply_len)
+// Fill obuf with a command for the camera, returns the number of bytes to send
+static int cmd_fill(freenect_device *dev, uint16_t cmd, const void *cmdbuf, unsigned int cmd_len, uint8_t *obuf)
 {
 	freenect_context *ctx = dev->parent;
-	int res, actual_len;
-	uint8_t obuf[0x400];
-	uint8_t ibuf[0x200];
 	cam_hdr *chdr = (cam_hdr*)obuf;
-	cam_hdr *rhdr = (cam_hdr*)ibuf;
 
 	if (cmd_len & 1 || cmd_len > (0x400 - sizeof(*chdr))) {
 		FN_ERROR("send_cmd: Invalid command length (0x%x)\n", cmd_len);
@@ -93,22 +91,19 @@ FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsig
 	chdr->len = fn_le16(cmd_len / 2);
 
 	memcpy(obuf+sizeof(*chdr), cmdbuf, cmd_len);
+	return cmd_len + sizeof(*chdr);
+}
 
-	res = fnusb_control(&dev->usb_cam, 0x40, 0, 0, 0, obuf, cmd_len + sizeof(*chdr));
-	FN_SPEW("send_cmd: cmd=%04x tag=%04x len=%04x: %d\n", cmd, dev->cam_tag, cmd_len, res);
-	if (res < 0) {
-		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", res);
-		return res;
-	}
+// Check the camera's reply to the command in obuf, returns the number of data
+// bytes following the header
+static int cmd_check_reply(freenect_context *ctx, const uint8_t *obuf, const uint8_t *ibuf, int actual_len)
+{
+	const cam_hdr *chdr = (const cam_hdr*)obuf;
+	const cam_hdr *rhdr = (const cam_hdr*)ibuf;
 
-	do {
-		actual_len = fnusb_control(&dev->usb_cam, 0xc0, 0, 0, 0, ibuf, 0x200);
-		FN_FLOOD("send_cmd: actual length = %d\n", actual_len);
-	} while ((actual_len == 0) || (actual_len == 0x200));
-	FN_SPEW("Control reply: %d\n", res);
 	if (actual_len < (int)sizeof(*rhdr)) {
-		FN_ERROR("send_cmd: Input control transfer failed (%d)\n", res);
-		return res;
+		FN_ERROR("send_cmd: Input control transfer failed (%d)\n", actual_len);
+		return -1;
 	}
 	actual_len -= sizeof(*rhdr);
 
@@ -128,6 +123,41 @@ FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsig
 		FN_ERROR("send_cmd: Bad len %04x != %04x\n", fn_le16(rhdr->len), (int)(actual_len/2));
 		return -1;
 	}
+	return actual_len;
+}
+
+FN_INTERNAL int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned int cmd_len, void *replybuf, int reply_len)
+{
+	freenect_context *ctx = dev->parent;
+	int res, actual_len;
+	uint8_t obuf[0x400];
+	uint8_t ibuf[0x200];
+	cam_hdr *rhdr = (cam_hdr*)ibuf;
+
+	// Queued asynchronous commands go first, the camera expects tags in order
+	if (fn_cmd_queue_drain(dev) < 0)
+		return -1;
+
+	int len = cmd_fill(dev, cmd, cmdbuf, cmd_len, obuf);
+	if (len < 0)
+		return len;
+
+	res = fnusb_control(&dev->usb_cam, 0x40, 0, 0, 0, obuf, len);
+	FN_SPEW("send_cmd: cmd=%04x tag=%04x len=%04x: %d\n", cmd, dev->cam_tag, cmd_len, res);
+	if (res < 0) {
+		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", res);
+		return res;
+	}
+
+	do {
+		actual_len = fnusb_control(&dev->usb_cam, 0xc0, 0, 0, 0, ibuf, 0x200);
+		FN_FLOOD("send_cmd: actual length = %d\n", actual_len);
+	} while ((actual_len == 0) || (actual_len == 0x200));
+	FN_SPEW("Control reply: %d\n", res);
+
+	actual_len = cmd_check_reply(ctx, obuf, ibuf, actual_len);
+	if (actual_len < 0)
+		return actual_len;
 
 	if (actual_len > reply_len) {
 		FN_WARNING("send_cmd: Data buffer is %d bytes long, but got %d bytes\n", reply_len, actual_len);
@@ -221,3 +251,358 @@ FN_INTERNAL int write_cmos_register(freenect_device *dev, uint16_t reg, uint16_t
 		FN_ERROR("write_cmos_register: send_cmd() returned %d\n", res);
 	return res;
 }
+
+enum {
+	FN_CMD_WRITE_REG,   // write_register()
+	FN_CMD_MODIFY_CMOS, // read_cmos_register(), change masked bits, write_cmos_register()
+};
+
+typedef struct {
+	int type;
+	uint16_t reg;
+	uint16_t value;
+	uint16_t mask; // FN_CMD_MODIFY_CMOS: bits of value to apply
+} fn_cmd_op;
+
+struct _freenect_cmd_batch {
+	freenect_device *dev;
+	freenect_cmd_batch *next; // in dev->cmd_queue
+	fn_cmd_op *ops;
+	int num_ops;
+	int max_ops;
+	int cur_op;
+	int cur_phase; // FN_CMD_MODIFY_CMOS: 0 while reading, 1 while writing
+	uint16_t cmos_value;
+	uint8_t obuf[0x20]; // command in flight, kept to check the reply against
+	int status; // 1 while queued or being sent
+	int submitted;
+	int detached; // free once complete
+	int in_callback;
+	freenect_cmd_batch_cb cb;
+	void *user_data;
+	uint64_t submit_us;
+	uint64_t done_us;
+};
+
+static void cmd_batch_send(freenect_cmd_batch *batch);
+
+static void cmd_batch_free(freenect_cmd_batch *batch)
+{
+	free(batch->ops);
+	free(batch);
+}
+
+// Record the outcome of a batch that is off the queue, and report it
+static void cmd_batch_complete(freenect_cmd_batch *batch, int status)
+{
+	freenect_device *dev = batch->dev;
+	freenect_context *ctx = dev->parent;
+
+	batch->status = status;
+	batch->done_us = fn_get_time_us();
+	FN_SPEW("Command batch of %d finished with %d after %d us\n", batch->num_ops, status, (int)(batch->done_us - batch->submit_us));
+
+	if (batch->cb) {
+		batch->in_callback = 1;
+		dev->cmd_queue_busy++;
+		batch->cb(dev, batch, status, batch->user_data);
+		dev->cmd_queue_busy--;
+		batch->in_callback = 0;
+	}
+	if (batch->detached)
+		cmd_batch_free(batch);
+}
+
+static void cmd_batch_finish(freenect_cmd_batch *batch, int status)
+{
+	freenect_device *dev = batch->dev;
+
+	dev->cmd_queue = batch->next;
+	if (!dev->cmd_queue)
+		dev->cmd_queue_tail = NULL;
+	batch->next = NULL;
+
+	// Start the next batch before the callback, which may wait for the queue
+	if (dev->cmd_queue)
+		cmd_batch_send(dev->cmd_queue);
+	cmd_batch_complete(batch, status);
+}
+
+#if !FNUSB_HAVE_CONTROL_ASYNC
+// Without asynchronous control transfers a batch is sent with the blocking
+// commands as soon as it is submitted, so nothing is ever queued
+static void cmd_batch_run(freenect_cmd_batch *batch)
+{
+	freenect_device *dev = batch->dev;
+	int res = 0;
+
+	for (; batch->cur_op < batch->num_ops && res >= 0; batch->cur_op++) {
+		fn_cmd_op *op = &batch->ops[batch->cur_op];
+		if (op->type == FN_CMD_WRITE_REG) {
+			res = write_register(dev, op->reg, op->value);
+		} else {
+			uint16_t value = read_cmos_register(dev, op->reg);
+			if (value == UINT16_MAX)
+				res = -1;
+			else
+				res = write_cmos_register(dev, op->reg, (value & ~op->mask) | (op->value & op->mask));
+		}
+	}
+	cmd_batch_complete(batch, res < 0 ? res : 0);
+}
+#endif
+
+static void cmd_in_done(void *user_data, int status, uint8_t *data, int len);
+
+static void cmd_out_done(void *user_data, int status, uint8_t *data, int len)
+{
+	freenect_cmd_batch *batch = (freenect_cmd_batch*)user_data;
+	freenect_context *ctx = batch->dev->parent;
+	(void)data; (void)len;
+
+	if (status < 0) {
+		FN_ERROR("send_cmd: Output control transfer failed (%d)\n", status);
+		cmd_batch_finish(batch, status);
+		return;
+	}
+	status = fnusb_control_async(&batch->dev->usb_cam, 0xc0, 0, 0, 0, NULL, 0x200, cmd_in_done, batch);
+	if (status < 0)
+		cmd_batch_finish(batch, status);
+}
+
+static void cmd_in_done(void *user_data, int status, uint8_t *data, int len)
+{
+	freenect_cmd_batch *batch = (freenect_cmd_batch*)user_data;
+	freenect_device *dev = batch->dev;
+	freenect_context *ctx = dev->parent;
+
+	if (status < 0) {
+		FN_ERROR("send_cmd: Input control transfer failed (%d)\n", status);
+		cmd_batch_finish(batch, status);
+		return;
+	}
+	// No reply yet, ask again - like send_cmd() but without blocking anyone
+	if (len == 0 || len == 0x200) {
+		status = fnusb_control_async(&dev->usb_cam, 0xc0, 0, 0, 0, NULL, 0x200, cmd_in_done, batch);
+		if (status < 0)
+			cmd_batch_finish(batch, status);
+		return;
+	}
+
+	len = cmd_check_reply(ctx, batch->obuf, data, len);
+	if (len < 0) {
+		cmd_batch_finish(batch, -1);
+		return;
+	}
+	dev->cam_tag++;
+
+	fn_cmd_op *op = &batch->ops[batch->cur_op];
+	if (op->type == FN_CMD_MODIFY_CMOS && batch->cur_phase == 0) {
+		if (len < 6) {
+			FN_ERROR("read_cmos_register: short reply (%d bytes)\n", len);
+			cmd_batch_finish(batch, -1);
+			return;
+		}
+		uint16_t reg;
+		memcpy(&reg, data + sizeof(cam_hdr) + 4, 2);
+		batch->cmos_value = (fn_le16(reg) & ~op->mask) | (op->value & op->mask);
+		batch->cur_phase = 1;
+	} else {
+		batch->cur_op++;
+		batch->cur_phase = 0;
+		if (batch->cur_op == batch->num_ops) {
+			cmd_batch_finish(batch, 0);
+			return;
+		}
+	}
+	cmd_batch_send(batch);
+}
+
+// Send the command for the current step of the batch at the head of the queue
+static void cmd_batch_send(freenect_cmd_batch *batch)
+{
+	freenect_device *dev = batch->dev;
+	fn_cmd_op *op = &batch->ops[batch->cur_op];
+	uint16_t cmdbuf[3];
+	int len;
+
+	if (op->type == FN_CMD_WRITE_REG) {
+		cmdbuf[0] = fn_le16(op->reg);
+		cmdbuf[1] = fn_le16(op->value);
+		len = cmd_fill(dev, 0x03, cmdbuf, 4, batch->obuf);
+	} else if (batch->cur_phase == 0) {
+		cmdbuf[0] = fn_le16(1);
+		cmdbuf[1] = fn_le16(op->reg & 0x7fff);
+		cmdbuf[2] = 0;
+		len = cmd_fill(dev, 0x95, cmdbuf, 6, batch->obuf);
+	} else {
+		cmdbuf[0] = fn_le16(1);
+		cmdbuf[1] = fn_le16(op->reg | 0x8000);
+		cmdbuf[2] = fn_le16(batch->cmos_value);
+		len = cmd_fill(dev, 0x95, cmdbuf, 6, batch->obuf);
+	}
+
+	int res = fnusb_control_async(&dev->usb_cam, 0x40, 0, 0, 0, batch->obuf, len, cmd_out_done, batch);
+	if (res < 0)
+		cmd_batch_finish(batch, res);
+}
+
+static int cmd_batch_add(freenect_cmd_batch *batch, int type, uint16_t reg, uint16_t value, uint16_t mask)
+{
+	if (batch->submitted)
+		return -1;
+	if (batch->num_ops == batch->max_ops) {
+		int max_ops = batch->max_ops ? batch->max_ops * 2 : 8;
+		fn_cmd_op *ops = (fn_cmd_op*)realloc(batch->ops, max_ops * sizeof(fn_cmd_op));
+		if (!ops)
+			return -1;
+		batch->ops = ops;
+		batch->max_ops = max_ops;
+	}
+	fn_cmd_op *op = &batch->ops[batch->num_ops++];
+	op->type = type;
+	op->reg = reg;
+	op->value = value;
+	op->mask = mask;
+	return 0;
+}
+
+freenect_cmd_batch *freenect_cmd_batch_create(freenect_device *dev)
+{
+	if (dev->is_virtual)
+		return NULL;
+	freenect_cmd_batch *batch = (freenect_cmd_batch*)malloc(sizeof(freenect_cmd_batch));
+	if (!batch)
+		return NULL;
+	memset(batch, 0, sizeof(*batch));
+	batch->dev = dev;
+	batch->status = 1;
+	return batch;
+}
+
+int freenect_cmd_batch_write_register(freenect_cmd_batch *batch, uint16_t reg, uint16_t value)
+{
+	return cmd_batch_add(batch, FN_CMD_WRITE_REG, reg, value, 0);
+}
+
+int freenect_cmd_batch_set_flag(freenect_cmd_batch *batch, freenect_flag flag, freenect_flag_value value)
+{
+	if (flag >= (1 << 16)) {
+		int reg = register_for_flag(flag);
+		if (reg < 0)
+			return reg;
+		return cmd_batch_add(batch, FN_CMD_WRITE_REG, reg, value, 0);
+	}
+	return cmd_batch_add(batch, FN_CMD_MODIFY_CMOS, 0x0106, value == FREENECT_ON ? flag : 0, flag);
+}
+
+int freenect_cmd_batch_submit(freenect_cmd_batch *batch, freenect_cmd_batch_cb cb, void *user_data)
+{
+	freenect_device *dev = batch->dev;
+
+	if (batch->submitted)
+		return -1;
+	batch->submitted = 1;
+	batch->cb = cb;
+	batch->user_data = user_data;
+	batch->submit_us = fn_get_time_us();
+
+	if (batch->num_ops == 0) {
+		batch->status = 0;
+		batch->done_us = batch->submit_us;
+		if (cb) {
+			batch->in_callback = 1;
+			cb(dev, batch, 0, user_data);
+			batch->in_callback = 0;
+		}
+		if (batch->detached)
+			cmd_batch_free(batch);
+		return 0;
+	}
+
+#if FNUSB_HAVE_CONTROL_ASYNC
+	if (dev->cmd_queue_tail) {
+		dev->cmd_queue_tail->next = batch;
+		dev->cmd_queue_tail = batch;
+	} else {
+		dev->cmd_queue = dev->cmd_queue_tail = batch;
+		cmd_batch_send(batch);
+	}
+#else
+	cmd_batch_run(batch);
+#endif
+	return 0;
+}
+
+int freenect_cmd_batch_status(freenect_cmd_batch *batch)
+{
+	return batch->status;
+}
+
+int freenect_cmd_batch_wait(freenect_cmd_batch *batch)
+{
+	freenect_context *ctx = batch->dev->parent;
+	if (!batch->submitted)
+		return -1;
+	while (batch->status == 1) {
+		if (fnusb_process_events(&ctx->usb) < 0)
+			return -1;
+	}
+	return batch->status;
+}
+
+int freenect_cmd_batch_time(freenect_cmd_batch *batch)
+{
+	if (batch->status == 1)
+		return -1;
+	return (int)(batch->done_us - batch->submit_us);
+}
+
+void freenect_cmd_batch_destroy(freenect_cmd_batch *batch)
+{
+	if ((batch->submitted && batch->status == 1) || batch->in_callback)
+		batch->detached = 1;
+	else
+		cmd_batch_free(batch);
+}
+
+int freenect_set_flag_async(freenect_device *dev, freenect_flag flag, freenect_flag_value value, freenect_cmd_batch_cb cb, void *user_data)
+{
+	freenect_cmd_batch *batch = freenect_cmd_batch_create(dev);
+	if (!batch)
+		return -1;
+	if (freenect_cmd_batch_set_flag(batch, flag, value) < 0) {
+		cmd_batch_free(batch);
+		return -1;
+	}
+	// detached before submitting, in case it completes straight away
+	batch->detached = 1;
+	return freenect_cmd_batch_submit(batch, cb, user_data);
+}
+
+// Wait for all queued command batches, so synchronous commands and closing
+// the device don't overtake them
+FN_INTERNAL int fn_cmd_queue_drain(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+	int res = 0;
+
+	if (!dev->cmd_queue)
+		return 0;
+	// Called back from the events handled below, or from a batch callback:
+	// the batches waiting can only complete once it returns
+	if (dev->cmd_queue_busy) {
+		FN_ERROR("Can't wait for queued camera commands from a batch callback\n");
+		return -1;
+	}
+
+	dev->cmd_queue_busy++;
+	while (dev->cmd_queue) {
+		if (fnusb_process_events(&ctx->usb) < 0) {
+			res = -1;
+			break;
+		}
+	}
+	dev->cmd_queue_busy--;
+	return res;
+}
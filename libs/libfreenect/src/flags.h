@@ -38,3 +38,7 @@ int write_register(freenect_device *dev, uint16_t reg, uint16_t data);
 // returns UINT16_MAX on error
 uint16_t read_cmos_register(freenect_device *dev, uint16_t reg);
 int write_cmos_register(freenect_device *dev, uint16_t reg, uint16_t value);
+
+// Blocks until the asynchronous command queue of the device is empty.
+// Returns -1 if it can't be waited for from where it was called.
+int fn_cmd_queue_drain(freenect_device *dev);
@@ -43,6 +43,32 @@
 
 typedef void (*fnusb_iso_cb)(freenect_device *dev, uint8_t *buf, int len);
 
+// How a stream buffer was allocated, so it can be freed the same way
+typedef enum {
+	FN_BUFFER_NONE = 0,
+	FN_BUFFER_ALIGNED, // page aligned heap memory
+	FN_BUFFER_HUGETLB, // explicitly mapped huge pages
+	FN_BUFFER_DEV_MEM, // libusb_dev_mem_alloc(), freed by usb_libusb10.c
+	FN_BUFFER_LOCKED = 0x10, // or'ed into the kind when the pages were locked with mlock()
+} fn_buffer_kind;
+
+// Mutex for state shared with the thread handling events
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION fn_lock;
+#define fn_lock_init(l) InitializeCriticalSection(l)
+#define fn_lock_destroy(l) DeleteCriticalSection(l)
+#define fn_lock_acquire(l) EnterCriticalSection(l)
+#define fn_lock_release(l) LeaveCriticalSection(l)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t fn_lock;
+#define fn_lock_init(l) pthread_mutex_init(l, NULL)
+#define fn_lock_destroy(l) pthread_mutex_destroy(l)
+#define fn_lock_acquire(l) pthread_mutex_lock(l)
+#define fn_lock_release(l) pthread_mutex_unlock(l)
+#endif
+
 #include "usb_libusb10.h"
 
 struct _freenect_context {
@@ -52,6 +78,7 @@ struct _freenect_context {
 	freenect_device_flags enabled_subdevices;
 	freenect_device *first;
 	int zero_plane_res;
+	int buffer_flags; // freenect_buffer_flags
     
     //if you want to load firmware from memory rather than disk
     unsigned char *     fn_fw_nui_ptr;
@@ -61,6 +88,9 @@ struct _freenect_context {
     unsigned int        fn_fw_k4w_size;
 };
 
+void *fn_buffer_alloc(freenect_context *ctx, size_t len, fn_buffer_kind *kind);
+void fn_buffer_free(void *buf, size_t len, fn_buffer_kind kind);
+
 #define LL_FATAL FREENECT_LOG_FATAL
 #define LL_ERROR FREENECT_LOG_ERROR
 #define LL_WARNING FREENECT_LOG_WARNING
@@ -128,6 +158,70 @@ static inline int32_t fn_le32s(int32_t s)
 #define fn_le32s(x) (x)
 #endif
 
+// Monotonic clock in microseconds, for measuring latencies
+#if defined(_WIN32)
+#include <windows.h>
+static inline uint64_t fn_get_time_us(void)
+{
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+	       (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+static inline uint64_t fn_get_time_us(void)
+{
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+}
+#else
+#include <time.h>
+static inline uint64_t fn_get_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+// Full memory barrier, for data published to other threads without locks
+#if defined(_MSC_VER)
+#define fn_memory_barrier() MemoryBarrier()
+#else
+#define fn_memory_barrier() __sync_synchronize()
+#endif
+
+// Sequence lock: one writer, any number of readers which never block the
+// writer.  The writer brackets its update with fn_seqlock_write_begin()/end();
+// readers copy the data and retry while fn_seqlock_read_retry() says so.
+static inline void fn_seqlock_write_begin(volatile uint32_t *seq)
+{
+	(*seq)++;
+	fn_memory_barrier();
+}
+static inline void fn_seqlock_write_end(volatile uint32_t *seq)
+{
+	fn_memory_barrier();
+	(*seq)++;
+}
+static inline uint32_t fn_seqlock_read_begin(volatile uint32_t *seq)
+{
+	uint32_t s;
+	while ((s = *seq) & 1)
+		;
+	fn_memory_barrier();
+	return s;
+}
+static inline int fn_seqlock_read_retry(volatile uint32_t *seq, uint32_t start)
+{
+	fn_memory_barrier();
+	return *seq != start;
+}
+
 #define DEPTH_PKTSIZE 1760
 #define VIDEO_PKTSIZE 1920
 
@@ -147,6 +241,23 @@ static inline int32_t fn_le32s(int32_t s)
 #define PID_K4W_AUDIO_ALT_1 0x02c3
 #define PID_K4W_AUDIO_ALT_2 0x02bb
 
+// Camera clock of a stream, unwrapped and fitted to the host clock, see timing.c
+typedef struct {
+	int have_frame;
+	int restart;            // don't count the next gap as dropped frames
+	uint32_t last_timestamp;
+	uint64_t device_time;
+	uint64_t last_arrival_us;
+	// Exponentially weighted fit of arrival time against camera time,
+	// relative to the first frame to keep the doubles precise
+	uint64_t origin_ticks, origin_us;
+	uint32_t samples;
+	double mean_ticks, mean_us, var_ticks, cov;
+
+	volatile uint32_t seq;
+	freenect_frame_info info;
+} fn_stream_clock;
+
 typedef struct {
 	int running;
 	uint8_t flag;
@@ -162,6 +273,9 @@ typedef struct {
 	uint lost_pkts;
 	int valid_frames;
 	int variable_length;
+	uint lost_pkts_checkpoint; // lost_pkts at the start of the adaptive window
+	int adapt_frames;
+	int adapt_stable_windows;
 	uint32_t last_timestamp;
 	uint32_t timestamp;
 	int split_bufs;
@@ -169,6 +283,18 @@ typedef struct {
 	void *usr_buf;
 	uint8_t *raw_buf;
 	void *proc_buf;
+	int lib_buf_size; // bytes allocated for lib_buf
+	int raw_buf_size; // bytes allocated for raw_buf when split_bufs is set
+	fn_buffer_kind lib_buf_kind;
+	fn_buffer_kind raw_buf_kind;
+	int held; // drop packets while a mode switch is being programmed
+	uint64_t switch_start_us; // when a mode switch was requested, 0 once its first frame arrived
+	int switch_time_us; // time from the last mode switch to its first frame
+	uint64_t start_us; // when the stream was started, 0 once its first frame arrived
+	int start_time_us; // time from the last start to its first frame
+	int start_call_us; // time the last freenect_start_*() call took
+	struct _fn_latest *latest; // buffer pool owning usr_buf, see latest.c
+	fn_stream_clock clock;
 } packet_stream;
 
 #ifdef BUILD_AUDIO
@@ -213,15 +339,30 @@ typedef struct {
 
 #endif
 
+// Registration parameters the camera reports for one video resolution and rate
+typedef struct {
+	freenect_resolution resolution;
+	int framerate;
+	freenect_reg_info reg_info;
+} fn_reg_info_entry;
+
+#define FN_REG_INFO_CACHE 4
+
 struct _freenect_device {
 	freenect_context *parent;
 	freenect_device *next;
 	void *user_data;
 
+	// Guards the tilt sampler, latest frame pool and depth stats pointers
+	// against being freed while other threads read through them
+	fn_lock lock;
+
 	// Cameras
 	fnusb_dev usb_cam;
 	fnusb_isoc_stream depth_isoc;
 	fnusb_isoc_stream video_isoc;
+	freenect_iso_config depth_iso_config;
+	freenect_iso_config video_iso_config;
 
 	freenect_depth_cb depth_cb;
 	freenect_video_cb video_cb;
@@ -234,12 +375,28 @@ struct _freenect_device {
 
 	int cam_inited;
 	uint16_t cam_tag;
+	freenect_cmd_batch *cmd_queue; // batch being sent, followed by those waiting
+	freenect_cmd_batch *cmd_queue_tail;
+	int cmd_queue_busy; // in fn_cmd_queue_drain() or a batch callback
+
+	// Set for devices fed by freenect_virtual_push_*() instead of USB
+	int is_virtual;
 
 	packet_stream depth;
 	packet_stream video;
+	struct _fn_video_multiplex *video_multiplex; // see freenect_start_video_multiplex()
 
 	// Registration
 	freenect_registration registration;
+	// Parameters of every video mode, so a mode switch needn't wait on the
+	// camera for them, see freenect_fetch_reg_info()
+	fn_reg_info_entry reg_info_cache[FN_REG_INFO_CACHE];
+	int reg_info_cached;
+	// raw_to_mm_shift clamped to FREENECT_DEPTH_MM_MAX_VALUE, for the depth unpackers
+	uint16_t raw_to_mm_clamped[FREENECT_DEPTH_RAW_MAX_VALUE];
+
+	// Depth statistics, gathered while frames are unpacked
+	struct _fn_depth_stats *depth_stats;
 
 #ifdef BUILD_AUDIO
 	// Audio
@@ -256,6 +413,7 @@ struct _freenect_device {
 	// Motor
 	fnusb_dev usb_motor;
 	freenect_raw_tilt_state raw_state;
+	struct _fn_tilt_sampler *tilt_sampler;
     
     int device_does_motor_control_with_audio;
     int motor_control_with_audio_enabled;
@@ -0,0 +1,310 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010-2011 individual OpenKinect contributors. See the CONTRIB
+ * file for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#include "freenect_internal.h"
+#include "latest.h"
+
+// fn_lock comes from freenect_internal.h
+#ifdef _WIN32
+typedef CONDITION_VARIABLE fn_cond;
+#define fn_cond_init(c) InitializeConditionVariable(c)
+#define fn_cond_destroy(c)
+#define fn_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_cond_t fn_cond;
+#define fn_cond_init(c) pthread_cond_init(c, NULL)
+#define fn_cond_destroy(c) pthread_cond_destroy(c)
+#define fn_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+typedef struct {
+	fn_latest *owner;
+	void *data;
+	int size;
+	int refs; // readers holding the frame
+	uint32_t sequence;
+	uint32_t timestamp;
+	freenect_frame_mode mode;
+} fn_latest_slot;
+
+// One slot is always being filled by the stream and one holds the newest
+// frame; the rest are free or pinned by readers.  Readers only ever take the
+// newest slot, so the slot being filled is never seen outside this file.
+struct _fn_latest {
+	fn_lock lock;
+	fn_cond cond;
+	fn_latest_slot *slots;
+	int num_slots;
+	int max_slots;
+	int writing;
+	int newest; // -1 until the first frame
+	uint32_t sequence;
+	uint32_t dropped;
+	int enabled;
+	int users; // frames held plus readers waiting
+};
+
+FN_INTERNAL fn_latest *fn_latest_create(int max_frames)
+{
+	fn_latest *latest = (fn_latest*)malloc(sizeof(fn_latest));
+	if (!latest)
+		return NULL;
+	memset(latest, 0, sizeof(*latest));
+	latest->max_slots = max_frames < 3 ? 3 : max_frames;
+	latest->slots = (fn_latest_slot*)calloc(latest->max_slots, sizeof(fn_latest_slot));
+	if (!latest->slots) {
+		free(latest);
+		return NULL;
+	}
+	for (int i = 0; i < latest->max_slots; i++)
+		latest->slots[i].owner = latest;
+	// One being written, one newest and one for a reader to hold
+	latest->num_slots = 3;
+	latest->writing = 0;
+	latest->newest = -1;
+	latest->enabled = 1;
+	fn_lock_init(&latest->lock);
+	fn_cond_init(&latest->cond);
+	return latest;
+}
+
+static void latest_free(fn_latest *latest)
+{
+	for (int i = 0; i < latest->num_slots; i++)
+		free(latest->slots[i].data);
+	free(latest->slots);
+	fn_cond_destroy(&latest->cond);
+	fn_lock_destroy(&latest->lock);
+	free(latest);
+}
+
+FN_INTERNAL void fn_latest_destroy(fn_latest *latest)
+{
+	fn_lock_acquire(&latest->lock);
+	latest->enabled = 0;
+	int unused = latest->users == 0;
+	fn_cond_broadcast(&latest->cond);
+	fn_lock_release(&latest->lock);
+	if (unused)
+		latest_free(latest);
+}
+
+// Only called on slots no reader can hold
+static int slot_reserve(fn_latest_slot *slot, int size)
+{
+	if (slot->data && slot->size >= size)
+		return 0;
+	void *data = realloc(slot->data, size);
+	if (!data)
+		return -1;
+	slot->data = data;
+	slot->size = size;
+	return 0;
+}
+
+FN_INTERNAL void *fn_latest_writing_buffer(fn_latest *latest, int size)
+{
+	fn_lock_acquire(&latest->lock);
+	fn_latest_slot *slot = &latest->slots[latest->writing];
+	void *data = slot_reserve(slot, size) == 0 ? slot->data : NULL;
+	// Size the spare slots now too, rather than on the first frames
+	for (int i = 0; data && i < latest->num_slots; i++) {
+		if (i != latest->writing && i != latest->newest && latest->slots[i].refs == 0)
+			slot_reserve(&latest->slots[i], size);
+	}
+	fn_lock_release(&latest->lock);
+	return data;
+}
+
+FN_INTERNAL void *fn_latest_publish(fn_latest *latest, void *buf, freenect_frame_mode mode, uint32_t timestamp)
+{
+	void *next = NULL;
+
+	fn_lock_acquire(&latest->lock);
+	fn_latest_slot *slot = &latest->slots[latest->writing];
+	if (buf != slot->data)
+		goto out;
+
+	// Any slot nobody holds will do; only grow the pool when readers pin the rest
+	int i, free_slot = -1;
+	for (i = 0; i < latest->num_slots; i++) {
+		if (i != latest->writing && i != latest->newest && latest->slots[i].refs == 0) {
+			free_slot = i;
+			break;
+		}
+	}
+	if (free_slot < 0 && latest->num_slots < latest->max_slots)
+		free_slot = latest->num_slots++;
+	if (free_slot < 0 || slot_reserve(&latest->slots[free_slot], slot->size) < 0) {
+		latest->dropped++;
+		goto out;
+	}
+
+	slot->sequence = ++latest->sequence;
+	slot->timestamp = timestamp;
+	slot->mode = mode;
+	latest->newest = latest->writing;
+	latest->writing = free_slot;
+	next = latest->slots[free_slot].data;
+	fn_cond_broadcast(&latest->cond);
+out:
+	fn_lock_release(&latest->lock);
+	return next;
+}
+
+// Wait for the condition variable until deadline, returns 0 on timeout
+#ifdef _WIN32
+static int latest_wait(fn_latest *latest, int timeout_ms, uint64_t deadline_us)
+{
+	DWORD ms = INFINITE;
+	if (timeout_ms >= 0) {
+		uint64_t now = fn_get_time_us();
+		if (now >= deadline_us)
+			return 0;
+		ms = (DWORD)((deadline_us - now + 999) / 1000);
+	}
+	return SleepConditionVariableCS(&latest->cond, &latest->lock, ms) || GetLastError() != ERROR_TIMEOUT;
+}
+#else
+static int latest_wait(fn_latest *latest, int timeout_ms, const struct timespec *deadline)
+{
+	if (timeout_ms < 0)
+		return pthread_cond_wait(&latest->cond, &latest->lock) == 0;
+	return pthread_cond_timedwait(&latest->cond, &latest->lock, deadline) == 0;
+}
+#endif
+
+FN_INTERNAL void fn_latest_ref(fn_latest *latest)
+{
+	fn_lock_acquire(&latest->lock);
+	latest->users++;
+	fn_lock_release(&latest->lock);
+}
+
+FN_INTERNAL int fn_latest_get(fn_latest *latest, freenect_frame *frame, int timeout_ms)
+{
+	int res = 1;
+
+	if (frame->reserved)
+		freenect_release_frame(frame);
+
+#ifdef _WIN32
+	uint64_t deadline = fn_get_time_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+#else
+	// pthread waits take a wall clock deadline
+	struct timeval now;
+	struct timespec deadline_ts;
+	struct timespec *deadline = &deadline_ts;
+	gettimeofday(&now, NULL);
+	uint64_t ns = (uint64_t)now.tv_usec * 1000 + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+	deadline_ts.tv_sec = now.tv_sec + ns / 1000000000;
+	deadline_ts.tv_nsec = ns % 1000000000;
+#endif
+
+	fn_lock_acquire(&latest->lock);
+	while (latest->enabled && (latest->newest < 0 || latest->slots[latest->newest].sequence <= frame->sequence)) {
+		if (timeout_ms == 0 || !latest_wait(latest, timeout_ms, deadline))
+			break;
+	}
+
+	if (!latest->enabled) {
+		res = -1;
+	} else if (latest->newest >= 0 && latest->slots[latest->newest].sequence > frame->sequence) {
+		fn_latest_slot *slot = &latest->slots[latest->newest];
+		slot->refs++;
+		frame->data = slot->data;
+		frame->timestamp = slot->timestamp;
+		frame->sequence = slot->sequence;
+		frame->mode = slot->mode;
+		frame->reserved = slot;
+		res = 0;
+	}
+	// A held frame keeps counting as a user until it is released
+	if (res != 0)
+		latest->users--;
+	int unused = !latest->enabled && latest->users == 0;
+	fn_lock_release(&latest->lock);
+
+	if (unused)
+		latest_free(latest);
+	return res;
+}
+
+void freenect_release_frame(freenect_frame *frame)
+{
+	fn_latest_slot *slot = (fn_latest_slot*)frame->reserved;
+	if (!slot)
+		return;
+	fn_latest *latest = slot->owner;
+
+	fn_lock_acquire(&latest->lock);
+	slot->refs--;
+	latest->users--;
+	int unused = !latest->enabled && latest->users == 0;
+	fn_lock_release(&latest->lock);
+
+	frame->data = NULL;
+	frame->reserved = NULL;
+	if (unused)
+		latest_free(latest);
+}
+
+// Take the reader's reference under the device lock, so disabling the
+// pool can't free it between loading the pointer and counting the reader
+static fn_latest *stream_ref_latest(freenect_device *dev, packet_stream *strm)
+{
+	fn_lock_acquire(&dev->lock);
+	fn_latest *latest = strm->latest;
+	if (latest)
+		fn_latest_ref(latest);
+	fn_lock_release(&dev->lock);
+	return latest;
+}
+
+int freenect_get_latest_depth(freenect_device *dev, freenect_frame *frame, int timeout_ms)
+{
+	fn_latest *latest = stream_ref_latest(dev, &dev->depth);
+	if (!latest)
+		return -1;
+	return fn_latest_get(latest, frame, timeout_ms);
+}
+
+int freenect_get_latest_video(freenect_device *dev, freenect_frame *frame, int timeout_ms)
+{
+	fn_latest *latest = stream_ref_latest(dev, &dev->video);
+	if (!latest)
+		return -1;
+	return fn_latest_get(latest, frame, timeout_ms);
+}
@@ -0,0 +1,47 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010-2011 individual OpenKinect contributors. See the CONTRIB
+ * file for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+
+// Pool of frame buffers behind freenect_get_latest_depth/video(), see latest.c
+typedef struct _fn_latest fn_latest;
+
+fn_latest *fn_latest_create(int max_frames);
+// Detach from the stream; freed once no reader holds or waits on it
+void fn_latest_destroy(fn_latest *latest);
+// Buffer the stream should fill next, grown to at least size bytes along
+// with the spare buffers nobody holds
+void *fn_latest_writing_buffer(fn_latest *latest, int size);
+// Publish the frame just finished in buf. Returns the buffer to fill next,
+// or NULL to keep filling buf (the frame was dropped or buf isn't ours).
+void *fn_latest_publish(fn_latest *latest, void *buf, freenect_frame_mode mode, uint32_t timestamp);
+// Count a reader in, so the pool outlives the stream dropping it. Taken
+// while whatever hands out the pool keeps it from being destroyed.
+void fn_latest_ref(fn_latest *latest);
+// Wait for a newer frame than frame holds; drops the reader's reference
+// unless a frame is returned, which keeps it until released
+int fn_latest_get(fn_latest *latest, freenect_frame *frame, int timeout_ms);
@@ -0,0 +1,650 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2011 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "freenect_internal.h"
+#include "libfreenect_record.h"
+#include "latest.h"
+#include "timing.h"
+
+/*
+ * Capture file layout.  All fields are little endian, every block starts on
+ * a 64 byte boundary so frame data can be handed out straight from the
+ * mapping to SIMD code.
+ *
+ *   file header   64 bytes
+ *   frame         64 byte frame header + data, padded to 64 bytes
+ *   ...
+ *   index         one 32 byte entry per frame, written on close
+ *
+ * The file header holds the offset of the index; it is zero while the file
+ * is being written, in which case playback rebuilds the index by walking
+ * the frame headers.
+ */
+
+#define REC_ALIGN 64
+#define REC_VERSION 1
+#define REC_FRAME_MAGIC 0x4d415246 // "FRAM"
+
+static const char rec_file_magic[8] = { 'F', 'N', 'R', 'E', 'C', 'O', 'R', 'D' };
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_count;
+	uint32_t index_offset_lo;
+	uint32_t index_offset_hi;
+	uint32_t reserved[10];
+} rec_file_header;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t stream;
+	uint32_t resolution;
+	uint32_t format;
+	uint32_t bytes;
+	uint32_t timestamp;
+	uint32_t reserved[10];
+} rec_frame_header;
+
+typedef struct {
+	uint32_t offset_lo;
+	uint32_t offset_hi;
+	uint32_t stream;
+	uint32_t resolution;
+	uint32_t format;
+	uint32_t bytes;
+	uint32_t timestamp;
+	uint32_t reserved;
+} rec_index_entry;
+
+struct _freenect_recorder {
+	FILE *file;
+	uint64_t offset; // end of the last frame written whole
+	rec_index_entry *index;
+	uint32_t count;
+	uint32_t capacity;
+	int failed; // the file couldn't be put back after a failed write
+};
+
+// A stream's frame with its timestamp unwrapped across device clock wraps
+typedef struct {
+	uint64_t time;
+	int index;
+} pb_time;
+
+struct _freenect_playback {
+	freenect_device *dev;
+	const uint8_t *map;
+	uint64_t map_size;
+	freenect_playback_frame *frames;
+	int count;
+	int cursor;
+	// Frames of each freenect_stream in order, for freenect_playback_find_frame()
+	pb_time *times[2];
+	int num_times[2];
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+static uint64_t rec_padding(uint64_t offset)
+{
+	return (REC_ALIGN - (offset % REC_ALIGN)) % REC_ALIGN;
+}
+
+FREENECTAPI int freenect_open_virtual_device(freenect_context *ctx, freenect_device **dev)
+{
+	freenect_device *pdev = (freenect_device*)malloc(sizeof(freenect_device));
+	if (!pdev)
+		return -1;
+
+	memset(pdev, 0, sizeof(*pdev));
+
+	pdev->parent = ctx;
+	fn_lock_init(&pdev->lock);
+	pdev->is_virtual = 1;
+	pdev->usb_cam.parent = pdev;
+	pdev->usb_motor.parent = pdev;
+	pdev->video_format = FREENECT_VIDEO_RGB;
+	pdev->video_resolution = FREENECT_RESOLUTION_MEDIUM;
+	pdev->depth_format = FREENECT_DEPTH_11BIT;
+	pdev->depth_resolution = FREENECT_RESOLUTION_MEDIUM;
+
+	if (!ctx->first) {
+		ctx->first = pdev;
+	} else {
+		freenect_device *prev = ctx->first;
+		while (prev->next)
+			prev = prev->next;
+		prev->next = pdev;
+	}
+
+	*dev = pdev;
+	return 0;
+}
+
+static void *virtual_frame_buffer(packet_stream *strm, const void *frame, int bytes)
+{
+	if (strm->latest)
+		strm->usr_buf = fn_latest_writing_buffer(strm->latest, bytes);
+	if (strm->usr_buf && strm->usr_buf != frame) {
+		memcpy(strm->usr_buf, frame, bytes);
+		return strm->usr_buf;
+	}
+	return (void*)frame;
+}
+
+FREENECTAPI int freenect_virtual_push_depth(freenect_device *dev, freenect_frame_mode mode, const void *frame, uint32_t timestamp)
+{
+	freenect_context *ctx = dev->parent;
+
+	if (!dev->is_virtual) {
+		FN_ERROR("freenect_virtual_push_depth() called on a USB device\n");
+		return -1;
+	}
+
+	dev->depth_format = mode.depth_format;
+	dev->depth_resolution = mode.resolution;
+	dev->depth.timestamp = timestamp;
+	dev->depth.valid_frames++;
+	fn_clock_frame(&dev->depth.clock, timestamp, mode.framerate);
+
+	void *buf = virtual_frame_buffer(&dev->depth, frame, mode.bytes);
+	if (dev->depth_cb)
+		dev->depth_cb(dev, buf, timestamp);
+	if (dev->depth.latest)
+		fn_latest_publish(dev->depth.latest, buf, mode, timestamp);
+	return 0;
+}
+
+FREENECTAPI int freenect_virtual_push_video(freenect_device *dev, freenect_frame_mode mode, const void *frame, uint32_t timestamp)
+{
+	freenect_context *ctx = dev->parent;
+
+	if (!dev->is_virtual) {
+		FN_ERROR("freenect_virtual_push_video() called on a USB device\n");
+		return -1;
+	}
+
+	dev->video_format = mode.video_format;
+	dev->video_resolution = mode.resolution;
+	dev->video.timestamp = timestamp;
+	dev->video.valid_frames++;
+	fn_clock_frame(&dev->video.clock, timestamp, mode.framerate);
+
+	void *buf = virtual_frame_buffer(&dev->video, frame, mode.bytes);
+	if (dev->video_cb)
+		dev->video_cb(dev, buf, timestamp);
+	if (dev->video.latest)
+		fn_latest_publish(dev->video.latest, buf, mode, timestamp);
+	return 0;
+}
+
+static int rec_write_header(freenect_recorder *rec, uint64_t index_offset)
+{
+	rec_file_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, rec_file_magic, sizeof(hdr.magic));
+	hdr.version = fn_le32(REC_VERSION);
+	hdr.frame_count = fn_le32(rec->count);
+	hdr.index_offset_lo = fn_le32((uint32_t)index_offset);
+	hdr.index_offset_hi = fn_le32((uint32_t)(index_offset >> 32));
+
+	if (fseek(rec->file, 0, SEEK_SET) != 0)
+		return -1;
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->file) != 1)
+		return -1;
+	return 0;
+}
+
+static int rec_write_padding(freenect_recorder *rec)
+{
+	static const uint8_t zeros[REC_ALIGN] = {0};
+	uint64_t pad = rec_padding(rec->offset);
+	if (pad && fwrite(zeros, (size_t)pad, 1, rec->file) != 1)
+		return -1;
+	rec->offset += pad;
+	return 0;
+}
+
+FREENECTAPI int freenect_record_open(freenect_recorder **rec, const char *filename)
+{
+	freenect_recorder *prec = (freenect_recorder*)malloc(sizeof(freenect_recorder));
+	if (!prec)
+		return -1;
+
+	memset(prec, 0, sizeof(*prec));
+
+	prec->file = fopen(filename, "wb");
+	if (!prec->file) {
+		free(prec);
+		return -1;
+	}
+
+	if (rec_write_header(prec, 0) < 0) {
+		fclose(prec->file);
+		free(prec);
+		return -1;
+	}
+	prec->offset = sizeof(rec_file_header);
+
+	*rec = prec;
+	return 0;
+}
+
+// Drop a partly written frame, so the next one goes where it started and the
+// index keeps matching the file
+static void rec_rewind(freenect_recorder *rec, uint64_t offset)
+{
+	rec->offset = offset;
+	clearerr(rec->file);
+#ifdef _WIN32
+	if (_fseeki64(rec->file, (__int64)offset, SEEK_SET) != 0)
+#else
+	if (fseeko(rec->file, (off_t)offset, SEEK_SET) != 0)
+#endif
+		rec->failed = 1;
+}
+
+static int rec_append(freenect_recorder *rec, freenect_stream stream, freenect_frame_mode mode, const void *frame, uint32_t timestamp)
+{
+	if (rec->failed || !mode.is_valid || mode.bytes <= 0)
+		return -1;
+
+	if (rec->count == rec->capacity) {
+		uint32_t capacity = rec->capacity ? rec->capacity * 2 : 1024;
+		rec_index_entry *index = (rec_index_entry*)realloc(rec->index, capacity * sizeof(rec_index_entry));
+		if (!index)
+			return -1;
+		rec->index = index;
+		rec->capacity = capacity;
+	}
+
+	rec_frame_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = fn_le32(REC_FRAME_MAGIC);
+	hdr.stream = fn_le32((uint32_t)stream);
+	hdr.resolution = fn_le32((uint32_t)mode.resolution);
+	hdr.format = fn_le32((uint32_t)mode.dummy);
+	hdr.bytes = fn_le32((uint32_t)mode.bytes);
+	hdr.timestamp = fn_le32(timestamp);
+
+	rec_index_entry *entry = &rec->index[rec->count];
+	entry->offset_lo = fn_le32((uint32_t)rec->offset);
+	entry->offset_hi = fn_le32((uint32_t)(rec->offset >> 32));
+	entry->stream = hdr.stream;
+	entry->resolution = hdr.resolution;
+	entry->format = hdr.format;
+	entry->bytes = hdr.bytes;
+	entry->timestamp = hdr.timestamp;
+	entry->reserved = 0;
+
+	uint64_t start = rec->offset;
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->file) != 1 ||
+	    fwrite(frame, mode.bytes, 1, rec->file) != 1) {
+		rec_rewind(rec, start);
+		return -1;
+	}
+	rec->offset += sizeof(hdr) + mode.bytes;
+	if (rec_write_padding(rec) < 0) {
+		rec_rewind(rec, start);
+		return -1;
+	}
+
+	rec->count++;
+	return 0;
+}
+
+FREENECTAPI int freenect_record_depth(freenect_recorder *rec, freenect_frame_mode mode, const void *frame, uint32_t timestamp)
+{
+	return rec_append(rec, FREENECT_STREAM_DEPTH, mode, frame, timestamp);
+}
+
+FREENECTAPI int freenect_record_video(freenect_recorder *rec, freenect_frame_mode mode, const void *frame, uint32_t timestamp)
+{
+	return rec_append(rec, FREENECT_STREAM_VIDEO, mode, frame, timestamp);
+}
+
+FREENECTAPI int freenect_record_close(freenect_recorder *rec)
+{
+	int res = 0;
+	uint64_t index_offset = rec->offset;
+
+	// Without an index playback scans the frames, which stops at the bad one
+	if (rec->failed)
+		res = -1;
+	if (res == 0 && rec->count && fwrite(rec->index, sizeof(rec_index_entry), rec->count, rec->file) != rec->count)
+		res = -1;
+	if (res == 0)
+		res = rec_write_header(rec, index_offset);
+	if (fclose(rec->file) != 0)
+		res = -1;
+
+	free(rec->index);
+	free(rec);
+	return res;
+}
+
+static freenect_frame_mode rec_frame_mode(freenect_stream stream, uint32_t resolution, uint32_t format, uint32_t bytes)
+{
+	freenect_frame_mode mode;
+	if (stream == FREENECT_STREAM_DEPTH)
+		mode = freenect_find_depth_mode((freenect_resolution)resolution, (freenect_depth_format)format);
+	else
+		mode = freenect_find_video_mode((freenect_resolution)resolution, (freenect_video_format)format);
+
+	if (!mode.is_valid || mode.bytes != (int32_t)bytes) {
+		// written by a build with modes this one doesn't know; still hand it out
+		memset(&mode, 0, sizeof(mode));
+		mode.resolution = (freenect_resolution)resolution;
+		mode.dummy = (int32_t)format;
+		mode.bytes = (int32_t)bytes;
+		mode.is_valid = 1;
+	}
+	return mode;
+}
+
+static int pb_add_frame(freenect_playback *pb, int *capacity, uint64_t offset, uint32_t stream, uint32_t resolution, uint32_t format, uint32_t bytes, uint32_t timestamp)
+{
+	if (offset + sizeof(rec_frame_header) + bytes > pb->map_size)
+		return -1;
+
+	if (pb->count == *capacity) {
+		int new_capacity = *capacity ? *capacity * 2 : 1024;
+		freenect_playback_frame *frames = (freenect_playback_frame*)realloc(pb->frames, new_capacity * sizeof(freenect_playback_frame));
+		if (!frames)
+			return -1;
+		pb->frames = frames;
+		*capacity = new_capacity;
+	}
+
+	freenect_playback_frame *frame = &pb->frames[pb->count++];
+	frame->stream = (freenect_stream)stream;
+	frame->mode = rec_frame_mode(frame->stream, resolution, format, bytes);
+	frame->timestamp = timestamp;
+	frame->data = pb->map + offset + sizeof(rec_frame_header);
+	return 0;
+}
+
+static int pb_read_index(freenect_playback *pb, const rec_file_header *hdr)
+{
+	uint64_t index_offset = ((uint64_t)fn_le32(hdr->index_offset_hi) << 32) | fn_le32(hdr->index_offset_lo);
+	uint32_t count = fn_le32(hdr->frame_count);
+	int capacity = 0;
+	uint32_t i;
+
+	if (index_offset + (uint64_t)count * sizeof(rec_index_entry) > pb->map_size)
+		return -1;
+
+	const rec_index_entry *index = (const rec_index_entry*)(pb->map + index_offset);
+	for (i = 0; i < count; i++) {
+		uint64_t offset = ((uint64_t)fn_le32(index[i].offset_hi) << 32) | fn_le32(index[i].offset_lo);
+		if (pb_add_frame(pb, &capacity, offset, fn_le32(index[i].stream), fn_le32(index[i].resolution),
+		                 fn_le32(index[i].format), fn_le32(index[i].bytes), fn_le32(index[i].timestamp)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Split the frames by stream for freenect_playback_find_frame(). Arrival order
+// only breaks when the 32 bit device clock wraps, so a step back is a wrap.
+static int pb_index_times(freenect_playback *pb)
+{
+	uint32_t last[2] = {0, 0};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		pb->times[i] = (pb_time*)malloc((pb->count ? pb->count : 1) * sizeof(pb_time));
+		if (!pb->times[i])
+			return -1;
+	}
+	for (i = 0; i < pb->count; i++) {
+		int k = pb->frames[i].stream == FREENECT_STREAM_DEPTH ? 0 : 1;
+		uint32_t timestamp = pb->frames[i].timestamp;
+		pb_time *t = &pb->times[k][pb->num_times[k]];
+		if (pb->num_times[k] == 0)
+			t->time = timestamp;
+		else
+			t->time = t[-1].time + (uint32_t)(timestamp - last[k]);
+		t->index = i;
+		last[k] = timestamp;
+		pb->num_times[k]++;
+	}
+	return 0;
+}
+
+// Recover the index of a file whose recorder was never closed.
+static int pb_scan_frames(freenect_playback *pb)
+{
+	uint64_t offset = sizeof(rec_file_header);
+	int capacity = 0;
+
+	while (offset + sizeof(rec_frame_header) <= pb->map_size) {
+		const rec_frame_header *hdr = (const rec_frame_header*)(pb->map + offset);
+		if (fn_le32(hdr->magic) != REC_FRAME_MAGIC)
+			break;
+		uint32_t bytes = fn_le32(hdr->bytes);
+		if (pb_add_frame(pb, &capacity, offset, fn_le32(hdr->stream), fn_le32(hdr->resolution),
+		                 fn_le32(hdr->format), bytes, fn_le32(hdr->timestamp)) < 0)
+			break;
+		offset += sizeof(rec_frame_header) + bytes;
+		offset += rec_padding(offset);
+	}
+	return 0;
+}
+
+static void pb_unmap(freenect_playback *pb)
+{
+#ifdef _WIN32
+	if (pb->map)
+		UnmapViewOfFile(pb->map);
+	if (pb->mapping)
+		CloseHandle(pb->mapping);
+	if (pb->file != INVALID_HANDLE_VALUE)
+		CloseHandle(pb->file);
+#else
+	if (pb->map)
+		munmap((void*)pb->map, (size_t)pb->map_size);
+	if (pb->fd >= 0)
+		close(pb->fd);
+#endif
+	pb->map = NULL;
+}
+
+static int pb_map(freenect_playback *pb, const char *filename)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	pb->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (pb->file == INVALID_HANDLE_VALUE)
+		return -1;
+	if (!GetFileSizeEx(pb->file, &size) || size.QuadPart == 0)
+		return -1;
+	pb->map_size = (uint64_t)size.QuadPart;
+	pb->mapping = CreateFileMapping(pb->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!pb->mapping)
+		return -1;
+	pb->map = (const uint8_t*)MapViewOfFile(pb->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!pb->map)
+		return -1;
+#else
+	struct stat st;
+	pb->fd = open(filename, O_RDONLY);
+	if (pb->fd < 0)
+		return -1;
+	if (fstat(pb->fd, &st) < 0 || st.st_size == 0)
+		return -1;
+	pb->map_size = (uint64_t)st.st_size;
+	void *map = mmap(NULL, (size_t)pb->map_size, PROT_READ, MAP_SHARED, pb->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	pb->map = (const uint8_t*)map;
+#endif
+	return 0;
+}
+
+FREENECTAPI int freenect_playback_open(freenect_context *ctx, freenect_playback **pb, const char *filename)
+{
+	freenect_playback *ppb = (freenect_playback*)malloc(sizeof(freenect_playback));
+	if (!ppb)
+		return -1;
+
+	memset(ppb, 0, sizeof(*ppb));
+#ifdef _WIN32
+	ppb->file = INVALID_HANDLE_VALUE;
+#else
+	ppb->fd = -1;
+#endif
+
+	if (pb_map(ppb, filename) < 0 || ppb->map_size < sizeof(rec_file_header)) {
+		FN_ERROR("freenect_playback_open: could not map %s\n", filename);
+		pb_unmap(ppb);
+		free(ppb);
+		return -1;
+	}
+
+	const rec_file_header *hdr = (const rec_file_header*)ppb->map;
+	if (memcmp(hdr->magic, rec_file_magic, sizeof(hdr->magic)) != 0 || fn_le32(hdr->version) != REC_VERSION) {
+		FN_ERROR("freenect_playback_open: %s is not a capture file\n", filename);
+		pb_unmap(ppb);
+		free(ppb);
+		return -1;
+	}
+
+	int res;
+	if (hdr->index_offset_lo || hdr->index_offset_hi) {
+		res = pb_read_index(ppb, hdr);
+	} else {
+		FN_WARNING("freenect_playback_open: %s has no index, scanning frames\n", filename);
+		res = pb_scan_frames(ppb);
+	}
+	if (res == 0)
+		res = pb_index_times(ppb);
+	if (res < 0 || freenect_open_virtual_device(ctx, &ppb->dev) < 0) {
+		FN_ERROR("freenect_playback_open: %s is corrupt\n", filename);
+		free(ppb->times[0]);
+		free(ppb->times[1]);
+		free(ppb->frames);
+		pb_unmap(ppb);
+		free(ppb);
+		return -1;
+	}
+
+	FN_INFO("freenect_playback_open: %s has %d frames\n", filename, ppb->count);
+	*pb = ppb;
+	return 0;
+}
+
+FREENECTAPI int freenect_playback_close(freenect_playback *pb)
+{
+	freenect_close_device(pb->dev);
+	free(pb->times[0]);
+	free(pb->times[1]);
+	free(pb->frames);
+	pb_unmap(pb);
+	free(pb);
+	return 0;
+}
+
+FREENECTAPI freenect_device *freenect_playback_get_device(freenect_playback *pb)
+{
+	return pb->dev;
+}
+
+FREENECTAPI int freenect_playback_num_frames(freenect_playback *pb)
+{
+	return pb->count;
+}
+
+FREENECTAPI int freenect_playback_get_frame(freenect_playback *pb, int index, freenect_playback_frame *frame)
+{
+	if (index < 0 || index >= pb->count)
+		return -1;
+	*frame = pb->frames[index];
+	return 0;
+}
+
+FREENECTAPI int freenect_playback_find_frame(freenect_playback *pb, freenect_stream stream, uint32_t timestamp)
+{
+	if (stream != FREENECT_STREAM_DEPTH && stream != FREENECT_STREAM_VIDEO)
+		return -1;
+	const pb_time *times = pb->times[stream == FREENECT_STREAM_DEPTH ? 0 : 1];
+	int n = pb->num_times[stream == FREENECT_STREAM_DEPTH ? 0 : 1];
+	if (n == 0)
+		return -1;
+
+	// Place timestamp on the unwrapped clock near the stream's first frame,
+	// then search for the first frame at or after it
+	int64_t offset = (int32_t)(timestamp - pb->frames[times[0].index].timestamp);
+	if (offset <= 0)
+		return times[0].index;
+	uint64_t target = times[0].time + (uint64_t)offset;
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (times[mid].time < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n ? times[lo].index : -1;
+}
+
+FREENECTAPI int freenect_playback_seek(freenect_playback *pb, int index)
+{
+	if (index < 0 || index > pb->count)
+		return -1;
+	pb->cursor = index;
+	return 0;
+}
+
+FREENECTAPI int freenect_playback_step(freenect_playback *pb)
+{
+	if (pb->cursor >= pb->count)
+		return 1;
+
+	freenect_playback_frame *frame = &pb->frames[pb->cursor++];
+	if (frame->stream == FREENECT_STREAM_DEPTH)
+		return freenect_virtual_push_depth(pb->dev, frame->mode, frame->data, frame->timestamp);
+	else
+		return freenect_virtual_push_video(pb->dev, frame->mode, frame->data, frame->timestamp);
+}
@@ -27,11 +27,36 @@
 #include "libfreenect.h"
 #include "freenect_internal.h"
 #include "registration.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
 
+// The SSE4.1 depth to mm kernel is built for every x86 target and only used
+// when the CPU has SSE4.1, so builds need no -msse4.1
+#if (defined(__i386__) || defined(__x86_64__)) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <smmintrin.h>
+#define FN_DEPTH_TO_MM_SSE41
+#define FN_TARGET_SSE41 __attribute__((target("sse4.1")))
+static int fn_cpu_has_sse41(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.1");
+}
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <smmintrin.h>
+#include <intrin.h>
+#define FN_DEPTH_TO_MM_SSE41
+#define FN_TARGET_SSE41
+static int fn_cpu_has_sse41(void)
+{
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] >> 19) & 1;
+}
+#endif
+
 
 #define REG_X_VAL_SCALE 256 // "fixed-point" precision for double -> int32_t conversion
 
@@ -100,15 +125,72 @@ static inline void unpack_8_pixels(uint8_t *raw, uint16_t *frame)
 	frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
 }
 
+#ifdef FN_DEPTH_TO_MM_SSE41
+// Unpack 8 pixels of 11 bits from the 11 bytes at raw, reading 16, and look
+// them up in the clamped table.  Each 32 bit lane gets the three bytes its
+// pixel touches in big endian order; a multiply stands in for the per lane
+// left shift SSE lacks, which lines every pixel up for one right shift.
+static inline FN_TARGET_SSE41 __m128i depth_to_mm_8_pixels(const uint8_t *raw, const uint16_t *lut)
+{
+	const __m128i lo_bytes = _mm_setr_epi8(2, 1, 0, -1, 3, 2, 1, -1, 4, 3, 2, -1, 6, 5, 4, -1);
+	const __m128i hi_bytes = _mm_setr_epi8(7, 6, 5, -1, 8, 7, 6, -1, 10, 9, 8, -1, -1, 10, 9, -1);
+	const __m128i mask = _mm_set1_epi32(0x7FF);
+
+	__m128i in = _mm_loadu_si128((const __m128i*)raw);
+	__m128i lo = _mm_mullo_epi32(_mm_shuffle_epi8(in, lo_bytes), _mm_setr_epi32(1 << 0, 1 << 3, 1 << 6, 1 << 1));
+	__m128i hi = _mm_mullo_epi32(_mm_shuffle_epi8(in, hi_bytes), _mm_setr_epi32(1 << 4, 1 << 7, 1 << 2, 1 << 5));
+	lo = _mm_and_si128(_mm_srli_epi32(lo, 13), mask);
+	hi = _mm_and_si128(_mm_srli_epi32(hi, 13), mask);
+
+	// There is no 16 bit gather, so the table is read one lane at a time
+	return _mm_setr_epi16(
+		lut[_mm_extract_epi32(lo, 0)], lut[_mm_extract_epi32(lo, 1)],
+		lut[_mm_extract_epi32(lo, 2)], lut[_mm_extract_epi32(lo, 3)],
+		lut[_mm_extract_epi32(hi, 0)], lut[_mm_extract_epi32(hi, 1)],
+		lut[_mm_extract_epi32(hi, 2)], lut[_mm_extract_epi32(hi, 3)]);
+}
+
+// Convert all but the last group of 8 of the n pixels, returning how many
+// were done.  The last group is left to the scalar loop, as its 16 byte load
+// would run past the end of the packed frame.
+static FN_TARGET_SSE41 int depth_to_mm_sse41(const uint8_t *input_packed, uint16_t *out, int n, const uint16_t *lut, fn_depth_stats *stats)
+{
+	uint16_t unpack[8];
+	int done;
+
+	// Nobody reads the frame before the callback, so aligned buffers are
+	// written around the cache
+	if (((uintptr_t)out & 15) == 0) {
+		for (done = 0; done < n - 8; done += 8, out += 8, input_packed += 11) {
+			__m128i mm = depth_to_mm_8_pixels(input_packed, lut);
+			_mm_stream_si128((__m128i*)out, mm);
+			if (stats) {
+				_mm_storeu_si128((__m128i*)unpack, mm);
+				fn_depth_stats_add8(stats, unpack);
+			}
+		}
+		_mm_sfence();
+	}
+	else {
+		for (done = 0; done < n - 8; done += 8, out += 8, input_packed += 11) {
+			_mm_storeu_si128((__m128i*)out, depth_to_mm_8_pixels(input_packed, lut));
+			if (stats)
+				fn_depth_stats_add8(stats, out);
+		}
+	}
+	return done;
+}
+#endif
+
 // apply registration data to a single packed frame
-FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm)
+FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm, fn_depth_stats* stats)
 {
 	freenect_registration* reg = &(dev->registration);
 	// set output buffer to zero using pointer-sized memory access (~ 30-40% faster than memset)
 	size_t i, *wipe = (size_t*)output_mm;
 	for (i = 0; i < DEPTH_X_RES * DEPTH_Y_RES * sizeof(uint16_t) / sizeof(size_t); i++) wipe[i] = DEPTH_NO_MM_VALUE;
 
-	uint16_t unpack[8];
+	uint16_t unpack[8], metric[8];
 
 	uint32_t target_offset = DEPTH_Y_RES * reg->reg_pad_info.start_lines;
 	uint32_t x,y,source_index = 8;
@@ -116,15 +198,20 @@ FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input
 	for (y = 0; y < DEPTH_Y_RES; y++) {
 		for (x = 0; x < DEPTH_X_RES; x++) {
 
-			// get 8 pixels from the packed frame
+			// get 8 pixels from the packed frame and convert them to millimeters
 			if (source_index == 8) {
 				unpack_8_pixels( input_packed, unpack );
 				source_index = 0;
 				input_packed += 11;
+				for (i = 0; i < 8; i++)
+					metric[i] = dev->raw_to_mm_clamped[ unpack[i] ];
+				// statistics are of the depth pixels, before they are moved
+				if (stats)
+					fn_depth_stats_add8(stats, metric);
 			}
 
-			// get the value at the current depth pixel, convert to millimeters
-			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[source_index++] ];
+			// get the value at the current depth pixel
+			uint16_t metric_depth = metric[source_index++];
 
 			// so long as the current pixel has a depth value
 			if (metric_depth == DEPTH_NO_MM_VALUE) continue;
@@ -169,31 +256,48 @@ FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input
 }
 
 // Same as freenect_apply_registration, but don't bother aligning to the RGB image
-FN_INTERNAL int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm)
+FN_INTERNAL int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm, fn_depth_stats* stats)
 {
-	freenect_registration* reg = &(dev->registration);
+	const uint16_t *lut = dev->raw_to_mm_clamped;
+	uint16_t *out = output_mm;
+	uint16_t *end = output_mm + DEPTH_X_RES * DEPTH_Y_RES;
 	uint16_t unpack[8];
-	uint32_t x,y,source_index = 8;
-	for (y = 0; y < DEPTH_Y_RES; y++) {
-		for (x = 0; x < DEPTH_X_RES; x++) {
-			// get 8 pixels from the packed frame
-			if (source_index == 8) {
-				unpack_8_pixels( input_packed, unpack );
-				source_index = 0;
-				input_packed += 11;
-			}
-			// get the value at the current depth pixel, convert to millimeters
-			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[source_index++] ];
-			output_mm[y * DEPTH_X_RES + x] = metric_depth < DEPTH_MAX_METRIC_VALUE ? metric_depth : DEPTH_MAX_METRIC_VALUE;
-		}
+	int i;
+
+#ifdef FN_DEPTH_TO_MM_SSE41
+	static int have_sse41 = -1;
+	if (have_sse41 < 0)
+		have_sse41 = fn_cpu_has_sse41();
+	if (have_sse41) {
+		int done = depth_to_mm_sse41(input_packed, out, end - out, lut, stats);
+		out += done;
+		input_packed += done / 8 * 11;
+	}
+#endif
+
+	for (; out < end; out += 8, input_packed += 11) {
+		unpack_8_pixels(input_packed, unpack);
+		for (i = 0; i < 8; i++)
+			out[i] = lut[unpack[i]];
+		if (stats)
+			fn_depth_stats_add8(stats, out);
 	}
 	return 0;
 }
 
-// create temporary x/y shift tables
-static void freenect_create_dxdy_tables(double* reg_x_table, double* reg_y_table, int32_t resolution_x, int32_t resolution_y, freenect_reg_info* regdata )
+// State of the registration polynomial at the start of a row
+typedef struct {
+	int64_t dX0, dXdX0, dXdXdX0;
+	int64_t dY0, dXdY0, dXdXdY0;
+} reg_row_state;
+
+/// fill the registration table straight from the camera's fixed-point
+/// polynomial.  Rows depend on each other only through a cheap recurrence,
+/// which is run first, so the rows themselves can be filled in parallel.
+/// Positions stay in 1/2^17 pixels throughout, which gives exactly the
+/// values converting through doubles did.
+static void freenect_init_registration_table(int32_t (*registration_table)[2], freenect_reg_info* regdata)
 {
-
 	int64_t AX6 = regdata->ax;
 	int64_t BX6 = regdata->bx;
 	int64_t CX2 = regdata->cx;
@@ -220,9 +324,10 @@ static void freenect_create_dxdy_tables(double* reg_x_table, double* reg_y_table
 	int64_t dYdYdX0 = (regdata->dydydx_start << 5) << 3;
 	int64_t dYdYdY0 = (regdata->dydydy_start << 5) << 3;
 
-	int32_t row,col,tOffs = 0;
+	reg_row_state rows[DEPTH_Y_RES];
+	int32_t row;
 
-	for (row = 0 ; row < resolution_y ; row++) {
+	for (row = 0 ; row < DEPTH_Y_RES ; row++) {
 
 		dXdXdX0 += CX2;
 
@@ -242,13 +347,34 @@ static void freenect_create_dxdy_tables(double* reg_x_table, double* reg_y_table
 		dYdY0   += dYdYdY0 >> 8;
 		dYdYdY0 += BY6;
 
-		int64_t coldXdXdY0 = dXdXdY0, coldXdY0 = dXdY0, coldY0 = dY0;
+		rows[row].dX0 = dX0;
+		rows[row].dXdX0 = dXdX0;
+		rows[row].dXdXdX0 = dXdXdX0;
+		rows[row].dY0 = dY0;
+		rows[row].dXdY0 = dXdY0;
+		rows[row].dXdXdY0 = dXdXdY0;
+	}
+
+#ifdef _OPENMP
+	#pragma omp parallel for
+#endif
+	for (row = 0 ; row < DEPTH_Y_RES ; row++) {
 
-		int64_t coldXdXdX0 = dXdXdX0, coldXdX0 = dXdX0, coldX0 = dX0;
+		int64_t coldXdXdX0 = rows[row].dXdXdX0, coldXdX0 = rows[row].dXdX0, coldX0 = rows[row].dX0;
+		int64_t coldXdXdY0 = rows[row].dXdXdY0, coldXdY0 = rows[row].dXdY0, coldY0 = rows[row].dY0;
+		int32_t (*entry)[2] = registration_table + row * DEPTH_X_RES;
+		int32_t col;
 
-		for (col = 0 ; col < resolution_x ; col++, tOffs++) {
-			reg_x_table[tOffs] = coldX0 * (1.0/(1<<17));
-			reg_y_table[tOffs] = coldY0 * (1.0/(1<<17));
+		for (col = 0 ; col < DEPTH_X_RES ; col++) {
+			int64_t new_x = ((int64_t)(col + DEPTH_X_OFFSET) << 17) + coldX0;
+			int64_t new_y = ((int64_t)(row + DEPTH_Y_OFFSET) << 17) + coldY0;
+
+			if ((new_x < 0) || (new_y < 0) || (new_x >= ((int64_t)DEPTH_X_RES << 17)) || (new_y >= ((int64_t)DEPTH_Y_RES << 17)))
+				entry[col][0] = 2 * DEPTH_X_RES * REG_X_VAL_SCALE; // intentionally set value outside image bounds
+			else
+				entry[col][0] = (new_x * REG_X_VAL_SCALE) >> 17;
+			// truncated toward zero, as the conversion from double was
+			entry[col][1] = new_y >= 0 ? new_y >> 17 : -((-new_y) >> 17);
 
 			coldX0     += coldXdX0 >> 6;
 			coldXdX0   += coldXdXdX0 >> 8;
@@ -261,33 +387,6 @@ static void freenect_create_dxdy_tables(double* reg_x_table, double* reg_y_table
 	}
 }
 
-static void freenect_init_registration_table(int32_t (*registration_table)[2], freenect_reg_info* reg_info) {
-
-	double* regtable_dx = (double*)malloc(DEPTH_X_RES*DEPTH_Y_RES*sizeof(double));
-	double* regtable_dy = (double*)malloc(DEPTH_X_RES*DEPTH_Y_RES*sizeof(double));
-	memset(regtable_dx, 0, DEPTH_X_RES*DEPTH_Y_RES * sizeof(double));
-	memset(regtable_dy, 0, DEPTH_X_RES*DEPTH_Y_RES * sizeof(double));
-	int32_t x,y,index = 0;
-
-	// create temporary dx/dy tables
-	freenect_create_dxdy_tables( regtable_dx, regtable_dy, DEPTH_X_RES, DEPTH_Y_RES, reg_info );
-
-	for (y = 0; y < DEPTH_Y_RES; y++) {
-		for (x = 0; x < DEPTH_X_RES; x++, index++) {
-			double new_x = x + regtable_dx[index] + DEPTH_X_OFFSET;
-			double new_y = y + regtable_dy[index] + DEPTH_Y_OFFSET;
-
-			if ((new_x < 0) || (new_y < 0) || (new_x >= DEPTH_X_RES) || (new_y >= DEPTH_Y_RES))
-				new_x = 2 * DEPTH_X_RES; // intentionally set value outside image bounds
-
-			registration_table[index][0] = new_x * REG_X_VAL_SCALE;
-			registration_table[index][1] = new_y;
-		}
-	}
-	free(regtable_dx);
-	free(regtable_dy);
-}
-
 // These are just constants.
 static double parameter_coefficient = 4;
 static double shift_scale = 10;
@@ -347,6 +446,11 @@ FN_INTERNAL int freenect_init_registration(freenect_device* dev)
 	// Fill tables.
 	complete_tables(reg);
 
+	// The unpackers clamp through the table instead of per pixel
+	int i;
+	for (i = 0; i < DEPTH_MAX_RAW_VALUE; i++)
+		dev->raw_to_mm_clamped[i] = reg->raw_to_mm_shift[i] < DEPTH_MAX_METRIC_VALUE ? reg->raw_to_mm_shift[i] : DEPTH_MAX_METRIC_VALUE;
+
 	return 0;
 }
 
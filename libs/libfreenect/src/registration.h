@@ -28,7 +28,10 @@
 
 #include "libfreenect.h"
 
+struct _fn_depth_stats;
+
 // Internal function declarations relating to registration
 int freenect_init_registration(freenect_device* dev);
-int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
-int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
+// stats, if given, gathers the statistics of the frame in mm as it is converted
+int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm, struct _fn_depth_stats* stats);
+int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm, struct _fn_depth_stats* stats);
@@ -0,0 +1,156 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "freenect_internal.h"
+#include "stats.h"
+
+FN_INTERNAL int fn_depth_stats_begin(fn_depth_stats *st, freenect_depth_format format)
+{
+	switch (format) {
+		case FREENECT_DEPTH_11BIT:
+			st->no_value = FREENECT_DEPTH_RAW_NO_VALUE;
+			st->shift = 0;
+			break;
+		case FREENECT_DEPTH_10BIT:
+			st->no_value = FREENECT_DEPTH_10BIT_NO_VALUE;
+			st->shift = 0;
+			break;
+		case FREENECT_DEPTH_MM:
+		case FREENECT_DEPTH_REGISTERED:
+			// FREENECT_DEPTH_MM_MAX_VALUE >> 3 still fits the bins
+			st->no_value = FREENECT_DEPTH_MM_NO_VALUE;
+			st->shift = 3;
+			break;
+		default:
+			return 0;
+	}
+	memset(st->bins, 0, sizeof(st->bins));
+	st->sum = 0;
+	st->valid = 0;
+	st->total = 0;
+	st->min = 0xffff;
+	st->max = 0;
+	return 1;
+}
+
+FN_INTERNAL void fn_depth_stats_end(fn_depth_stats *st, uint32_t timestamp)
+{
+	freenect_depth_stats *r = &st->result;
+	int i;
+
+	fn_seqlock_write_begin(&st->seq);
+	for (i = 0; i < FREENECT_DEPTH_STATS_BINS; i++)
+		r->histogram[i] = st->bins[0][i] + st->bins[1][i] + st->bins[2][i] + st->bins[3][i];
+	// Every pixel without a reading landed in the same bin
+	r->histogram[st->no_value >> st->shift] -= st->total - st->valid;
+	r->timestamp = timestamp;
+	r->valid = st->valid;
+	r->min = st->valid ? st->min : 0;
+	r->max = st->valid ? st->max : 0;
+	r->mean = st->valid ? (float)((double)st->sum / st->valid) : 0;
+	r->bin_shift = st->shift;
+	st->have_stats = 1;
+	fn_seqlock_write_end(&st->seq);
+}
+
+FN_INTERNAL fn_depth_stats *fn_depth_stats_hold(freenect_device *dev)
+{
+	fn_lock_acquire(&dev->lock);
+	fn_depth_stats *st = dev->depth_stats;
+	if (st)
+		st->busy = 1;
+	fn_lock_release(&dev->lock);
+	return st;
+}
+
+FN_INTERNAL void fn_depth_stats_drop(freenect_device *dev, fn_depth_stats *st)
+{
+	fn_lock_acquire(&dev->lock);
+	st->busy = 0;
+	int orphaned = st->orphaned;
+	fn_lock_release(&dev->lock);
+	if (orphaned)
+		free(st);
+}
+
+FREENECTAPI int freenect_enable_depth_stats(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+
+	if (dev->depth_stats)
+		return 0;
+	fn_depth_stats *st = (fn_depth_stats*)calloc(1, sizeof(fn_depth_stats));
+	if (!st) {
+		FN_ERROR("freenect_enable_depth_stats: out of memory\n");
+		return -1;
+	}
+	fn_lock_acquire(&dev->lock);
+	dev->depth_stats = st;
+	fn_lock_release(&dev->lock);
+	return 0;
+}
+
+FREENECTAPI int freenect_disable_depth_stats(freenect_device *dev)
+{
+	// A frame being measured keeps the stats until it is done with them
+	fn_lock_acquire(&dev->lock);
+	fn_depth_stats *st = dev->depth_stats;
+	dev->depth_stats = NULL;
+	int busy = st && st->busy;
+	if (busy)
+		st->orphaned = 1;
+	fn_lock_release(&dev->lock);
+
+	if (!st)
+		return -1;
+	if (!busy)
+		free(st);
+	return 0;
+}
+
+FREENECTAPI int freenect_get_depth_stats(freenect_device *dev, freenect_depth_stats *stats)
+{
+	uint32_t seq;
+	int have = 0;
+
+	// The lock keeps the stats from being disabled under us; the seqlock
+	// keeps them whole while the next frame is published
+	fn_lock_acquire(&dev->lock);
+	fn_depth_stats *st = dev->depth_stats;
+	if (st) {
+		do {
+			seq = fn_seqlock_read_begin(&st->seq);
+			have = st->have_stats;
+			if (have)
+				memcpy(stats, &st->result, sizeof(*stats));
+		} while (fn_seqlock_read_retry(&st->seq, seq));
+	}
+	fn_lock_release(&dev->lock);
+	return have ? 0 : -1;
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010-2011 individual OpenKinect contributors. See the CONTRIB
+ * file for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+#pragma once
+
+#include "libfreenect.h"
+
+// Depth statistics accumulated by the unpackers, see stats.c
+typedef struct _fn_depth_stats {
+	// Four interleaved histograms, so neighbouring pixels with the same
+	// reading don't wait on each other's increment
+	uint32_t bins[4][FREENECT_DEPTH_STATS_BINS];
+	uint64_t sum;
+	uint32_t valid;
+	uint32_t total;
+	uint16_t min, max;
+	uint16_t no_value;
+	int shift;
+
+	volatile uint32_t seq;
+	int have_stats;
+	freenect_depth_stats result;
+
+	// Under the device lock: a frame is being measured, and stats were
+	// disabled meanwhile so the unpacker frees them
+	int busy;
+	int orphaned;
+} fn_depth_stats;
+
+// Take the device's statistics for a frame, or NULL if they're disabled
+fn_depth_stats *fn_depth_stats_hold(freenect_device *dev);
+// Done with the frame's statistics; frees them if disabled meanwhile
+void fn_depth_stats_drop(freenect_device *dev, fn_depth_stats *st);
+
+// Reset for a frame in the given format; returns 0 if it has no statistics
+int fn_depth_stats_begin(fn_depth_stats *st, freenect_depth_format format);
+// Merge the histograms and publish the frame's statistics
+void fn_depth_stats_end(fn_depth_stats *st, uint32_t timestamp);
+
+// Count 8 pixels just unpacked; each must be below FREENECT_DEPTH_STATS_BINS << shift
+static inline void fn_depth_stats_add8(fn_depth_stats *st, const uint16_t *v)
+{
+	const int shift = st->shift;
+	const int none = st->no_value;
+	uint32_t valid = 0, sum = 0;
+	int lo = st->min, hi = st->max;
+	int k;
+	for (k = 0; k < 8; k++) {
+		int d = v[k];
+		int ok = d != none;
+		st->bins[k & 3][d >> shift]++;
+		valid += ok;
+		sum += ok ? d : 0;
+		lo = ok && d < lo ? d : lo;
+		hi = ok && d > hi ? d : hi;
+	}
+	st->valid += valid;
+	st->total += 8;
+	st->sum += sum;
+	st->min = lo;
+	st->max = hi;
+}
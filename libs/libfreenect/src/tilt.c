@@ -31,6 +31,7 @@
 #include <math.h>
 
 #include "freenect_internal.h"
+#include "tilt.h"
 
 // The kinect can tilt from +31 to -31 degrees in what looks like 1 degree increments
 // The control input looks like 2*desired_degrees
@@ -92,6 +93,22 @@ int get_reply(libusb_device_handle* dev, freenect_context *ctx){
 }
 
 
+// Decode the 10 byte reply to the motor's 0x32 state request
+static void tilt_state_parse(const uint8_t *buf, freenect_raw_tilt_state *state)
+{
+	uint16_t ux, uy, uz;
+
+	ux = ((uint16_t)buf[2] << 8) | buf[3];
+	uy = ((uint16_t)buf[4] << 8) | buf[5];
+	uz = ((uint16_t)buf[6] << 8) | buf[7];
+
+	state->accelerometer_x = (int16_t)ux;
+	state->accelerometer_y = (int16_t)uy;
+	state->accelerometer_z = (int16_t)uz;
+	state->tilt_angle = (int8_t)buf[8];
+	state->tilt_status = (freenect_tilt_status_code)buf[9];
+}
+
 freenect_raw_tilt_state* freenect_get_tilt_state(freenect_device *dev)
 {
 	return &dev->raw_state;
@@ -167,27 +184,242 @@ int freenect_update_tilt_state(freenect_device *dev)
 		return 0;
     
     
+	// The background sampler already has a recent state, don't block on the device
+	freenect_tilt_sample sample;
+	if (freenect_get_tilt_sample(dev, &sample) == 0) {
+		dev->raw_state = sample.state;
+		return 10;
+	}
+
 	uint8_t buf[10];
-	uint16_t ux, uy, uz;
 	int ret = fnusb_control(&dev->usb_motor, 0xC0, 0x32, 0x0, 0x0, buf, 10);
 	if (ret != 10) {
 		FN_ERROR("Error in accelerometer reading, libusb_control_transfer returned %d\n", ret);
 		return ret < 0 ? ret : -1;
 	}
 
-	ux = ((uint16_t)buf[2] << 8) | buf[3];
-	uy = ((uint16_t)buf[4] << 8) | buf[5];
-	uz = ((uint16_t)buf[6] << 8) | buf[7];
-
-	dev->raw_state.accelerometer_x = (int16_t)ux;
-	dev->raw_state.accelerometer_y = (int16_t)uy;
-	dev->raw_state.accelerometer_z = (int16_t)uz;
-	dev->raw_state.tilt_angle = (int8_t)buf[8];
-	dev->raw_state.tilt_status = (freenect_tilt_status_code)buf[9];
+	tilt_state_parse(buf, &dev->raw_state);
 
 	return ret;
 }
 
+struct _fn_tilt_sampler {
+	volatile uint32_t seq; // seqlock over latest and the history ring
+	freenect_tilt_sample latest;
+	int have_sample;
+	freenect_tilt_sample *history;
+	int history_len;
+	int history_count;
+	int history_next; // slot the next sample goes into
+
+	// only touched by poll, under the device lock
+	int period_us;
+	uint64_t next_us;
+
+	// A read in flight keeps the sampler alive. The device may be gone by
+	// the time it lands, so this lock is the sampler's own.
+	fn_lock lock;
+	int in_flight;
+	int orphaned; // stopped without the read landing; it frees the sampler
+};
+typedef struct _fn_tilt_sampler fn_tilt_sampler;
+
+static void tilt_sampler_free(fn_tilt_sampler *sampler)
+{
+	fn_lock_destroy(&sampler->lock);
+	free(sampler->history);
+	free(sampler);
+}
+
+static void tilt_sample_done(void *user_data, int status, uint8_t *data, int len)
+{
+	fn_tilt_sampler *sampler = (fn_tilt_sampler*)user_data;
+	freenect_tilt_sample sample;
+
+	if (status >= 0 && len == 10) {
+		tilt_state_parse(data, &sample.state);
+		sample.timestamp = fn_get_time_us();
+
+		fn_seqlock_write_begin(&sampler->seq);
+		sampler->latest = sample;
+		sampler->have_sample = 1;
+		if (sampler->history_len) {
+			sampler->history[sampler->history_next] = sample;
+			sampler->history_next = (sampler->history_next + 1) % sampler->history_len;
+			if (sampler->history_count < sampler->history_len)
+				sampler->history_count++;
+		}
+		fn_seqlock_write_end(&sampler->seq);
+	}
+
+	fn_lock_acquire(&sampler->lock);
+	sampler->in_flight = 0;
+	int orphaned = sampler->orphaned;
+	fn_lock_release(&sampler->lock);
+	if (orphaned)
+		tilt_sampler_free(sampler);
+}
+
+FN_INTERNAL void freenect_tilt_sampler_poll(freenect_device *dev)
+{
+	freenect_context *ctx = dev->parent;
+
+	fn_lock_acquire(&dev->lock);
+	fn_tilt_sampler *sampler = dev->tilt_sampler;
+	uint64_t now = fn_get_time_us();
+	if (!sampler || now < sampler->next_us) {
+		fn_lock_release(&dev->lock);
+		return;
+	}
+	fn_lock_acquire(&sampler->lock);
+	int busy = sampler->in_flight;
+	sampler->in_flight = 1;
+	fn_lock_release(&sampler->lock);
+	if (busy) {
+		fn_lock_release(&dev->lock);
+		return;
+	}
+	// Keep to the rate on average, but don't try to catch up after a stall
+	sampler->next_us += sampler->period_us;
+	if (sampler->next_us < now)
+		sampler->next_us = now + sampler->period_us;
+
+	int res = fnusb_control_async(&dev->usb_motor, 0xC0, 0x32, 0x0, 0x0, NULL, 10, tilt_sample_done, sampler);
+	if (res < 0) {
+		FN_WARNING("Failed to request accelerometer state: %d\n", res);
+		fn_lock_acquire(&sampler->lock);
+		sampler->in_flight = 0;
+		fn_lock_release(&sampler->lock);
+	}
+	fn_lock_release(&dev->lock);
+}
+
+int freenect_start_tilt_sampler(freenect_device *dev, int rate_hz, int history_len)
+{
+	freenect_context *ctx = dev->parent;
+
+	if (rate_hz <= 0 || history_len < 0)
+		return -1;
+	if (!dev->usb_motor.dev || dev->motor_control_with_audio_enabled) {
+		FN_ERROR("freenect_start_tilt_sampler(): no motor subdevice to sample\n");
+		return -1;
+	}
+#if !FNUSB_HAVE_CONTROL_ASYNC
+	FN_ERROR("freenect_start_tilt_sampler(): needs asynchronous control transfers\n");
+	return -1;
+#endif
+
+	fn_tilt_sampler *sampler = (fn_tilt_sampler*)malloc(sizeof(fn_tilt_sampler));
+	if (!sampler)
+		return -1;
+	memset(sampler, 0, sizeof(*sampler));
+	if (history_len) {
+		sampler->history = (freenect_tilt_sample*)malloc(history_len * sizeof(freenect_tilt_sample));
+		if (!sampler->history) {
+			free(sampler);
+			return -1;
+		}
+	}
+	sampler->history_len = history_len;
+	sampler->period_us = 1000000 / rate_hz;
+	sampler->next_us = fn_get_time_us();
+	fn_lock_init(&sampler->lock);
+
+	fn_lock_acquire(&dev->lock);
+	int running = dev->tilt_sampler != NULL;
+	if (!running)
+		dev->tilt_sampler = sampler;
+	fn_lock_release(&dev->lock);
+	if (running) {
+		tilt_sampler_free(sampler);
+		return -1;
+	}
+	freenect_tilt_sampler_poll(dev);
+	return 0;
+}
+
+int freenect_stop_tilt_sampler(freenect_device *dev)
+{
+	fn_lock_acquire(&dev->lock);
+	fn_tilt_sampler *sampler = dev->tilt_sampler;
+	dev->tilt_sampler = NULL;
+	fn_lock_release(&dev->lock);
+	if (!sampler)
+		return -1;
+
+	// Let the read in flight land before the sampler goes away. If events
+	// can't be handled, the read frees the sampler whenever it does land.
+	for (;;) {
+		fn_lock_acquire(&sampler->lock);
+		int in_flight = sampler->in_flight;
+		fn_lock_release(&sampler->lock);
+		if (!in_flight)
+			break;
+		if (fnusb_process_events(&dev->parent->usb) < 0) {
+			fn_lock_acquire(&sampler->lock);
+			in_flight = sampler->in_flight;
+			sampler->orphaned = in_flight;
+			fn_lock_release(&sampler->lock);
+			if (in_flight)
+				return 0;
+			break;
+		}
+	}
+	tilt_sampler_free(sampler);
+	return 0;
+}
+
+int freenect_get_tilt_sample(freenect_device *dev, freenect_tilt_sample *sample)
+{
+	int have_sample = 0;
+	uint32_t seq;
+
+	// The lock keeps the sampler from being stopped under us; the seqlock
+	// keeps the sample whole while the event thread writes a new one
+	fn_lock_acquire(&dev->lock);
+	fn_tilt_sampler *sampler = dev->tilt_sampler;
+	if (sampler) {
+		do {
+			seq = fn_seqlock_read_begin(&sampler->seq);
+			have_sample = sampler->have_sample;
+			*sample = sampler->latest;
+		} while (fn_seqlock_read_retry(&sampler->seq, seq));
+	}
+	fn_lock_release(&dev->lock);
+
+	if (!sampler)
+		return -1;
+	return have_sample ? 0 : -1;
+}
+
+int freenect_get_tilt_history(freenect_device *dev, freenect_tilt_sample *samples, int max_samples)
+{
+	int count = -1, i;
+	uint32_t seq;
+
+	fn_lock_acquire(&dev->lock);
+	fn_tilt_sampler *sampler = dev->tilt_sampler;
+	if (sampler) {
+		do {
+			seq = fn_seqlock_read_begin(&sampler->seq);
+			count = sampler->history_count < max_samples ? sampler->history_count : max_samples;
+			int slot = sampler->history_next;
+			for (i = 0; i < count; i++) {
+				slot = (slot + sampler->history_len - 1) % sampler->history_len;
+				samples[i] = sampler->history[slot];
+			}
+		} while (fn_seqlock_read_retry(&sampler->seq, seq));
+	}
+	fn_lock_release(&dev->lock);
+
+	return count;
+}
+
+uint64_t freenect_get_time_us(void)
+{
+	return fn_get_time_us();
+}
+
 #ifdef BUILD_AUDIO
 int freenect_set_tilt_degs_alt(freenect_device *dev, int tilt_degrees)
 {
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "freenect_internal.h"
+#include "timing.h"
+
+// Frames the fit averages over once it has settled
+#define CLOCK_WINDOW 256
+
+static double clock_ticks_per_us(fn_stream_clock *clock)
+{
+	// The fit needs two frames before it says anything about the rate
+	if (clock->samples < 2 || clock->var_ticks <= 0 || clock->cov <= 0)
+		return FREENECT_TICKS_PER_SECOND / 1000000.0;
+	return clock->var_ticks / clock->cov;
+}
+
+FN_INTERNAL void fn_clock_restart(fn_stream_clock *clock)
+{
+	clock->restart = 1;
+}
+
+FN_INTERNAL void fn_clock_frame(fn_stream_clock *clock, uint32_t timestamp, int framerate)
+{
+	uint64_t now = fn_get_time_us();
+	uint32_t dropped = 0;
+
+	if (!clock->have_frame) {
+		clock->device_time = timestamp;
+		clock->origin_ticks = timestamp;
+		clock->origin_us = now;
+	} else {
+		double rate = clock_ticks_per_us(clock);
+		uint32_t delta = timestamp - clock->last_timestamp;
+		// A long enough pause hides whole wraps of the camera clock; the
+		// host clock tells how many went by
+		double expected = (now - clock->last_arrival_us) * rate;
+		double wraps = floor((expected - delta) / 4294967296.0 + 0.5);
+		uint64_t ticks = delta + (wraps > 0 ? (uint64_t)wraps << 32 : 0);
+		// Going back in time means a different clock, as when a recording
+		// loops; carry on by the host clock
+		int jumped = wraps < 0;
+		if (jumped)
+			ticks = (uint64_t)expected;
+
+		if (!clock->restart && !jumped && framerate > 0) {
+			double period = rate * 1000000.0 / framerate;
+			double frames = floor(ticks / period + 0.5);
+			if (frames > 1)
+				dropped = (uint32_t)(frames - 1);
+		}
+		clock->device_time += ticks;
+	}
+
+	// Exponentially weighted least squares of arrival against camera time;
+	// it starts as a plain average and settles into a moving window
+	double x = (double)(clock->device_time - clock->origin_ticks);
+	double y = (double)(int64_t)(now - clock->origin_us);
+	double w = clock->samples < CLOCK_WINDOW ? 1.0 / (clock->samples + 1) : 1.0 / CLOCK_WINDOW;
+	double dx = x - clock->mean_ticks;
+	double dy = y - clock->mean_us;
+	clock->mean_ticks += w * dx;
+	clock->mean_us += w * dy;
+	clock->var_ticks = (1 - w) * (clock->var_ticks + w * dx * dx);
+	clock->cov = (1 - w) * (clock->cov + w * dx * dy);
+	clock->samples++;
+
+	double rate = clock_ticks_per_us(clock);
+	double host = clock->mean_us + (x - clock->mean_ticks) / rate;
+
+	fn_seqlock_write_begin(&clock->seq);
+	freenect_frame_info *info = &clock->info;
+	info->timestamp = timestamp;
+	info->device_time = clock->device_time;
+	info->arrival_us = now;
+	info->host_us = clock->origin_us + (int64_t)floor(host + 0.5);
+	info->ticks_per_us = rate;
+	info->sequence = clock->have_frame ? info->sequence + 1 + dropped : 0;
+	info->dropped = dropped;
+	info->total_dropped = clock->have_frame ? info->total_dropped + dropped : 0;
+	fn_seqlock_write_end(&clock->seq);
+
+	clock->have_frame = 1;
+	clock->restart = 0;
+	clock->last_timestamp = timestamp;
+	clock->last_arrival_us = now;
+}
+
+static int clock_get_info(fn_stream_clock *clock, freenect_frame_info *info)
+{
+	uint32_t seq;
+	int have;
+	do {
+		seq = fn_seqlock_read_begin(&clock->seq);
+		have = clock->have_frame;
+		*info = clock->info;
+	} while (fn_seqlock_read_retry(&clock->seq, seq));
+	return have ? 0 : -1;
+}
+
+FREENECTAPI int freenect_get_depth_frame_info(freenect_device *dev, freenect_frame_info *info)
+{
+	return clock_get_info(&dev->depth.clock, info);
+}
+
+FREENECTAPI int freenect_get_video_frame_info(freenect_device *dev, freenect_frame_info *info)
+{
+	return clock_get_info(&dev->video.clock, info);
+}
@@ -38,8 +38,165 @@
 #endif 
 
 
+static int fnusb_is_camera(struct libusb_device_descriptor *desc)
+{
+	return desc->idVendor == VID_MICROSOFT && (desc->idProduct == PID_NUI_CAMERA || desc->idProduct == PID_K4W_CAMERA);
+}
+
+#if FNUSB_HAVE_HOTPLUG
+static int fnusb_cam_compare(libusb_device *a, libusb_device *b)
+{
+	int d = libusb_get_bus_number(a) - libusb_get_bus_number(b);
+	if (d != 0)
+		return d;
+	return libusb_get_device_address(a) - libusb_get_device_address(b);
+}
+
+// Runs from inside libusb event handling, so it must not do any blocking I/O;
+// serial numbers are read later by fnusb_list_device_attributes().
+static int LIBUSB_CALL fnusb_hotplug_cb(libusb_context *usb_ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	fnusb_ctx *ctx = (fnusb_ctx*)user_data;
+	struct libusb_device_descriptor desc;
+	int i;
+	(void)usb_ctx;
+
+	if (libusb_get_device_descriptor(device, &desc) < 0 || !fnusb_is_camera(&desc))
+		return 0;
+
+	fn_lock_acquire(&ctx->cams_lock);
+	for (i = 0; i < ctx->num_cams; i++) {
+		if (ctx->cams[i].dev == device)
+			break;
+	}
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		fnusb_cached_cam *cams = i < ctx->num_cams ? NULL : (fnusb_cached_cam*)realloc(ctx->cams, (ctx->num_cams + 1) * sizeof(fnusb_cached_cam));
+		if (cams) {
+			ctx->cams = cams;
+			for (i = ctx->num_cams; i > 0 && fnusb_cam_compare(cams[i-1].dev, device) > 0; i--)
+				cams[i] = cams[i-1];
+			cams[i].dev = libusb_ref_device(device);
+			cams[i].serial = NULL;
+			ctx->num_cams++;
+		}
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && i < ctx->num_cams) {
+		libusb_unref_device(ctx->cams[i].dev);
+		free(ctx->cams[i].serial);
+		memmove(&ctx->cams[i], &ctx->cams[i+1], (ctx->num_cams - i - 1) * sizeof(fnusb_cached_cam));
+		ctx->num_cams--;
+	}
+	fn_lock_release(&ctx->cams_lock);
+	return 0;
+}
+
+static int fnusb_cam_sort(const void *a, const void *b)
+{
+	return fnusb_cam_compare(((const fnusb_cached_cam*)a)->dev, ((const fnusb_cached_cam*)b)->dev);
+}
+#endif
+
+// Hotplug events wait for a thread to handle events. With none doing so
+// lately, the cache is rebuilt from the bus instead, as enumerating must not
+// dispatch the stream callbacks of the caller's devices.
+#define FNUSB_EVENTS_STALE_US 1000000
+
+// Lock the camera cache and make sure it is current. Returns with cams_lock
+// held.
+static void fnusb_lock_cams(fnusb_ctx *ctx)
+{
+#if FNUSB_HAVE_HOTPLUG
+	fn_lock_acquire(&ctx->cams_lock);
+	if (fn_get_time_us() - ctx->events_us < FNUSB_EVENTS_STALE_US)
+		return;
+	fn_lock_release(&ctx->cams_lock);
+
+	libusb_device **devs;
+	ssize_t cnt = libusb_get_device_list(ctx->ctx, &devs);
+	fnusb_cached_cam *cams = cnt > 0 ? (fnusb_cached_cam*)malloc(cnt * sizeof(fnusb_cached_cam)) : NULL;
+	struct libusb_device_descriptor desc;
+	int num_cams = 0;
+	int i, j;
+	for (i = 0; cams && i < cnt; i++) {
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 || !fnusb_is_camera(&desc))
+			continue;
+		cams[num_cams].dev = libusb_ref_device(devs[i]);
+		cams[num_cams].serial = NULL;
+		num_cams++;
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(devs, 1);
+	if (cams)
+		qsort(cams, num_cams, sizeof(fnusb_cached_cam), fnusb_cam_sort);
+
+	fn_lock_acquire(&ctx->cams_lock);
+	if (cnt < 0 || (cnt > 0 && !cams))
+		return; // keep what is cached
+	// Serials already read stay with their cameras
+	for (i = 0; i < ctx->num_cams; i++) {
+		for (j = 0; j < num_cams; j++) {
+			if (cams[j].dev == ctx->cams[i].dev) {
+				cams[j].serial = ctx->cams[i].serial;
+				ctx->cams[i].serial = NULL;
+				break;
+			}
+		}
+		libusb_unref_device(ctx->cams[i].dev);
+		free(ctx->cams[i].serial);
+	}
+	free(ctx->cams);
+	ctx->cams = cams;
+	ctx->num_cams = num_cams;
+#else
+	fn_lock_acquire(&ctx->cams_lock);
+#endif
+}
+
+// The context comes zeroed from freenect_init(), so the cache starts empty
+static void fnusb_start_hotplug(fnusb_ctx *ctx)
+{
+#if FNUSB_HAVE_HOTPLUG
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return;
+	// ENUMERATE fills the cache with the cameras already plugged in
+	int res = libusb_hotplug_register_callback(ctx->ctx,
+		(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		LIBUSB_HOTPLUG_ENUMERATE, VID_MICROSOFT, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		fnusb_hotplug_cb, ctx, &ctx->hotplug_handle);
+	if (res == LIBUSB_SUCCESS)
+		ctx->hotplug = 1;
+#endif
+}
+
+static void fnusb_stop_hotplug(fnusb_ctx *ctx)
+{
+	int i;
+#if FNUSB_HAVE_HOTPLUG
+	if (ctx->hotplug)
+		libusb_hotplug_deregister_callback(ctx->ctx, ctx->hotplug_handle);
+#endif
+	fn_lock_acquire(&ctx->cams_lock);
+	for (i = 0; i < ctx->num_cams; i++) {
+		libusb_unref_device(ctx->cams[i].dev);
+		free(ctx->cams[i].serial);
+	}
+	free(ctx->cams);
+	ctx->cams = NULL;
+	ctx->num_cams = 0;
+	ctx->hotplug = 0;
+	fn_lock_release(&ctx->cams_lock);
+}
+
 FN_INTERNAL int fnusb_num_devices(fnusb_ctx *ctx)
 {
+	// The hotplug cache saves enumerating the whole bus on every call
+	if (ctx->hotplug) {
+		fnusb_lock_cams(ctx);
+		int num_cams = ctx->num_cams;
+		fn_lock_release(&ctx->cams_lock);
+		return num_cams;
+	}
+
 	libusb_device **devs; 
 	//pointer to pointer of device, used to retrieve a list of devices	
 	ssize_t cnt = libusb_get_device_list (ctx->ctx, &devs); 
@@ -53,7 +210,7 @@ FN_INTERNAL int fnusb_num_devices(fnusb_ctx *ctx)
 		int r = libusb_get_device_descriptor (devs[i], &desc);
 		if (r < 0)
 			continue;
-		if (desc.idVendor == VID_MICROSOFT && (desc.idProduct == PID_NUI_CAMERA || desc.idProduct == PID_K4W_CAMERA))
+		if (fnusb_is_camera(&desc))
 			nr++;
 	}
 	libusb_free_device_list (devs, 1);
@@ -61,48 +218,100 @@ FN_INTERNAL int fnusb_num_devices(fnusb_ctx *ctx)
 	return nr;
 }
 
+// Read the serial number string of a camera.  Returns a malloc'd string, or
+// NULL if the camera has none or can't be opened.
+static char *fnusb_read_serial(libusb_device *device)
+{
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) < 0)
+		return NULL;
+	// Verify that a serial number exists to query.  If not, don't touch the device.
+	if (desc.iSerialNumber == 0)
+		return NULL;
+
+	// Open device.
+	int res;
+	libusb_device_handle *this_device;
+	res = libusb_open(device, &this_device);
+	unsigned char string_desc[256]; // String descriptors are at most 256 bytes.
+	if (res != 0)
+		return NULL;
+
+	// Read string descriptor referring to serial number.
+	res = libusb_get_string_descriptor_ascii(this_device, desc.iSerialNumber, string_desc, 256);
+	libusb_close(this_device);
+	if (res < 0)
+		return NULL;
+	return strdup((char*)string_desc);
+}
+
 FN_INTERNAL int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_device_attributes** attribute_list)
 {
 	*attribute_list = NULL; // initialize some return value in case the user is careless.
+	struct freenect_device_attributes** camera_prev_next = attribute_list;
+	int num_cams = 0;
+	int i;
+
+	// Cameras whose serial can't be read are listed with an empty one, so
+	// that the position of each in the list is its index for
+	// freenect_open_device(), as freenect_open_device_by_camera_serial() expects
+	if (ctx->hotplug) {
+		// Serials are read without the lock, so hotplug events aren't held up
+		// by the blocking reads; the cameras are referenced meanwhile
+		fnusb_lock_cams(ctx);
+		int count = ctx->num_cams;
+		fnusb_cached_cam *cams = (fnusb_cached_cam*)malloc((count ? count : 1) * sizeof(fnusb_cached_cam));
+		if (!cams) {
+			fn_lock_release(&ctx->cams_lock);
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			cams[i].dev = libusb_ref_device(ctx->cams[i].dev);
+			cams[i].serial = ctx->cams[i].serial ? strdup(ctx->cams[i].serial) : NULL;
+		}
+		fn_lock_release(&ctx->cams_lock);
+
+		for (i = 0; i < count; i++) {
+			if (!cams[i].serial && (cams[i].serial = fnusb_read_serial(cams[i].dev)) != NULL) {
+				int j;
+				fn_lock_acquire(&ctx->cams_lock);
+				for (j = 0; j < ctx->num_cams; j++) {
+					if (ctx->cams[j].dev == cams[i].dev && !ctx->cams[j].serial)
+						ctx->cams[j].serial = strdup(cams[i].serial);
+				}
+				fn_lock_release(&ctx->cams_lock);
+			}
+
+			struct freenect_device_attributes* new_dev_attrs = (struct freenect_device_attributes*)malloc(sizeof(struct freenect_device_attributes));
+			memset(new_dev_attrs, 0, sizeof(*new_dev_attrs));
+			*camera_prev_next = new_dev_attrs;
+			new_dev_attrs->camera_serial = cams[i].serial ? cams[i].serial : strdup("");
+			camera_prev_next = &(new_dev_attrs->next);
+			num_cams++;
+			libusb_unref_device(cams[i].dev);
+		}
+		free(cams);
+		return num_cams;
+	}
+
 	libusb_device **devs;
 	//pointer to pointer of device, used to retrieve a list of devices
 	ssize_t count = libusb_get_device_list (ctx->ctx, &devs);
 	if (count < 0)
 		return -1;
 
-	struct freenect_device_attributes** camera_prev_next = attribute_list;
-
 	// Pass over the list.  For each camera seen, if we already have a camera
 	// for the newest_camera device, allocate a new one and append it to the list,
 	// incrementing num_devs.  Likewise for each audio device.
 	struct libusb_device_descriptor desc;
-	int num_cams = 0;
-	int i;
 	for (i = 0; i < count; i++) {
 		int r = libusb_get_device_descriptor (devs[i], &desc);
 		if (r < 0)
 			continue;
-		if (desc.idVendor == VID_MICROSOFT && (desc.idProduct == PID_NUI_CAMERA || desc.idProduct == PID_K4W_CAMERA)) {
-			// Verify that a serial number exists to query.  If not, don't touch the device.
-			if (desc.iSerialNumber == 0) {
-				continue;
-			}
-
-			// Open device.
-			int res;
-			libusb_device_handle *this_device;
-			res = libusb_open(devs[i], &this_device);
-			unsigned char string_desc[256]; // String descriptors are at most 256 bytes.
-			if (res != 0) {
-				continue;
-			}
-
-			// Read string descriptor referring to serial number.
-			res = libusb_get_string_descriptor_ascii(this_device, desc.iSerialNumber, string_desc, 256);
-			libusb_close(this_device);
-			if (res < 0) {
-				continue;
-			}
+		if (fnusb_is_camera(&desc)) {
+			char *serial = fnusb_read_serial(devs[i]);
+			if (!serial)
+				serial = strdup("");
 
 			// Add item to linked list.
 			struct freenect_device_attributes* new_dev_attrs = (struct freenect_device_attributes*)malloc(sizeof(struct freenect_device_attributes));
@@ -110,7 +319,7 @@ FN_INTERNAL int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_dev
 
 			*camera_prev_next = new_dev_attrs;
 			// Copy string with serial number
-			new_dev_attrs->camera_serial = strdup((char*)string_desc);
+			new_dev_attrs->camera_serial = serial;
 			camera_prev_next = &(new_dev_attrs->next);
 			// Increment number of cameras found
 			num_cams++;
@@ -124,20 +333,24 @@ FN_INTERNAL int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_dev
 FN_INTERNAL int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
 {
 	int res;
+	fn_lock_init(&ctx->cams_lock);
 	if (!usb_ctx) {
 		res = libusb_init(&ctx->ctx);
 		if (res >= 0) {
 			ctx->should_free_ctx = 1;
+			fnusb_start_hotplug(ctx);
 			return 0;
 		} else {
 			ctx->should_free_ctx = 0;
 			ctx->ctx = NULL;
+			fn_lock_destroy(&ctx->cams_lock);
 			return res;
 		}
 	} else {
     // explicit cast required: in WIN32, freenect_usb_context* maps to void*
     ctx->ctx = (libusb_context*)usb_ctx;
 		ctx->should_free_ctx = 0;
+		fnusb_start_hotplug(ctx);
 		return 0;
 	}
 }
@@ -145,21 +358,37 @@ FN_INTERNAL int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
 FN_INTERNAL int fnusb_shutdown(fnusb_ctx *ctx)
 {
 	//int res;
+	fnusb_stop_hotplug(ctx);
 	if (ctx->should_free_ctx) {
 		libusb_exit(ctx->ctx);
 		ctx->ctx = NULL;
 	}
+	fn_lock_destroy(&ctx->cams_lock);
 	return 0;
 }
 
+// Note that events are being handled, which keeps the hotplug cache current
+static void fnusb_events_handled(fnusb_ctx *ctx)
+{
+	if (!ctx->hotplug)
+		return;
+	fn_lock_acquire(&ctx->cams_lock);
+	ctx->events_us = fn_get_time_us();
+	fn_lock_release(&ctx->cams_lock);
+}
+
 FN_INTERNAL int fnusb_process_events(fnusb_ctx *ctx)
 {
-	return libusb_handle_events(ctx->ctx);
+	int res = libusb_handle_events(ctx->ctx);
+	fnusb_events_handled(ctx);
+	return res;
 }
 
 FN_INTERNAL int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* timeout)
 {
-	return libusb_handle_events_timeout(ctx->ctx, timeout);
+	int res = libusb_handle_events_timeout(ctx->ctx, timeout);
+	fnusb_events_handled(ctx);
+	return res;
 }
 
 // Returns 1 if `pid` identifies K4W audio, 0 otherwise
@@ -196,6 +425,30 @@ FN_INTERNAL int fnusb_open_subdevices(freenect_device *dev, int index)
 	int res;
 	struct libusb_device_descriptor desc;
 
+	// With the hotplug cache, index counts cameras in the cache's order, as
+	// fnusb_num_devices() and fnusb_list_device_attributes() do. Turn it
+	// into the camera's position in this list, which the searches below use.
+	if (ctx->usb.hotplug) {
+		// The device list holds its own reference, so the camera outlives
+		// its removal from the cache
+		fnusb_lock_cams(&ctx->usb);
+		libusb_device *target = index >= 0 && index < ctx->usb.num_cams ? ctx->usb.cams[index].dev : NULL;
+		fn_lock_release(&ctx->usb.cams_lock);
+		int position = 0;
+		for (i = 0; i < cnt; i++) {
+			if (devs[i] == target)
+				break;
+			if (libusb_get_device_descriptor(devs[i], &desc) >= 0 && fnusb_is_camera(&desc))
+				position++;
+		}
+		if (i == cnt) {
+			FN_ERROR("Could not find camera %d\n", index);
+			libusb_free_device_list(devs, 1);
+			return -1;
+		}
+		index = position;
+	}
+
 	for (i = 0; i < cnt; i++) {
 		int r = libusb_get_device_descriptor (devs[i], &desc);
 		if (r < 0)
@@ -537,6 +790,12 @@ static void iso_callback(struct libusb_transfer *xfer)
 				strm->cb(strm->parent->parent, buf, xfer->iso_packet_desc[i].actual_length);
 				buf += strm->len;
 			}
+			// park the transfer instead of resubmitting if the queue was shrunk
+			if (!strm->dead && strm->num_xfers - strm->num_idle > strm->target_xfers) {
+				strm->idle_xfers[strm->num_idle++] = xfer;
+				FN_SPEW("EP %02x transfer parked, %d in flight\n", xfer->endpoint, strm->num_xfers - strm->num_idle);
+				break;
+			}
 			int res;
 			res = libusb_submit_transfer(xfer);
 			if (res != 0) {
@@ -599,44 +858,114 @@ static void iso_callback(struct libusb_transfer *xfer)
 	}
 }
 
-FN_INTERNAL int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int pkts, int len)
+static uint8_t *fnusb_alloc_iso_buffer(fnusb_dev *dev, size_t len, fn_buffer_kind *kind)
+{
+	freenect_context *ctx = dev->parent->parent;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (ctx->buffer_flags & FREENECT_BUFFER_DEV_MEM) {
+		uint8_t *buf = libusb_dev_mem_alloc(dev->dev, len);
+		if (buf) {
+			*kind = FN_BUFFER_DEV_MEM;
+			return buf;
+		}
+		FN_INFO("Device memory not available, using host memory for transfers\n");
+	}
+#endif
+	return (uint8_t*)fn_buffer_alloc(ctx, len, kind);
+}
+
+FN_INTERNAL int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int active_xfers, int pkts, int len)
 {
 	freenect_context *ctx = dev->parent->parent;
 	int ret, i;
 
+	if (active_xfers < 1 || active_xfers > xfers)
+		active_xfers = xfers;
+
+	// The transfers and their buffer outlive the stream, so restarting it
+	// only has to allocate when it needs more than last time
+	if (!strm->xfers || xfers > strm->alloc_xfers || pkts > strm->alloc_pkts || len > strm->alloc_len) {
+		fnusb_free_iso(dev, strm);
+
+		strm->buffer = fnusb_alloc_iso_buffer(dev, (size_t)xfers * pkts * len, &strm->buffer_kind);
+		strm->xfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * xfers);
+		strm->idle_xfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * xfers);
+		if (!strm->buffer || !strm->xfers || !strm->idle_xfers) {
+			FN_ERROR("Failed to allocate isochronous transfer buffers\n");
+			fnusb_free_iso(dev, strm);
+			return -1;
+		}
+		for (i=0; i<xfers; i++) {
+			FN_SPEW("Creating EP %02x transfer #%d\n", ep, i);
+			strm->xfers[i] = libusb_alloc_transfer(pkts);
+		}
+		strm->alloc_xfers = xfers;
+		strm->alloc_pkts = pkts;
+		strm->alloc_len = len;
+	}
+
 	strm->parent = dev;
 	strm->cb = cb;
 	strm->num_xfers = xfers;
+	strm->num_idle = 0;
+	strm->target_xfers = active_xfers;
 	strm->pkts = pkts;
 	strm->len = len;
-	strm->buffer = (uint8_t*)malloc(xfers * pkts * len);
-	strm->xfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * xfers);
 	strm->dead = 0;
 	strm->dead_xfers = 0;
 
 	uint8_t *bufp = strm->buffer;
 
 	for (i=0; i<xfers; i++) {
-		FN_SPEW("Creating EP %02x transfer #%d\n", ep, i);
-		strm->xfers[i] = libusb_alloc_transfer(pkts);
-
 		libusb_fill_iso_transfer(strm->xfers[i], dev->dev, ep, bufp, pkts * len, pkts, iso_callback, strm, 0);
 
 		libusb_set_iso_packet_lengths(strm->xfers[i], len);
 
+		bufp += pkts*len;
+
+		if (i >= active_xfers) {
+			strm->idle_xfers[strm->num_idle++] = strm->xfers[i];
+			continue;
+		}
+
 		ret = libusb_submit_transfer(strm->xfers[i]);
 		if (ret < 0) {
 			FN_WARNING("Failed to submit isochronous transfer %d: %d\n", i, ret);
 			strm->dead_xfers++;
 		}
-
-		bufp += pkts*len;
 	}
 
 	return 0;
 
 }
 
+// Change the number of transfers kept in flight, within what was allocated
+// by fnusb_start_iso().  Extra transfers are parked as they complete.
+FN_INTERNAL int fnusb_set_iso_xfers(fnusb_isoc_stream *strm, int active_xfers)
+{
+	freenect_context *ctx = strm->parent->parent->parent;
+	int ret;
+
+	if (strm->dead)
+		return -1;
+	if (active_xfers < 1)
+		active_xfers = 1;
+	if (active_xfers > strm->num_xfers)
+		active_xfers = strm->num_xfers;
+
+	strm->target_xfers = active_xfers;
+
+	while (strm->num_idle > 0 && strm->num_xfers - strm->num_idle < strm->target_xfers) {
+		struct libusb_transfer *xfer = strm->idle_xfers[--strm->num_idle];
+		ret = libusb_submit_transfer(xfer);
+		if (ret < 0) {
+			FN_WARNING("Failed to submit parked isochronous transfer: %d\n", ret);
+			strm->dead_xfers++;
+		}
+	}
+	return active_xfers;
+}
+
 FN_INTERNAL int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 {
 	freenect_context *ctx = dev->parent->parent;
@@ -650,20 +979,41 @@ FN_INTERNAL int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 		libusb_cancel_transfer(strm->xfers[i]);
 	FN_FLOOD("fnusb_stop_iso() cancelled all transfers\n");
 
-	while (strm->dead_xfers < strm->num_xfers) {
-		FN_FLOOD("fnusb_stop_iso() dead = %d\tnum = %d\n", strm->dead_xfers, strm->num_xfers);
+	// parked transfers were never submitted, so they won't call back
+	while (strm->dead_xfers + strm->num_idle < strm->num_xfers) {
+		FN_FLOOD("fnusb_stop_iso() dead = %d\tidle = %d\tnum = %d\n", strm->dead_xfers, strm->num_idle, strm->num_xfers);
 		libusb_handle_events(ctx->usb.ctx);
 	}
 
-	for (i=0; i<strm->num_xfers; i++)
-		libusb_free_transfer(strm->xfers[i]);
-	FN_FLOOD("fnusb_stop_iso() freed all transfers\n");
+	FN_FLOOD("fnusb_stop_iso() done, transfers kept for restart\n");
+	return 0;
+}
 
-	free(strm->buffer);
+// Free the transfers and buffer kept by fnusb_stop_iso().  The stream must
+// be stopped, and the device still open if device memory was used.
+FN_INTERNAL int fnusb_free_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
+{
+	int i;
+	(void)dev; // only needed to free device memory
+
+	if (strm->xfers) {
+		for (i=0; i<strm->alloc_xfers; i++)
+			libusb_free_transfer(strm->xfers[i]);
+	}
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (strm->buffer_kind == FN_BUFFER_DEV_MEM)
+		libusb_dev_mem_free(dev->dev, strm->buffer, (size_t)strm->alloc_xfers * strm->alloc_pkts * strm->alloc_len);
+	else
+#endif
+	fn_buffer_free(strm->buffer, (size_t)strm->alloc_xfers * strm->alloc_pkts * strm->alloc_len, strm->buffer_kind);
 	free(strm->xfers);
+	free(strm->idle_xfers);
 
-	FN_FLOOD("fnusb_stop_iso() freed buffers and stream\n");
-	FN_FLOOD("fnusb_stop_iso() done\n");
+	strm->buffer = NULL;
+	strm->buffer_kind = FN_BUFFER_NONE;
+	strm->xfers = NULL;
+	strm->idle_xfers = NULL;
+	strm->alloc_xfers = strm->alloc_pkts = strm->alloc_len = 0;
 	return 0;
 }
 
@@ -672,6 +1022,86 @@ FN_INTERNAL int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRe
 	return libusb_control_transfer(dev->dev, bmRequestType, bRequest, wValue, wIndex, data, wLength, 0);
 }
 
+#if FNUSB_HAVE_CONTROL_ASYNC
+typedef struct {
+	fnusb_control_cb cb;
+	void *user_data;
+} fnusb_control_req;
+
+static void LIBUSB_CALL control_callback(struct libusb_transfer *xfer)
+{
+	fnusb_control_req req = *(fnusb_control_req*)xfer->user_data;
+	int status;
+
+	switch (xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			status = 0;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			status = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			status = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			status = LIBUSB_ERROR_PIPE;
+			break;
+		default:
+			status = LIBUSB_ERROR_IO;
+			break;
+	}
+
+	// free first, the callback is likely to submit the next request
+	uint8_t data[0x200];
+	int len = xfer->actual_length;
+	if (len > (int)sizeof(data))
+		len = sizeof(data);
+	memcpy(data, libusb_control_transfer_get_data(xfer), len);
+	free(xfer->user_data);
+	libusb_free_transfer(xfer);
+
+	req.cb(req.user_data, status, data, len);
+}
+
+// Like fnusb_control(), but returns straight away; cb is called from event handling
+FN_INTERNAL int fnusb_control_async(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, uint16_t wLength, fnusb_control_cb cb, void *user_data)
+{
+	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+	uint8_t *buf = (uint8_t*)malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	fnusb_control_req *req = (fnusb_control_req*)malloc(sizeof(fnusb_control_req));
+	int res;
+
+	if (!xfer || !buf || !req) {
+		libusb_free_transfer(xfer);
+		free(buf);
+		free(req);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	req->cb = cb;
+	req->user_data = user_data;
+	libusb_fill_control_setup(buf, bmRequestType, bRequest, wValue, wIndex, wLength);
+	if (data && !(bmRequestType & LIBUSB_ENDPOINT_IN))
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+	libusb_fill_control_transfer(xfer, dev->dev, buf, control_callback, req, 0);
+	xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	res = libusb_submit_transfer(xfer);
+	if (res < 0) {
+		libusb_free_transfer(xfer);
+		free(req);
+	}
+	return res;
+}
+#else
+FN_INTERNAL int fnusb_control_async(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, uint16_t wLength, fnusb_control_cb cb, void *user_data)
+{
+	(void)dev; (void)bmRequestType; (void)bRequest; (void)wValue; (void)wIndex;
+	(void)data; (void)wLength; (void)cb; (void)user_data;
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+#endif
+
 #ifdef BUILD_AUDIO
 FN_INTERNAL int fnusb_bulk(fnusb_dev *dev, uint8_t endpoint, uint8_t *data, int len, int *transferred) {
 	*transferred = 0;
@@ -60,9 +60,40 @@
 #define VIDEO_PKTBUF 1920
 #endif
 
+// Hotplug notification appeared in libusb 1.0.16; the Windows libusb-1.0
+// emulation layer and older releases don't have it.
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define FNUSB_HAVE_HOTPLUG 1
+#else
+#define FNUSB_HAVE_HOTPLUG 0
+#endif
+
+// The Windows libusb-1.0 emulation layer sits on libusb-0.1, which has no
+// asynchronous control transfers; fnusb_control_async() then always fails.
+#ifdef LIBUSBEMU
+#define FNUSB_HAVE_CONTROL_ASYNC 0
+#else
+#define FNUSB_HAVE_CONTROL_ASYNC 1
+#endif
+
+typedef struct {
+	libusb_device *dev; // referenced while it is in the cache
+	char *serial; // read on first use, NULL until then
+} fnusb_cached_cam;
+
 typedef struct {
 	libusb_context *ctx;
 	int should_free_ctx;
+	int hotplug; // 1 if the camera cache below is kept up to date by hotplug events
+#if FNUSB_HAVE_HOTPLUG
+	libusb_hotplug_callback_handle hotplug_handle;
+#endif
+	// Hotplug events are delivered by whichever thread handles events, so the
+	// cache and events_us are only touched with cams_lock held
+	fn_lock cams_lock;
+	fnusb_cached_cam *cams; // sorted by bus and address
+	int num_cams;
+	uint64_t events_us; // when events were last handled
 } fnusb_ctx;
 
 typedef struct {
@@ -74,9 +105,16 @@ typedef struct {
 typedef struct {
 	fnusb_dev *parent; //so we can go up from the libusb userdata
 	struct libusb_transfer **xfers;
+	struct libusb_transfer **idle_xfers; // allocated but parked, not submitted
 	uint8_t *buffer;
+	fn_buffer_kind buffer_kind;
+	int alloc_xfers; // transfers, packets and packet size the arena was
+	int alloc_pkts;  // allocated for; kept across stop/start until
+	int alloc_len;   // fnusb_free_iso()
 	fnusb_iso_cb cb;
 	int num_xfers;
+	int num_idle;
+	int target_xfers;
 	int pkts;
 	int len;
 	int dead;
@@ -94,10 +132,17 @@ int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* timeout);
 int fnusb_open_subdevices(freenect_device *dev, int index);
 int fnusb_close_subdevices(freenect_device *dev);
 
-int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int pkts, int len);
+int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int active_xfers, int pkts, int len);
 int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm);
+int fnusb_free_iso(fnusb_dev *dev, fnusb_isoc_stream *strm);
+int fnusb_set_iso_xfers(fnusb_isoc_stream *strm, int active_xfers);
 
 int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength);
+
+// status is 0 or a libusb error; data/len hold what was received for IN requests.
+// Returns LIBUSB_ERROR_NOT_SUPPORTED where FNUSB_HAVE_CONTROL_ASYNC is 0.
+typedef void (*fnusb_control_cb)(void *user_data, int status, uint8_t *data, int len);
+int fnusb_control_async(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, uint16_t wLength, fnusb_control_cb cb, void *user_data);
 #ifdef BUILD_AUDIO
 int fnusb_bulk(fnusb_dev *dev, uint8_t endpoint, uint8_t *data, int len, int *transferred);
 int fnusb_num_interfaces(fnusb_dev *dev);
@@ -49,16 +49,51 @@ int ofxFreenectContext::numDevices() {
 ofxFreenectDevice::ofxFreenectDevice() {
     bIsOpen = false;
     bWasDisconnected = false;
-    bIsFrameNewVideo = bIsFrameNewDepth = false;
-    bNeedsUpdateVideo = bNeedsUpdateDepth = false;
+    bIsFrameNewVideo = bIsFrameNewDepth = bIsFrameNewIr = false;
+    bNeedsUpdateVideo = bNeedsUpdateDepth = bNeedsUpdateIr = false;
+    multiplexRgbFrames = multiplexIrFrames = 0;
+    bMultiplexing = false;
+    memset(&multiplexStats, 0, sizeof(multiplexStats));
     depthTable = new ofxFreenectDepthTable();
     depthTable->generateExponential(3, 6, true);
+    recorder = NULL;
+    depthPublisher = videoPublisher = NULL;
+    server = NULL;
+    depthPipeline = NULL;
+    background = NULL;
+    depthPyramid = NULL;
+    normals = NULL;
+    voxelGrid = NULL;
+    memset(&depthIsoConfig, 0, sizeof(depthIsoConfig));
+    memset(&videoIsoConfig, 0, sizeof(videoIsoConfig));
+    memset(&depthIsoStats, 0, sizeof(depthIsoStats));
+    memset(&videoIsoStats, 0, sizeof(videoIsoStats));
+    memset(&zeroPlane, 0, sizeof(zeroPlane));
+    memset(&depthStats, 0, sizeof(depthStats));
+    memset(&videoFrameInfo, 0, sizeof(videoFrameInfo));
+    memset(&depthFrameInfo, 0, sizeof(depthFrameInfo));
+    bDepthStats = bDepthStatsOn = bHasDepthStats = bAutoEqualize = false;
+    bIsoConfigChanged = false;
+    bufferFlags = 0;
+    bCaptureThreadConfigChanged = false;
+    bLockMemory = false;
+    bUseTexture = true;
+    bVideoTextureDirty = bDepthTextureDirty = bIrTextureDirty = false;
+    bSwitchVideoMode = bSwitchDepthMode = false;
+    bVideoModeChanged = bDepthModeChanged = false;
+    videoSwitchTime = depthSwitchTime = -1;
+    videoStartTime = depthStartTime = -1;
+    tiltRate = tiltHistoryLength = 0;
+    bHasTiltSample = false;
 }
 
 //--------------------------------------------------------------
 ofxFreenectDevice::~ofxFreenectDevice() {
     delete depthTable;
     close();
+    stopRecording();
+    stopPublishing();
+    stopServing();
 }
 
 //--------------------------------------------------------------
@@ -86,19 +121,22 @@ void ofxFreenectDevice::close() {
 //--------------------------------------------------------------
 void ofxFreenectDevice::update() {
     
-    if (bIsOpen) {
-        if (!videoTexture.isAllocated()) {
-            videoTexture.allocate(vmode.width, vmode.height, GL_RGB);
-        }
-        
-        if (!depthTexture.isAllocated()) {
-            depthTexture.allocate(dmode.width, dmode.height, GL_LUMINANCE16);
-        }
+    // Textures of the old size are dropped here and allocated again when
+    // they are next asked for
+    if (bVideoModeChanged) {
+        if (videoTexture.isAllocated())
+            videoTexture.clear();
+        bVideoModeChanged = false;
+    }
+    if (bDepthModeChanged) {
+        if (depthTexture.isAllocated())
+            depthTexture.clear();
+        bDepthModeChanged = false;
     }
     
     if (bNeedsUpdateVideo) {
         if (this->lock()) {
-            videoTexture.loadData(videoPixels);
+            bVideoTextureDirty = bUseTexture;
             bNeedsUpdateVideo = false;
             bIsFrameNewVideo = true;
             this->unlock();
@@ -107,10 +145,25 @@ void ofxFreenectDevice::update() {
     else
         bIsFrameNewVideo = false;
     
+    if (bNeedsUpdateIr) {
+        if (this->lock()) {
+            bIrTextureDirty = bUseTexture;
+            bNeedsUpdateIr = false;
+            bIsFrameNewIr = true;
+            this->unlock();
+        }
+    }
+    else
+        bIsFrameNewIr = false;
+    
     if (bNeedsUpdateDepth) {
         if (this->lock()) {
+            // The mm modes read up to FREENECT_DEPTH_MM_MAX_VALUE, 10 bit up to 1023
+            depthTable->setFormat(dmode.depth_format);
+            if (bAutoEqualize && bHasDepthStats)
+                depthTable->generateEqualized(depthStats, true);
             depthTable->apply(depthPixels.getPixels(), depthPixels.getWidth()*depthPixels.getHeight());
-            depthTexture.loadData(depthPixels);
+            bDepthTextureDirty = bUseTexture;
             bNeedsUpdateDepth = false;
             bIsFrameNewDepth = true;
             this->unlock();
@@ -120,24 +173,116 @@ void ofxFreenectDevice::update() {
         bIsFrameNewDepth = false;
 }
 
+//--------------------------------------------------------------
+void ofxFreenectDevice::setUseTexture(bool use) {
+    bUseTexture = use;
+    if (!use) {
+        // Only textures that were made have a GL context to release them in
+        if (videoTexture.isAllocated())
+            videoTexture.clear();
+        if (depthTexture.isAllocated())
+            depthTexture.clear();
+        if (irTexture.isAllocated())
+            irTexture.clear();
+        bVideoTextureDirty = bDepthTextureDirty = bIrTextureDirty = false;
+    }
+    else {
+        bVideoTextureDirty = bDepthTextureDirty = bIrTextureDirty = true;
+    }
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::isUsingTexture() {
+    return bUseTexture;
+}
+
+//--------------------------------------------------------------
+// Make the texture fit pixels of a mode that may have changed since it was allocated
+static void allocateTexture(ofTexture & texture, int width, int height, int glType) {
+    if (texture.isAllocated() && texture.getWidth() == width && texture.getHeight() == height && texture.getTextureData().glTypeInternal == glType)
+        return;
+    texture.allocate(width, height, glType);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::uploadVideoTexture() {
+    
+    if (!bUseTexture || !bVideoTextureDirty || !bIsOpen)
+        return;
+    if (this->lock()) {
+        allocateTexture(videoTexture, videoPixels.getWidth(), videoPixels.getHeight(), videoPixels.getNumChannels() == 1 ? GL_LUMINANCE : GL_RGB);
+        videoTexture.loadData(videoPixels);
+        bVideoTextureDirty = false;
+        this->unlock();
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::uploadDepthTexture() {
+    
+    if (!bUseTexture || !bDepthTextureDirty || !bIsOpen)
+        return;
+    if (this->lock()) {
+        allocateTexture(depthTexture, depthPixels.getWidth(), depthPixels.getHeight(), GL_LUMINANCE16);
+        depthTexture.loadData(depthPixels);
+        bDepthTextureDirty = false;
+        this->unlock();
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::uploadIrTexture() {
+    
+    if (!bUseTexture || !bIrTextureDirty || !irPixels.isAllocated())
+        return;
+    if (this->lock()) {
+        allocateTexture(irTexture, irPixels.getWidth(), irPixels.getHeight(), GL_LUMINANCE);
+        irTexture.loadData(irPixels);
+        bIrTextureDirty = false;
+        this->unlock();
+    }
+}
+
 //--------------------------------------------------------------
 void ofxFreenectDevice::draw(float x, float y) {
-    videoTexture.draw(x, y);
+    uploadVideoTexture();
+    if (videoTexture.isAllocated())
+        videoTexture.draw(x, y);
 }
 
 //--------------------------------------------------------------
 void ofxFreenectDevice::draw(float x, float y, float w, float h) {
-    videoTexture.draw(x, y, w, h);
+    uploadVideoTexture();
+    if (videoTexture.isAllocated())
+        videoTexture.draw(x, y, w, h);
 }
 
 //--------------------------------------------------------------
 void ofxFreenectDevice::drawDepth(float x, float y) {
-    depthTexture.draw(x, y);
+    uploadDepthTexture();
+    if (depthTexture.isAllocated())
+        depthTexture.draw(x, y);
 }
 
 //--------------------------------------------------------------
 void ofxFreenectDevice::drawDepth(float x, float y, float w, float h) {
-    depthTexture.draw(x, y, w, h);
+    uploadDepthTexture();
+    if (depthTexture.isAllocated())
+        depthTexture.draw(x, y, w, h);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::drawIr(float x, float y) {
+    uploadIrTexture();
+    if (irTexture.isAllocated())
+        irTexture.draw(x, y);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::drawIr(float x, float y, float w, float h) {
+    uploadIrTexture();
+    if (irTexture.isAllocated())
+        irTexture.draw(x, y, w, h);
 }
 
 //--------------------------------------------------------------
@@ -149,11 +294,392 @@ void ofxFreenectDevice::applyCommand(int command) {
     pendingCommands.push_back(command);
 }
 
+//--------------------------------------------------------------
+bool ofxFreenectDevice::switchVideoMode(freenect_resolution res, freenect_video_format fmt) {
+    
+    freenect_frame_mode mode = freenect_find_video_mode(res, fmt);
+    if (!mode.is_valid) {
+        ofLogError("ofxFreenectDevice", "invalid video mode");
+        return false;
+    }
+    // Video pixels are 8 bit, one or three channels
+    if (mode.bytes != mode.width * mode.height && mode.bytes != mode.width * mode.height * 3) {
+        ofLogError("ofxFreenectDevice", "video mode is not 8 bit per channel");
+        return false;
+    }
+    lock();
+    pendingVideoMode = mode;
+    bSwitchVideoMode = true;
+    unlock();
+    return true;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::switchDepthMode(freenect_resolution res, freenect_depth_format fmt) {
+    
+    freenect_frame_mode mode = freenect_find_depth_mode(res, fmt);
+    if (!mode.is_valid) {
+        ofLogError("ofxFreenectDevice", "invalid depth mode");
+        return false;
+    }
+    // Depth pixels are unpacked 16 bit
+    if (mode.bytes != mode.width * mode.height * 2) {
+        ofLogError("ofxFreenectDevice", "depth mode is packed");
+        return false;
+    }
+    lock();
+    pendingDepthMode = mode;
+    bSwitchDepthMode = true;
+    unlock();
+    return true;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDevice::getVideoSwitchTime() {
+    return videoSwitchTime;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDevice::getDepthSwitchTime() {
+    return depthSwitchTime;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDevice::getVideoStartTime() {
+    return videoStartTime;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDevice::getDepthStartTime() {
+    return depthStartTime;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setBufferFlags(int flags) {
+    bufferFlags = flags;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setCaptureThreadConfig(const ofxFreenectThreadConfig & config) {
+    lock();
+    captureThreadConfig = config;
+    bCaptureThreadConfigChanged = true;
+    unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setLockMemory(bool enabled) {
+    bLockMemory = enabled;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setDepthIsoConfig(const freenect_iso_config & config) {
+    lock();
+    depthIsoConfig = config;
+    bIsoConfigChanged = true;
+    unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setVideoIsoConfig(const freenect_iso_config & config) {
+    lock();
+    videoIsoConfig = config;
+    bIsoConfigChanged = true;
+    unlock();
+}
+
+//--------------------------------------------------------------
+freenect_iso_stats ofxFreenectDevice::getDepthIsoStats() {
+    lock();
+    freenect_iso_stats stats = depthIsoStats;
+    unlock();
+    return stats;
+}
+
+//--------------------------------------------------------------
+freenect_iso_stats ofxFreenectDevice::getVideoIsoStats() {
+    lock();
+    freenect_iso_stats stats = videoIsoStats;
+    unlock();
+    return stats;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setDepthPipeline(ofxFreenectDepthPipeline *pipeline) {
+    processingMutex.lock();
+    lock();
+    depthPipeline = pipeline;
+    unlock();
+    processingMutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setBackground(ofxFreenectBackground *background) {
+    processingMutex.lock();
+    lock();
+    this->background = background;
+    unlock();
+    processingMutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setDepthPyramid(ofxFreenectDepthPyramid *pyramid) {
+    processingMutex.lock();
+    lock();
+    depthPyramid = pyramid;
+    unlock();
+    processingMutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setNormals(ofxFreenectNormals *normals) {
+    processingMutex.lock();
+    lock();
+    this->normals = normals;
+    unlock();
+    processingMutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setVoxelGrid(ofxFreenectVoxelGrid *voxelGrid) {
+    processingMutex.lock();
+    lock();
+    this->voxelGrid = voxelGrid;
+    unlock();
+    processingMutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setDepthStats(bool enabled) {
+    bDepthStats = enabled;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::getDepthStats(freenect_depth_stats & stats) {
+    lock();
+    bool hasStats = bHasDepthStats;
+    if (hasStats)
+        stats = depthStats;
+    unlock();
+    return hasStats;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setAutoEqualize(bool enabled) {
+    bAutoEqualize = enabled;
+    if (enabled)
+        bDepthStats = true;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setVideoMultiplex(int rgbFrames, int irFrames) {
+    multiplexRgbFrames = rgbFrames;
+    multiplexIrFrames = irFrames;
+}
+
+//--------------------------------------------------------------
+freenect_multiplex_stats ofxFreenectDevice::getVideoMultiplexStats() {
+    lock();
+    freenect_multiplex_stats stats = multiplexStats;
+    unlock();
+    return stats;
+}
+
+//--------------------------------------------------------------
+freenect_frame_info ofxFreenectDevice::getVideoFrameInfo() {
+    lock();
+    freenect_frame_info info = videoFrameInfo;
+    unlock();
+    return info;
+}
+
+//--------------------------------------------------------------
+freenect_frame_info ofxFreenectDevice::getDepthFrameInfo() {
+    lock();
+    freenect_frame_info info = depthFrameInfo;
+    unlock();
+    return info;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::setTiltSampler(int rateHz, int historyLength) {
+    tiltRate = rateHz;
+    tiltHistoryLength = historyLength;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::getTiltSample(freenect_tilt_sample & sample) {
+    lock();
+    bool hasSample = bHasTiltSample;
+    sample = tiltSample;
+    unlock();
+    return hasSample;
+}
+
+//--------------------------------------------------------------
+vector<freenect_tilt_sample> ofxFreenectDevice::getTiltHistory() {
+    lock();
+    vector<freenect_tilt_sample> history = tiltHistory;
+    unlock();
+    return history;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::startRecording(string filename) {
+    
+    stopRecording();
+    
+    freenect_recorder* rec;
+    if (freenect_record_open(&rec, ofToDataPath(filename).c_str()) < 0) {
+        ofLogError("ofxFreenectDevice", "failed to open recording " + filename);
+        return false;
+    }
+    
+    recorderMutex.lock();
+    recorder = rec;
+    recorderMutex.unlock();
+    return true;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::stopRecording() {
+    
+    recorderMutex.lock();
+    if (recorder != NULL) {
+        if (freenect_record_close(recorder) < 0)
+            ofLogError("ofxFreenectDevice", "failed to finish recording");
+        recorder = NULL;
+    }
+    recorderMutex.unlock();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::isRecording() {
+    recorderMutex.lock();
+    bool bRecording = recorder != NULL;
+    recorderMutex.unlock();
+    return bRecording;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::startPublishing(string name, int numSlots) {
+    
+    stopPublishing();
+    
+    // Slots fit the largest mode, so mode switches keep publishing
+    int depthBytes = 0, videoBytes = 0;
+    for (int i=0; i<freenect_get_depth_mode_count(); i++)
+        depthBytes = MAX(depthBytes, freenect_get_depth_mode(i).bytes);
+    for (int i=0; i<freenect_get_video_mode_count(); i++)
+        videoBytes = MAX(videoBytes, freenect_get_video_mode(i).bytes);
+    
+    ofxFreenectSharedPublisher* depthPub = new ofxFreenectSharedPublisher();
+    ofxFreenectSharedPublisher* videoPub = new ofxFreenectSharedPublisher();
+    if (!depthPub->setup(name + "-depth", depthBytes, numSlots) || !videoPub->setup(name + "-video", videoBytes, numSlots)) {
+        ofLogError("ofxFreenectDevice", "failed to start publishing " + name);
+        delete depthPub;
+        delete videoPub;
+        return false;
+    }
+    
+    publisherMutex.lock();
+    depthPublisher = depthPub;
+    videoPublisher = videoPub;
+    publisherMutex.unlock();
+    return true;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::stopPublishing() {
+    
+    publisherMutex.lock();
+    delete depthPublisher;
+    delete videoPublisher;
+    depthPublisher = videoPublisher = NULL;
+    publisherMutex.unlock();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::isPublishing() {
+    return depthPublisher != NULL;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::startServing(string path, int numThreads, int queueLength) {
+    
+    stopServing();
+    
+    ofxFreenectFrameServer* frameServer = new ofxFreenectFrameServer();
+    if (!frameServer->setup(path, numThreads, queueLength)) {
+        ofLogError("ofxFreenectDevice", "failed to start serving " + path);
+        delete frameServer;
+        return false;
+    }
+    
+    serverMutex.lock();
+    server = frameServer;
+    serverMutex.unlock();
+    return true;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::stopServing() {
+    
+    serverMutex.lock();
+    delete server;
+    server = NULL;
+    serverMutex.unlock();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDevice::isServing() {
+    return server != NULL;
+}
+
 //--------------------------------------------------------------
 void ofxFreenectDevice::rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp) {
     
     ofxFreenectDevice* fdevice = (ofxFreenectDevice*)freenect_get_user(dev);
-    if (fdevice != NULL && fdevice->lock()) {
+    if (fdevice == NULL)
+        return;
+    // Multiplexed frames come in whichever mode the turn is in
+    freenect_frame_mode mode = fdevice->bMultiplexing ? freenect_get_current_video_mode(dev) : fdevice->vmode;
+    // stopRecording() deletes the recorder under the mutex, so only test it there
+    fdevice->recorderMutex.lock();
+    if (fdevice->recorder != NULL)
+        freenect_record_video(fdevice->recorder, mode, rgb, timestamp);
+    fdevice->recorderMutex.unlock();
+    if (fdevice->videoPublisher != NULL) {
+        freenect_frame_info info;
+        freenect_get_video_frame_info(dev, &info);
+        fdevice->publisherMutex.lock();
+        if (fdevice->videoPublisher != NULL)
+            fdevice->videoPublisher->publish(rgb, mode, info);
+        fdevice->publisherMutex.unlock();
+    }
+    if (fdevice->server != NULL) {
+        freenect_frame_info info;
+        freenect_get_video_frame_info(dev, &info);
+        fdevice->serverMutex.lock();
+        if (fdevice->server != NULL)
+            fdevice->server->publish(FREENECT_STREAM_VIDEO, rgb, mode, info);
+        fdevice->serverMutex.unlock();
+    }
+    if (fdevice->bMultiplexing && mode.video_format == FREENECT_VIDEO_IR_8BIT) {
+        if (fdevice->lock()) {
+            // The first IR frame arrives in libfreenect's own buffer
+            if (rgb != fdevice->irPixelsBack.getPixels())
+                memcpy(fdevice->irPixelsBack.getPixels(), rgb, mode.bytes);
+            swap(fdevice->irPixels, fdevice->irPixelsBack);
+            fdevice->bIsFrameNewIr = false;
+            freenect_set_video_buffer(dev, fdevice->irPixelsBack.getPixels());
+            fdevice->bNeedsUpdateIr = true;
+            fdevice->unlock();
+        }
+        return;
+    }
+    if (fdevice->lock()) {
+        freenect_get_video_frame_info(dev, &fdevice->videoFrameInfo);
         swap(fdevice->videoPixels, fdevice->videoPixelsBack);
         fdevice->bIsFrameNewVideo = false;
         freenect_set_video_buffer(dev, fdevice->videoPixelsBack.getPixels());
@@ -165,7 +691,83 @@ void ofxFreenectDevice::rgb_cb(freenect_device *dev, void *rgb, uint32_t timesta
 void ofxFreenectDevice::depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp) {
     
     ofxFreenectDevice* fdevice = (ofxFreenectDevice*)freenect_get_user(dev);
+    if (fdevice != NULL) {
+        fdevice->recorderMutex.lock();
+        if (fdevice->recorder != NULL)
+            freenect_record_depth(fdevice->recorder, fdevice->dmode, v_depth, timestamp);
+        fdevice->recorderMutex.unlock();
+    }
+    if (fdevice != NULL && fdevice->depthPublisher != NULL) {
+        freenect_frame_info info;
+        freenect_get_depth_frame_info(dev, &info);
+        fdevice->publisherMutex.lock();
+        if (fdevice->depthPublisher != NULL)
+            fdevice->depthPublisher->publish(v_depth, fdevice->dmode, info);
+        fdevice->publisherMutex.unlock();
+    }
+    if (fdevice != NULL && fdevice->server != NULL) {
+        freenect_frame_info info;
+        freenect_get_depth_frame_info(dev, &info);
+        fdevice->serverMutex.lock();
+        if (fdevice->server != NULL)
+            fdevice->server->publish(FREENECT_STREAM_DEPTH, v_depth, fdevice->dmode, info);
+        fdevice->serverMutex.unlock();
+    }
+    // The back buffer is ours until the swap, so filter it before taking the lock
+    if (fdevice != NULL) {
+        fdevice->processingMutex.lock();
+        fdevice->lock();
+        ofxFreenectDepthPipeline *pipeline = fdevice->depthPipeline;
+        ofxFreenectBackground *background = fdevice->background;
+        ofxFreenectDepthPyramid *pyramid = fdevice->depthPyramid;
+        ofxFreenectNormals *normals = fdevice->normals;
+        ofxFreenectVoxelGrid *voxelGrid = fdevice->voxelGrid;
+        freenect_zero_plane_info zeroPlane = fdevice->zeroPlane;
+        fdevice->unlock();
+        
+        freenect_frame_mode mode = fdevice->dmode;
+        int noValue = -1;
+        switch (mode.depth_format) {
+            case FREENECT_DEPTH_11BIT:
+                noValue = FREENECT_DEPTH_RAW_NO_VALUE;
+                break;
+            case FREENECT_DEPTH_10BIT:
+                noValue = FREENECT_DEPTH_10BIT_NO_VALUE;
+                break;
+            case FREENECT_DEPTH_MM:
+            case FREENECT_DEPTH_REGISTERED:
+                noValue = FREENECT_DEPTH_MM_NO_VALUE;
+                break;
+            default:
+                break;
+        }
+        if (noValue >= 0 && pipeline != NULL) {
+            pipeline->setNoValue(noValue);
+            pipeline->process((uint16_t*)v_depth, mode.width, mode.height);
+        }
+        if (noValue >= 0 && background != NULL) {
+            background->setNoValue(noValue);
+            background->update((uint16_t*)v_depth, mode.width, mode.height);
+        }
+        if (noValue >= 0 && pyramid != NULL) {
+            pyramid->setNoValue(noValue);
+            pyramid->update((uint16_t*)v_depth, mode.width, mode.height);
+        }
+        if (noValue == FREENECT_DEPTH_MM_NO_VALUE && normals != NULL) {
+            normals->setZeroPlane(zeroPlane);
+            normals->update((uint16_t*)v_depth, mode.width, mode.height);
+        }
+        if (noValue == FREENECT_DEPTH_MM_NO_VALUE && voxelGrid != NULL) {
+            voxelGrid->setZeroPlane(zeroPlane);
+            voxelGrid->update((uint16_t*)v_depth, mode.width, mode.height);
+        }
+        fdevice->processingMutex.unlock();
+    }
     if (fdevice != NULL && fdevice->lock()) {
+        // Gathered by the unpacker for this very frame
+        if (fdevice->bDepthStatsOn)
+            fdevice->bHasDepthStats = freenect_get_depth_stats(dev, &fdevice->depthStats) == 0;
+        freenect_get_depth_frame_info(dev, &fdevice->depthFrameInfo);
         swap(fdevice->depthPixels, fdevice->depthPixelsBack);
         fdevice->bIsFrameNewDepth = false;
         freenect_set_depth_buffer(dev, fdevice->depthPixelsBack.getPixels());
@@ -174,6 +776,12 @@ void ofxFreenectDevice::depth_cb(freenect_device *dev, void *v_depth, uint32_t t
     }
 }
 
+//--------------------------------------------------------------
+void ofxFreenectDevice::flag_cb(freenect_device *dev, freenect_cmd_batch *batch, int status, void *user) {
+    if (status < 0)
+        ofLogError("ofxFreenectDevice", "failed to set flag");
+}
+
 //--------------------------------------------------------------
 void ofxFreenectDevice::threadedFunction() {
     
@@ -183,8 +791,11 @@ void ofxFreenectDevice::threadedFunction() {
     }
     
     //freenect_set_log_level(f_ctx, FREENECT_LOG_SPEW);
+    freenect_set_buffer_flags(f_ctx, bufferFlags | (bLockMemory ? FREENECT_BUFFER_LOCKED : 0));
     
     while (isThreadRunning()) {
+        
+        applyThreadConfig();
 
         if (freenect_num_devices(f_ctx) > 0) {
             
@@ -198,6 +809,10 @@ void ofxFreenectDevice::threadedFunction() {
                 freenect_set_led(f_dev, LED_GREEN);
                 freenect_set_user(f_dev, this);
                 
+                freenect_registration registration = freenect_copy_registration(f_dev);
+                zeroPlane = registration.zero_plane_info;
+                freenect_destroy_registration(&registration);
+                
                 vmode = freenect_get_current_video_mode(f_dev);
                 videoPixels.allocate(vmode.width, vmode.height, 3);
                 videoPixels.set(0);
@@ -209,12 +824,25 @@ void ofxFreenectDevice::threadedFunction() {
                 depthPixels.set(0);
                 depthPixelsBack.allocate(dmode.width, dmode.height, 1);
                 freenect_set_depth_buffer(f_dev, depthPixelsBack.getPixels());
+                lockPixels();
                 
                 freenect_set_video_callback(f_dev, rgb_cb);
                 freenect_set_depth_callback(f_dev, depth_cb);
                 
-                if (freenect_start_video(f_dev) < 0)
-                    ofLogError("ofxFreenectDevice", "failed to start video");
+                lock();
+                bIsoConfigChanged = true;
+                bDepthStatsOn = bHasDepthStats = false;
+                // Blank textures until the first frames arrive
+                bVideoTextureDirty = bDepthTextureDirty = bUseTexture;
+                unlock();
+                applyIsoConfig();
+                applyDepthStats();
+                
+                if (tiltRate > 0 && freenect_start_tilt_sampler(f_dev, tiltRate, tiltHistoryLength) < 0)
+                    ofLogError("ofxFreenectDevice", "failed to start tilt sampler");
+                vector<freenect_tilt_sample> history(tiltHistoryLength);
+                
+                startVideo();
                 
                 if (freenect_start_depth(f_dev) < 0)
                     ofLogError("ofxFreenectDevice", "failed to start depth");
@@ -225,23 +853,33 @@ void ofxFreenectDevice::threadedFunction() {
 
                 while (isThreadRunning() && freenect_process_events_timeout(f_ctx, &timeout) >= 0) {
                     
+                    // Flags are sent without waiting for the camera, so frames
+                    // keep flowing while they are applied
                     map<freenect_flag,freenect_flag_value>::iterator it = pendingFlags.begin();
                     for (; it != pendingFlags.end(); ++it) {
-                        if (freenect_set_flag(f_dev, it->first, it->second) < 0) {
+                        if (freenect_set_flag_async(f_dev, it->first, it->second, flag_cb, NULL) < 0) {
                             ofLogError("ofxFreenectDevice", "failed to set flag");
                         }
                     }
                     pendingFlags.clear();
                     
+                    applyIsoConfig();
+                    applyDepthStats();
+                    applyModeSwitch();
+                    applyThreadConfig();
+                    
                     vector<int>::iterator is = pendingCommands.begin();
                     for (; is != pendingCommands.end(); ++is) {
                         switch (is[0]) {
                             case OFX_FREENECT_CMD_START_VIDEO:
-                                freenect_start_video(f_dev);break;
+                                startVideo();break;
                             case OFX_FREENECT_CMD_START_DEPTH:
                                 freenect_stop_depth(f_dev);break;
                             case OFX_FREENECT_CMD_STOP_VIDEO:
-                                freenect_stop_video(f_dev);break;
+                                // Multiplexing stops with the stream
+                                freenect_stop_video(f_dev);
+                                bMultiplexing = false;
+                                break;
                             case OFX_FREENECT_CMD_STOP_DEPTH:
                                 freenect_stop_depth(f_dev);break;
                             case OFX_FREENECT_CMD_WAIT:
@@ -253,6 +891,38 @@ void ofxFreenectDevice::threadedFunction() {
                         }
                     }
                     pendingCommands.clear();
+                    
+                    freenect_iso_stats dstats, vstats;
+                    memset(&dstats, 0, sizeof(dstats));
+                    memset(&vstats, 0, sizeof(vstats));
+                    freenect_get_depth_iso_stats(f_dev, &dstats);
+                    freenect_get_video_iso_stats(f_dev, &vstats);
+                    freenect_multiplex_stats mstats;
+                    memset(&mstats, 0, sizeof(mstats));
+                    if (bMultiplexing)
+                        freenect_get_video_multiplex_stats(f_dev, &mstats);
+                    lock();
+                    depthIsoStats = dstats;
+                    videoIsoStats = vstats;
+                    multiplexStats = mstats;
+                    unlock();
+                    
+                    if (tiltRate > 0) {
+                        freenect_tilt_sample sample;
+                        bool hasSample = freenect_get_tilt_sample(f_dev, &sample) == 0;
+                        int count = history.empty() ? 0 : freenect_get_tilt_history(f_dev, &history[0], history.size());
+                        lock();
+                        bHasTiltSample = hasSample;
+                        if (hasSample)
+                            tiltSample = sample;
+                        tiltHistory.assign(history.begin(), history.begin() + max(count, 0));
+                        unlock();
+                    }
+                    
+                    videoSwitchTime = freenect_get_video_switch_time(f_dev);
+                    depthSwitchTime = freenect_get_depth_switch_time(f_dev);
+                    videoStartTime = freenect_get_video_start_time(f_dev, NULL);
+                    depthStartTime = freenect_get_depth_start_time(f_dev, NULL);
                 }
             reopen:
                 bIsOpen = false;
@@ -267,11 +937,162 @@ void ofxFreenectDevice::threadedFunction() {
         }
         else {
             //ofLogNotice("ofxFreenectDevice", "no devices found");
-            ofSleepMillis(500);
+            // Hotplug events are dispatched from here, so a camera being
+            // plugged in wakes us up straight away instead of after a poll
+            struct timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 500000;
+            freenect_process_events_timeout(f_ctx, &timeout);
         }
     }
 }
 
+//--------------------------------------------------------------
+void ofxFreenectDevice::startVideo() {
+    
+    bMultiplexing = false;
+    if (multiplexRgbFrames > 0 && multiplexIrFrames > 0) {
+        freenect_frame_mode modes[2];
+        modes[0] = vmode;
+        modes[1] = freenect_find_video_mode(vmode.resolution, FREENECT_VIDEO_IR_8BIT);
+        int frames[2] = { multiplexRgbFrames, multiplexIrFrames };
+        irPixels.allocate(modes[1].width, modes[1].height, 1);
+        irPixels.set(0);
+        irPixelsBack.allocate(modes[1].width, modes[1].height, 1);
+        lockPixels();
+        if (freenect_start_video_multiplex(f_dev, modes, frames, 2) < 0)
+            ofLogError("ofxFreenectDevice", "failed to start multiplexed video");
+        else
+            bMultiplexing = true;
+    }
+    else if (freenect_start_video(f_dev) < 0)
+        ofLogError("ofxFreenectDevice", "failed to start video");
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::applyIsoConfig() {
+    
+    lock();
+    bool changed = bIsoConfigChanged;
+    freenect_iso_config dconfig = depthIsoConfig;
+    freenect_iso_config vconfig = videoIsoConfig;
+    bIsoConfigChanged = false;
+    unlock();
+    
+    if (!changed)
+        return;
+    
+    if (freenect_set_depth_iso_config(f_dev, &dconfig) < 0)
+        ofLogError("ofxFreenectDevice", "invalid depth iso config");
+    if (freenect_set_video_iso_config(f_dev, &vconfig) < 0)
+        ofLogError("ofxFreenectDevice", "invalid video iso config");
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::applyDepthStats() {
+    
+    if (bDepthStats == bDepthStatsOn)
+        return;
+    
+    // The depth callback runs on this thread, so it never sees them half switched
+    if (bDepthStats) {
+        if (freenect_enable_depth_stats(f_dev) < 0) {
+            ofLogError("ofxFreenectDevice", "failed to enable depth stats");
+            bDepthStats = false;
+            return;
+        }
+    }
+    else
+        freenect_disable_depth_stats(f_dev);
+    
+    lock();
+    bDepthStatsOn = bDepthStats;
+    bHasDepthStats = false;
+    unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::applyModeSwitch() {
+    
+    lock();
+    bool switchVideo = bSwitchVideoMode;
+    bool switchDepth = bSwitchDepthMode;
+    bSwitchVideoMode = bSwitchDepthMode = false;
+    if (switchVideo) {
+        // No frames are delivered between setting the buffer and the switch
+        vmode = pendingVideoMode;
+        int channels = vmode.bytes / (vmode.width * vmode.height);
+        videoPixels.allocate(vmode.width, vmode.height, channels);
+        videoPixels.set(0);
+        videoPixelsBack.allocate(vmode.width, vmode.height, channels);
+        freenect_set_video_buffer(f_dev, videoPixelsBack.getPixels());
+        bNeedsUpdateVideo = false;
+        bVideoModeChanged = true;
+    }
+    if (switchDepth) {
+        dmode = pendingDepthMode;
+        depthPixels.allocate(dmode.width, dmode.height, 1);
+        depthPixels.set(0);
+        depthPixelsBack.allocate(dmode.width, dmode.height, 1);
+        freenect_set_depth_buffer(f_dev, depthPixelsBack.getPixels());
+        bNeedsUpdateDepth = false;
+        bDepthModeChanged = true;
+    }
+    unlock();
+    
+    // On failure the device stays in its old mode, so size the pixels back
+    if (switchVideo && freenect_switch_video_mode(f_dev, vmode) < 0) {
+        ofLogError("ofxFreenectDevice", "failed to switch video mode");
+        lock();
+        vmode = freenect_get_current_video_mode(f_dev);
+        videoPixels.allocate(vmode.width, vmode.height, vmode.bytes / (vmode.width * vmode.height));
+        videoPixelsBack.allocate(vmode.width, vmode.height, vmode.bytes / (vmode.width * vmode.height));
+        freenect_set_video_buffer(f_dev, videoPixelsBack.getPixels());
+        unlock();
+    }
+    if (switchDepth && freenect_switch_depth_mode(f_dev, dmode) < 0) {
+        ofLogError("ofxFreenectDevice", "failed to switch depth mode");
+        lock();
+        dmode = freenect_get_current_depth_mode(f_dev);
+        depthPixels.allocate(dmode.width, dmode.height, 1);
+        depthPixelsBack.allocate(dmode.width, dmode.height, 1);
+        freenect_set_depth_buffer(f_dev, depthPixelsBack.getPixels());
+        unlock();
+    }
+    if (switchVideo || switchDepth)
+        lockPixels();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::applyThreadConfig() {
+    
+    lock();
+    bool changed = bCaptureThreadConfigChanged;
+    ofxFreenectThreadConfig config = captureThreadConfig;
+    bCaptureThreadConfigChanged = false;
+    unlock();
+    
+    if (changed && !config.apply())
+        ofLogWarning("ofxFreenectDevice", "capture thread runs with part of its config");
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDevice::lockPixels() {
+    
+    // Reallocated pixels keep no lock, so start over with the current ones
+    lockedPixels.unlockAll();
+    if (!bLockMemory)
+        return;
+    lockedPixels.lock(videoPixels.getPixels(), videoPixels.getWidth() * videoPixels.getHeight() * videoPixels.getNumChannels());
+    lockedPixels.lock(videoPixelsBack.getPixels(), videoPixelsBack.getWidth() * videoPixelsBack.getHeight() * videoPixelsBack.getNumChannels());
+    lockedPixels.lock(depthPixels.getPixels(), depthPixels.getWidth() * depthPixels.getHeight() * sizeof(uint16_t));
+    lockedPixels.lock(depthPixelsBack.getPixels(), depthPixelsBack.getWidth() * depthPixelsBack.getHeight() * sizeof(uint16_t));
+    if (irPixelsBack.isAllocated()) {
+        lockedPixels.lock(irPixels.getPixels(), irPixels.getWidth() * irPixels.getHeight());
+        lockedPixels.lock(irPixelsBack.getPixels(), irPixelsBack.getWidth() * irPixelsBack.getHeight());
+    }
+}
+
 //--------------------------------------------------------------
 int ofxFreenectDevice::getWidth() {
     return vmode.width;
@@ -293,14 +1114,27 @@ ofShortPixels & ofxFreenectDevice::getDepthPixels() {
 
 //--------------------------------------------------------------
 ofTexture & ofxFreenectDevice::getTextureReference() {
+    uploadVideoTexture();
     return videoTexture;
 }
 
 //--------------------------------------------------------------
 ofTexture & ofxFreenectDevice::getTextureReferenceDepth() {
+    uploadDepthTexture();
     return depthTexture;
 }
 
+//--------------------------------------------------------------
+ofPixels & ofxFreenectDevice::getIrPixels() {
+    return irPixels;
+}
+
+//--------------------------------------------------------------
+ofTexture & ofxFreenectDevice::getTextureReferenceIr() {
+    uploadIrTexture();
+    return irTexture;
+}
+
 //--------------------------------------------------------------
 bool ofxFreenectDevice::isOpen() {
     return bIsOpen;
@@ -321,40 +1155,118 @@ bool ofxFreenectDevice::isFrameNewDepth() {
     return bIsFrameNewDepth;
 }
 
+//--------------------------------------------------------------
+bool ofxFreenectDevice::isFrameNewIr() {
+    return bIsFrameNewIr;
+}
+
 //--------------------------------------------------------------
 freenect_device *ofxFreenectDevice::getDevice() {
     return f_dev;
 }
 
+// Generators a depth table remembers, to make it again for a new range
+#define OFX_FREENECT_TABLE_LINEAR       0
+#define OFX_FREENECT_TABLE_EXPONENTIAL  1
+#define OFX_FREENECT_TABLE_EQUALIZED    2
+
+//--------------------------------------------------------------
+ofxFreenectDepthTable::ofxFreenectDepthTable() {
+    format = FREENECT_DEPTH_11BIT;
+    table.resize(FREENECT_DEPTH_RAW_MAX_VALUE);
+    noValue = FREENECT_DEPTH_RAW_NO_VALUE;
+    kind = OFX_FREENECT_TABLE_LINEAR;
+    power = 3;
+    multiply = 6;
+    bInverse = false;
+    generate();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTable::setFormat(freenect_depth_format format) {
+    if (format == this->format)
+        return;
+    this->format = format;
+    switch (format) {
+        case FREENECT_DEPTH_MM:
+        case FREENECT_DEPTH_REGISTERED:
+            table.resize(FREENECT_DEPTH_MM_MAX_VALUE + 1);
+            noValue = FREENECT_DEPTH_MM_NO_VALUE;
+            break;
+        case FREENECT_DEPTH_10BIT:
+            table.resize(FREENECT_DEPTH_10BIT_NO_VALUE + 1);
+            noValue = FREENECT_DEPTH_10BIT_NO_VALUE;
+            break;
+        default:
+            table.resize(FREENECT_DEPTH_RAW_MAX_VALUE);
+            noValue = FREENECT_DEPTH_RAW_NO_VALUE;
+            break;
+    }
+    // Statistics of the old format don't fit the new range, so an equalized
+    // table is linear until it is generated from new ones
+    if (kind == OFX_FREENECT_TABLE_EQUALIZED)
+        kind = OFX_FREENECT_TABLE_LINEAR;
+    generate();
+}
+
 //--------------------------------------------------------------
 void ofxFreenectDepthTable::apply(uint16_t *pixels, int count) {
+    // Readings beyond the format's range have no depth either
+    const uint16_t *t = &table[0];
+    const int size = table.size();
     for (int i=0; i<count; i++) {
-        pixels[i] = table[pixels[i]];
+        uint16_t v = pixels[i];
+        pixels[i] = v < size ? t[v] : 0;
     }
 }
 
 //--------------------------------------------------------------
 void ofxFreenectDepthTable::generateLinear() {
-    for (int i=0; i<2048; i++) {
-        table[i] = i * 0xffff / 2047;
-    }
-    table[2047] = 0;
+    kind = OFX_FREENECT_TABLE_LINEAR;
+    generate();
 }
 
 //--------------------------------------------------------------
 void ofxFreenectDepthTable::generateExponential(float power, float multiply, bool inverse) {
-    if (inverse) {
-        for (int i=0; i<2048; i++) {
-            float v = i / 2047.;
-            table[i] = 0xffff - powf(v, power) * multiply * 0xffff;
+    kind = OFX_FREENECT_TABLE_EXPONENTIAL;
+    this->power = power;
+    this->multiply = multiply;
+    bInverse = inverse;
+    generate();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTable::generate() {
+    const int last = table.size() - 1;
+    if (kind == OFX_FREENECT_TABLE_EXPONENTIAL) {
+        for (int i=0; i<=last; i++) {
+            float v = powf((float)i / last, power) * multiply * 0xffff;
+            table[i] = bInverse ? 0xffff - v : v;
         }
-        table[2047] = 0;
     }
     else {
-        for (int i=0; i<2048; i++) {
-            float v = i / 2047.;
-            table[i] = powf(v, power) * multiply * 0xffff;
+        for (int i=0; i<=last; i++)
+            table[i] = (uint32_t)i * 0xffff / last;
+    }
+    table[noValue] = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTable::generateEqualized(const freenect_depth_stats & stats, bool inverse) {
+    if (stats.valid == 0)
+        return;
+    kind = OFX_FREENECT_TABLE_EQUALIZED;
+    // Each value maps to the share of readings at or below its bin
+    int shift = stats.bin_shift;
+    uint64_t below = 0;
+    int bin = -1;
+    uint16_t value = 0;
+    for (int i=0; i<(int)table.size(); i++) {
+        while (bin < (i >> shift) && bin + 1 < FREENECT_DEPTH_STATS_BINS) {
+            below += stats.histogram[++bin];
+            value = below * 0xffff / stats.valid;
         }
-        table[2047] = 0;
+        table[i] = inverse ? 0xffff - value : value;
     }
+    table[noValue] = 0;
 }
@@ -9,6 +9,15 @@
 
 #include "ofMain.h"
 #include "libfreenect.h"
+#include "libfreenect_record.h"
+#include "ofxFreenectDepthPipeline.h"
+#include "ofxFreenectBackground.h"
+#include "ofxFreenectDepthPyramid.h"
+#include "ofxFreenectNormals.h"
+#include "ofxFreenectVoxelGrid.h"
+#include "ofxFreenectSharedMemory.h"
+#include "ofxFreenectFrameServer.h"
+#include "ofxFreenectRealtime.h"
 
 #if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
 #else
@@ -53,6 +62,12 @@ public:
     void close();
     void update();
     
+    // Without textures the device never touches GL, so it runs headless.
+    // With them, frames are uploaded only when a texture is drawn or asked
+    // for, at most once per new frame.
+    void setUseTexture(bool use);
+    bool isUsingTexture();
+    
     void draw(float x, float y);
     void draw(float x, float y, float w, float h);
     void drawDepth(float x, float y);
@@ -61,6 +76,89 @@ public:
     void applyFlag(freenect_flag flag, freenect_flag_value value);
     void applyCommand(int command);
     
+    // Mode switching without restarting the streams
+    bool switchVideoMode(freenect_resolution res, freenect_video_format fmt);
+    bool switchDepthMode(freenect_resolution res, freenect_depth_format fmt);
+    int getVideoSwitchTime();
+    int getDepthSwitchTime();
+    // Microseconds from starting a stream to its first frame, -1 until it arrived
+    int getVideoStartTime();
+    int getDepthStartTime();
+    
+    // Stream buffer memory, see freenect_buffer_flags; takes effect on open
+    void setBufferFlags(int flags);
+    
+    // Affinity and real-time priority of the capture thread, which runs the
+    // USB event loop and the frame callbacks. Packet loss shows up in the
+    // iso stats' lost_pkts and the frame info's total_dropped.
+    void setCaptureThreadConfig(const ofxFreenectThreadConfig & config);
+    
+    // Lock libfreenect's stream buffers and the pixels into RAM; takes effect on open
+    void setLockMemory(bool enabled);
+    
+    // Isochronous transfer queue
+    void setDepthIsoConfig(const freenect_iso_config & config);
+    void setVideoIsoConfig(const freenect_iso_config & config);
+    freenect_iso_stats getDepthIsoStats();
+    freenect_iso_stats getVideoIsoStats();
+    
+    // Depth post-processing, run on the capture thread as frames arrive.
+    // The pipeline is not owned by the device. This and the setters below
+    // wait for a frame being processed, so the old object may be deleted
+    // once they return.
+    void setDepthPipeline(ofxFreenectDepthPipeline *pipeline);
+    
+    // Foreground extraction, fed with each depth frame after the pipeline.
+    // Read the mask from the background model; it is not owned by the device.
+    void setBackground(ofxFreenectBackground *background);
+    
+    // Coarse depth levels, rebuilt from each depth frame after the pipeline
+    void setDepthPyramid(ofxFreenectDepthPyramid *pyramid);
+    
+    // Surface normals, estimated from each depth frame in the mm modes
+    void setNormals(ofxFreenectNormals *normals);
+    
+    // Occupancy of the scene, integrated from each depth frame in the mm modes
+    void setVoxelGrid(ofxFreenectVoxelGrid *voxelGrid);
+    
+    // Depth histogram, range and mean, gathered by libfreenect while it
+    // unpacks each frame. Auto equalize also turns them on and rebuilds the
+    // depth table from them for every frame.
+    void setDepthStats(bool enabled);
+    bool getDepthStats(freenect_depth_stats & stats);
+    void setAutoEqualize(bool enabled);
+    
+    // Take turns between RGB and 8 bit IR on the video stream, rgbFrames
+    // then irFrames at a time; 0 streams RGB only. Takes effect on open.
+    void setVideoMultiplex(int rgbFrames, int irFrames);
+    freenect_multiplex_stats getVideoMultiplexStats();
+    
+    // Capture timing of the frames in getPixels() and getDepthPixels()
+    freenect_frame_info getVideoFrameInfo();
+    freenect_frame_info getDepthFrameInfo();
+    
+    // Accelerometer, sampled in the background; takes effect on open
+    void setTiltSampler(int rateHz, int historyLength = 0);
+    bool getTiltSample(freenect_tilt_sample & sample);
+    vector<freenect_tilt_sample> getTiltHistory();
+    
+    // Recording
+    bool startRecording(string filename);
+    void stopRecording();
+    bool isRecording();
+    
+    // Publish every frame to other processes, in the shared memory rings
+    // name-depth and name-video; read them with ofxFreenectSharedClient
+    bool startPublishing(string name, int numSlots = 4);
+    void stopPublishing();
+    bool isPublishing();
+    
+    // Stream every frame to local clients over the Unix domain socket at
+    // path; receive them with ofxFreenectFrameClient
+    bool startServing(string path, int numThreads = 2, int queueLength = 4);
+    void stopServing();
+    bool isServing();
+    
     // Accessors
     int getWidth();
     int getHeight();
@@ -68,18 +166,34 @@ public:
     ofShortPixels & getDepthPixels();
     ofTexture & getTextureReference();
     ofTexture & getTextureReferenceDepth();
+    // IR frames of a multiplexed video stream
+    ofPixels & getIrPixels();
+    ofTexture & getTextureReferenceIr();
+    void drawIr(float x, float y);
+    void drawIr(float x, float y, float w, float h);
     bool isOpen();
     bool isFrameNew();
     bool isFrameNewVideo();
     bool isFrameNewDepth();
+    bool isFrameNewIr();
     int numDevices();
     freenect_device *getDevice();
 
 private:
     static void rgb_cb(freenect_device *dev, void *rgb, uint32_t timestamp);
     static void depth_cb(freenect_device *dev, void *v_depth, uint32_t timestamp);
+    static void flag_cb(freenect_device *dev, freenect_cmd_batch *batch, int status, void *user);
     
     void threadedFunction();
+    void startVideo();
+    void applyIsoConfig();
+    void applyDepthStats();
+    void applyModeSwitch();
+    void applyThreadConfig();
+    void lockPixels();
+    void uploadVideoTexture();
+    void uploadDepthTexture();
+    void uploadIrTexture();
 
     freenect_context *f_ctx;
     freenect_device *f_dev;
@@ -90,26 +204,95 @@ private:
     vector<int> pendingCommands;
     
     bool bIsOpen, bWasDisconnected;
-	bool bIsFrameNewVideo, bIsFrameNewDepth;
-	bool bNeedsUpdateVideo, bNeedsUpdateDepth;
+	bool bIsFrameNewVideo, bIsFrameNewDepth, bIsFrameNewIr;
+	bool bNeedsUpdateVideo, bNeedsUpdateDepth, bNeedsUpdateIr;
+    bool bUseTexture, bVideoTextureDirty, bDepthTextureDirty, bIrTextureDirty;
     
     ofTexture videoTexture;
     ofTexture depthTexture;
+    ofTexture irTexture;
     
     ofPixels        videoPixels, videoPixelsBack;
     ofShortPixels   depthPixels, depthPixelsBack;
+    ofPixels        irPixels, irPixelsBack;
+    
+    int multiplexRgbFrames, multiplexIrFrames;
+    bool bMultiplexing;
+    freenect_multiplex_stats multiplexStats;
     
     ofxFreenectDepthTable* depthTable;
+    ofxFreenectDepthPipeline* depthPipeline;
+    ofxFreenectBackground* background;
+    ofxFreenectDepthPyramid* depthPyramid;
+    ofxFreenectNormals* normals;
+    ofxFreenectVoxelGrid* voxelGrid;
+    // Held by depth_cb while it runs the stages above, so their setters
+    // return only once the old ones are out of use
+    ofMutex processingMutex;
+    freenect_zero_plane_info zeroPlane;
+    
+    freenect_frame_info videoFrameInfo, depthFrameInfo;
+    
+    bool bDepthStats, bDepthStatsOn, bHasDepthStats, bAutoEqualize;
+    freenect_depth_stats depthStats;
+    
+    freenect_iso_config depthIsoConfig, videoIsoConfig;
+    freenect_iso_stats depthIsoStats, videoIsoStats;
+    bool bIsoConfigChanged;
+    int bufferFlags;
+    
+    ofxFreenectThreadConfig captureThreadConfig;
+    bool bCaptureThreadConfigChanged;
+    bool bLockMemory;
+    ofxFreenectLockedMemory lockedPixels;
+    
+    freenect_frame_mode pendingVideoMode, pendingDepthMode;
+    bool bSwitchVideoMode, bSwitchDepthMode;
+    bool bVideoModeChanged, bDepthModeChanged;
+    int videoSwitchTime, depthSwitchTime;
+    int videoStartTime, depthStartTime;
+    
+    int tiltRate, tiltHistoryLength;
+    bool bHasTiltSample;
+    freenect_tilt_sample tiltSample;
+    vector<freenect_tilt_sample> tiltHistory;
+    
+    freenect_recorder* recorder;
+    ofMutex recorderMutex;
+    
+    ofxFreenectSharedPublisher* depthPublisher;
+    ofxFreenectSharedPublisher* videoPublisher;
+    ofMutex publisherMutex;
+    
+    ofxFreenectFrameServer* server;
+    ofMutex serverMutex;
 };
 
 // DEPTH TABLE
 class ofxFreenectDepthTable {
 public:
+    ofxFreenectDepthTable();
+    
+    // Size the table for the readings of a depth format, 11 bit until set.
+    // The last table generated is made again for the new range.
+    void setFormat(freenect_depth_format format);
+    
     void apply(uint16_t* pixels, int count);
     
     void generateLinear();
     void generateExponential(float power = 3, float multiply = 6, bool inverse = false);
+    // Histogram equalization, spreading the readings evenly over the range
+    void generateEqualized(const freenect_depth_stats & stats, bool inverse = false);
 
 private:
-    uint16_t table[2048];
+    void generate();
+    
+    vector<uint16_t> table;
+    freenect_depth_format format;
+    int noValue;
+    
+    // The last generator and its parameters
+    int kind;
+    float power, multiply;
+    bool bInverse;
 };
\ No newline at end of file
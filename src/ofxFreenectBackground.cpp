@@ -0,0 +1,199 @@
+//
+//  ofxFreenectBackground.cpp
+//
+//
+
+#include "ofxFreenectBackground.h"
+
+// Background adapts at 1/4 per frame while learning
+#define OFX_FREENECT_BACKGROUND_LEARN_SHIFT 2
+
+//--------------------------------------------------------------
+ofxFreenectBackground::ofxFreenectBackground() {
+    stride = 0;
+    bNewMask = bNewBits = false;
+    depth = NULL;
+    width = height = 0;
+    learnFrames = 30;
+    bRelearn = false;
+    bLearning = false;
+    shift = 8;
+    frameShift = 0;
+    minDiff = 50;
+    deviations = 3 * 16;
+    noValue = 0;
+    bBitMask = false;
+    pool = NULL;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::learn(int frames) {
+    mutex.lock();
+    learnFrames = MAX(frames, 1);
+    bRelearn = true;
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectBackground::isLearning() {
+    return learnFrames > 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::setThreshold(uint16_t minDiff, float deviations) {
+    this->minDiff = minDiff;
+    this->deviations = deviations * 16;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::setAdaptRate(int shift) {
+    this->shift = ofClamp(shift, 0, 15);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::setNoValue(uint16_t value) {
+    noValue = value;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::setBitMask(bool enabled) {
+    bBitMask = enabled;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::setWorkerPool(ofxFreenectWorkerPool *pool) {
+    this->pool = pool;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::update(const uint16_t *depth, int width, int height) {
+
+    mutex.lock();
+    bool relearn = bRelearn || width != this->width || height != this->height;
+    bRelearn = false;
+    int learning = learnFrames;
+    mutex.unlock();
+
+    if (relearn) {
+        mean.assign(width * height, 0);
+        deviation.assign(width * height, 0);
+        stride = (width + 31) / 32;
+        this->width = width;
+        this->height = height;
+    }
+    // Buffers only change size with the frame, so nothing is allocated per frame
+    maskBack.allocate(width, height, 1);
+    if (bBitMask)
+        bitsBack.resize(stride * height);
+
+    this->depth = depth;
+    frameShift = learning > 0 ? OFX_FREENECT_BACKGROUND_LEARN_SHIFT : shift;
+    bLearning = learning > 0;
+    if (pool != NULL)
+        pool->run(this, height);
+    else
+        runRows(0, height);
+
+    mutex.lock();
+    if (learnFrames > 0 && !bRelearn)
+        learnFrames--;
+    swap(mask, maskBack);
+    bNewMask = true;
+    if (bBitMask) {
+        swap(bits, bitsBack);
+        bNewBits = true;
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBackground::runRows(int y0, int y1) {
+
+    // Members are copied to locals: the stores through out could alias them,
+    // which keeps the compiler from vectorizing the row loop
+    const int w = width;
+    const int words = stride;
+    const int none = noValue;
+    const int floor = minDiff;
+    const int k = deviations;
+    const int s = frameShift;
+    const int adapt = frameShift > 0;
+    const int learning = bLearning;
+
+    for (int y=y0; y<y1; y++) {
+        const uint16_t *d = depth + y * w;
+        uint32_t *m = &mean[y * w];
+        uint16_t *dev = &deviation[y * w];
+        uint8_t *out = maskBack.getPixels() + y * w;
+
+        for (int x=0; x<w; x++) {
+            // Masked rather than selected, which gcc can't vectorize here
+            int raw = d[x];
+            int v = raw & (0 - (raw != none));
+            int mx = m[x];
+            int md = mx >> 8;
+            int dv = dev[x];
+
+            // Closer than the background, or where there was never a reading
+            int threshold = MAX(floor, (dv * k) >> 8);
+            int fg = !learning & (v != 0) & ((mx == 0) | (md - v > threshold));
+            out[x] = 0 - fg;
+
+            // Only background readings move the model
+            int fresh = mx == 0;
+            int nm = fresh ? (v << 8) : mx + (((v << 8) - mx) >> s);
+            int ad = MIN(abs(v - md) << 4, 0xffff);
+            int nd = fresh ? 0 : dv + ((ad - dv) >> s);
+            int update = adapt & (v != 0) & !fg;
+            m[x] = update ? nm : mx;
+            dev[x] = update ? nd : dv;
+        }
+
+        if (bBitMask) {
+            uint32_t *b = &bitsBack[y * words];
+            int full = w / 32;
+            for (int i=0; i<full; i++) {
+                const uint8_t *o = out + i * 32;
+                uint32_t word = 0;
+                for (int j=0; j<32; j++)
+                    word |= (uint32_t)(o[j] & 1) << j;
+                b[i] = word;
+            }
+            if (full < words) {
+                uint32_t word = 0;
+                for (int j=0; j<w-full*32; j++)
+                    word |= (uint32_t)(out[full * 32 + j] & 1) << j;
+                b[full] = word;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectBackground::getMask(ofPixels & pixels) {
+    mutex.lock();
+    bool isNew = bNewMask;
+    if (isNew) {
+        pixels = mask;
+        bNewMask = false;
+    }
+    mutex.unlock();
+    return isNew;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectBackground::getBitMask(vector<uint32_t> & bits) {
+    mutex.lock();
+    bool isNew = bNewBits;
+    if (isNew) {
+        bits = this->bits;
+        bNewBits = false;
+    }
+    mutex.unlock();
+    return isNew;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectBackground::getBitMaskStride() {
+    return stride;
+}
@@ -0,0 +1,76 @@
+//
+//  ofxFreenectBackground.h
+//
+//  Learns the static depth background and marks what is in front of it.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxFreenectWorkerPool.h"
+
+class ofxFreenectBackground : public ofxFreenectWorkerJob {
+public:
+    ofxFreenectBackground();
+
+    // Forget the background and learn it again from the next frames
+    void learn(int frames = 30);
+    bool isLearning();
+
+    // A pixel is foreground when it is closer than the background by more
+    // than minDiff and more than deviations times its usual noise
+    void setThreshold(uint16_t minDiff, float deviations = 3);
+
+    // The background follows slow changes at a rate of 1/2^shift per frame;
+    // 0 freezes it once learnt
+    void setAdaptRate(int shift);
+
+    // Value of pixels without a reading, FREENECT_DEPTH_RAW_NO_VALUE or
+    // FREENECT_DEPTH_10BIT_NO_VALUE for the raw modes
+    void setNoValue(uint16_t value);
+
+    // Also pack the mask into bits, see getBitMask()
+    void setBitMask(bool enabled);
+
+    // Split the work into bands of rows on the pool's threads
+    void setWorkerPool(ofxFreenectWorkerPool *pool);
+
+    // Feed a depth frame, called from whichever thread delivers them
+    void update(const uint16_t *depth, int width, int height);
+
+    // Copy the latest mask, 255 for foreground. Returns false if there is
+    // no new mask since the last call.
+    bool getMask(ofPixels & mask);
+
+    // Copy the latest mask as bits, 32 pixels per word starting at the least
+    // significant bit, each row padded to getBitMaskStride() words
+    bool getBitMask(vector<uint32_t> & bits);
+    int getBitMaskStride();
+
+private:
+    void runRows(int y0, int y1);
+
+    // Running background per pixel: mean depth in 1/256ths and mean absolute
+    // deviation in 1/16ths, one plane each so the row loops vectorize
+    vector<uint32_t> mean;
+    vector<uint16_t> deviation;
+
+    ofPixels mask, maskBack;
+    vector<uint32_t> bits, bitsBack;
+    int stride;
+    bool bNewMask, bNewBits;
+    ofMutex mutex;
+
+    const uint16_t *depth;
+    int width, height;
+    int learnFrames;
+    bool bRelearn, bLearning;
+    int shift, frameShift;
+
+    uint16_t minDiff;
+    int deviations;
+    uint16_t noValue;
+    bool bBitMask;
+
+    ofxFreenectWorkerPool *pool;
+};
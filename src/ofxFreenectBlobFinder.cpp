@@ -0,0 +1,217 @@
+//
+//  ofxFreenectBlobFinder.cpp
+//
+//
+
+#include "ofxFreenectBlobFinder.h"
+#include <climits>
+
+static bool blobLarger(const ofxFreenectBlob & a, const ofxFreenectBlob & b) {
+    return a.area > b.area;
+}
+
+// Pixels without a reading are never in range, whatever the range: the raw
+// modes' 2047 would otherwise pass a far limit at or above it, and 0 a near
+// limit of 0
+static inline bool inRange(uint16_t v, uint16_t noValue, uint16_t minDepth, uint16_t maxDepth) {
+    return v != 0 && v != noValue && v >= minDepth && v <= maxDepth;
+}
+
+//--------------------------------------------------------------
+ofxFreenectBlobFinder::ofxFreenectBlobFinder() {
+    minArea = 20;
+    maxArea = INT_MAX;
+    maxBlobs = 32;
+    noValue = 0;
+    prevBegin = prevEnd = rowBegin = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::setAreaRange(int minArea, int maxArea) {
+    this->minArea = minArea;
+    this->maxArea = maxArea;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::setMaxBlobs(int maxBlobs) {
+    this->maxBlobs = maxBlobs;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::setNoValue(uint16_t value) {
+    noValue = value;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectBlobFinder::find(const ofShortPixels & depth, uint16_t minDepth, uint16_t maxDepth) {
+
+    int width = depth.getWidth();
+    int height = depth.getHeight();
+    const uint16_t *pixels = depth.getPixels();
+    const uint16_t none = noValue;
+
+    runs.clear();
+    rowBegin = 0;
+    for (int y=0; y<height; y++) {
+        const uint16_t *row = pixels + y * width;
+        beginRow();
+        int x = 0;
+        while (x < width) {
+            while (x < width && !inRange(row[x], none, minDepth, maxDepth))
+                x++;
+            int start = x;
+            while (x < width && inRange(row[x], none, minDepth, maxDepth))
+                x++;
+            if (x > start)
+                addRun(start, x, y);
+        }
+    }
+    label(pixels, width);
+    return blobs.size();
+}
+
+//--------------------------------------------------------------
+int ofxFreenectBlobFinder::find(const ofPixels & mask, const ofShortPixels *depth) {
+
+    int width = mask.getWidth();
+    int height = mask.getHeight();
+    const unsigned char *pixels = mask.getPixels();
+
+    runs.clear();
+    rowBegin = 0;
+    for (int y=0; y<height; y++) {
+        const unsigned char *row = pixels + y * width;
+        beginRow();
+        int x = 0;
+        while (x < width) {
+            while (x < width && row[x] == 0)
+                x++;
+            int start = x;
+            while (x < width && row[x] != 0)
+                x++;
+            if (x > start)
+                addRun(start, x, y);
+        }
+    }
+    label(depth != NULL ? depth->getPixels() : NULL, width);
+    return blobs.size();
+}
+
+//--------------------------------------------------------------
+int ofxFreenectBlobFinder::size() {
+    return blobs.size();
+}
+
+//--------------------------------------------------------------
+ofxFreenectBlob & ofxFreenectBlobFinder::getBlob(int index) {
+    return blobs[index];
+}
+
+//--------------------------------------------------------------
+const vector<ofxFreenectBlob> & ofxFreenectBlobFinder::getBlobs() {
+    return blobs;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::beginRow() {
+    // The runs added since the last row began are the previous row's
+    prevBegin = rowBegin;
+    prevEnd = rowBegin = runs.size();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::addRun(int x0, int x1, int y) {
+
+    Run run;
+    run.x0 = x0;
+    run.x1 = x1;
+    run.y = y;
+    run.parent = runs.size();
+    runs.push_back(run);
+    int index = run.parent;
+
+    // Runs of the previous row that end left of this one can't touch any
+    // later run of this row either. The ones that reach further right are
+    // kept for the next run. Diagonal neighbours count as touching.
+    while (prevBegin < prevEnd && runs[prevBegin].x1 < x0)
+        prevBegin++;
+    for (int i=prevBegin; i<prevEnd && runs[i].x0 <= x1; i++) {
+        int a = root(i);
+        int b = root(index);
+        if (a < b)
+            runs[b].parent = a;
+        else if (b < a)
+            runs[a].parent = b;
+    }
+}
+
+//--------------------------------------------------------------
+int ofxFreenectBlobFinder::root(int run) {
+    while (runs[run].parent != run) {
+        runs[run].parent = runs[runs[run].parent].parent;
+        run = runs[run].parent;
+    }
+    return run;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectBlobFinder::label(const uint16_t *depth, int width) {
+
+    // Roots are always the lowest run of their component, so every root
+    // is reached before the runs that belong to it
+    int count = runs.size();
+    stats.resize(count);
+    for (int i=0; i<count; i++) {
+        const Run & run = runs[i];
+        int r = root(i);
+        Stats & s = stats[r];
+        if (r == i) {
+            s.sumX = s.sumY = s.sumDepth = 0;
+            s.area = s.depthCount = 0;
+            s.x0 = run.x0;
+            s.x1 = run.x1;
+            s.y0 = s.y1 = run.y;
+        }
+        int length = run.x1 - run.x0;
+        s.area += length;
+        s.sumX += length * (run.x0 + run.x1 - 1) * 0.5;
+        s.sumY += (double)length * run.y;
+        s.x0 = MIN(s.x0, run.x0);
+        s.x1 = MAX(s.x1, run.x1);
+        s.y1 = run.y;
+
+        if (depth != NULL) {
+            const uint16_t *d = depth + run.y * width;
+            for (int x=run.x0; x<run.x1; x++) {
+                if (d[x] != 0 && d[x] != noValue) {
+                    s.sumDepth += d[x];
+                    s.depthCount++;
+                }
+            }
+        }
+    }
+
+    blobs.clear();
+    for (int i=0; i<count; i++) {
+        if (runs[i].parent != i)
+            continue;
+        const Stats & s = stats[i];
+        if (s.area < minArea || s.area > maxArea)
+            continue;
+        ofxFreenectBlob blob;
+        blob.centroid.x = s.sumX / s.area;
+        blob.centroid.y = s.sumY / s.area;
+        blob.boundingBox.set(s.x0, s.y0, s.x1 - s.x0, s.y1 - s.y0 + 1);
+        blob.area = s.area;
+        blob.depth = s.depthCount ? s.sumDepth / s.depthCount : 0;
+        blobs.push_back(blob);
+    }
+
+    if ((int)blobs.size() > maxBlobs) {
+        partial_sort(blobs.begin(), blobs.begin() + maxBlobs, blobs.end(), blobLarger);
+        blobs.resize(maxBlobs);
+    }
+    else {
+        sort(blobs.begin(), blobs.end(), blobLarger);
+    }
+}
@@ -0,0 +1,69 @@
+//
+//  ofxFreenectBlobFinder.h
+//
+//  Connected components of a depth range or foreground mask, labelled on
+//  runs of pixels rather than single pixels.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+struct ofxFreenectBlob {
+    ofVec2f centroid;
+    ofRectangle boundingBox;
+    int area;           // pixels
+    float depth;        // mean depth of the pixels with a reading, 0 if none
+};
+
+class ofxFreenectBlobFinder {
+public:
+    ofxFreenectBlobFinder();
+
+    // Blobs outside [minArea, maxArea] are dropped; at most maxBlobs are kept,
+    // largest first
+    void setAreaRange(int minArea, int maxArea);
+    void setMaxBlobs(int maxBlobs);
+
+    // Value of depth pixels without a reading, FREENECT_DEPTH_RAW_NO_VALUE or
+    // FREENECT_DEPTH_10BIT_NO_VALUE for the raw modes
+    void setNoValue(uint16_t value);
+
+    // Blobs of the pixels with a reading and depth in [minDepth, maxDepth]
+    int find(const ofShortPixels & depth, uint16_t minDepth, uint16_t maxDepth);
+
+    // Blobs of the non-zero pixels of mask, with the mean depth taken from
+    // depth when given (it must be the same size)
+    int find(const ofPixels & mask, const ofShortPixels *depth = NULL);
+
+    int size();
+    ofxFreenectBlob & getBlob(int index);
+    const vector<ofxFreenectBlob> & getBlobs();
+
+private:
+    struct Run {
+        int x0, x1;     // [x0, x1)
+        int y;
+        int parent;
+    };
+
+    struct Stats {
+        double sumX, sumY, sumDepth;
+        int area, depthCount;
+        int x0, y0, x1, y1;
+    };
+
+    void beginRow();
+    void addRun(int x0, int x1, int y);
+    void label(const uint16_t *depth, int width);
+    int root(int run);
+
+    // All reused between frames; they only grow
+    vector<Run> runs;
+    vector<Stats> stats;
+    vector<ofxFreenectBlob> blobs;
+    int prevBegin, prevEnd, rowBegin;
+
+    int minArea, maxArea, maxBlobs;
+    uint16_t noValue;
+};
@@ -0,0 +1,424 @@
+//
+//  ofxFreenectDepthPipeline.cpp
+//
+//
+
+#include "ofxFreenectDepthPipeline.h"
+
+// The row loops below are written without branches so the compiler can
+// vectorize them. Hole filling scans runs along a row and stays scalar.
+
+// Pixels the median sorts at a time
+#define OFX_FREENECT_MEDIAN_RUN 64
+
+//--------------------------------------------------------------
+ofxFreenectDepthRange::ofxFreenectDepthRange(uint16_t minDepth, uint16_t maxDepth) {
+    this->minDepth = minDepth;
+    this->maxDepth = maxDepth;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthRange::process(const uint16_t *src, uint16_t *dst, int width, int, int y0, int y1) {
+    const uint16_t lo = minDepth, hi = maxDepth;
+    int count = (y1 - y0) * width;
+    src += y0 * width;
+    dst += y0 * width;
+    for (int i=0; i<count; i++) {
+        uint16_t v = src[i];
+        dst[i] = (v >= lo && v <= hi) ? v : 0;
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthSpeckle::ofxFreenectDepthSpeckle(uint16_t maxDiff, int minNeighbours) {
+    this->maxDiff = maxDiff;
+    this->minNeighbours = minNeighbours;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthSpeckle::begin(int width, int) {
+    count.resize(width);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthSpeckle::process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1) {
+    const int diff = maxDiff;
+    const int needed = minNeighbours;
+    uint8_t *n = &count[0];
+
+    for (int y=y0; y<y1; y++) {
+        const uint16_t *c = src + y * width;
+        uint16_t *d = dst + y * width;
+        if (y == 0 || y == height-1) {
+            memcpy(d, c, width * sizeof(uint16_t));
+            continue;
+        }
+        memset(n, 0, width);
+        for (int dy=-1; dy<=1; dy++) {
+            for (int dx=-1; dx<=1; dx++) {
+                if (dx == 0 && dy == 0)
+                    continue;
+                const uint16_t *o = c + dy * width + dx;
+                for (int x=1; x<width-1; x++) {
+                    int delta = (int)o[x] - (int)c[x];
+                    n[x] += (o[x] != 0) & (delta <= diff) & (delta >= -diff);
+                }
+            }
+        }
+        d[0] = c[0];
+        d[width-1] = c[width-1];
+        for (int x=1; x<width-1; x++) {
+            d[x] = c[x] & (0 - (n[x] >= needed));
+        }
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthTemporalEMA::ofxFreenectDepthTemporalEMA(float alpha, uint16_t resetDiff) {
+    this->alpha = alpha;
+    this->resetDiff = resetDiff;
+    weight = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTemporalEMA::begin(int width, int height) {
+    if (state.size() != (size_t)(width * height))
+        state.assign(width * height, 0);
+    weight = ofClamp(alpha, 0, 1) * 256;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTemporalEMA::process(const uint16_t *src, uint16_t *dst, int width, int, int y0, int y1) {
+    const int w = weight;
+    const int reset = resetDiff;
+    int count = (y1 - y0) * width;
+    src += y0 * width;
+    dst += y0 * width;
+    uint16_t *s = &state[y0 * width];
+
+    for (int i=0; i<count; i++) {
+        int v = src[i];
+        int prev = s[i];
+        int delta = v - prev;
+        int jump = (prev == 0) | (delta > reset) | (delta < -reset);
+        int next = jump ? v : prev + ((delta * w + 128) >> 8);
+        // Pixels without a reading keep the average for when they come back
+        s[i] = v ? next : prev;
+        dst[i] = v ? next : 0;
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthTemporalMedian::ofxFreenectDepthTemporalMedian(int frames) {
+    this->frames = ofClamp(frames, 1, 9);
+    head = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTemporalMedian::begin(int width, int height) {
+    if (history.size() != (size_t)(width * height * frames)) {
+        history.assign(width * height * frames, 0);
+        head = 0;
+    }
+    else {
+        head = (head + 1) % frames;
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthTemporalMedian::process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1) {
+    const int f = frames;
+    const int size = width * height;
+    uint16_t v[9][OFX_FREENECT_MEDIAN_RUN];
+    uint16_t half[OFX_FREENECT_MEDIAN_RUN];
+
+    memcpy(&history[head * size + y0 * width], src + y0 * width, (y1 - y0) * width * sizeof(uint16_t));
+
+    for (int i=y0*width; i<y1*width; i+=OFX_FREENECT_MEDIAN_RUN) {
+        const int len = MIN(OFX_FREENECT_MEDIAN_RUN, y1*width - i);
+
+        // 0 wraps around to the top, so the valid readings sort first
+        for (int k=0; k<f; k++) {
+            const uint16_t *h = &history[k * size + i];
+            for (int x=0; x<len; x++)
+                v[k][x] = h[x] - 1;
+        }
+
+        // Odd-even transposition sort, each step a min and a max over the run
+        for (int p=0; p<f; p++) {
+            for (int k=p&1; k+1<f; k+=2) {
+                uint16_t *a = v[k], *b = v[k+1];
+                for (int x=0; x<len; x++) {
+                    uint16_t lo = MIN(a[x], b[x]);
+                    uint16_t hi = MAX(a[x], b[x]);
+                    a[x] = lo;
+                    b[x] = hi;
+                }
+            }
+        }
+
+        for (int x=0; x<len; x++)
+            half[x] = 0;
+        for (int k=0; k<f; k++) {
+            for (int x=0; x<len; x++)
+                half[x] += v[k][x] != 0xffff;
+        }
+        for (int x=0; x<len; x++)
+            half[x] >>= 1;
+
+        // Without readings the pick is the wrapped 0 itself, back to 0 below
+        uint16_t *pick = v[0];
+        for (int k=1; k<f; k++) {
+            for (int x=0; x<len; x++) {
+                uint16_t m = 0 - (half[x] == k);
+                pick[x] = (v[k][x] & m) | (pick[x] & ~m);
+            }
+        }
+        uint16_t *d = dst + i;
+        for (int x=0; x<len; x++)
+            d[x] = pick[x] + 1;
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthSpatial::ofxFreenectDepthSpatial(uint16_t maxDiff, int radius) {
+    this->maxDiff = maxDiff;
+    this->radius = ofClamp(radius, 1, 3);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthSpatial::begin(int width, int) {
+    sum.resize(width);
+    count.resize(width);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthSpatial::process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1) {
+    const int r = radius;
+    const int diff = maxDiff;
+    uint32_t *s = &sum[0];
+    uint16_t *n = &count[0];
+
+    for (int y=y0; y<y1; y++) {
+        const uint16_t *c = src + y * width;
+        uint16_t *d = dst + y * width;
+        if (y < r || y >= height-r) {
+            memcpy(d, c, width * sizeof(uint16_t));
+            continue;
+        }
+        memset(s, 0, width * sizeof(uint32_t));
+        memset(n, 0, width * sizeof(uint16_t));
+        for (int dy=-r; dy<=r; dy++) {
+            for (int dx=-r; dx<=r; dx++) {
+                const uint16_t *o = c + dy * width + dx;
+                for (int x=r; x<width-r; x++) {
+                    int delta = (int)o[x] - (int)c[x];
+                    uint32_t m = (o[x] != 0) & (delta <= diff) & (delta >= -diff);
+                    s[x] += o[x] & (0 - m);
+                    n[x] += m;
+                }
+            }
+        }
+        for (int x=0; x<r; x++) {
+            d[x] = c[x];
+            d[width-1-x] = c[width-1-x];
+        }
+        for (int x=r; x<width-r; x++) {
+            // The centre always counts itself when it has a reading. Sums stay
+            // below 2^24, so the float division is exact before rounding.
+            float mean = s[x] / (float)MAX(n[x], 1) + 0.5f;
+            d[x] = (uint16_t)mean & (0 - (c[x] != 0));
+        }
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthHoleFill::ofxFreenectDepthHoleFill(int maxWidth) {
+    this->maxWidth = maxWidth;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthHoleFill::process(const uint16_t *src, uint16_t *dst, int width, int, int y0, int y1) {
+    for (int y=y0; y<y1; y++) {
+        const uint16_t *c = src + y * width;
+        uint16_t *d = dst + y * width;
+        if (d != c)
+            memcpy(d, c, width * sizeof(uint16_t));
+
+        int x = 0;
+        while (x < width) {
+            if (d[x] != 0) {
+                x++;
+                continue;
+            }
+            int start = x;
+            while (x < width && d[x] == 0)
+                x++;
+            // Gaps touching the edge of the frame have nothing to fill from
+            if (start == 0 || x == width || x - start > maxWidth)
+                continue;
+            uint16_t v = max(d[start-1], d[x]);
+            for (int i=start; i<x; i++)
+                d[i] = v;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthPipeline::ofxFreenectDepthPipeline() {
+    noValue = 0;
+    bandRows = 32;
+    time = 0;
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthPipeline::~ofxFreenectDepthPipeline() {
+    clear();
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthStage* ofxFreenectDepthPipeline::addStage(ofxFreenectDepthStage *stage) {
+    mutex.lock();
+    stages.push_back(stage);
+    stageTimes.push_back(0);
+    mutex.unlock();
+    return stage;
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthStage* ofxFreenectDepthPipeline::getStage(int index) {
+    return stages[index];
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPipeline::getNumStages() {
+    return stages.size();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPipeline::clear() {
+    mutex.lock();
+    for (size_t i=0; i<stages.size(); i++)
+        delete stages[i];
+    stages.clear();
+    stageTimes.clear();
+    buffers.clear();
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPipeline::setNoValue(uint16_t value) {
+    noValue = value;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPipeline::setBandRows(int rows) {
+    bandRows = MAX(rows, 1);
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPipeline::getStageTime(int index) {
+    return stageTimes[index];
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPipeline::getTime() {
+    return time;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPipeline::process(uint16_t *pixels, int width, int height) {
+
+    mutex.lock();
+    unsigned long long start = ofGetElapsedTimeMicros();
+
+    // Work out which buffer each stage reads and writes. Stages that work in
+    // place share the buffer of the stage before them.
+    vector<int> active;
+    vector<uint16_t*> in, out;
+    vector<int> radius, done;
+    vector<unsigned long long> elapsed;
+    uint16_t *current = pixels;
+    int firstReader = -1;
+    size_t numBuffers = 0;
+
+    for (size_t i=0; i<stages.size(); i++) {
+        if (stages[i]->enabled && stages[i]->getRadius() > 0)
+            numBuffers++;
+    }
+    if (buffers.size() < numBuffers)
+        buffers.resize(numBuffers);
+    numBuffers = 0;
+
+    for (size_t i=0; i<stages.size(); i++) {
+        stageTimes[i] = 0;
+        if (!stages[i]->enabled)
+            continue;
+        int r = stages[i]->getRadius();
+        in.push_back(current);
+        if (r > 0) {
+            buffers[numBuffers].resize(width * height);
+            current = &buffers[numBuffers++][0];
+            if (firstReader < 0)
+                firstReader = active.size();
+        }
+        out.push_back(current);
+        active.push_back(i);
+        radius.push_back(r);
+        done.push_back(0);
+        elapsed.push_back(0);
+        stages[i]->begin(width, height);
+    }
+
+    const uint16_t none = noValue;
+    int loaded = 0, stored = 0;
+    int n = active.size();
+
+    while (stored < height) {
+
+        // Load the next band, marking pixels without a reading as 0
+        int end = MIN(loaded + bandRows, height);
+        if (none != 0) {
+            for (int i=loaded*width; i<end*width; i++) {
+                uint16_t v = pixels[i];
+                pixels[i] = v == none ? 0 : v;
+            }
+        }
+        loaded = end;
+
+        // Advance each stage as far as the rows it reads are ready
+        int ready = loaded;
+        for (int s=0; s<n; s++) {
+            int target = ready == height ? height : MAX(ready - radius[s], 0);
+            if (target > done[s]) {
+                unsigned long long t = ofGetElapsedTimeMicros();
+                stages[active[s]]->process(in[s], out[s], width, height, done[s], target);
+                elapsed[s] += ofGetElapsedTimeMicros() - t;
+                done[s] = target;
+            }
+            ready = done[s];
+        }
+
+        // Write finished rows back. When the result is in a buffer of its own,
+        // stop short of the rows the first reading stage still needs.
+        int limit = ready;
+        if (current != pixels && done[firstReader] < height)
+            limit = MIN(limit, done[firstReader] - radius[firstReader]);
+        if (limit > stored) {
+            if (current != pixels)
+                memcpy(pixels + stored * width, current + stored * width, (limit - stored) * width * sizeof(uint16_t));
+            if (none != 0) {
+                for (int i=stored*width; i<limit*width; i++) {
+                    uint16_t v = pixels[i];
+                    pixels[i] = v == 0 ? none : v;
+                }
+            }
+            stored = limit;
+        }
+    }
+
+    for (int s=0; s<n; s++)
+        stageTimes[active[s]] = elapsed[s];
+    time = ofGetElapsedTimeMicros() - start;
+    mutex.unlock();
+}
@@ -0,0 +1,163 @@
+//
+//  ofxFreenectDepthPipeline.h
+//
+//  Depth post-processing run on the capture thread, before frames are
+//  handed to the app.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+// DEPTH STAGE
+// A stage filters rows of a depth frame. Values are in the units of the depth
+// mode; 0 means no reading (the pipeline maps the raw modes' 2047 to 0 and back).
+class ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthStage() : enabled(true) {}
+    virtual ~ofxFreenectDepthStage() {}
+
+    virtual string getName() = 0;
+
+    // Rows above and below each pixel the stage reads. Stages with a radius of 0
+    // run in place, everything else writes into a buffer of its own.
+    virtual int getRadius() { return 0; }
+
+    // Called once per frame before any rows are processed
+    virtual void begin(int /*width*/, int /*height*/) {}
+
+    // Filter rows [y0, y1) of src into dst
+    virtual void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1) = 0;
+
+    bool enabled;
+};
+
+// Drop readings outside [minDepth, maxDepth]
+class ofxFreenectDepthRange : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthRange(uint16_t minDepth = 500, uint16_t maxDepth = 4000);
+
+    string getName() { return "range"; }
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+    uint16_t minDepth, maxDepth;
+};
+
+// Drop readings with fewer than minNeighbours of their 8 neighbours within maxDiff
+class ofxFreenectDepthSpeckle : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthSpeckle(uint16_t maxDiff = 40, int minNeighbours = 3);
+
+    string getName() { return "speckle"; }
+    int getRadius() { return 1; }
+    void begin(int width, int height);
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+    uint16_t maxDiff;
+    int minNeighbours;
+
+private:
+    vector<uint8_t> count;
+};
+
+// Exponential moving average over frames. A pixel that moves by more than
+// resetDiff jumps to the new reading instead of smearing.
+class ofxFreenectDepthTemporalEMA : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthTemporalEMA(float alpha = 0.4, uint16_t resetDiff = 100);
+
+    string getName() { return "temporal ema"; }
+    void begin(int width, int height);
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+    float alpha;
+    uint16_t resetDiff;
+
+private:
+    vector<uint16_t> state;
+    int weight;
+};
+
+// Median of the valid readings over the last frames (up to 9). The frames are
+// kept in planes and sorted with a network of min/max across a run of pixels.
+class ofxFreenectDepthTemporalMedian : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthTemporalMedian(int frames = 5);
+
+    string getName() { return "temporal median"; }
+    void begin(int width, int height);
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+private:
+    vector<uint16_t> history;
+    int frames, head;
+};
+
+// Average of the neighbours within maxDiff of each pixel, so edges between
+// surfaces are kept
+class ofxFreenectDepthSpatial : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthSpatial(uint16_t maxDiff = 30, int radius = 1);
+
+    string getName() { return "spatial"; }
+    int getRadius() { return radius; }
+    void begin(int width, int height);
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+    uint16_t maxDiff;
+
+private:
+    int radius;
+    vector<uint32_t> sum;
+    vector<uint16_t> count;
+};
+
+// Fill gaps of up to maxWidth pixels along each row with the farther of the
+// readings on either side, so foreground edges don't bleed into the gap
+class ofxFreenectDepthHoleFill : public ofxFreenectDepthStage {
+public:
+    ofxFreenectDepthHoleFill(int maxWidth = 8);
+
+    string getName() { return "hole fill"; }
+    void process(const uint16_t *src, uint16_t *dst, int width, int height, int y0, int y1);
+
+    int maxWidth;
+};
+
+
+// DEPTH PIPELINE
+// Runs its stages over a frame in bands of rows. Each band goes through every
+// stage that has the rows it needs before the next band is loaded, so the
+// stages share one pass over memory instead of a full-frame pass each.
+class ofxFreenectDepthPipeline {
+public:
+    ofxFreenectDepthPipeline();
+    ~ofxFreenectDepthPipeline();
+
+    // The pipeline takes ownership of the stage
+    ofxFreenectDepthStage* addStage(ofxFreenectDepthStage *stage);
+    ofxFreenectDepthStage* getStage(int index);
+    int getNumStages();
+    void clear();
+
+    // Value of pixels without a reading, FREENECT_DEPTH_RAW_NO_VALUE or
+    // FREENECT_DEPTH_10BIT_NO_VALUE for the raw modes
+    void setNoValue(uint16_t value);
+    void setBandRows(int rows);
+
+    void process(uint16_t *pixels, int width, int height);
+
+    // Microseconds spent in the stage (or the whole pipeline) on the last frame
+    int getStageTime(int index);
+    int getTime();
+
+private:
+    ofMutex mutex;
+    vector<ofxFreenectDepthStage*> stages;
+    vector<int> stageTimes;
+    int time;
+
+    vector< vector<uint16_t> > buffers;
+    uint16_t noValue;
+    int bandRows;
+};
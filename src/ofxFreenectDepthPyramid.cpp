@@ -0,0 +1,172 @@
+//
+//  ofxFreenectDepthPyramid.cpp
+//
+//
+
+#include "ofxFreenectDepthPyramid.h"
+
+//--------------------------------------------------------------
+ofxFreenectDepthPyramid::ofxFreenectDepthPyramid() {
+    numLevels = 3;
+    depth = NULL;
+    width = height = 0;
+    noValue = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::setNumLevels(int levels) {
+    mutex.lock();
+    // Block counts are kept in 16 bits, which holds up to 4^7
+    numLevels = ofClamp(levels, 1, 7);
+    width = height = 0;
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPyramid::getNumLevels() {
+    // No levels until the first frame
+    return levels.empty() ? 0 : levels.size() - 1;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::setNoValue(uint16_t value) {
+    noValue = value;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::update(const uint16_t *depth, int width, int height) {
+
+    mutex.lock();
+
+    if (width != this->width || height != this->height) {
+        // Level 0 is the frame itself and has no planes of its own
+        levels.resize(1);
+        levels[0].width = width;
+        levels[0].height = height;
+        size_t size = 0;
+        for (int i=1; i<=numLevels && (width >> i) > 0 && (height >> i) > 0; i++) {
+            Level level;
+            level.width = width >> i;
+            level.height = height >> i;
+            for (int p=0; p<PLANES; p++) {
+                level.offset[p] = size;
+                size += level.width * level.height;
+            }
+            levels.push_back(level);
+        }
+        storage.resize(size);
+        this->width = width;
+        this->height = height;
+    }
+
+    // Each finished pair of rows at one level completes a row of the next,
+    // so the whole pyramid comes out of a single pass over the frame
+    this->depth = depth;
+    if (levels.size() > 1) {
+        for (int y=0; y<levels[1].height; y++)
+            buildRow(1, y);
+    }
+
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::buildRow(int level, int y) {
+
+    const Level & dst = levels[level];
+    const int none = noValue;
+    uint16_t *mean = &storage[dst.offset[MEAN] + y * dst.width];
+    uint16_t *lo = &storage[dst.offset[MIN] + y * dst.width];
+    uint16_t *hi = &storage[dst.offset[MAX] + y * dst.width];
+    uint16_t *count = &storage[dst.offset[COUNT] + y * dst.width];
+
+    if (level == 1) {
+        const uint16_t *r0 = depth + (2 * y) * width;
+        const uint16_t *r1 = r0 + width;
+        for (int x=0; x<dst.width; x++) {
+            int v[4] = { r0[2*x], r0[2*x+1], r1[2*x], r1[2*x+1] };
+            int sum = 0, n = 0, vmin = 0xffff, vmax = 0;
+            for (int i=0; i<4; i++) {
+                int valid = (v[i] != none) & (v[i] != 0);
+                sum += valid ? v[i] : 0;
+                n += valid;
+                vmin = MIN(vmin, valid ? v[i] : 0xffff);
+                vmax = MAX(vmax, valid ? v[i] : 0);
+            }
+            mean[x] = n ? (sum + n / 2) / n : none;
+            lo[x] = n ? vmin : none;
+            hi[x] = n ? vmax : none;
+            count[x] = n;
+        }
+    }
+    else {
+        // Blocks are weighted by how many readings they hold
+        const Level & src = levels[level-1];
+        for (int x=0; x<dst.width; x++) {
+            uint64_t sum = 0;
+            int n = 0, vmin = 0xffff, vmax = 0;
+            for (int i=0; i<4; i++) {
+                size_t p = (2 * y + (i >> 1)) * src.width + 2 * x + (i & 1);
+                int c = storage[src.offset[COUNT] + p];
+                sum += (uint64_t)storage[src.offset[MEAN] + p] * c;
+                n += c;
+                vmin = MIN(vmin, c ? storage[src.offset[MIN] + p] : 0xffff);
+                vmax = MAX(vmax, c ? storage[src.offset[MAX] + p] : 0);
+            }
+            mean[x] = n ? (sum + n / 2) / n : none;
+            lo[x] = n ? vmin : none;
+            hi[x] = n ? vmax : none;
+            count[x] = n;
+        }
+    }
+
+    if ((y & 1) && level + 1 < (int)levels.size())
+        buildRow(level + 1, y >> 1);
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPyramid::getWidth(int level) {
+    if (level < 0 || level >= (int)levels.size())
+        return 0;
+    return levels[level].width;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectDepthPyramid::getHeight(int level) {
+    if (level < 0 || level >= (int)levels.size())
+        return 0;
+    return levels[level].height;
+}
+
+//--------------------------------------------------------------
+const uint16_t* ofxFreenectDepthPyramid::getPlane(int level, int plane) {
+    // Level 0 is the frame itself, which isn't kept
+    if (level < 1 || level >= (int)levels.size())
+        return NULL;
+    return &storage[levels[level].offset[plane]];
+}
+
+//--------------------------------------------------------------
+const uint16_t* ofxFreenectDepthPyramid::getMean(int level) {
+    return getPlane(level, MEAN);
+}
+
+//--------------------------------------------------------------
+const uint16_t* ofxFreenectDepthPyramid::getMin(int level) {
+    return getPlane(level, MIN);
+}
+
+//--------------------------------------------------------------
+const uint16_t* ofxFreenectDepthPyramid::getMax(int level) {
+    return getPlane(level, MAX);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::lock() {
+    mutex.lock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthPyramid::unlock() {
+    mutex.unlock();
+}
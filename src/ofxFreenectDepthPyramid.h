@@ -0,0 +1,60 @@
+//
+//  ofxFreenectDepthPyramid.h
+//
+//  Half, quarter and eighth resolution depth with per-block mean, min and max.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+class ofxFreenectDepthPyramid {
+public:
+    ofxFreenectDepthPyramid();
+
+    // Number of levels below full resolution (1 to 7), each half the size of the last
+    void setNumLevels(int levels);
+    int getNumLevels();
+
+    // Value of pixels without a reading, FREENECT_DEPTH_RAW_NO_VALUE or
+    // FREENECT_DEPTH_10BIT_NO_VALUE for the raw modes. Blocks with no reading at
+    // all get this value too.
+    void setNoValue(uint16_t value);
+
+    // Rebuild every level from a full resolution frame
+    void update(const uint16_t *depth, int width, int height);
+
+    // Level 1 is half resolution, up to getNumLevels(); other levels give a
+    // size of 0 and NULL planes. The planes stay valid until the frame size
+    // or number of levels changes; hold the lock while reading them if
+    // update() runs on another thread.
+    int getWidth(int level);
+    int getHeight(int level);
+    const uint16_t* getMean(int level);
+    const uint16_t* getMin(int level);
+    const uint16_t* getMax(int level);
+
+    void lock();
+    void unlock();
+
+private:
+    void buildRow(int level, int y);
+    const uint16_t* getPlane(int level, int plane);
+
+    enum { MEAN, MIN, MAX, COUNT, PLANES };
+
+    struct Level {
+        int width, height;
+        size_t offset[PLANES];
+    };
+
+    // Every plane of every level lives in this one buffer
+    vector<uint16_t> storage;
+    vector<Level> levels;
+    int numLevels;
+
+    const uint16_t *depth;
+    int width, height;
+    uint16_t noValue;
+    ofMutex mutex;
+};
@@ -0,0 +1,856 @@
+//
+//  ofxFreenectFrameServer.cpp
+//
+//
+
+#include "ofxFreenectFrameServer.h"
+#include <deque>
+
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+#define OFX_FREENECT_NO_SOCKETS
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define OFX_FREENECT_SERVER_HELLO_MAGIC 0x4b4e4648  // "KNFH"
+#define OFX_FREENECT_SERVER_FRAME_MAGIC 0x4b4e4646  // "KNFF"
+#define OFX_FREENECT_SERVER_VERSION     1
+#define OFX_FREENECT_CODEC_BANDS        16
+
+// Sent by a client to ask for streams, and echoed back by the server with
+// what it agreed to
+struct ofxFreenectServerHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t streams;       // OFX_FREENECT_SERVE_DEPTH | OFX_FREENECT_SERVE_VIDEO
+    uint32_t decimation;    // every decimation'th frame of each stream
+    uint32_t depthCoding;   // OFX_FREENECT_CODING_RAW or OFX_FREENECT_CODING_DELTA
+    uint32_t queueLength;   // frames the server keeps waiting for the client
+};
+
+// Precedes the payload of every frame
+struct ofxFreenectServerFrame {
+    uint32_t magic;
+    uint32_t stream;        // freenect_stream
+    uint32_t coding;        // of the payload; video is always raw
+    int32_t resolution;
+    int32_t format;         // freenect_video_format or freenect_depth_format
+    uint32_t timestamp;     // camera timestamp
+    uint32_t number;        // counts the stream's frames on the server from 1
+    uint32_t payload;       // bytes following the header
+    uint64_t hostTime;      // capture time on the freenect_get_time_us() clock
+    uint64_t dropped;       // frames dropped from this client's queue so far
+};
+
+// Frame data shared by the queues of every client it goes to
+struct ofxFreenectServerMessage {
+    vector<uint8_t> data;
+    int refs;
+};
+
+struct ofxFreenectServerEntry {
+    vector<uint8_t> head;                   // hello reply or frame header
+    ofxFreenectServerMessage *message;      // NULL for a hello reply
+};
+
+struct ofxFreenectServerClient {
+    int fd;
+    bool bHello;
+    ofxFreenectServerHello hello;
+    uint8_t input[sizeof(ofxFreenectServerHello)];
+    size_t inputBytes;
+    uint32_t count[2];      // frames seen per stream, for decimation
+    deque<ofxFreenectServerEntry> queue;
+    size_t sent;            // bytes of the front entry already sent
+    uint64_t dropped;
+};
+
+//--------------------------------------------------------------
+static void appendUint32(vector<uint8_t> & out, uint32_t value) {
+    out.insert(out.end(), (uint8_t*)&value, (uint8_t*)&value + 4);
+}
+
+//--------------------------------------------------------------
+static uint32_t readUint32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+//--------------------------------------------------------------
+static bool isUnpackedDepth(int format) {
+    return format == FREENECT_DEPTH_11BIT || format == FREENECT_DEPTH_10BIT || format == FREENECT_DEPTH_MM || format == FREENECT_DEPTH_REGISTERED;
+}
+
+//--------------------------------------------------------------
+ofxFreenectDepthCodec::ofxFreenectDepthCodec() {
+    pool = NULL;
+    pixels = NULL;
+    width = height = 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthCodec::setWorkerPool(ofxFreenectWorkerPool *pool) {
+    this->pool = pool;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthCodec::encode(const uint16_t *pixels, int width, int height, vector<uint8_t> & out) {
+
+    this->pixels = pixels;
+    this->width = width;
+    this->height = height;
+
+    // A delta takes at most 3 bytes, so each band codes into the space of its own rows
+    int bands = MIN(height, OFX_FREENECT_CODEC_BANDS);
+    bandBytes.assign(bands, 0);
+    bandData.resize((size_t)width * height * 3);
+
+    if (pool != NULL)
+        pool->run(this, bands);
+    else
+        runRows(0, bands);
+
+    appendUint32(out, bands);
+    for (int b=0; b<bands; b++)
+        appendUint32(out, bandBytes[b]);
+    for (int b=0; b<bands; b++) {
+        const uint8_t *band = &bandData[(size_t)(height * b / bands) * width * 3];
+        out.insert(out.end(), band, band + bandBytes[b]);
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectDepthCodec::runRows(int b0, int b1) {
+
+    int bands = bandBytes.size();
+    for (int b=b0; b<b1; b++) {
+        int y0 = height * b / bands;
+        int y1 = height * (b + 1) / bands;
+        uint8_t *start = &bandData[(size_t)y0 * width * 3];
+        uint8_t *o = start;
+        for (int y=y0; y<y1; y++) {
+            const uint16_t *row = pixels + (size_t)y * width;
+            int prediction = y > y0 ? row[-width] : 0;
+            for (int x=0; x<width; x++) {
+                int delta = row[x] - prediction;
+                prediction = row[x];
+                uint32_t z = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+                while (z >= 0x80) {
+                    *o++ = z | 0x80;
+                    z >>= 7;
+                }
+                *o++ = z;
+            }
+        }
+        bandBytes[b] = o - start;
+    }
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectDepthCodec::decode(const uint8_t *data, size_t size, uint16_t *pixels, int width, int height) {
+
+    if (size < 4)
+        return false;
+    uint32_t bands = readUint32(data);
+    if (bands == 0 || bands > (uint32_t)height || size < 4 + 4 * (size_t)bands)
+        return false;
+
+    const uint8_t *p = data + 4 + 4 * bands;
+    const uint8_t *end = data + size;
+    for (uint32_t b=0; b<bands; b++) {
+        uint32_t bytes = readUint32(data + 4 + 4 * b);
+        if (bytes > (size_t)(end - p))
+            return false;
+        const uint8_t *bandEnd = p + bytes;
+        int y0 = height * b / bands;
+        int y1 = height * (b + 1) / bands;
+        for (int y=y0; y<y1; y++) {
+            uint16_t *row = pixels + (size_t)y * width;
+            int prediction = y > y0 ? row[-width] : 0;
+            for (int x=0; x<width; x++) {
+                uint32_t z = 0;
+                int shift = 0;
+                uint8_t c;
+                do {
+                    if (p >= bandEnd || shift > 14)
+                        return false;
+                    c = *p++;
+                    z |= (uint32_t)(c & 0x7f) << shift;
+                    shift += 7;
+                } while (c & 0x80);
+                prediction += (int)(z >> 1) ^ -(int)(z & 1);
+                row[x] = prediction;
+            }
+        }
+        if (p != bandEnd)
+            return false;
+    }
+    return p == end;
+}
+
+//--------------------------------------------------------------
+ofxFreenectFrameServer::ofxFreenectFrameServer() {
+    listenFd = -1;
+    wakeFds[0] = wakeFds[1] = -1;
+    maxQueueLength = 4;
+    numClients = 0;
+    skipped = dropped = 0;
+    bPending[0] = bPending[1] = false;
+    frameNumber[0] = frameNumber[1] = 0;
+}
+
+//--------------------------------------------------------------
+ofxFreenectFrameServer::~ofxFreenectFrameServer() {
+    close();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameServer::setup(string path, int numThreads, int queueLength) {
+
+    close();
+
+#ifdef OFX_FREENECT_NO_SOCKETS
+    ofLogError("ofxFreenectFrameServer", "Unix domain sockets are not supported on this platform");
+    return false;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        ofLogError("ofxFreenectFrameServer", "socket path is too long: " + path);
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // A socket left behind by a server that died is replaced
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        ofLogError("ofxFreenectFrameServer", "failed to listen on " + path);
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+    if (pipe(wakeFds) < 0) {
+        ofLogError("ofxFreenectFrameServer", "failed to create wake pipe");
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeFds[1], F_SETFL, fcntl(wakeFds[1], F_GETFL) | O_NONBLOCK);
+
+    this->path = path;
+    listenFd = fd;
+    maxQueueLength = MAX(queueLength, 1);
+    numClients = 0;
+    skipped = dropped = 0;
+    bPending[0] = bPending[1] = false;
+    frameNumber[0] = frameNumber[1] = 0;
+
+    pool.setup(numThreads);
+    codec.setWorkerPool(&pool);
+    startThread(true, false);
+    return true;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::close() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    if (listenFd < 0)
+        return;
+    stopThread();
+    wake();
+    waitForThread(false);
+
+    while (clients.size() > 0)
+        removeClient(clients.size() - 1);
+    ::close(listenFd);
+    ::close(wakeFds[0]);
+    ::close(wakeFds[1]);
+    unlink(path.c_str());
+    listenFd = -1;
+    wakeFds[0] = wakeFds[1] = -1;
+    pool.close();
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameServer::isSetup() {
+    return listenFd >= 0;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::publish(freenect_stream stream, const void *data, const freenect_frame_mode & mode, const freenect_frame_info & info) {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    if (listenFd < 0 || numClients == 0)
+        return;
+
+    mutex.lock();
+    if (bPending[stream])
+        skipped++;
+    pending[stream].resize(mode.bytes);
+    memcpy(&pending[stream][0], data, mode.bytes);
+    pendingMode[stream] = mode;
+    pendingInfo[stream] = info;
+    bPending[stream] = true;
+    mutex.unlock();
+
+    wake();
+#endif
+}
+
+//--------------------------------------------------------------
+int ofxFreenectFrameServer::getNumClients() {
+    return numClients;
+}
+
+//--------------------------------------------------------------
+uint64_t ofxFreenectFrameServer::getSkipped() {
+    mutex.lock();
+    uint64_t n = skipped;
+    mutex.unlock();
+    return n;
+}
+
+//--------------------------------------------------------------
+uint64_t ofxFreenectFrameServer::getDropped() {
+    mutex.lock();
+    uint64_t n = dropped;
+    mutex.unlock();
+    return n;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::wake() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    // A full pipe already wakes the thread, so EAGAIN is as good as a write
+    char c = 0;
+    while (write(wakeFds[1], &c, 1) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        if (errno != EINTR) {
+            ofLogWarning("ofxFreenectFrameServer", "failed to wake the server thread");
+            return;
+        }
+    }
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::threadedFunction() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    vector<struct pollfd> fds;
+
+    while (isThreadRunning()) {
+
+        fds.resize(clients.size() + 2);
+        fds[0].fd = wakeFds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = listenFd;
+        fds[1].events = POLLIN;
+        for (size_t i=0; i<clients.size(); i++) {
+            fds[i+2].fd = clients[i]->fd;
+            fds[i+2].events = POLLIN | (clients[i]->queue.empty() ? 0 : POLLOUT);
+        }
+        for (size_t i=0; i<fds.size(); i++)
+            fds[i].revents = 0;
+
+        if (poll(&fds[0], fds.size(), 100) < 0 && errno != EINTR) {
+            ofLogError("ofxFreenectFrameServer", "poll failed");
+            break;
+        }
+        if (!isThreadRunning())
+            break;
+
+        // Clients are handled last to first so they can be removed in place
+        for (int i=fds.size()-3; i>=0; i--) {
+            ofxFreenectServerClient *client = clients[i];
+            short revents = fds[i+2].revents;
+            bool bOk = true;
+            if (revents & (POLLERR | POLLNVAL))
+                bOk = false;
+            if (bOk && (revents & (POLLIN | POLLHUP)))
+                bOk = readClient(client);
+            if (bOk && (revents & POLLOUT))
+                bOk = writeClient(client);
+            if (!bOk)
+                removeClient(i);
+        }
+
+        if (fds[1].revents & POLLIN)
+            acceptClients();
+
+        if (fds[0].revents & POLLIN) {
+            char buffer[64];
+            while (read(wakeFds[0], buffer, sizeof(buffer)) > 0);
+            takeFrame(FREENECT_STREAM_DEPTH);
+            takeFrame(FREENECT_STREAM_VIDEO);
+        }
+    }
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::takeFrame(int stream) {
+
+    mutex.lock();
+    if (!bPending[stream]) {
+        mutex.unlock();
+        return;
+    }
+    swap(pending[stream], taken[stream]);
+    freenect_frame_mode mode = pendingMode[stream];
+    freenect_frame_info info = pendingInfo[stream];
+    bPending[stream] = false;
+    uint32_t number = ++frameNumber[stream];
+    mutex.unlock();
+
+    // Each coding is done once, for all the clients that want it
+    ofxFreenectServerMessage *coded[2] = { NULL, NULL };
+    for (size_t i=0; i<clients.size(); i++) {
+        ofxFreenectServerClient *client = clients[i];
+        if (!client->bHello || !(client->hello.streams & (1 << stream)))
+            continue;
+        if (client->count[stream]++ % client->hello.decimation != 0)
+            continue;
+
+        int coding = OFX_FREENECT_CODING_RAW;
+        if (stream == FREENECT_STREAM_DEPTH && isUnpackedDepth(mode.dummy))
+            coding = client->hello.depthCoding;
+        if (coded[coding] == NULL) {
+            coded[coding] = new ofxFreenectServerMessage();
+            coded[coding]->refs = 1;
+            if (coding == OFX_FREENECT_CODING_DELTA)
+                codec.encode((const uint16_t*)&taken[stream][0], mode.width, mode.height, coded[coding]->data);
+            else
+                coded[coding]->data = taken[stream];
+        }
+
+        ofxFreenectServerFrame header;
+        memset(&header, 0, sizeof(header));
+        header.magic = OFX_FREENECT_SERVER_FRAME_MAGIC;
+        header.stream = stream;
+        header.coding = coding;
+        header.resolution = mode.resolution;
+        header.format = mode.dummy;
+        header.timestamp = info.timestamp;
+        header.number = number;
+        header.payload = coded[coding]->data.size();
+        header.hostTime = info.host_us;
+        header.dropped = client->dropped;
+
+        ofxFreenectServerEntry entry;
+        entry.head.assign((uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+        entry.message = coded[coding];
+        entry.message->refs++;
+        queueMessage(client, entry);
+    }
+    for (int i=0; i<2; i++)
+        if (coded[i] != NULL)
+            releaseMessage(coded[i]);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::acceptClients() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    int fd;
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        ofxFreenectServerClient *client = new ofxFreenectServerClient();
+        client->fd = fd;
+        client->bHello = false;
+        memset(&client->hello, 0, sizeof(client->hello));
+        client->inputBytes = 0;
+        client->count[0] = client->count[1] = 0;
+        client->sent = 0;
+        client->dropped = 0;
+        clients.push_back(client);
+    }
+    mutex.lock();
+    numClients = clients.size();
+    mutex.unlock();
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameServer::readClient(ofxFreenectServerClient *client) {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    while (true) {
+        ssize_t n = recv(client->fd, client->input + client->inputBytes, sizeof(client->input) - client->inputBytes, 0);
+        if (n == 0)
+            return false;
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        client->inputBytes += n;
+        if (client->inputBytes < sizeof(client->input))
+            continue;
+        client->inputBytes = 0;
+
+        // A client may ask again at any time to change what it gets
+        ofxFreenectServerHello hello;
+        memcpy(&hello, client->input, sizeof(hello));
+        if (hello.magic != OFX_FREENECT_SERVER_HELLO_MAGIC || hello.version != OFX_FREENECT_SERVER_VERSION) {
+            ofLogWarning("ofxFreenectFrameServer", "dropping client with an unknown protocol");
+            return false;
+        }
+        hello.streams &= OFX_FREENECT_SERVE_DEPTH | OFX_FREENECT_SERVE_VIDEO;
+        hello.decimation = MAX(hello.decimation, 1u);
+        if (hello.depthCoding != OFX_FREENECT_CODING_DELTA)
+            hello.depthCoding = OFX_FREENECT_CODING_RAW;
+        if (hello.queueLength == 0 || hello.queueLength > (uint32_t)maxQueueLength)
+            hello.queueLength = maxQueueLength;
+        client->hello = hello;
+        client->bHello = true;
+        client->count[0] = client->count[1] = 0;
+
+        ofxFreenectServerEntry entry;
+        entry.head.assign((uint8_t*)&hello, (uint8_t*)&hello + sizeof(hello));
+        entry.message = NULL;
+        client->queue.push_back(entry);
+    }
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameServer::writeClient(ofxFreenectServerClient *client) {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    while (!client->queue.empty()) {
+        ofxFreenectServerEntry & entry = client->queue.front();
+        size_t headBytes = entry.head.size();
+        size_t dataBytes = entry.message != NULL ? entry.message->data.size() : 0;
+
+        struct iovec iov[2];
+        int count = 0;
+        if (client->sent < headBytes) {
+            iov[count].iov_base = &entry.head[client->sent];
+            iov[count].iov_len = headBytes - client->sent;
+            count++;
+        }
+        if (dataBytes > 0) {
+            size_t offset = client->sent > headBytes ? client->sent - headBytes : 0;
+            iov[count].iov_base = &entry.message->data[offset];
+            iov[count].iov_len = dataBytes - offset;
+            count++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        client->sent += n;
+        if (client->sent == headBytes + dataBytes) {
+            if (entry.message != NULL)
+                releaseMessage(entry.message);
+            client->queue.pop_front();
+            client->sent = 0;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::queueMessage(ofxFreenectServerClient *client, ofxFreenectServerEntry & entry) {
+
+    // A client that falls behind loses its oldest frames rather than holding
+    // up the others. The frame being sent and hello replies are kept.
+    while (client->queue.size() >= client->hello.queueLength) {
+        size_t i = client->sent > 0 ? 1 : 0;
+        while (i < client->queue.size() && client->queue[i].message == NULL)
+            i++;
+        if (i >= client->queue.size())
+            break;
+        releaseMessage(client->queue[i].message);
+        client->queue.erase(client->queue.begin() + i);
+        client->dropped++;
+        mutex.lock();
+        dropped++;
+        mutex.unlock();
+    }
+    client->queue.push_back(entry);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::releaseMessage(ofxFreenectServerMessage *message) {
+    if (--message->refs == 0)
+        delete message;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameServer::removeClient(int index) {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    ofxFreenectServerClient *client = clients[index];
+    ::close(client->fd);
+    for (size_t i=0; i<client->queue.size(); i++)
+        if (client->queue[i].message != NULL)
+            releaseMessage(client->queue[i].message);
+    delete client;
+    clients.erase(clients.begin() + index);
+    mutex.lock();
+    numClients = clients.size();
+    mutex.unlock();
+#endif
+}
+
+//--------------------------------------------------------------
+ofxFreenectFrameClient::ofxFreenectFrameClient() {
+    fd = -1;
+    bConnected = false;
+    bOwnsContext = false;
+    ctx = NULL;
+    dev = NULL;
+    streams = decimation = depthCoding = queueLength = 0;
+    received = dropped = 0;
+}
+
+//--------------------------------------------------------------
+ofxFreenectFrameClient::~ofxFreenectFrameClient() {
+    close();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameClient::setup(string path, int streams, int decimation, int depthCoding, int queueLength, freenect_context *ctx) {
+
+    close();
+
+#ifdef OFX_FREENECT_NO_SOCKETS
+    ofLogError("ofxFreenectFrameClient", "Unix domain sockets are not supported on this platform");
+    return false;
+#else
+    bOwnsContext = ctx == NULL;
+    if (bOwnsContext && freenect_init(&ctx, NULL) < 0) {
+        ofLogError("ofxFreenectFrameClient", "init failed");
+        return false;
+    }
+    if (freenect_open_virtual_device(ctx, &dev) < 0) {
+        ofLogError("ofxFreenectFrameClient", "failed to open virtual device");
+        if (bOwnsContext)
+            freenect_shutdown(ctx);
+        dev = NULL;
+        return false;
+    }
+
+    this->ctx = ctx;
+    this->path = path;
+    this->streams = streams;
+    this->decimation = MAX(decimation, 1);
+    this->depthCoding = depthCoding;
+    this->queueLength = MAX(queueLength, 0);
+    received = dropped = 0;
+    startThread(true, false);
+    return true;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameClient::close() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    if (dev == NULL)
+        return;
+    stopThread();
+    waitForThread(false);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    bConnected = false;
+
+    freenect_close_device(dev);
+    dev = NULL;
+    if (bOwnsContext)
+        freenect_shutdown(ctx);
+    ctx = NULL;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameClient::isConnected() {
+    return bConnected;
+}
+
+//--------------------------------------------------------------
+freenect_device *ofxFreenectFrameClient::getDevice() {
+    return dev;
+}
+
+//--------------------------------------------------------------
+uint64_t ofxFreenectFrameClient::getReceived() {
+    lock();
+    uint64_t n = received;
+    unlock();
+    return n;
+}
+
+//--------------------------------------------------------------
+uint64_t ofxFreenectFrameClient::getDropped() {
+    lock();
+    uint64_t n = dropped;
+    unlock();
+    return n;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectFrameClient::threadedFunction() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    while (isThreadRunning()) {
+        if (fd < 0 && !connectServer()) {
+            ofSleepMillis(250);
+            continue;
+        }
+        if (!receiveFrame()) {
+            if (isThreadRunning())
+                ofLogNotice("ofxFreenectFrameClient", "lost connection to " + path);
+            ::close(fd);
+            fd = -1;
+            bConnected = false;
+        }
+    }
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameClient::connectServer() {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    ofxFreenectServerHello hello;
+    hello.magic = OFX_FREENECT_SERVER_HELLO_MAGIC;
+    hello.version = OFX_FREENECT_SERVER_VERSION;
+    hello.streams = streams;
+    hello.decimation = decimation;
+    hello.depthCoding = depthCoding;
+    hello.queueLength = queueLength;
+
+    ofxFreenectServerHello reply;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)
+        || !readFully(&reply, sizeof(reply))
+        || reply.magic != OFX_FREENECT_SERVER_HELLO_MAGIC) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    if (reply.streams != hello.streams || reply.depthCoding != hello.depthCoding)
+        ofLogNotice("ofxFreenectFrameClient", "server did not agree to every stream and coding asked for");
+    bConnected = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameClient::readFully(void *buffer, size_t size) {
+#ifndef OFX_FREENECT_NO_SOCKETS
+    uint8_t *p = (uint8_t*)buffer;
+    while (size > 0) {
+        // Wake up now and then to notice close()
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ready = poll(&pfd, 1, 100);
+        if (!isThreadRunning())
+            return false;
+        if (ready < 0 && errno != EINTR)
+            return false;
+        if (ready <= 0)
+            continue;
+
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectFrameClient::receiveFrame() {
+
+    ofxFreenectServerFrame header;
+    if (!readFully(&header, sizeof(header)) || header.magic != OFX_FREENECT_SERVER_FRAME_MAGIC)
+        return false;
+
+    freenect_frame_mode mode;
+    if (header.stream == FREENECT_STREAM_DEPTH)
+        mode = freenect_find_depth_mode((freenect_resolution)header.resolution, (freenect_depth_format)header.format);
+    else
+        mode = freenect_find_video_mode((freenect_resolution)header.resolution, (freenect_video_format)header.format);
+    if (!mode.is_valid)
+        return false;
+
+    // Never trust a size more than a frame could take
+    bool bDelta = header.stream == FREENECT_STREAM_DEPTH && header.coding == OFX_FREENECT_CODING_DELTA;
+    size_t maxBytes = bDelta ? 4 + 4 * OFX_FREENECT_CODEC_BANDS + (size_t)mode.width * mode.height * 3 : mode.bytes;
+    if ((bDelta && header.payload > maxBytes) || (!bDelta && header.payload != maxBytes))
+        return false;
+    payload.resize(header.payload);
+    if (header.payload > 0 && !readFully(&payload[0], header.payload))
+        return false;
+
+    const void *frame = &payload[0];
+    if (bDelta) {
+        depth.resize(mode.width * mode.height);
+        if (!ofxFreenectDepthCodec::decode(&payload[0], payload.size(), &depth[0], mode.width, mode.height)) {
+            ofLogError("ofxFreenectFrameClient", "received a corrupt depth frame");
+            return false;
+        }
+        frame = &depth[0];
+    }
+
+    if (header.stream == FREENECT_STREAM_DEPTH)
+        freenect_virtual_push_depth(dev, mode, frame, header.timestamp);
+    else
+        freenect_virtual_push_video(dev, mode, frame, header.timestamp);
+
+    lock();
+    received++;
+    dropped = header.dropped;
+    unlock();
+    return true;
+}
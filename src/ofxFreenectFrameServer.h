@@ -0,0 +1,148 @@
+//
+//  ofxFreenectFrameServer.h
+//
+//  Depth and video streamed to local clients over a Unix domain socket,
+//  with depth compressed losslessly.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "libfreenect.h"
+#include "libfreenect_record.h"
+#include "ofxFreenectWorkerPool.h"
+
+// Streams a client can ask for
+#define OFX_FREENECT_SERVE_DEPTH    1
+#define OFX_FREENECT_SERVE_VIDEO    2
+
+// How depth frames are sent
+#define OFX_FREENECT_CODING_RAW     0
+#define OFX_FREENECT_CODING_DELTA   1   // row deltas, zigzag and varint coded
+
+// DEPTH CODEC
+// Lossless depth compression. Each pixel is predicted from its left
+// neighbour (the first of a row from the one above), and the difference is
+// stored in as few bytes as it needs. The frame is cut into bands which are
+// coded independently, in parallel when there is a worker pool.
+class ofxFreenectDepthCodec : public ofxFreenectWorkerJob {
+public:
+    ofxFreenectDepthCodec();
+
+    void setWorkerPool(ofxFreenectWorkerPool *pool);
+
+    // Append the coded frame to out
+    void encode(const uint16_t *pixels, int width, int height, vector<uint8_t> & out);
+
+    // Decode a frame coded by encode(); false if data is not a valid frame of this size
+    static bool decode(const uint8_t *data, size_t size, uint16_t *pixels, int width, int height);
+
+    void runRows(int y0, int y1);
+
+private:
+    ofxFreenectWorkerPool *pool;
+    const uint16_t *pixels;
+    int width, height;
+    vector<uint8_t> bandData;
+    vector<uint32_t> bandBytes;
+};
+
+// SERVER
+struct ofxFreenectServerClient;
+struct ofxFreenectServerMessage;
+struct ofxFreenectServerEntry;
+
+class ofxFreenectFrameServer : public ofThread {
+public:
+    ofxFreenectFrameServer();
+    ~ofxFreenectFrameServer();
+
+    // Listen on the socket at path. Depth is compressed on numThreads workers
+    // besides the server thread; each client may have up to queueLength
+    // frames waiting before its oldest are dropped.
+    bool setup(string path, int numThreads = 2, int queueLength = 4);
+    void close();
+    bool isSetup();
+
+    // Queue a frame for the clients that asked for its stream. Only the data
+    // is copied here; coding and sending happen on the server thread, which
+    // skips frames it could not get to before the next one.
+    void publish(freenect_stream stream, const void *data, const freenect_frame_mode & mode, const freenect_frame_info & info);
+
+    int getNumClients();
+    // Frames the server thread was too busy to pick up
+    uint64_t getSkipped();
+    // Frames dropped from the queues of clients that fell behind
+    uint64_t getDropped();
+
+private:
+    void threadedFunction();
+    void wake();
+    void takeFrame(int stream);
+    void acceptClients();
+    bool readClient(ofxFreenectServerClient *client);
+    bool writeClient(ofxFreenectServerClient *client);
+    void queueMessage(ofxFreenectServerClient *client, ofxFreenectServerEntry & entry);
+    void releaseMessage(ofxFreenectServerMessage *message);
+    void removeClient(int index);
+
+    string path;
+    int listenFd;
+    int wakeFds[2];
+    int maxQueueLength;
+
+    ofxFreenectWorkerPool pool;
+    ofxFreenectDepthCodec codec;
+    vector<ofxFreenectServerClient*> clients;
+
+    // Frames handed over by publish(), one per stream
+    ofMutex mutex;
+    vector<uint8_t> pending[2], taken[2];
+    freenect_frame_mode pendingMode[2];
+    freenect_frame_info pendingInfo[2];
+    bool bPending[2];
+    uint32_t frameNumber[2];
+    int numClients;
+    uint64_t skipped, dropped;
+};
+
+// CLIENT
+// Receives frames from a server and delivers them through a virtual
+// freenect_device, so code written against a live device runs unchanged.
+class ofxFreenectFrameClient : public ofThread {
+public:
+    ofxFreenectFrameClient();
+    ~ofxFreenectFrameClient();
+
+    // Connect to the server at path for every decimation'th frame of the
+    // streams, keeping at most queueLength frames waiting (0 for the server's
+    // limit). Reconnects whenever the server goes away. The virtual device is
+    // opened in ctx, or in a context of the client's own.
+    bool setup(string path, int streams = OFX_FREENECT_SERVE_DEPTH | OFX_FREENECT_SERVE_VIDEO, int decimation = 1, int depthCoding = OFX_FREENECT_CODING_DELTA, int queueLength = 0, freenect_context *ctx = NULL);
+    void close();
+    bool isConnected();
+
+    // Set callbacks, buffers and user data on it as on a device from
+    // freenect_open_device(). Callbacks run on the client's thread.
+    freenect_device *getDevice();
+
+    uint64_t getReceived();
+    // Frames the server dropped because this client fell behind
+    uint64_t getDropped();
+
+private:
+    void threadedFunction();
+    bool connectServer();
+    bool readFully(void *buffer, size_t size);
+    bool receiveFrame();
+
+    string path;
+    int streams, decimation, depthCoding, queueLength;
+    int fd;
+    bool bConnected, bOwnsContext;
+    freenect_context *ctx;
+    freenect_device *dev;
+    vector<uint8_t> payload;
+    vector<uint16_t> depth;
+    uint64_t received, dropped;
+};
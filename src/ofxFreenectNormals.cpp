@@ -0,0 +1,254 @@
+//
+//  ofxFreenectNormals.cpp
+//
+//
+
+#include "ofxFreenectNormals.h"
+
+// Pixels of a row the normal pass works on at a time
+#define OFX_FREENECT_NORMALS_RUN 64
+
+//--------------------------------------------------------------
+ofxFreenectNormals::ofxFreenectNormals() {
+    // Typical values until the device's own are set
+    memset(&zeroPlane, 0, sizeof(zeroPlane));
+    zeroPlane.reference_distance = 120;
+    zeroPlane.reference_pixel_size = 0.1042;
+    bRaysDirty = true;
+    bPacked = false;
+    depth = NULL;
+    width = height = 0;
+    radius = 4;
+    maxDepthChange = 20;
+    pool = NULL;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::setZeroPlane(const freenect_zero_plane_info & zeroPlane) {
+    // Keep the defaults until the device has been read
+    if (zeroPlane.reference_distance <= 0)
+        return;
+    mutex.lock();
+    if (memcmp(&zeroPlane, &this->zeroPlane, sizeof(zeroPlane)) != 0) {
+        this->zeroPlane = zeroPlane;
+        bRaysDirty = true;
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::setRadius(int radius) {
+    this->radius = MAX(radius, 1);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::setMaxDepthChange(float maxDepthChange) {
+    this->maxDepthChange = maxDepthChange;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::setPacked(bool packed) {
+    bPacked = packed;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::setWorkerPool(ofxFreenectWorkerPool *pool) {
+    this->pool = pool;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::update(const uint16_t *depth, int width, int height) {
+
+    mutex.lock();
+
+    if (width != this->width || height != this->height) {
+        int size = (width + 1) * (height + 1);
+        sumX.resize(size);
+        sumY.resize(size);
+        sumZ.resize(size);
+        sumN.resize(size);
+        normals.allocate(width, height, 3);
+        this->width = width;
+        this->height = height;
+        bRaysDirty = true;
+    }
+    if (bPacked)
+        packed.resize(width * height);
+
+    // Camera space is x = ray * z. The zero plane is given for 1280x1024,
+    // which the 640x480 modes crop to 1280x960 and halve.
+    if (bRaysDirty) {
+        double scale = 640.0 / width;
+        double factor = 2 * zeroPlane.reference_pixel_size / zeroPlane.reference_distance;
+        rayX.resize(width);
+        rayY.resize(height);
+        for (int x=0; x<width; x++)
+            rayX[x] = (x - width / 2) * scale * factor;
+        for (int y=0; y<height; y++)
+            rayY[y] = (y - height / 2) * scale * factor;
+        bRaysDirty = false;
+    }
+
+    // Summed area tables of x, y, z and the number of readings, so any
+    // window's mean point costs four lookups
+    const int stride = width + 1;
+    double *IX = &sumX[0], *IY = &sumY[0], *IZ = &sumZ[0], *IN = &sumN[0];
+    for (int x=0; x<stride; x++)
+        IX[x] = IY[x] = IZ[x] = IN[x] = 0;
+    for (int y=0; y<height; y++) {
+        const uint16_t *d = depth + y * width;
+        const int above = y * stride + 1, row = (y + 1) * stride;
+        double sx = 0, sy = 0, sz = 0, sn = 0;
+        double ry = rayY[y];
+        IX[row] = IY[row] = IZ[row] = IN[row] = 0;
+        for (int x=0; x<width; x++) {
+            double z = d[x];
+            sx += rayX[x] * z;
+            sy += ry * z;
+            sz += z;
+            sn += d[x] != 0;
+            IX[row + x + 1] = IX[above + x] + sx;
+            IY[row + x + 1] = IY[above + x] + sy;
+            IZ[row + x + 1] = IZ[above + x] + sz;
+            IN[row + x + 1] = IN[above + x] + sn;
+        }
+    }
+
+    this->depth = depth;
+    if (pool != NULL)
+        pool->run(this, height);
+    else
+        runRows(0, height);
+
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::runRows(int y0, int y1) {
+
+    const int r = radius;
+    const int w = width;
+    const int stride = w + 1;
+    const double *IX = &sumX[0], *IY = &sumY[0], *IZ = &sumZ[0], *IN = &sumN[0];
+    const float *rays = &rayX[0];
+    // Each half window must have at least half its pixels
+    const double minCount = r * (2 * r + 1) / 2;
+    const double change = maxDepthChange * 0.001 * r;
+    double cxs[OFX_FREENECT_NORMALS_RUN], cys[OFX_FREENECT_NORMALS_RUN], czs[OFX_FREENECT_NORMALS_RUN];
+    double lengths[OFX_FREENECT_NORMALS_RUN];
+
+    for (int y=y0; y<y1; y++) {
+        const uint16_t *d = depth + y * w;
+        float *out = normals.getPixels() + y * w * 3;
+        uint32_t *pack = bPacked ? &packed[y * w] : NULL;
+
+        // Pixels too close to the border get no normal
+        memset(out, 0, w * 3 * sizeof(float));
+        if (pack != NULL)
+            memset(pack, 0, w * sizeof(uint32_t));
+        if (y < r || y + r >= height)
+            continue;
+
+        // Rows of the corners of the (2r+1) square around a pixel and of the
+        // pixel's own row
+        const int top = (y - r) * stride, mid = y * stride, below = (y + 1) * stride, bottom = (y + r + 1) * stride;
+        const double ry = rayY[y];
+
+        for (int x0=r; x0<w-r; x0+=OFX_FREENECT_NORMALS_RUN) {
+            const int len = MIN(OFX_FREENECT_NORMALS_RUN, w - r - x0);
+
+            // Every pixel of the run is worked out and the rejected ones
+            // zeroed, so the loop has no branches. gcc won't vectorize a
+            // select whose operands need computing, hence only constants are
+            // selected and the divisors are kept at 1 or more.
+            for (int i=0; i<len; i++) {
+                const int x = x0 + i;
+                const int a = top + x - r, b = top + x, c = top + x + 1, e = top + x + r + 1;
+                const int f = mid + x - r, g = mid + x + r + 1;
+                const int h = below + x - r, k = below + x + r + 1;
+                const int l = bottom + x - r, m = bottom + x, o = bottom + x + 1, p = bottom + x + r + 1;
+
+                // Left, right, top and bottom halves of the window
+                double ln = IN[m] - IN[b] - IN[l] + IN[a], rn = IN[p] - IN[e] - IN[o] + IN[c];
+                double tn = IN[g] - IN[e] - IN[f] + IN[a], bn = IN[p] - IN[k] - IN[l] + IN[h];
+                double keep = 1;
+                keep = ln >= minCount ? keep : 0.0;
+                keep = rn >= minCount ? keep : 0.0;
+                keep = tn >= minCount ? keep : 0.0;
+                keep = bn >= minCount ? keep : 0.0;
+                ln += ln < 1 ? 1.0 : 0.0;
+                rn += rn < 1 ? 1.0 : 0.0;
+                tn += tn < 1 ? 1.0 : 0.0;
+                bn += bn < 1 ? 1.0 : 0.0;
+
+                double lx = (IX[m] - IX[b] - IX[l] + IX[a]) / ln, ly = (IY[m] - IY[b] - IY[l] + IY[a]) / ln, lz = (IZ[m] - IZ[b] - IZ[l] + IZ[a]) / ln;
+                double rx = (IX[p] - IX[e] - IX[o] + IX[c]) / rn, ry_ = (IY[p] - IY[e] - IY[o] + IY[c]) / rn, rz = (IZ[p] - IZ[e] - IZ[o] + IZ[c]) / rn;
+                double tx = (IX[g] - IX[e] - IX[f] + IX[a]) / tn, ty = (IY[g] - IY[e] - IY[f] + IY[a]) / tn, tz = (IZ[g] - IZ[e] - IZ[f] + IZ[a]) / tn;
+                double bx = (IX[p] - IX[k] - IX[l] + IX[h]) / bn, by = (IY[p] - IY[k] - IY[l] + IY[h]) / bn, bz = (IZ[p] - IZ[k] - IZ[l] + IZ[h]) / bn;
+
+                // Tangents across and down; a jump in depth means an edge
+                double hx = rx - lx, hy = ry_ - ly, hz = rz - lz;
+                double vx = bx - tx, vy = by - ty, vz = bz - tz;
+                double z = d[x];
+                double limit = change * z;
+                keep = z != 0 ? keep : 0.0;
+                keep = fabs(hz) <= limit ? keep : 0.0;
+                keep = fabs(vz) <= limit ? keep : 0.0;
+
+                double cx = vy * hz - vz * hy;
+                double cy = vz * hx - vx * hz;
+                double cz = vx * hy - vy * hx;
+                double length2 = cx * cx + cy * cy + cz * cz;
+                keep = length2 > 0 ? keep : 0.0;
+                // Face the camera
+                double sign = cx * rays[x] + cy * ry + cz > 0 ? -keep : keep;
+                cxs[i] = sign * cx;
+                cys[i] = sign * cy;
+                czs[i] = sign * cz;
+                lengths[i] = length2 + (length2 > 0 ? 0.0 : 1.0);
+            }
+
+            // sqrt() only vectorizes where it needn't set errno, as with
+            // clang on Apple platforms or -fno-math-errno. Adding 0 turns the
+            // -0 of rejected pixels into 0.
+            float *dst = out + x0 * 3;
+            for (int i=0; i<len; i++) {
+                double length = sqrt(lengths[i]);
+                dst[i * 3] = cxs[i] / length + 0.0;
+                dst[i * 3 + 1] = cys[i] / length + 0.0;
+                dst[i * 3 + 2] = czs[i] / length + 0.0;
+            }
+            if (pack != NULL) {
+                for (int i=0; i<len; i++) {
+                    const float *n = dst + i * 3;
+                    uint32_t valid = (n[0] != 0) | (n[1] != 0) | (n[2] != 0);
+                    uint32_t word = (1u << 30)
+                        | ((uint32_t)(n[0] * 511.5f + 512) & 0x3ff)
+                        | ((uint32_t)(n[1] * 511.5f + 512) & 0x3ff) << 10
+                        | ((uint32_t)(n[2] * 511.5f + 512) & 0x3ff) << 20;
+                    pack[x0 + i] = word & (0 - valid);
+                }
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------
+ofFloatPixels & ofxFreenectNormals::getNormals() {
+    return normals;
+}
+
+//--------------------------------------------------------------
+const vector<uint32_t> & ofxFreenectNormals::getPackedNormals() {
+    return packed;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::lock() {
+    mutex.lock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectNormals::unlock() {
+    mutex.unlock();
+}
@@ -0,0 +1,68 @@
+//
+//  ofxFreenectNormals.h
+//
+//  Smoothed surface normals for every pixel of a depth frame in mm.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "libfreenect_registration.h"
+#include "ofxFreenectWorkerPool.h"
+
+class ofxFreenectNormals : public ofxFreenectWorkerJob {
+public:
+    ofxFreenectNormals();
+
+    // Camera geometry, from freenect_copy_registration()
+    void setZeroPlane(const freenect_zero_plane_info & zeroPlane);
+
+    // Normals average the surface over (2 * radius + 1)^2 pixels
+    void setRadius(int radius);
+
+    // Pixels where the surface jumps by more than maxDepthChange mm per
+    // metre of distance within the window get no normal
+    void setMaxDepthChange(float maxDepthChange);
+
+    // Also pack the normals into 10:10:10 words, see getPackedNormals()
+    void setPacked(bool packed);
+
+    // Split the normal pass into bands of rows on the pool's threads
+    void setWorkerPool(ofxFreenectWorkerPool *pool);
+
+    // Estimate normals from a frame in mm, 0 meaning no reading
+    void update(const uint16_t *depth, int width, int height);
+
+    // Unit normals facing the camera, (0, 0, 0) where there is none. Hold
+    // the lock while reading them if update() runs on another thread.
+    ofFloatPixels & getNormals();
+
+    // x, y and z mapped from [-1, 1] to 0..1023 in bits 0-9, 10-19 and 20-29;
+    // bit 30 is set where there is a normal
+    const vector<uint32_t> & getPackedNormals();
+
+    void lock();
+    void unlock();
+
+private:
+    void runRows(int y0, int y1);
+
+    // Summed area tables of the camera space points and how many there are,
+    // one plane each so the normal pass vectorizes across a row
+    vector<double> sumX, sumY, sumZ, sumN;
+    vector<float> rayX, rayY;
+    freenect_zero_plane_info zeroPlane;
+    bool bRaysDirty;
+
+    ofFloatPixels normals;
+    vector<uint32_t> packed;
+    bool bPacked;
+
+    const uint16_t *depth;
+    int width, height;
+    int radius;
+    float maxDepthChange;
+
+    ofxFreenectWorkerPool *pool;
+    ofMutex mutex;
+};
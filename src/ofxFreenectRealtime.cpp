@@ -0,0 +1,104 @@
+//
+//  ofxFreenectRealtime.cpp
+//
+//
+
+#include "ofxFreenectRealtime.h"
+
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+//--------------------------------------------------------------
+bool ofxFreenectThreadConfig::apply() const {
+
+    bool bOk = true;
+
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+    if (cpus.size() > 0) {
+        DWORD_PTR mask = 0;
+        for (size_t i=0; i<cpus.size(); i++)
+            if (cpus[i] >= 0 && cpus[i] < (int)sizeof(mask) * 8)
+                mask |= (DWORD_PTR)1 << cpus[i];
+        if (mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+            ofLogWarning("ofxFreenectThreadConfig", "failed to set thread affinity");
+            bOk = false;
+        }
+    }
+    // Windows has no real-time policies for threads, only its highest priority
+    if (!SetThreadPriority(GetCurrentThread(), priority > 0 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_NORMAL)) {
+        ofLogWarning("ofxFreenectThreadConfig", "failed to set thread priority");
+        bOk = false;
+    }
+#else
+    if (cpus.size() > 0) {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i=0; i<cpus.size(); i++)
+            if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            ofLogWarning("ofxFreenectThreadConfig", "failed to set thread affinity");
+            bOk = false;
+        }
+#else
+        ofLogWarning("ofxFreenectThreadConfig", "thread affinity is not supported on this platform");
+        bOk = false;
+#endif
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    int policy = SCHED_OTHER;
+    if (priority > 0) {
+        policy = bRoundRobin ? SCHED_RR : SCHED_FIFO;
+        param.sched_priority = ofClamp(priority, sched_get_priority_min(policy), sched_get_priority_max(policy));
+    }
+    if (pthread_setschedparam(pthread_self(), policy, &param) != 0) {
+        ofLogWarning("ofxFreenectThreadConfig", priority > 0 ? "real-time scheduling was refused" : "failed to restore normal scheduling");
+        bOk = false;
+    }
+#endif
+
+    return bOk;
+}
+
+//--------------------------------------------------------------
+ofxFreenectLockedMemory::~ofxFreenectLockedMemory() {
+    unlockAll();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectLockedMemory::lock(void *data, size_t bytes) {
+
+    if (data == NULL || bytes == 0)
+        return false;
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+    bool bOk = VirtualLock(data, bytes) != 0;
+#else
+    bool bOk = mlock(data, bytes) == 0;
+#endif
+    if (!bOk) {
+        ofLogWarning("ofxFreenectLockedMemory", "failed to lock " + ofToString(bytes) + " bytes in memory");
+        return false;
+    }
+    regions.push_back(make_pair(data, bytes));
+    return true;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectLockedMemory::unlockAll() {
+    for (size_t i=0; i<regions.size(); i++) {
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+        VirtualUnlock(regions[i].first, regions[i].second);
+#else
+        munlock(regions[i].first, regions[i].second);
+#endif
+    }
+    regions.clear();
+}
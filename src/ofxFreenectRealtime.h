@@ -0,0 +1,38 @@
+//
+//  ofxFreenectRealtime.h
+//
+//  CPU affinity, real-time priority and locked memory for capture threads.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+// THREAD CONFIG
+// Scheduling for a thread, applied by the thread itself. Real-time
+// priorities need CAP_SYS_NICE or an RTPRIO limit on Linux; when the OS
+// refuses, the thread keeps its normal scheduling.
+struct ofxFreenectThreadConfig {
+    ofxFreenectThreadConfig() : priority(0), bRoundRobin(false) {}
+
+    vector<int> cpus;   // cores the thread may run on, any if empty
+    int priority;       // 1 (lowest) to 99 for real time, 0 for normal scheduling
+    bool bRoundRobin;   // SCHED_RR rather than SCHED_FIFO
+
+    // Apply to the calling thread; false if any part was refused
+    bool apply() const;
+};
+
+// LOCKED MEMORY
+// Keeps buffers resident, so writing a frame into them never waits on the
+// pager. Locks are released by unlockAll() or when this is destroyed.
+class ofxFreenectLockedMemory {
+public:
+    ~ofxFreenectLockedMemory();
+
+    bool lock(void *data, size_t bytes);
+    void unlockAll();
+
+private:
+    vector<pair<void*, size_t> > regions;
+};
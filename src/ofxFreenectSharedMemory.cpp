@@ -0,0 +1,346 @@
+//
+//  ofxFreenectSharedMemory.cpp
+//
+//
+
+#include "ofxFreenectSharedMemory.h"
+
+#if defined(_MSC_VER) || defined(_WIN32) || defined(WIN32) || defined(__MINGW32__)
+#define OFX_FREENECT_NO_SHM
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define OFX_FREENECT_SHM_MAGIC      0x4b4e5348  // "KNSH"
+#define OFX_FREENECT_SHM_VERSION    1
+#define OFX_FREENECT_SHM_MAX_SLOTS  16
+#define OFX_FREENECT_SHM_ALIGN      4096
+
+#if defined(_MSC_VER)
+#define ofxFreenectBarrier() MemoryBarrier()
+#else
+#define ofxFreenectBarrier() __sync_synchronize()
+#endif
+
+// Each slot is guarded by a sequence number which is odd while the slot is
+// being written, so readers never lock anything the publisher waits on
+struct ofxFreenectSharedSlot {
+    volatile uint32_t sequence;
+    volatile uint32_t number;
+    int32_t width, height, bytes, format;
+    uint32_t timestamp;
+    uint64_t hostTime;
+};
+
+struct ofxFreenectSharedHeader {
+    volatile uint32_t magic;
+    uint32_t version;
+    uint64_t size;          // of the whole mapping
+    uint32_t numSlots;
+    uint32_t slotBytes;     // data bytes per slot
+    uint64_t dataOffset;    // of slot 0, then every slotBytes
+    volatile uint32_t closed;
+    volatile uint32_t latest;   // number of the newest frame, 0 before the first
+    ofxFreenectSharedSlot slots[OFX_FREENECT_SHM_MAX_SLOTS];
+};
+
+//--------------------------------------------------------------
+static string shmName(const string & name) {
+    return name.size() > 0 && name[0] == '/' ? name : "/" + name;
+}
+
+//--------------------------------------------------------------
+static const uint8_t* slotData(const ofxFreenectSharedHeader *header, int slot) {
+    return (const uint8_t*)header + header->dataOffset + (uint64_t)slot * header->slotBytes;
+}
+
+#ifndef OFX_FREENECT_NO_SHM
+//--------------------------------------------------------------
+// Mark a ring that is still there as closed, so clients of a publisher that
+// died without closing it let go of it and attach to the new one
+static void closeStale(const string & path) {
+    int fd = shm_open(path.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ofxFreenectSharedHeader)) {
+        ::close(fd);
+        return;
+    }
+    void *mem = mmap(NULL, sizeof(ofxFreenectSharedHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        return;
+    ofxFreenectSharedHeader *old = (ofxFreenectSharedHeader*)mem;
+    if (old->magic == OFX_FREENECT_SHM_MAGIC) {
+        old->closed = 1;
+        ofxFreenectBarrier();
+    }
+    munmap(mem, sizeof(ofxFreenectSharedHeader));
+}
+#endif
+
+//--------------------------------------------------------------
+ofxFreenectSharedPublisher::ofxFreenectSharedPublisher() {
+    header = NULL;
+    size = 0;
+}
+
+//--------------------------------------------------------------
+ofxFreenectSharedPublisher::~ofxFreenectSharedPublisher() {
+    close();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedPublisher::setup(string name, int maxBytes, int numSlots) {
+
+    close();
+
+#ifdef OFX_FREENECT_NO_SHM
+    ofLogError("ofxFreenectSharedPublisher", "shared memory is not supported on this platform");
+    return false;
+#else
+    numSlots = ofClamp(numSlots, 2, OFX_FREENECT_SHM_MAX_SLOTS);
+    size_t slotBytes = (maxBytes + OFX_FREENECT_SHM_ALIGN - 1) / OFX_FREENECT_SHM_ALIGN * OFX_FREENECT_SHM_ALIGN;
+    size_t dataOffset = (sizeof(ofxFreenectSharedHeader) + OFX_FREENECT_SHM_ALIGN - 1) / OFX_FREENECT_SHM_ALIGN * OFX_FREENECT_SHM_ALIGN;
+    size_t total = dataOffset + slotBytes * numSlots;
+
+    // A ring left behind by a publisher that died is replaced; its clients
+    // keep their old mapping until they see it closed
+    string path = shmName(name);
+    closeStale(path);
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        ofLogError("ofxFreenectSharedPublisher", "failed to create " + path);
+        return false;
+    }
+    if (ftruncate(fd, total) < 0) {
+        ofLogError("ofxFreenectSharedPublisher", "failed to size " + path);
+        ::close(fd);
+        shm_unlink(path.c_str());
+        return false;
+    }
+    void *mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        ofLogError("ofxFreenectSharedPublisher", "failed to map " + path);
+        shm_unlink(path.c_str());
+        return false;
+    }
+
+    header = (ofxFreenectSharedHeader*)mem;
+    header->version = OFX_FREENECT_SHM_VERSION;
+    header->size = total;
+    header->numSlots = numSlots;
+    header->slotBytes = slotBytes;
+    header->dataOffset = dataOffset;
+    header->closed = 0;
+    header->latest = 0;
+    // Clients only trust the header once the magic is there
+    ofxFreenectBarrier();
+    header->magic = OFX_FREENECT_SHM_MAGIC;
+
+    this->name = path;
+    size = total;
+    return true;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectSharedPublisher::close() {
+#ifndef OFX_FREENECT_NO_SHM
+    if (header == NULL)
+        return;
+    header->closed = 1;
+    ofxFreenectBarrier();
+    munmap(header, size);
+    shm_unlink(name.c_str());
+    header = NULL;
+    size = 0;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedPublisher::isSetup() {
+    return header != NULL;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectSharedPublisher::publish(const void *data, const freenect_frame_mode & mode, const freenect_frame_info & info) {
+
+    if (header == NULL)
+        return;
+    if (mode.bytes > (int)header->slotBytes) {
+        ofLogError("ofxFreenectSharedPublisher", "frame is larger than the ring's slots");
+        return;
+    }
+
+    uint32_t number = header->latest + 1;
+    if (number == 0)
+        number = 1;
+    int index = number % header->numSlots;
+    ofxFreenectSharedSlot & slot = header->slots[index];
+
+    slot.sequence++;
+    ofxFreenectBarrier();
+    memcpy((uint8_t*)slotData(header, index), data, mode.bytes);
+    slot.number = number;
+    slot.width = mode.width;
+    slot.height = mode.height;
+    slot.bytes = mode.bytes;
+    slot.format = mode.dummy;
+    slot.timestamp = info.timestamp;
+    slot.hostTime = info.host_us;
+    ofxFreenectBarrier();
+    slot.sequence++;
+    ofxFreenectBarrier();
+    header->latest = number;
+}
+
+//--------------------------------------------------------------
+ofxFreenectSharedClient::ofxFreenectSharedClient() {
+    header = NULL;
+    size = 0;
+    lastNumber = 0;
+    skipped = 0;
+}
+
+//--------------------------------------------------------------
+ofxFreenectSharedClient::~ofxFreenectSharedClient() {
+    close();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::setup(string name) {
+
+    close();
+
+#ifdef OFX_FREENECT_NO_SHM
+    ofLogError("ofxFreenectSharedClient", "shared memory is not supported on this platform");
+    return false;
+#else
+    string path = shmName(name);
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ofxFreenectSharedHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        return false;
+
+    const ofxFreenectSharedHeader *h = (const ofxFreenectSharedHeader*)mem;
+    ofxFreenectBarrier();
+    if (h->magic != OFX_FREENECT_SHM_MAGIC || h->version != OFX_FREENECT_SHM_VERSION || h->size != (uint64_t)st.st_size) {
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    this->name = path;
+    header = h;
+    size = st.st_size;
+    lastNumber = h->latest;
+    skipped = 0;
+    return true;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxFreenectSharedClient::close() {
+#ifndef OFX_FREENECT_NO_SHM
+    if (header == NULL)
+        return;
+    munmap((void*)header, size);
+    header = NULL;
+    size = 0;
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::isConnected() {
+    return header != NULL && !header->closed;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::getLatest(ofxFreenectSharedFrame & frame) {
+
+    // Follow a publisher that restarted
+    if (header != NULL && header->closed)
+        close();
+    if (header == NULL && (name.empty() || !setup(name)))
+        return false;
+
+    uint32_t number = header->latest;
+    ofxFreenectBarrier();
+    if (number == lastNumber)
+        return false;
+
+    int index = number % header->numSlots;
+    const ofxFreenectSharedSlot & slot = header->slots[index];
+    uint32_t sequence = slot.sequence;
+    ofxFreenectBarrier();
+    // Already being reused; the next call will find a newer frame
+    if ((sequence & 1) || slot.number != number)
+        return false;
+
+    frame.data = slotData(header, index);
+    frame.width = slot.width;
+    frame.height = slot.height;
+    frame.bytes = slot.bytes;
+    frame.format = slot.format;
+    frame.timestamp = slot.timestamp;
+    frame.hostTime = slot.hostTime;
+    frame.number = number;
+    frame.slot = index;
+    frame.slotSequence = sequence;
+    if (!isIntact(frame))
+        return false;
+
+    if (lastNumber != 0)
+        skipped += number - lastNumber - 1;
+    lastNumber = number;
+    return true;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::isIntact(const ofxFreenectSharedFrame & frame) {
+    ofxFreenectBarrier();
+    return header != NULL && header->slots[frame.slot].sequence == frame.slotSequence;
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::copyLatest(ofPixels & pixels) {
+    ofxFreenectSharedFrame frame;
+    if (!getLatest(frame) || frame.width * frame.height == 0)
+        return false;
+    int channels = frame.bytes / (frame.width * frame.height);
+    if (pixels.getWidth() != frame.width || pixels.getHeight() != frame.height || pixels.getNumChannels() != channels)
+        pixels.allocate(frame.width, frame.height, channels);
+    memcpy(pixels.getPixels(), frame.data, frame.width * frame.height * channels);
+    return isIntact(frame);
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectSharedClient::copyLatest(ofShortPixels & pixels) {
+    ofxFreenectSharedFrame frame;
+    if (!getLatest(frame) || frame.bytes != frame.width * frame.height * 2)
+        return false;
+    if (pixels.getWidth() != frame.width || pixels.getHeight() != frame.height)
+        pixels.allocate(frame.width, frame.height, 1);
+    memcpy(pixels.getPixels(), frame.data, frame.bytes);
+    return isIntact(frame);
+}
+
+//--------------------------------------------------------------
+uint64_t ofxFreenectSharedClient::getSkipped() {
+    return skipped;
+}
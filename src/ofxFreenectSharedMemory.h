@@ -0,0 +1,81 @@
+//
+//  ofxFreenectSharedMemory.h
+//
+//  Frames published into a POSIX shared memory ring, read by other processes
+//  without copying.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "libfreenect.h"
+
+// A frame in the ring. data points into shared memory and may be overwritten
+// by the publisher at any time; check isIntact() after using it.
+struct ofxFreenectSharedFrame {
+    const void *data;
+    int width, height, bytes;
+    int format;             // freenect_video_format or freenect_depth_format
+    uint32_t timestamp;     // camera timestamp
+    uint64_t hostTime;      // capture time on the freenect_get_time_us() clock, the same in every process
+    uint32_t number;        // counts published frames from 1
+
+    // Where the frame lives, for isIntact()
+    int slot;
+    uint32_t slotSequence;
+};
+
+struct ofxFreenectSharedHeader;
+
+// PUBLISHER
+class ofxFreenectSharedPublisher {
+public:
+    ofxFreenectSharedPublisher();
+    ~ofxFreenectSharedPublisher();
+
+    // Create the ring called name with numSlots frames of up to maxBytes.
+    // Readers get numSlots - 1 frame times to use a frame before it is reused.
+    bool setup(string name, int maxBytes, int numSlots = 4);
+    void close();
+    bool isSetup();
+
+    void publish(const void *data, const freenect_frame_mode & mode, const freenect_frame_info & info);
+
+private:
+    string name;
+    ofxFreenectSharedHeader *header;
+    size_t size;
+};
+
+// CLIENT
+class ofxFreenectSharedClient {
+public:
+    ofxFreenectSharedClient();
+    ~ofxFreenectSharedClient();
+
+    // Map the ring called name read only. Fails until a publisher has set it up.
+    bool setup(string name);
+    void close();
+    bool isConnected();
+
+    // The newest frame, if one was published since the last call. Frames
+    // published in between are skipped.
+    bool getLatest(ofxFreenectSharedFrame & frame);
+
+    // Whether the frame is still untouched by the publisher
+    bool isIntact(const ofxFreenectSharedFrame & frame);
+
+    // Copy the newest frame, if there is a new one that survives the copy
+    bool copyLatest(ofPixels & pixels);
+    bool copyLatest(ofShortPixels & pixels);
+
+    // Frames published but never returned by getLatest()
+    uint64_t getSkipped();
+
+private:
+    string name;
+    const ofxFreenectSharedHeader *header;
+    size_t size;
+    uint32_t lastNumber;
+    uint64_t skipped;
+};
@@ -0,0 +1,432 @@
+//
+//  ofxFreenectVoxelGrid.cpp
+//
+//
+
+#include "ofxFreenectVoxelGrid.h"
+
+// Voxel keys hold x, y and z offset by the bias in 21 bits each; brick keys
+// the same without the low 3 bits, in 18 bits each
+#define OFX_FREENECT_VOXEL_BITS     21
+#define OFX_FREENECT_VOXEL_BIAS     (1 << (OFX_FREENECT_VOXEL_BITS - 1))
+#define OFX_FREENECT_VOXEL_MASK     ((1 << OFX_FREENECT_VOXEL_BITS) - 1)
+#define OFX_FREENECT_BRICK_BITS     (OFX_FREENECT_VOXEL_BITS - 3)
+#define OFX_FREENECT_BRICK_MASK     ((1 << OFX_FREENECT_BRICK_BITS) - 1)
+
+//--------------------------------------------------------------
+static inline uint64_t brickKeyOf(uint64_t voxelKey) {
+    return ((voxelKey >> 3) & OFX_FREENECT_BRICK_MASK)
+        | ((voxelKey >> (OFX_FREENECT_VOXEL_BITS + 3)) & OFX_FREENECT_BRICK_MASK) << OFX_FREENECT_BRICK_BITS
+        | ((voxelKey >> (2 * OFX_FREENECT_VOXEL_BITS + 3)) & OFX_FREENECT_BRICK_MASK) << (2 * OFX_FREENECT_BRICK_BITS);
+}
+
+//--------------------------------------------------------------
+// Index of a voxel within its brick, x fastest
+static inline int voxelIndexOf(uint64_t voxelKey) {
+    return (int)(voxelKey & 7)
+        | (int)((voxelKey >> OFX_FREENECT_VOXEL_BITS) & 7) << 3
+        | (int)((voxelKey >> (2 * OFX_FREENECT_VOXEL_BITS)) & 7) << 6;
+}
+
+//--------------------------------------------------------------
+static inline uint32_t hashBrick(uint64_t key) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+//--------------------------------------------------------------
+ofxFreenectVoxelGrid::ofxFreenectVoxelGrid() {
+    // Typical values until the device's own are set
+    memset(&zeroPlane, 0, sizeof(zeroPlane));
+    zeroPlane.reference_distance = 120;
+    zeroPlane.reference_pixel_size = 0.1042;
+    bRaysDirty = true;
+    bBrickPass = false;
+    focal = 0;
+    maxBricks = 65536;
+    depth = NULL;
+    width = height = 0;
+    voxelSize = 50;
+    minDepth = 500;
+    maxDepth = 4000;
+    step = 1;
+    hit = 64;
+    miss = 32;
+    decay = 1;
+    threshold = 128;
+    pool = NULL;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setZeroPlane(const freenect_zero_plane_info & zeroPlane) {
+    // Keep the defaults until the device has been read
+    if (zeroPlane.reference_distance <= 0)
+        return;
+    mutex.lock();
+    if (memcmp(&zeroPlane, &this->zeroPlane, sizeof(zeroPlane)) != 0) {
+        this->zeroPlane = zeroPlane;
+        bRaysDirty = true;
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setVoxelSize(float size) {
+    mutex.lock();
+    size = MAX(size, 1);
+    if (size != voxelSize) {
+        voxelSize = size;
+        bricks.clear();
+        table.clear();
+        changed.clear();
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+float ofxFreenectVoxelGrid::getVoxelSize() {
+    return voxelSize;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setDepthRange(uint16_t minDepth, uint16_t maxDepth) {
+    this->minDepth = MAX(minDepth, 1);
+    this->maxDepth = maxDepth;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setPixelStep(int step) {
+    this->step = MAX(step, 1);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setWeights(int hit, int miss, int decay, int threshold) {
+    this->hit = ofClamp(hit, 0, 255);
+    this->miss = ofClamp(miss, 0, 255);
+    this->decay = ofClamp(decay, 0, 255);
+    this->threshold = ofClamp(threshold, 1, 255);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setMaxBricks(int maxBricks) {
+    this->maxBricks = MAX(maxBricks, 1);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::setWorkerPool(ofxFreenectWorkerPool *pool) {
+    this->pool = pool;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::update(const uint16_t *depth, int width, int height) {
+
+    mutex.lock();
+
+    if (width != this->width || height != this->height) {
+        rowHits.resize(height);
+        this->width = width;
+        this->height = height;
+        bRaysDirty = true;
+    }
+
+    // Camera space is x = ray * z, as in ofxFreenectNormals
+    if (bRaysDirty) {
+        double scale = 640.0 / width;
+        double factor = 2 * zeroPlane.reference_pixel_size / zeroPlane.reference_distance;
+        rayX.resize(width);
+        rayY.resize(height);
+        for (int x=0; x<width; x++)
+            rayX[x] = (x - width / 2) * scale * factor;
+        for (int y=0; y<height; y++)
+            rayY[y] = (y - height / 2) * scale * factor;
+        focal = 1 / (scale * factor);
+        bRaysDirty = false;
+    }
+
+    // Voxels with readings, in bands of rows
+    this->depth = depth;
+    bBrickPass = false;
+    if (pool != NULL)
+        pool->run(this, height);
+    else
+        runRows(0, height);
+
+    // Mark them in their bricks. Neighbouring readings mostly share a
+    // brick, so the table is only searched when it changes.
+    uint64_t lastKey = ~0ULL;
+    int last = -1;
+    for (int y=0; y<height; y++) {
+        const vector<uint64_t> & hits = rowHits[y];
+        for (size_t i=0; i<hits.size(); i++) {
+            uint64_t key = brickKeyOf(hits[i]);
+            if (key != lastKey) {
+                last = findBrick(key);
+                if (last < 0)
+                    last = addBrick(key);
+                lastKey = key;
+            }
+            if (last >= 0) {
+                int v = voxelIndexOf(hits[i]);
+                bricks[last].hits[v >> 6] |= 1ULL << (v & 63);
+            }
+        }
+    }
+
+    // Hits, free space and decay for every brick, in batches
+    bBrickPass = true;
+    if (pool != NULL)
+        pool->run(this, bricks.size());
+    else
+        runRows(0, bricks.size());
+    this->depth = NULL;
+
+    changed.clear();
+    int empty = 0;
+    for (size_t i=0; i<bricks.size(); i++) {
+        if (bricks[i].bChanged)
+            changed.push_back(bricks[i].key);
+        empty += bricks[i].bEmpty;
+    }
+    // Bricks that have decayed away are dropped once they make up a quarter
+    if (empty * 4 > (int)bricks.size())
+        compact();
+
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::runRows(int y0, int y1) {
+    if (bBrickPass)
+        updateBricks(y0, y1);
+    else
+        integrateRows(y0, y1);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::integrateRows(int y0, int y1) {
+
+    const float scale = 1 / voxelSize;
+    vector<float> vx(width), vy(width), vz(width);
+
+    for (int y=y0; y<y1; y++) {
+        vector<uint64_t> & hits = rowHits[y];
+        hits.clear();
+        if (y % step != 0)
+            continue;
+
+        // Points in voxel units, one plane per axis so the loop vectorizes
+        const uint16_t *d = depth + y * width;
+        const float ry = rayY[y];
+        for (int x=0; x<width; x++) {
+            float z = d[x] * scale;
+            vx[x] = rayX[x] * z;
+            vy[x] = ry * z;
+            vz[x] = z;
+        }
+
+        uint64_t last = ~0ULL;
+        for (int x=0; x<width; x+=step) {
+            if (d[x] < minDepth || d[x] > maxDepth)
+                continue;
+            uint64_t key = (uint64_t)(((int)floorf(vx[x]) + OFX_FREENECT_VOXEL_BIAS) & OFX_FREENECT_VOXEL_MASK)
+                | (uint64_t)(((int)floorf(vy[x]) + OFX_FREENECT_VOXEL_BIAS) & OFX_FREENECT_VOXEL_MASK) << OFX_FREENECT_VOXEL_BITS
+                | (uint64_t)(((int)floorf(vz[x]) + OFX_FREENECT_VOXEL_BIAS) & OFX_FREENECT_VOXEL_MASK) << (2 * OFX_FREENECT_VOXEL_BITS);
+            // Runs of pixels in the same voxel are kept once
+            if (key != last)
+                hits.push_back(key);
+            last = key;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::updateBricks(int b0, int b1) {
+
+    const float cx = width / 2, cy = height / 2;
+
+    for (int b=b0; b<b1; b++) {
+        Brick & brick = bricks[b];
+        ofVec3f corner = brickCorner(brick.key);
+        brick.bChanged = false;
+        brick.bEmpty = true;
+
+        for (int i=0; i<512; i++) {
+            int value = brick.occupancy[i];
+            int next;
+            if (brick.hits[i >> 6] >> (i & 63) & 1) {
+                next = MIN(value + hit, 255);
+            }
+            else if (value == 0) {
+                continue;
+            }
+            else {
+                // Free when the camera sees a surface behind the voxel's
+                // centre, otherwise out of view, hidden or unmeasured
+                float x = corner.x + ((i & 7) + 0.5f) * voxelSize;
+                float y = corner.y + ((i >> 3 & 7) + 0.5f) * voxelSize;
+                float z = corner.z + ((i >> 6) + 0.5f) * voxelSize;
+                bool bFree = false;
+                if (z > 0) {
+                    int u = (int)floorf(x * focal / z + cx + 0.5f);
+                    int v = (int)floorf(y * focal / z + cy + 0.5f);
+                    if (u >= 0 && u < width && v >= 0 && v < height) {
+                        uint16_t d = depth[v * width + u];
+                        bFree = d >= minDepth && d > z + voxelSize;
+                    }
+                }
+                next = MAX(value - (bFree ? miss : decay), 0);
+            }
+            if ((value >= threshold) != (next >= threshold))
+                brick.bChanged = true;
+            if (next != 0)
+                brick.bEmpty = false;
+            brick.occupancy[i] = next;
+        }
+        memset(brick.hits, 0, sizeof(brick.hits));
+    }
+}
+
+//--------------------------------------------------------------
+int ofxFreenectVoxelGrid::findBrick(uint64_t key) {
+    if (table.empty())
+        return -1;
+    uint32_t mask = table.size() - 1;
+    for (uint32_t i = hashBrick(key) & mask; table[i] >= 0; i = (i + 1) & mask)
+        if (bricks[table[i]].key == key)
+            return table[i];
+    return -1;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectVoxelGrid::addBrick(uint64_t key) {
+    if ((int)bricks.size() >= maxBricks)
+        return -1;
+
+    // Keep the table at most half full, so probes stay short
+    if ((bricks.size() + 1) * 2 > table.size()) {
+        table.resize(MAX(table.size() * 2, 1024));
+        rebuildTable();
+    }
+
+    Brick brick;
+    memset(&brick, 0, sizeof(brick));
+    brick.key = key;
+    brick.bEmpty = true;
+    bricks.push_back(brick);
+
+    int index = bricks.size() - 1;
+    uint32_t mask = table.size() - 1;
+    uint32_t i = hashBrick(key) & mask;
+    while (table[i] >= 0)
+        i = (i + 1) & mask;
+    table[i] = index;
+    return index;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::rebuildTable() {
+    table.assign(table.size(), -1);
+    uint32_t mask = table.size() - 1;
+    for (size_t b=0; b<bricks.size(); b++) {
+        uint32_t i = hashBrick(bricks[b].key) & mask;
+        while (table[i] >= 0)
+            i = (i + 1) & mask;
+        table[i] = b;
+    }
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::compact() {
+    size_t kept = 0;
+    for (size_t b=0; b<bricks.size(); b++)
+        if (!bricks[b].bEmpty)
+            bricks[kept++] = bricks[b];
+    bricks.resize(kept);
+    rebuildTable();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectVoxelGrid::voxelKey(const ofVec3f & point, uint64_t & key) {
+    // Scaled as in integrateRows(), so points on a boundary land alike
+    const float scale = 1 / voxelSize;
+    int x = (int)floorf(point.x * scale) + OFX_FREENECT_VOXEL_BIAS;
+    int y = (int)floorf(point.y * scale) + OFX_FREENECT_VOXEL_BIAS;
+    int z = (int)floorf(point.z * scale) + OFX_FREENECT_VOXEL_BIAS;
+    if ((x | y | z) & ~OFX_FREENECT_VOXEL_MASK)
+        return false;
+    key = (uint64_t)x | (uint64_t)y << OFX_FREENECT_VOXEL_BITS | (uint64_t)z << (2 * OFX_FREENECT_VOXEL_BITS);
+    return true;
+}
+
+//--------------------------------------------------------------
+ofVec3f ofxFreenectVoxelGrid::brickCorner(uint64_t key) {
+    int x = (int)(key & OFX_FREENECT_BRICK_MASK) * 8 - OFX_FREENECT_VOXEL_BIAS;
+    int y = (int)(key >> OFX_FREENECT_BRICK_BITS & OFX_FREENECT_BRICK_MASK) * 8 - OFX_FREENECT_VOXEL_BIAS;
+    int z = (int)(key >> (2 * OFX_FREENECT_BRICK_BITS) & OFX_FREENECT_BRICK_MASK) * 8 - OFX_FREENECT_VOXEL_BIAS;
+    return ofVec3f(x * voxelSize, y * voxelSize, z * voxelSize);
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::clear() {
+    mutex.lock();
+    bricks.clear();
+    table.clear();
+    changed.clear();
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+bool ofxFreenectVoxelGrid::isOccupied(const ofVec3f & point) {
+    return getOccupancy(point) >= threshold;
+}
+
+//--------------------------------------------------------------
+int ofxFreenectVoxelGrid::getOccupancy(const ofVec3f & point) {
+    int value = 0;
+    uint64_t key;
+    mutex.lock();
+    if (voxelKey(point, key)) {
+        int b = findBrick(brickKeyOf(key));
+        if (b >= 0)
+            value = bricks[b].occupancy[voxelIndexOf(key)];
+    }
+    mutex.unlock();
+    return value;
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::getOccupiedVoxels(vector<ofVec3f> & centers, bool changedOnly) {
+
+    centers.clear();
+    mutex.lock();
+    int count = changedOnly ? changed.size() : bricks.size();
+    for (int c=0; c<count; c++) {
+        int b = changedOnly ? findBrick(changed[c]) : c;
+        if (b < 0)
+            continue;
+        const Brick & brick = bricks[b];
+        ofVec3f corner = brickCorner(brick.key);
+        for (int i=0; i<512; i++)
+            if (brick.occupancy[i] >= threshold)
+                centers.push_back(ofVec3f(corner.x + ((i & 7) + 0.5f) * voxelSize,
+                                          corner.y + ((i >> 3 & 7) + 0.5f) * voxelSize,
+                                          corner.z + ((i >> 6) + 0.5f) * voxelSize));
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectVoxelGrid::getChangedBricks(vector<ofVec3f> & corners) {
+    mutex.lock();
+    corners.resize(changed.size());
+    for (size_t i=0; i<changed.size(); i++)
+        corners[i] = brickCorner(changed[i]);
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+int ofxFreenectVoxelGrid::getNumBricks() {
+    mutex.lock();
+    int count = bricks.size();
+    mutex.unlock();
+    return count;
+}
@@ -0,0 +1,103 @@
+//
+//  ofxFreenectVoxelGrid.h
+//
+//  Sparse voxel occupancy of the scene, built up from depth frames in mm.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "libfreenect_registration.h"
+#include "ofxFreenectWorkerPool.h"
+
+class ofxFreenectVoxelGrid : public ofxFreenectWorkerJob {
+public:
+    ofxFreenectVoxelGrid();
+
+    // Camera geometry, from freenect_copy_registration()
+    void setZeroPlane(const freenect_zero_plane_info & zeroPlane);
+
+    // Edge of a voxel in mm. Changing it clears the grid.
+    void setVoxelSize(float size);
+    float getVoxelSize();
+
+    // Readings outside [minDepth, maxDepth] mm are ignored
+    void setDepthRange(uint16_t minDepth, uint16_t maxDepth);
+
+    // Use every step'th pixel of every step'th row
+    void setPixelStep(int step);
+
+    // Each voxel holds an occupancy of 0 to 255. A reading in it adds hit,
+    // seeing past it to a surface behind takes miss, and any other frame
+    // takes decay. It is occupied from threshold up.
+    void setWeights(int hit, int miss, int decay, int threshold = 128);
+
+    // Bricks the grid may hold; readings in new bricks beyond it are dropped
+    void setMaxBricks(int maxBricks);
+
+    // Integrate in bands of rows, and update bricks in batches, on the pool's threads
+    void setWorkerPool(ofxFreenectWorkerPool *pool);
+
+    // Integrate a frame in mm, 0 meaning no reading
+    void update(const uint16_t *depth, int width, int height);
+    void clear();
+
+    // Queries are in camera space, in mm with z away from the camera
+    bool isOccupied(const ofVec3f & point);
+    int getOccupancy(const ofVec3f & point);
+
+    // Centres of the occupied voxels, of all bricks or only of those that
+    // changed in the last update
+    void getOccupiedVoxels(vector<ofVec3f> & centers, bool changedOnly = false);
+
+    // Lowest corners of the bricks where a voxel became occupied or free in
+    // the last update
+    void getChangedBricks(vector<ofVec3f> & corners);
+
+    int getNumBricks();
+
+    void runRows(int y0, int y1);
+
+private:
+    // 8x8x8 voxels, x fastest
+    struct Brick {
+        uint64_t key;
+        uint64_t hits[8];       // a bit per voxel with a reading this frame
+        uint8_t occupancy[512];
+        bool bChanged, bEmpty;
+    };
+
+    void integrateRows(int y0, int y1);
+    void updateBricks(int b0, int b1);
+    int findBrick(uint64_t key);
+    int addBrick(uint64_t key);
+    void rebuildTable();
+    void compact();
+    bool voxelKey(const ofVec3f & point, uint64_t & key);
+    ofVec3f brickCorner(uint64_t key);
+
+    // Bricks are found through an open addressed table of their indices
+    vector<Brick> bricks;
+    vector<int32_t> table;
+    int maxBricks;
+    // Keys of the bricks that changed in the last update
+    vector<uint64_t> changed;
+
+    // Voxels with a reading, per row of the frame
+    vector<vector<uint64_t> > rowHits;
+    vector<float> rayX, rayY;
+    float focal;
+    freenect_zero_plane_info zeroPlane;
+    bool bRaysDirty;
+    bool bBrickPass;
+
+    const uint16_t *depth;
+    int width, height;
+    float voxelSize;
+    uint16_t minDepth, maxDepth;
+    int step;
+    int hit, miss, decay, threshold;
+
+    ofxFreenectWorkerPool *pool;
+    ofMutex mutex;
+};
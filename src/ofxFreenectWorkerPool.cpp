@@ -0,0 +1,127 @@
+//
+//  ofxFreenectWorkerPool.cpp
+//
+//
+
+#include "ofxFreenectWorkerPool.h"
+
+// WORKER
+class ofxFreenectWorker : public ofThread {
+public:
+    ofxFreenectWorker() : job(NULL), y0(0), y1(0), bConfigChanged(false) {}
+
+    // Only called while the worker is idle, go.set() publishes it
+    void setConfig(const ofxFreenectThreadConfig & config) {
+        this->config = config;
+        bConfigChanged = true;
+    }
+
+    void start(ofxFreenectWorkerJob *job, int y0, int y1) {
+        this->job = job;
+        this->y0 = y0;
+        this->y1 = y1;
+        go.set();
+    }
+
+    void wait() {
+        done.wait();
+    }
+
+    void quit() {
+        stopThread();
+        go.set();
+        waitForThread(false);
+    }
+
+private:
+    void threadedFunction() {
+        while (isThreadRunning()) {
+            go.wait();
+            if (!isThreadRunning())
+                break;
+            if (bConfigChanged) {
+                config.apply();
+                bConfigChanged = false;
+            }
+            job->runRows(y0, y1);
+            done.set();
+        }
+    }
+
+    Poco::Event go, done;
+    ofxFreenectWorkerJob *job;
+    int y0, y1;
+    ofxFreenectThreadConfig config;
+    bool bConfigChanged;
+};
+
+//--------------------------------------------------------------
+ofxFreenectWorkerPool::ofxFreenectWorkerPool() {
+}
+
+//--------------------------------------------------------------
+ofxFreenectWorkerPool::~ofxFreenectWorkerPool() {
+    close();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectWorkerPool::setup(int numThreads) {
+    close();
+    mutex.lock();
+    for (int i=0; i<numThreads; i++) {
+        ofxFreenectWorker *worker = new ofxFreenectWorker();
+        worker->setConfig(config);
+        worker->startThread(true, false);
+        workers.push_back(worker);
+    }
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectWorkerPool::close() {
+    mutex.lock();
+    for (size_t i=0; i<workers.size(); i++) {
+        workers[i]->quit();
+        delete workers[i];
+    }
+    workers.clear();
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+int ofxFreenectWorkerPool::getNumThreads() {
+    return workers.size();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectWorkerPool::setThreadConfig(const ofxFreenectThreadConfig & config) {
+    // Jobs hold the mutex, so every worker is idle here
+    mutex.lock();
+    this->config = config;
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i]->setConfig(config);
+    mutex.unlock();
+}
+
+//--------------------------------------------------------------
+void ofxFreenectWorkerPool::run(ofxFreenectWorkerJob *job, int rows) {
+
+    // One job at a time, the workers only hold one band each
+    mutex.lock();
+    int bands = MIN((int)workers.size() + 1, rows);
+    if (bands <= 1) {
+        if (rows > 0)
+            job->runRows(0, rows);
+        mutex.unlock();
+        return;
+    }
+
+    for (int i=1; i<bands; i++) {
+        workers[i-1]->start(job, rows * i / bands, rows * (i+1) / bands);
+    }
+    job->runRows(0, rows / bands);
+    for (int i=1; i<bands; i++) {
+        workers[i-1]->wait();
+    }
+    mutex.unlock();
+}
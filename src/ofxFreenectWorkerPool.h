@@ -0,0 +1,46 @@
+//
+//  ofxFreenectWorkerPool.h
+//
+//  Splits per-frame image work into bands of rows and runs them in parallel.
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "Poco/Event.h"
+#include "ofxFreenectRealtime.h"
+
+// WORKER JOB
+class ofxFreenectWorkerJob {
+public:
+    virtual ~ofxFreenectWorkerJob() {}
+
+    // Process rows [y0, y1). Bands never overlap, but run concurrently.
+    virtual void runRows(int y0, int y1) = 0;
+};
+
+// WORKER POOL
+class ofxFreenectWorker;
+
+class ofxFreenectWorkerPool {
+public:
+    ofxFreenectWorkerPool();
+    ~ofxFreenectWorkerPool();
+
+    // Start numThreads workers; the thread calling run() always takes a band
+    // too. With 0 workers jobs run on the calling thread only.
+    void setup(int numThreads);
+    void close();
+    int getNumThreads();
+
+    // Affinity and priority of the workers, applied before their next job
+    void setThreadConfig(const ofxFreenectThreadConfig & config);
+
+    // Run the job over rows [0, rows) and return once every band is done
+    void run(ofxFreenectWorkerJob *job, int rows);
+
+private:
+    vector<ofxFreenectWorker*> workers;
+    ofxFreenectThreadConfig config;
+    ofMutex mutex;
+};